@@ -55,6 +55,16 @@
 #define SMARTCAM_BUFFER_SIZE	((SMARTCAM_RGB_FRAME_SIZE + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
 #define MAX_STREAMING_BUFFERS	7
 #define SMARTCAM_NFORMATS 2
+#define SMARTCAM_MAX_DEVICES	16
+
+/* private ioctl: CLOCK_MONOTONIC microseconds at which the next frame written
+   was captured (the phone capture time mapped to the host clock), used as its
+   timestamp instead of the write time */
+#define VIDIOC_SMARTCAM_S_TIMESTAMP	_IOW('V', BASE_VIDIOC_PRIVATE + 0, __u64)
+/* private ioctl: the frame written last is also the next one (the phone sent
+   the same picture again), it is handed out once more with a new sequence
+   number and timestamp but without being written again */
+#define VIDIOC_SMARTCAM_REPEAT_FRAME	_IO('V', BASE_VIDIOC_PRIVATE + 1)
 
 //#define SMARTCAM_DEBUG
 #undef SCAM_MSG				/* undef it, just in case */
@@ -76,12 +86,27 @@
     Basic structures
    ------------------------------------------------------------------*/
 
+/* one per video node, each node is fed by its own phone session */
 struct smartcam_dev {
     struct v4l2_device  v4l2_dev;
     struct video_device vdev;
     struct mutex        mutex;
+    wait_queue_head_t   wq;
+    char*               frame_data;
+    __u32               frame_sequence;
+    __u32               last_read_frame;
+    __u32               format;
+    struct timeval      frame_timestamp;
+    struct timeval      next_timestamp;
+    bool                has_next_timestamp;
 };
 
+static unsigned int devices = 1;
+module_param(devices, uint, 0444);
+MODULE_PARM_DESC(devices, "number of smartcam video devices to create (1-16)");
+
+static struct smartcam_dev* smartcam_devs[SMARTCAM_MAX_DEVICES];
+
 
 static struct v4l2_pix_format formats[] = {
 {
@@ -106,14 +131,6 @@ static struct v4l2_pix_format formats[] = {
 
 static const char fmtdesc[2][5] = { "YUYV", "RGB3" };
 
-static DECLARE_WAIT_QUEUE_HEAD(wq);
-
-static char* frame_data = NULL;
-static __u32 frame_sequence = 0;
-static __u32 last_read_frame = 0;
-static __u32 format = 0;
-static struct timeval frame_timestamp;
-
 static inline void v4l2l_get_timestamp(struct timeval *tv) {
 	/* ktime_get_ts is considered deprecated, so use ktime_get_ts64 if possible */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 17, 0)
@@ -128,6 +145,18 @@ static inline void v4l2l_get_timestamp(struct timeval *tv) {
 	tv->tv_usec = ts.tv_nsec / NSEC_PER_USEC;
 }
 
+/* frame_data holds the next frame: stamps it and wakes up the readers */
+static void smartcam_publish_frame(struct smartcam_dev *dev)
+{
+    ++ dev->frame_sequence;
+    if (dev->has_next_timestamp) {
+        dev->frame_timestamp = dev->next_timestamp;
+        dev->has_next_timestamp = false;
+    } else
+        v4l2l_get_timestamp(&dev->frame_timestamp);
+    wake_up_interruptible_all(&dev->wq);
+}
+
 /* ------------------------------------------------------------------
     IOCTL vidioc handling
    ------------------------------------------------------------------*/
@@ -158,7 +187,8 @@ static int vidioc_enum_fmt_cap(struct file *file, void  *priv, struct v4l2_fmtde
 
 static int vidioc_g_fmt_cap(struct file *file, void *priv, struct v4l2_format *f)
 {
-    f->fmt.pix = formats[format];
+    struct smartcam_dev *dev = video_drvdata(file);
+    f->fmt.pix = formats[dev->format];
 
     SCAM_MSG("(%s) %s called\n", current->comm, __FUNCTION__);
     return 0;
@@ -166,13 +196,14 @@ static int vidioc_g_fmt_cap(struct file *file, void *priv, struct v4l2_format *f
 
 static int vidioc_try_fmt_cap(struct file *file, void *priv, struct v4l2_format *f)
 {
+    struct smartcam_dev *dev = video_drvdata(file);
     int i;
 
     SCAM_MSG("(%s) %s called\n", current->comm, __FUNCTION__);
 
     for (i = 0; i < SMARTCAM_NFORMATS; i++) {
         if (f->fmt.pix.pixelformat == formats[i].pixelformat) {
-            f->fmt.pix = formats[format];
+            f->fmt.pix = formats[dev->format];
             return 0;
         }
     }
@@ -182,6 +213,7 @@ static int vidioc_try_fmt_cap(struct file *file, void *priv, struct v4l2_format
 
 static int vidioc_s_fmt_cap(struct file *file, void *priv, struct v4l2_format *f)
 {
+    struct smartcam_dev *dev = video_drvdata(file);
     int i;
 
     SCAM_MSG("%s called\n", __FUNCTION__);
@@ -190,8 +222,8 @@ static int vidioc_s_fmt_cap(struct file *file, void *priv, struct v4l2_format *f
         if ((f->fmt.pix.width == formats[i].width) &&
             (f->fmt.pix.height == formats[i].height) &&
             (f->fmt.pix.pixelformat == formats[i].pixelformat)) {
-            format = i;
-            f->fmt.pix = formats[format];
+            dev->format = i;
+            f->fmt.pix = formats[dev->format];
             return 0;
         }
     }
@@ -208,10 +240,11 @@ static int vidioc_s_fmt_cap(struct file *file, void *priv, struct v4l2_format *f
 
 static int smartcam_mmap(struct file *file, struct vm_area_struct *vma)
 {
+        struct smartcam_dev *dev = video_drvdata(file);
         int ret;
         long length = vma->vm_end - vma->vm_start;
         unsigned long start = vma->vm_start;
-        char *vmalloc_area_ptr = frame_data;
+        char *vmalloc_area_ptr = dev->frame_data;
         unsigned long pfn;
 
     SCAM_MSG("(%s) %s called\n", current->comm, __FUNCTION__);
@@ -258,6 +291,8 @@ static int vidioc_reqbufs(struct file *file, void *priv, struct v4l2_requestbuff
 
 static int vidioc_querybuf(struct file *file, void *priv, struct v4l2_buffer *vidbuf)
 {
+    struct smartcam_dev *dev = video_drvdata(file);
+
     SCAM_MSG("(%s) %s called\n", current->comm, __FUNCTION__);
 
     if(vidbuf->index < 0 || vidbuf->index >= MAX_STREAMING_BUFFERS)
@@ -274,7 +309,7 @@ static int vidioc_querybuf(struct file *file, void *priv, struct v4l2_buffer *vi
 
     vidbuf->memory = V4L2_MEMORY_MMAP;
     vidbuf->length = SMARTCAM_BUFFER_SIZE;
-    vidbuf->bytesused = formats[format].sizeimage;
+    vidbuf->bytesused = formats[dev->format].sizeimage;
     vidbuf->flags = V4L2_BUF_FLAG_MAPPED;
     vidbuf->m.offset = 2 * vidbuf->index * vidbuf->length;
     vidbuf->reserved = 0;
@@ -283,6 +318,8 @@ static int vidioc_querybuf(struct file *file, void *priv, struct v4l2_buffer *vi
 
 static int vidioc_qbuf(struct file *file, void *priv, struct v4l2_buffer *vidbuf)
 {
+    struct smartcam_dev *dev = video_drvdata(file);
+
     SCAM_MSG("(%s) %s called\n", current->comm, __FUNCTION__);
 
     if(vidbuf->index < 0 || vidbuf->index >= MAX_STREAMING_BUFFERS)
@@ -298,13 +335,15 @@ static int vidioc_qbuf(struct file *file, void *priv, struct v4l2_buffer *vidbuf
         return -EINVAL;
     }
     vidbuf->length = SMARTCAM_BUFFER_SIZE;
-    vidbuf->bytesused = formats[format].sizeimage;
+    vidbuf->bytesused = formats[dev->format].sizeimage;
     vidbuf->flags = V4L2_BUF_FLAG_MAPPED;
     return 0;
 }
 
 static int vidioc_dqbuf(struct file *file, void *priv, struct v4l2_buffer *vidbuf)
 {
+    struct smartcam_dev *dev = video_drvdata(file);
+
     if(file->f_flags & O_NONBLOCK)
         SCAM_MSG("(%s) %s called (non-blocking)\n", current->comm, __FUNCTION__);
     else
@@ -328,11 +367,11 @@ static int vidioc_dqbuf(struct file *file, void *priv, struct v4l2_buffer *vidbu
         msleep_interruptible(1000);
 
     vidbuf->length = SMARTCAM_BUFFER_SIZE;
-    vidbuf->bytesused = formats[format].sizeimage;
+    vidbuf->bytesused = formats[dev->format].sizeimage;
     vidbuf->flags = V4L2_BUF_FLAG_MAPPED;
-    vidbuf->timestamp = frame_timestamp;
-    vidbuf->sequence = frame_sequence;
-    last_read_frame = frame_sequence;
+    vidbuf->timestamp = dev->frame_timestamp;
+    vidbuf->sequence = dev->frame_sequence;
+    dev->last_read_frame = dev->frame_sequence;
     return 0;
 }
 
@@ -465,6 +504,31 @@ static int vidioc_s_crop(struct file *file, void *priv, const struct v4l2_crop *
 }
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0)
+static long vidioc_default(struct file *file, void *priv, bool valid_prio, unsigned int cmd, void *arg)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 1, 0)
+static long vidioc_default(struct file *file, void *priv, bool valid_prio, int cmd, void *arg)
+#else
+static long vidioc_default(struct file *file, void *priv, int cmd, void *arg)
+#endif
+{
+    struct smartcam_dev *dev = video_drvdata(file);
+    __u64 micros;
+
+    if (cmd == VIDIOC_SMARTCAM_REPEAT_FRAME) {
+        smartcam_publish_frame(dev);
+        return 0;
+    }
+    if (cmd != VIDIOC_SMARTCAM_S_TIMESTAMP)
+        return -ENOTTY;
+
+    micros = *(__u64*) arg;
+    dev->next_timestamp.tv_sec = div_u64(micros, USEC_PER_SEC);
+    dev->next_timestamp.tv_usec = micros - (__u64) dev->next_timestamp.tv_sec * USEC_PER_SEC;
+    dev->has_next_timestamp = true;
+    return 0;
+}
+
 static int vidioc_g_parm(struct file *file, void *priv, struct v4l2_streamparm *streamparm)
 {
     SCAM_MSG("(%s) %s called - return 0\n", current->comm, __FUNCTION__);
@@ -509,19 +573,21 @@ static int smartcam_open(struct file *file)
 
 static ssize_t smartcam_read(struct file *file, char __user *data, size_t count, loff_t *f_pos)
 {
+    struct smartcam_dev *dev = video_drvdata(file);
+
         SCAM_MSG("(%s) %s called (count=%d, f_pos = %d)\n", current->comm, __FUNCTION__, (int) count, (int) *f_pos);
 
-    if(*f_pos >= formats[format].sizeimage)
+    if(*f_pos >= formats[dev->format].sizeimage)
         return 0;
 
     if (!(file->f_flags & O_NONBLOCK))
      // interruptible_sleep_on_timeout(&wq, HZ/10); /* wait max 1 second */
         msleep_interruptible(100);
-    last_read_frame = frame_sequence;
+    dev->last_read_frame = dev->frame_sequence;
 
-    if(*f_pos + count > formats[format].sizeimage)
-        count = formats[format].sizeimage - *f_pos;
-    if(copy_to_user(data, frame_data + *f_pos, count))
+    if(*f_pos + count > formats[dev->format].sizeimage)
+        count = formats[dev->format].sizeimage - *f_pos;
+    if(copy_to_user(data, dev->frame_data + *f_pos, count))
     {
         return -EFAULT;
     }
@@ -537,10 +603,10 @@ static int Clamp (int x)
         else               return r;
 }
 
-static void rgb_to_yuyv(void)
+static void rgb_to_yuyv(struct smartcam_dev *dev)
 {
-    unsigned char *rp = frame_data, *wp = frame_data;
-    for (; rp < (unsigned char *)(frame_data + SMARTCAM_RGB_FRAME_SIZE);
+    unsigned char *rp = dev->frame_data, *wp = dev->frame_data;
+    for (; rp < (unsigned char *)(dev->frame_data + SMARTCAM_RGB_FRAME_SIZE);
             rp += 6, wp += 4) {
         unsigned char r1 = rp[0], g1 = rp[1], b1 = rp[2];
         unsigned char r2 = rp[3], g2 = rp[4], b2 = rp[5];
@@ -561,34 +627,34 @@ static void rgb_to_yuyv(void)
 
 static ssize_t smartcam_write(struct file *file, const char __user *data, size_t count, loff_t *f_pos)
 {
+    struct smartcam_dev *dev = video_drvdata(file);
+
     SCAM_MSG("(%s) %s called (count=%d, f_pos = %d)\n", current->comm, __FUNCTION__, (int) count, (int) *f_pos);
 
     if (count >= SMARTCAM_RGB_FRAME_SIZE)
         count = SMARTCAM_RGB_FRAME_SIZE;
 
-    if(copy_from_user(frame_data, data, count))
+    if(copy_from_user(dev->frame_data, data, count))
     {
         return -EFAULT;
     }
-    ++ frame_sequence;
+    if (formats[dev->format].pixelformat == V4L2_PIX_FMT_YUYV)
+        rgb_to_yuyv(dev);
 
-    if (formats[format].pixelformat == V4L2_PIX_FMT_YUYV)
-        rgb_to_yuyv();
-
-    v4l2l_get_timestamp(&frame_timestamp);
-    wake_up_interruptible_all(&wq);
+    smartcam_publish_frame(dev);
     return count;
 }
 
 static unsigned int smartcam_poll(struct file *file, struct poll_table_struct *wait)
 {
+    struct smartcam_dev *dev = video_drvdata(file);
     int mask = (POLLOUT | POLLWRNORM);	/* writable */
-    if (last_read_frame != frame_sequence)
+    if (dev->last_read_frame != dev->frame_sequence)
         mask |= (POLLIN | POLLRDNORM);	/* readable */
 
     SCAM_MSG("(%s) %s called\n", current->comm, __FUNCTION__);
 
-    poll_wait(file, &wq, wait);
+    poll_wait(file, &dev->wq, wait);
 
     return mask;
 }
@@ -639,6 +705,7 @@ static const struct v4l2_ioctl_ops smartcam_ioctl_ops = {
     .vidioc_s_parm	      = vidioc_s_parm,
     .vidioc_streamon      = vidioc_streamon,
     .vidioc_streamoff     = vidioc_streamoff,
+    .vidioc_default       = vidioc_default,
 };
 
 static struct video_device smartcam_vid = {
@@ -658,7 +725,15 @@ static struct video_device smartcam_vid = {
     Initialization and module stuff
    ------------------------------------------------------------------*/
 
-static int __init smartcam_init(void)
+static void smartcam_destroy_dev(struct smartcam_dev *dev)
+{
+    video_unregister_device(&dev->vdev);
+    v4l2_device_unregister(&dev->v4l2_dev);
+    vfree(dev->frame_data);
+    kfree(dev);
+}
+
+static int smartcam_create_dev(int index)
 {
     struct smartcam_dev *dev;
     struct video_device *vfd;
@@ -669,19 +744,21 @@ static int __init smartcam_init(void)
         return -ENOMEM;
     
     mutex_init(&dev->mutex);
+    init_waitqueue_head(&dev->wq);
     
-    frame_data =  (char*) vmalloc(SMARTCAM_BUFFER_SIZE);
-    if(!frame_data)
+    dev->frame_data =  (char*) vmalloc(SMARTCAM_BUFFER_SIZE);
+    if(!dev->frame_data)
     {
-        return -ENOMEM;
+        ret = -ENOMEM;
+        goto free_dev;
     }
-    frame_sequence = last_read_frame = 0;
+    dev->frame_sequence = dev->last_read_frame = 0;
 //  ret = video_register_device(&smartcam_vid, VFL_TYPE_GRABBER, -1);
     snprintf(dev->v4l2_dev.name, sizeof(dev->v4l2_dev.name),
-            "%s", SMARTCAM_MODULE_NAME);
+            "%s-%d", SMARTCAM_MODULE_NAME, index);
     ret = v4l2_device_register(NULL, &dev->v4l2_dev);
     if (ret)
-        goto free_dev;
+        goto free_data;
     vfd = &dev->vdev;
     *vfd = smartcam_vid;
     vfd->v4l2_dev = &dev->v4l2_dev;
@@ -692,23 +769,51 @@ static int __init smartcam_init(void)
     if (ret < 0)
         goto unreg_dev;
     SCAM_MSG("(%s) load status: %d\n", current->comm, ret);
+    smartcam_devs[index] = dev;
     return 0;
 unreg_dev:
     v4l2_device_unregister(&dev->v4l2_dev);
+free_data:
+    vfree(dev->frame_data);
 free_dev:
     kfree(dev);
     return ret;
 }
 
+static int __init smartcam_init(void)
+{
+    int i;
+    int ret = 0;
+
+    if (devices < 1)
+        devices = 1;
+    if (devices > SMARTCAM_MAX_DEVICES)
+        devices = SMARTCAM_MAX_DEVICES;
+
+    for (i = 0; i < devices; i++) {
+        ret = smartcam_create_dev(i);
+        if (ret < 0)
+            goto destroy_devs;
+    }
+    return 0;
+destroy_devs:
+    while (--i >= 0) {
+        smartcam_destroy_dev(smartcam_devs[i]);
+        smartcam_devs[i] = NULL;
+    }
+    return ret;
+}
+
 static void __exit smartcam_exit(void)
 {
-    struct smartcam_dev *dev;
+    int i;
     SCAM_MSG("(%s) %s called\n", current->comm, __FUNCTION__);
-    frame_sequence = 0;
-    vfree(frame_data);
-    video_unregister_device(&smartcam_vid);
-    v4l2_device_unregister(&dev->v4l2_dev);
-    kfree(dev);
+    for (i = 0; i < SMARTCAM_MAX_DEVICES; i++) {
+        if (smartcam_devs[i] == NULL)
+            continue;
+        smartcam_destroy_dev(smartcam_devs[i]);
+        smartcam_devs[i] = NULL;
+    }
 }
 
 module_init(smartcam_init);
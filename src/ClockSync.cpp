@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// ClockSync.cpp
+
+#include <stdlib.h>
+
+#include "ClockSync.h"
+
+// replies needed before the mapping is used
+#define CLOCK_SYNC_REPLIES 4
+#define CLOCK_FAST_PING_MICROS 200000ULL
+#define CLOCK_PING_MICROS 1000000ULL
+// a line through a shorter history is mostly noise, offset only
+#define CLOCK_MIN_DRIFT_SPAN_MICROS 10000000ULL
+// more than any real oscillator, the phone clock was adjusted
+#define CLOCK_MAX_DRIFT 0.0005
+// an offset that far from the prediction is a phone clock step
+#define CLOCK_STEP_MICROS 500000LL
+
+CClockSync::CClockSync():
+    nextPingId(1)
+{
+    for(int i = 0; i < CLOCK_PENDING_PINGS; i++)
+    {
+        pingIds[i] = 0;
+        pingMicros[i] = 0;
+    }
+    Reset();
+}
+
+CClockSync::~CClockSync()
+{
+}
+
+void CClockSync::Reset()
+{
+    filterCount = 0;
+    filterPos = 0;
+    historyCount = 0;
+    historyPos = 0;
+    lastChosenHost = 0;
+    fitBase = 0;
+    fitOffset = 0;
+    fitDrift = 0;
+    replyCount = 0;
+    bestDelay = 0;
+}
+
+unsigned int CClockSync::GetNextPingId()
+{
+    return nextPingId;
+}
+
+unsigned int CClockSync::StartPing(unsigned long long hostMicros)
+{
+    unsigned int id = nextPingId;
+    nextPingId = (nextPingId + 1) & 0xFFFF;
+    if(nextPingId == 0)
+    {
+        nextPingId = 1;
+    }
+    // an unanswered ping gives way after CLOCK_PENDING_PINGS others
+    int slot = id % CLOCK_PENDING_PINGS;
+    pingIds[slot] = id;
+    pingMicros[slot] = hostMicros;
+    return id;
+}
+
+bool CClockSync::AddReply(unsigned int pingId, unsigned long long phoneRecvMicros,
+                          unsigned long long phoneSendMicros, unsigned long long hostRecvMicros)
+{
+    int slot = pingId % CLOCK_PENDING_PINGS;
+    if(pingId == 0 || pingIds[slot] != pingId || phoneSendMicros < phoneRecvMicros ||
+       hostRecvMicros < pingMicros[slot])
+    {
+        return false;
+    }
+    unsigned long long hostSendMicros = pingMicros[slot];
+    pingIds[slot] = 0;
+
+    long long delay = (long long)(hostRecvMicros - hostSendMicros) - (long long)(phoneSendMicros - phoneRecvMicros);
+    long long offset = ((long long)(phoneRecvMicros - hostSendMicros) + (long long)(phoneSendMicros - hostRecvMicros)) / 2;
+    unsigned long long hostMicros = hostSendMicros + (hostRecvMicros - hostSendMicros) / 2;
+    if(delay < 0)
+    {
+        delay = 0;  // coarse phone clock
+    }
+    if(replyCount >= CLOCK_SYNC_REPLIES && llabs(offset - (long long) Predict(hostMicros)) > CLOCK_STEP_MICROS)
+    {
+        Reset();
+    }
+    ++replyCount;
+
+    filterOffsets[filterPos] = offset;
+    filterDelays[filterPos] = delay;
+    filterHosts[filterPos] = hostMicros;
+    filterPos = (filterPos + 1) % CLOCK_FILTER_LEN;
+    if(filterCount < CLOCK_FILTER_LEN)
+    {
+        ++filterCount;
+    }
+    int best = 0;
+    for(int i = 1; i < filterCount; i++)
+    {
+        if(filterDelays[i] < filterDelays[best])
+        {
+            best = i;
+        }
+    }
+    bestDelay = filterDelays[best];
+    if(filterHosts[best] != lastChosenHost)
+    {
+        lastChosenHost = filterHosts[best];
+        historyOffsets[historyPos] = filterOffsets[best];
+        historyHosts[historyPos] = filterHosts[best];
+        historyPos = (historyPos + 1) % CLOCK_HISTORY_LEN;
+        if(historyCount < CLOCK_HISTORY_LEN)
+        {
+            ++historyCount;
+        }
+        Fit();
+    }
+    return true;
+}
+
+// Least squares line through the history, times relative to its oldest
+// entry so that doubles keep the precision
+void CClockSync::Fit()
+{
+    int oldest = (historyCount < CLOCK_HISTORY_LEN ? 0 : historyPos);
+    int newest = (historyPos + CLOCK_HISTORY_LEN - 1) % CLOCK_HISTORY_LEN;
+    fitBase = historyHosts[oldest];
+    fitDrift = 0;
+    fitOffset = (double) historyOffsets[newest];
+    if(historyHosts[newest] - fitBase < CLOCK_MIN_DRIFT_SPAN_MICROS)
+    {
+        fitBase = historyHosts[newest];
+        return;
+    }
+    double sumX = 0, sumY = 0;
+    for(int i = 0; i < historyCount; i++)
+    {
+        sumX += (double)(historyHosts[i] - fitBase);
+        sumY += (double) historyOffsets[i];
+    }
+    double meanX = sumX / historyCount, meanY = sumY / historyCount;
+    double sxy = 0, sxx = 0;
+    for(int i = 0; i < historyCount; i++)
+    {
+        double dx = (double)(historyHosts[i] - fitBase) - meanX;
+        sxy += dx * ((double) historyOffsets[i] - meanY);
+        sxx += dx * dx;
+    }
+    fitDrift = sxy / sxx;
+    if(fitDrift > CLOCK_MAX_DRIFT)
+    {
+        fitDrift = CLOCK_MAX_DRIFT;
+    }
+    else if(fitDrift < -CLOCK_MAX_DRIFT)
+    {
+        fitDrift = -CLOCK_MAX_DRIFT;
+    }
+    fitOffset = meanY - fitDrift * meanX;
+}
+
+double CClockSync::Predict(unsigned long long hostMicros)
+{
+    return fitOffset + fitDrift * ((double) hostMicros - (double) fitBase);
+}
+
+bool CClockSync::IsSynced()
+{
+    return (replyCount >= CLOCK_SYNC_REPLIES);
+}
+
+// phone = host + offset(host) solved for host; worked relative to fitBase
+// so the doubles only carry the small differences
+unsigned long long CClockSync::ToHostMicros(unsigned long long phoneMicros)
+{
+    if(!IsSynced())
+    {
+        return phoneMicros;
+    }
+    double phoneSinceBase = (double)(long long)(phoneMicros - fitBase);
+    double hostSinceBase = (phoneSinceBase - fitOffset) / (1 + fitDrift);
+    if((double) fitBase + hostSinceBase < 0)
+    {
+        return 0;
+    }
+    long long rounded = (long long)(hostSinceBase < 0 ? hostSinceBase - 0.5 : hostSinceBase + 0.5);
+    return fitBase + (unsigned long long) rounded;
+}
+
+unsigned long long CClockSync::GetPingIntervalMicros()
+{
+    return (IsSynced() ? CLOCK_PING_MICROS : CLOCK_FAST_PING_MICROS);
+}
+
+long long CClockSync::GetOffsetMicros(unsigned long long hostMicros)
+{
+    return (long long) Predict(hostMicros);
+}
+
+float CClockSync::GetDriftPpm()
+{
+    return (float)(fitDrift * 1000000);
+}
+
+unsigned int CClockSync::GetRoundTripMicros()
+{
+    return (unsigned int) bestDelay;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// ClockSync.h
+
+#ifndef __CLOCK_SYNC_H__
+#define __CLOCK_SYNC_H__
+
+#define CLOCK_PENDING_PINGS 4
+#define CLOCK_FILTER_LEN 8
+#define CLOCK_HISTORY_LEN 32
+
+// Maps the phone clock to the host CLOCK_MONOTONIC, NTP style: the host
+// pings, the phone answers with the times it received the ping and sent the
+// answer. Every exchange gives the clock offset and the round trip; the
+// exchange with the shortest round trip among the last few is the one least
+// skewed by queueing, and a line fitted through those over the last
+// minute or so gives offset and drift.
+class CClockSync
+{
+public:
+    CClockSync();
+    virtual ~CClockSync();
+    // Id the next ping goes out with
+    unsigned int GetNextPingId();
+    // Id to send with a ping going out at hostMicros
+    unsigned int StartPing(unsigned long long hostMicros);
+    // The answer to a ping, all times in micros; false if the ping is unknown
+    // or the times make no sense
+    bool AddReply(unsigned int pingId, unsigned long long phoneRecvMicros,
+                  unsigned long long phoneSendMicros, unsigned long long hostRecvMicros);
+    bool IsSynced();
+    // Host time of a phone time, the phone time as is until synced
+    unsigned long long ToHostMicros(unsigned long long phoneMicros);
+    // Pings go out often until synced, then once a second
+    unsigned long long GetPingIntervalMicros();
+    // phone clock minus host clock at hostMicros
+    long long GetOffsetMicros(unsigned long long hostMicros);
+    float GetDriftPpm();
+    unsigned int GetRoundTripMicros();
+
+private:
+    // Methods:
+    double Predict(unsigned long long hostMicros);
+    void Fit();
+    void Reset();
+    // Data:
+    unsigned int pingIds[CLOCK_PENDING_PINGS];
+    unsigned long long pingMicros[CLOCK_PENDING_PINGS];
+    unsigned int nextPingId;
+    // the last exchanges: offset, round trip and host time (midpoint)
+    long long filterOffsets[CLOCK_FILTER_LEN];
+    long long filterDelays[CLOCK_FILTER_LEN];
+    unsigned long long filterHosts[CLOCK_FILTER_LEN];
+    int filterCount;
+    int filterPos;
+    // the best exchange of the filter each time a new one came out on top
+    long long historyOffsets[CLOCK_HISTORY_LEN];
+    unsigned long long historyHosts[CLOCK_HISTORY_LEN];
+    int historyCount;
+    int historyPos;
+    unsigned long long lastChosenHost;
+    // offset(host) = fitOffset + fitDrift * (host - fitBase)
+    unsigned long long fitBase;
+    double fitOffset;
+    double fitDrift;
+    unsigned int replyCount;
+    long long bestDelay;
+};
+
+#endif//__CLOCK_SYNC_H__
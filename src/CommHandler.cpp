@@ -23,30 +23,50 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
 #include <bluetooth/rfcomm.h>
+#include <bluetooth/l2cap.h>
 
 #include "CommHandler.h"
+#include "PacketParser.h"
+#include "PacketRing.h"
 #include "SmartEngine.h"
 #include "UIHandler.h"
+#include "smartcam.h"
 
 // Constructor
 CCommHandler::CCommHandler(CSmartEngine* pEngine):
     pSmartEngine(pEngine),
-    isConnected(false),
-    serverSocket(INVALID_SOCKET),
-    clientSocket(INVALID_SOCKET),
+    serverPort(0),
+    serverRcvBufSize(0),
+    l2capServerSocket(INVALID_SOCKET),
+    epollFd(-1),
+    wakeupFd(-1),
     sdpRecord(NULL),
-    sdpSession(NULL),
-    rcvPacket(NULL),
-    rcvPacketLen(0),
-    rcvPacketMaxLen(0)
+    sdpSession(NULL)
 {
+    memset(udpPeerAddrs, 0, sizeof(udpPeerAddrs));
+    for(int i = 0; i < SMARTCAM_CONN_TYPES; i++)
+    {
+        serverSockets[i] = INVALID_SOCKET;
+        inheritedSockets[i] = INVALID_SOCKET;
+    }
+    for(int i = 0; i < SMARTCAM_MAX_SESSIONS; i++)
+    {
+        udpPeerSockets[i] = INVALID_SOCKET;
+    }
+    for(int i = 0; i < SMARTCAM_MAX_HELLOS; i++)
+    {
+        helloSockets[i] = INVALID_SOCKET;
+    }
 }
 
 // Destructor
@@ -56,16 +76,113 @@ CCommHandler::~CCommHandler()
 
 int CCommHandler::Initialize()
 {
-    rcvPacket = new unsigned char[DEFAULT_PAKET_MAX_LEN];
-    if(rcvPacket == NULL)
+    struct epoll_event event;
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if(epollFd < 0)
+    {
+        CUIHandler::Msg("Could not create epoll instance: %d(%s)\n", errno, strerror(errno));
         return -1;
-    rcvPacketMaxLen = DEFAULT_PAKET_MAX_LEN;
+    }
+    wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(wakeupFd < 0)
+    {
+        CUIHandler::Msg("Could not create wakeup eventfd: %d(%s)\n", errno, strerror(errno));
+        return -1;
+    }
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = wakeupFd;
+    if(epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeupFd, &event) < 0)
+    {
+        CUIHandler::Msg("Could not watch wakeup eventfd: %d(%s)\n", errno, strerror(errno));
+        return -1;
+    }
     return 0;
 }
 
-int CCommHandler::StartInetServer(int port)
+// Switches a freshly bound server socket to non-blocking mode and adds it
+// to the epoll set, so the comm thread is woken up as soon as a phone connects
+int CCommHandler::WatchServerSocket(int socket)
+{
+    struct epoll_event event;
+    int flags = fcntl(socket, F_GETFL, NULL);
+    if(flags < 0)
+    {
+        CUIHandler::Msg("Could not retrieve socket flags: %d(%s)\n", errno, strerror(errno));
+        return -1;
+    }
+    flags |= O_NONBLOCK;
+    fcntl(socket, F_SETFL, flags);
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = socket;
+    if(epoll_ctl(epollFd, EPOLL_CTL_ADD, socket, &event) < 0)
+    {
+        CUIHandler::Msg("Could not watch server socket: %d(%s)\n", errno, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Accepted sockets inherit the receive buffer of the listening socket; it
+// has to be set before listen() for TCP to pick a matching window scale
+void CCommHandler::SetRcvBufSize(int socket, int rcvBufSize)
+{
+    if(rcvBufSize <= 0)
+    {
+        return;
+    }
+    if(setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &rcvBufSize, sizeof(rcvBufSize)) < 0)
+    {
+        printf("smartcam: could not set receive buffer to %d bytes: %s\n", rcvBufSize, strerror(errno));
+    }
+}
+
+int CCommHandler::AdoptServerSocket(int socket)
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    int type = 0, isListening = 0;
+    socklen_t optLen = sizeof(type);
+    if(getsockname(socket, (struct sockaddr*)&sin, &len) < 0 ||
+       getsockopt(socket, SOL_SOCKET, SO_TYPE, &type, &optLen) < 0)
+    {
+        printf("smartcam: inherited fd %d is no socket: %d(%s)\n", socket, errno, strerror(errno));
+        return -1;
+    }
+    if(sin.sin_family != AF_INET)
+    {
+        printf("smartcam: inherited socket %d is not a TCP/IP socket, ignored\n", socket);
+        return -1;
+    }
+    ConnectionType connType = (type == SOCK_DGRAM ? CONN_UDP : CONN_INET);
+    optLen = sizeof(isListening);
+    if(type == SOCK_STREAM &&
+       (getsockopt(socket, SOL_SOCKET, SO_ACCEPTCONN, &isListening, &optLen) < 0 || !isListening))
+    {
+        printf("smartcam: inherited socket %d is not listening, ignored\n", socket);
+        return -1;
+    }
+    if((type != SOCK_STREAM && type != SOCK_DGRAM) || inheritedSockets[connType] != INVALID_SOCKET)
+    {
+        printf("smartcam: inherited socket %d is of no use, ignored\n", socket);
+        return -1;
+    }
+    // not for the children, e.g. a browser opened from the UI
+    fcntl(socket, F_SETFD, FD_CLOEXEC);
+    inheritedSockets[connType] = socket;
+    printf("smartcam: inherited %s socket on port %d\n",
+           (connType == CONN_UDP ? "udp" : "inet"), ntohs(sin.sin_port));
+    return 0;
+}
+bool CCommHandler::IsServerInherited(ConnectionType connType)
+{
+    return (inheritedSockets[connType] != INVALID_SOCKET);
+}
+int CCommHandler::StartInetServer(int port, int rcvBufSize)
 {
-    int flags = 0;
     struct sockaddr_in sin;
     // Initialize the addr
     sin.sin_family = AF_INET;
@@ -73,46 +190,116 @@ int CCommHandler::StartInetServer(int port)
     sin.sin_port = htons(port);
     socklen_t len = sizeof(sin);
 
-    serverSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if(serverSocket == INVALID_SOCKET)
+    // an inherited listener is bound and listening already
+    int sock = inheritedSockets[CONN_INET];
+    if(sock == INVALID_SOCKET)
     {
-        CUIHandler::Msg("Could not create inet socket: %d(%s)\n", errno, strerror(errno));
-        return -1;
-    }
+        sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if(sock == INVALID_SOCKET)
+        {
+            CUIHandler::Msg("Could not create inet socket: %d(%s)\n", errno, strerror(errno));
+            return -1;
+        }
 
-    // Bind the socket to the address returned
-    if(bind(serverSocket, (struct sockaddr*)&sin, sizeof(sin)) < 0)
-    {
-        CUIHandler::Msg("Could not bind inet socket: %d(%s)\n", errno, strerror(errno));
-        close(serverSocket);
-        return -1;
+        // Bind the socket to the address returned
+        if(bind(sock, (struct sockaddr*)&sin, sizeof(sin)) < 0)
+        {
+            CUIHandler::Msg("Could not bind inet socket: %d(%s)\n", errno, strerror(errno));
+            close(sock);
+            return -1;
+        }
+        SetRcvBufSize(sock, rcvBufSize);
+        if(listen(sock, SMARTCAM_MAX_SESSIONS) < 0)
+        {
+            CUIHandler::Msg("Could not listen on inet socket: %d(%s)\n", errno, strerror(errno));
+            close(sock);
+            return -1;
+        }
     }
-    if(listen(serverSocket, 1) < 0)
+    else
     {
-        CUIHandler::Msg("Could not listen on inet socket: %d(%s)\n", errno, strerror(errno));
-        close(serverSocket);
-        return -1;
+        // accepted sockets inherit it, even if it comes after the listen()
+        SetRcvBufSize(sock, rcvBufSize);
     }
-    if(getsockname(serverSocket, (struct sockaddr*)&sin, &len) < 0)
+    if(getsockname(sock, (struct sockaddr*)&sin, &len) < 0)
     {
         CUIHandler::Msg("Could not get socket name: %d(%s)\n", errno, strerror(errno));
-        close(serverSocket);
+        if(sock != inheritedSockets[CONN_INET])
+            close(sock);
         return -1;
     }
-    printf("smartcam: listening on %s, port %d\n", inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
-    flags = fcntl(serverSocket, F_GETFL, NULL);
-    if(flags < 0)
+    if(WatchServerSocket(sock) != 0)
     {
-        CUIHandler::Msg("Could not retrieve socket flags: %d(%s)\n", errno, strerror(errno));
+        if(sock != inheritedSockets[CONN_INET])
+            close(sock);
         return -1;
     }
-    flags |= O_NONBLOCK;
-    fcntl(serverSocket, F_SETFL, flags);
+    serverSockets[CONN_INET] = sock;
+    printf("smartcam: listening on %s, port %d\n", inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
+    return 0;
+}
 
+int CCommHandler::StartUdpServer(int port, int rcvBufSize)
+{
+    struct sockaddr_in sin;
+    int reuse = 1;
+    // Initialize the addr
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = INADDR_ANY;
+    sin.sin_port = htons(port);
+
+    int sock = inheritedSockets[CONN_UDP];
+    if(sock != INVALID_SOCKET)
+    {
+        // the per phone sockets have to bind the port it was bound to; they
+        // need SO_REUSEADDR on it as well, which whoever bound it has to set
+        socklen_t len = sizeof(sin);
+        if(getsockname(sock, (struct sockaddr*)&sin, &len) < 0)
+        {
+            CUIHandler::Msg("Could not get socket name: %d(%s)\n", errno, strerror(errno));
+            return -1;
+        }
+        port = ntohs(sin.sin_port);
+        SetRcvBufSize(sock, rcvBufSize);
+        if(WatchServerSocket(sock) != 0)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if(sock == INVALID_SOCKET)
+        {
+            CUIHandler::Msg("Could not create udp socket: %d(%s)\n", errno, strerror(errno));
+            return -1;
+        }
+        // the per phone sockets are bound to the same port
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if(bind(sock, (struct sockaddr*)&sin, sizeof(sin)) < 0)
+        {
+            CUIHandler::Msg("Could not bind udp socket: %d(%s)\n", errno, strerror(errno));
+            close(sock);
+            return -1;
+        }
+        SetRcvBufSize(sock, rcvBufSize);
+        if(WatchServerSocket(sock) != 0)
+        {
+            close(sock);
+            return -1;
+        }
+    }
+    serverSockets[CONN_UDP] = sock;
+    serverPort = port;
+    serverRcvBufSize = rcvBufSize;
+    printf("smartcam: listening for udp on port %d\n", port);
     return 0;
 }
 
-void CCommHandler::RegisterBtService(uint8_t rfcommChannel)
+// One record for both channels: RFCOMM in the protocol descriptor list that
+// every phone reads, the L2CAP PSM (if any) in the additional one
+void CCommHandler::RegisterBtService(uint8_t rfcommChannel, uint16_t l2capPsm)
 {
     uint8_t svc_uuid_int[] = { 0xB9, 0xDE, 0xC6, 0xD2, 0x29, 0x30, 0x43, 0x38, 0xA0, 0x79, 0xAA, 0xE5, 0x60, 0x05, 0x32, 0x38 };
     const char* service_name = "SmartCam";
@@ -129,7 +316,10 @@ void CCommHandler::RegisterBtService(uint8_t rfcommChannel)
     *root_list = 0,
     *proto_list = 0,
     *access_proto_list = 0,
-    *svc_class_list = 0;
+    *svc_class_list = 0,
+    *psm_l2cap_list = 0,
+    *psm_proto_list = 0,
+    *add_proto_list = 0;
     sdp_data_t* channel = 0, *psm = 0;
 
     sdpRecord = sdp_record_alloc();
@@ -161,6 +351,17 @@ void CCommHandler::RegisterBtService(uint8_t rfcommChannel)
     access_proto_list = sdp_list_append(0, proto_list);
     sdp_set_access_protos(sdpRecord, access_proto_list);
 
+    // set the l2cap channel
+    if(l2capPsm != 0)
+    {
+        psm = sdp_data_alloc(SDP_UINT16, &l2capPsm);
+        psm_l2cap_list = sdp_list_append(0, &l2cap_uuid);
+        sdp_list_append(psm_l2cap_list, psm);
+        psm_proto_list = sdp_list_append(0, psm_l2cap_list);
+        add_proto_list = sdp_list_append(0, psm_proto_list);
+        sdp_set_add_access_protos(sdpRecord, add_proto_list);
+    }
+
     // set the name, provider, and description
     sdp_set_info_attr(sdpRecord, service_name, service_prov, service_dsc);
 
@@ -186,6 +387,13 @@ void CCommHandler::RegisterBtService(uint8_t rfcommChannel)
     sdp_list_free(proto_list, 0);
     sdp_list_free(access_proto_list, 0);
     sdp_list_free(svc_class_list, 0);
+    if(psm != NULL)
+    {
+        sdp_data_free(psm);
+        sdp_list_free(psm_l2cap_list, 0);
+        sdp_list_free(psm_proto_list, 0);
+        sdp_list_free(add_proto_list, 0);
+    }
 }
 
 int CCommHandler::DynamicBtBind(int sock, struct sockaddr_rc* sockaddr, uint8_t* port)
@@ -202,9 +410,72 @@ int CCommHandler::DynamicBtBind(int sock, struct sockaddr_rc* sockaddr, uint8_t*
     return -1;
 }
 
-int CCommHandler::StartBtServer()
+// L2CAP in ERTM or streaming mode with a large MTU carries far more than
+// RFCOMM's small frames and credits. The socket is a SOCK_STREAM one, so it
+// reads like RFCOMM and TCP. Returns the PSM picked by the kernel, 0 if the
+// adapter or kernel cannot do it (RFCOMM alone is still served then).
+uint16_t CCommHandler::StartL2capServer(const bdaddr_t* bdaddr, int rcvBufSize, BtL2capMode l2capMode)
+{
+    struct sockaddr_l2 localAddr;
+    struct l2cap_options options;
+    socklen_t len = sizeof(options);
+
+    l2capServerSocket = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_L2CAP);
+    if(l2capServerSocket == INVALID_SOCKET)
+    {
+        printf("smartcam: could not create l2cap socket: %s\n", strerror(errno));
+        return 0;
+    }
+    memset(&options, 0, sizeof(options));
+    if(getsockopt(l2capServerSocket, SOL_L2CAP, L2CAP_OPTIONS, &options, &len) < 0)
+    {
+        printf("smartcam: could not get l2cap options: %s\n", strerror(errno));
+        close(l2capServerSocket);
+        l2capServerSocket = INVALID_SOCKET;
+        return 0;
+    }
+    options.imtu = SMARTCAM_L2CAP_MTU;
+    options.mode = (l2capMode == BT_L2CAP_STREAMING ? L2CAP_MODE_STREAMING : L2CAP_MODE_ERTM);
+    if(setsockopt(l2capServerSocket, SOL_L2CAP, L2CAP_OPTIONS, &options, sizeof(options)) < 0)
+    {
+        // ERTM is off (disable_ertm) or not supported by this kernel
+        printf("smartcam: could not set l2cap mode %d: %s\n", options.mode, strerror(errno));
+        close(l2capServerSocket);
+        l2capServerSocket = INVALID_SOCKET;
+        return 0;
+    }
+
+    SetRcvBufSize(l2capServerSocket, rcvBufSize);
+
+    // PSM 0: the kernel picks a free dynamic one
+    memset(&localAddr, 0, sizeof(localAddr));
+    localAddr.l2_family = AF_BLUETOOTH;
+    localAddr.l2_bdaddr = *bdaddr;
+    localAddr.l2_psm = 0;
+    len = sizeof(localAddr);
+    if(bind(l2capServerSocket, (struct sockaddr*) &localAddr, sizeof(localAddr)) < 0 ||
+       listen(l2capServerSocket, SMARTCAM_MAX_SESSIONS) < 0 ||
+       getsockname(l2capServerSocket, (struct sockaddr*) &localAddr, &len) < 0)
+    {
+        printf("smartcam: could not listen on l2cap socket: %s\n", strerror(errno));
+        close(l2capServerSocket);
+        l2capServerSocket = INVALID_SOCKET;
+        return 0;
+    }
+    if(WatchServerSocket(l2capServerSocket) != 0)
+    {
+        close(l2capServerSocket);
+        l2capServerSocket = INVALID_SOCKET;
+        return 0;
+    }
+    uint16_t psm = btohs(localAddr.l2_psm);
+    printf("smartcam: listening on l2cap psm 0x%04x (%s, mtu %d)\n", psm,
+           (l2capMode == BT_L2CAP_STREAMING ? "streaming" : "ertm"), SMARTCAM_L2CAP_MTU);
+    return psm;
+}
+
+int CCommHandler::StartBtServer(int rcvBufSize, BtL2capMode l2capMode)
 {
-    int flags = 0;
     uint8_t port = 0;
     struct sockaddr_rc localAddr = { 0 };
     socklen_t len = sizeof(localAddr);
@@ -216,59 +487,92 @@ int CCommHandler::StartBtServer()
         return -1;
     }
     // allocate server socket
-    serverSocket = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+    int sock = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+    if(sock == INVALID_SOCKET)
+    {
+        CUIHandler::Msg("Could not create bt socket: %d(%s)\n", errno, strerror(errno));
+        return -1;
+    }
 
     // bind socket to 1st available port of the first available local bluetooth adapter
     localAddr.rc_family = AF_BLUETOOTH;
     localAddr.rc_bdaddr = di.bdaddr;
-    if(DynamicBtBind(serverSocket, &localAddr, &port))
+    if(DynamicBtBind(sock, &localAddr, &port))
     {
         CUIHandler::Msg("Could not bind on bt socket: %d(%s)\n", errno, strerror(errno));
-        close(serverSocket);
+        close(sock);
         return -1;
     }
-    if(listen(serverSocket, 1) < 0)
+    SetRcvBufSize(sock, rcvBufSize);
+    if(listen(sock, SMARTCAM_MAX_SESSIONS) < 0)
     {
         CUIHandler::Msg("Could not listen on bt socket: %d(%s)\n", errno, strerror(errno));
-        close(serverSocket);
+        close(sock);
         return -1;
     }
-    if(getsockname(serverSocket, (struct sockaddr*) &localAddr, &len) < 0)
+    if(getsockname(sock, (struct sockaddr*) &localAddr, &len) < 0)
     {
         CUIHandler::Msg("Could not get socket name: %d(%s)\n", errno, strerror(errno));
-        close(serverSocket);
+        close(sock);
         return -1;
     }
     char buf[255] = { 0 };
     ba2str(&localAddr.rc_bdaddr, buf);
     port = localAddr.rc_channel;
     printf("smartcam: listening on %s, port %d\n", buf, port);
-    // advertise bt service
-    RegisterBtService(port);
-    flags = fcntl(serverSocket, F_GETFL, NULL);
-    if(flags < 0)
+    uint16_t psm = 0;
+    if(l2capMode != BT_L2CAP_OFF)
     {
-        CUIHandler::Msg("Could not retrieve socket flags: %d(%s)\n", errno, strerror(errno));
+        psm = StartL2capServer(&di.bdaddr, rcvBufSize, l2capMode);
+    }
+    serverSockets[CONN_BLUETOOTH] = sock;
+    if(WatchServerSocket(sock) != 0)
+    {
+        StopServer(CONN_BLUETOOTH);
         return -1;
     }
-    flags |= O_NONBLOCK;
-    fcntl(serverSocket, F_SETFL, flags);
+    // advertise bt service
+    RegisterBtService(port, psm);
     return 0;
 }
 
-AcceptResultCode CCommHandler::AcceptBtClient()
+AcceptResultCode CCommHandler::AcceptBtClient(int* clientSocket)
 {
     struct sockaddr_rc remAddr = { 0 };
     socklen_t opt = sizeof(remAddr);
+
+    // phones that found the PSM in the SDP record come in over L2CAP
+    if(l2capServerSocket != INVALID_SOCKET)
+    {
+        struct sockaddr_l2 l2Addr;
+        struct l2cap_options options;
+        socklen_t l2Len = sizeof(l2Addr);
+        memset(&l2Addr, 0, sizeof(l2Addr));
+        *clientSocket = accept(l2capServerSocket, (struct sockaddr*) &l2Addr, &l2Len);
+        if(*clientSocket != INVALID_SOCKET)
+        {
+            char buf[255] = {0};
+            ba2str(&l2Addr.l2_bdaddr, buf);
+            memset(&options, 0, sizeof(options));
+            l2Len = sizeof(options);
+            getsockopt(*clientSocket, SOL_L2CAP, L2CAP_OPTIONS, &options, &l2Len);
+            printf("smartcam: accepted bt l2cap connection from %s (mode %d, mtu %d)\n", buf, options.mode, options.imtu);
+            return ACCEPT_OK;
+        }
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            printf("smartcam: could not accept l2cap connection: %s\n", strerror(errno));
+        }
+    }
     // accept one connection
-    if((clientSocket = accept(serverSocket, (struct sockaddr*) &remAddr, &opt)) == INVALID_SOCKET)
+    if((*clientSocket = accept(serverSockets[CONN_BLUETOOTH], (struct sockaddr*) &remAddr, &opt)) == INVALID_SOCKET)
     {
         if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
         {
             return ACCEPT_RETRY;
         }
         CUIHandler::Msg("Could not accept bt connection on socket: %d(%s)\n", errno, strerror(errno));
-        close(serverSocket);
+        StopServer(CONN_BLUETOOTH);
         return ACCEPT_ERROR;
     }
 
@@ -276,24 +580,22 @@ AcceptResultCode CCommHandler::AcceptBtClient()
     ba2str(&remAddr.rc_bdaddr, buf);
     printf("smartcam: accepted bt connection from %s\n", buf);
 
-    isConnected = 1;
-    pSmartEngine->OnConnected();
     return ACCEPT_OK;
 }
 
-AcceptResultCode CCommHandler::AcceptInetClient()
+AcceptResultCode CCommHandler::AcceptInetClient(int* clientSocket)
 {
     struct sockaddr_in remAddr = { 0 };
     socklen_t opt = sizeof(remAddr);
     // accept one connection
-    if((clientSocket = accept(serverSocket, (struct sockaddr*) &remAddr, &opt)) == INVALID_SOCKET)
+    if((*clientSocket = accept(serverSockets[CONN_INET], (struct sockaddr*) &remAddr, &opt)) == INVALID_SOCKET)
     {
         if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
         {
             return ACCEPT_RETRY;
         }
         CUIHandler::Msg("Could not accept inet connection on socket: %d(%s)\n", errno, strerror(errno));
-        close(serverSocket);
+        StopServer(CONN_INET);
         return ACCEPT_ERROR;
     }
 
@@ -307,120 +609,363 @@ AcceptResultCode CCommHandler::AcceptInetClient()
         printf("smartcam: accepted inet connection, but inet_ntoa() failed ...\n");
     }
 
-    isConnected = 1;
-    pSmartEngine->OnConnected();
     return ACCEPT_OK;
 }
 
-int CCommHandler::Disconnect()
+bool CCommHandler::IsUdpPeerConnected(struct sockaddr_in* peerAddr)
 {
-    isConnected = 0;
-    // close the sockets (if opened)
-    if(clientSocket != INVALID_SOCKET)
+    for(int i = 0; i < SMARTCAM_MAX_SESSIONS; i++)
     {
-        close(clientSocket);
-        clientSocket = INVALID_SOCKET;
+        struct sockaddr_in connectedAddr;
+        socklen_t len = sizeof(connectedAddr);
+        if(udpPeerSockets[i] == INVALID_SOCKET)
+        {
+            continue;
+        }
+        if(udpPeerAddrs[i].sin_addr.s_addr != peerAddr->sin_addr.s_addr ||
+           udpPeerAddrs[i].sin_port != peerAddr->sin_port)
+        {
+            continue;
+        }
+        // the session may be gone (and its socket closed) in the meantime
+        if(getpeername(udpPeerSockets[i], (struct sockaddr*)&connectedAddr, &len) == 0 &&
+           connectedAddr.sin_addr.s_addr == peerAddr->sin_addr.s_addr &&
+           connectedAddr.sin_port == peerAddr->sin_port)
+        {
+            return true;
+        }
+        udpPeerSockets[i] = INVALID_SOCKET;
     }
-    return 0;
+    return false;
 }
 
-int CCommHandler::RcvPacket()
+// The first datagram of a phone creates a socket bound to the server port and
+// connected to the phone: the kernel then delivers the rest of its datagrams
+// there and the session reads them like a stream client. The fragment carried
+// by the first datagram is lost, the jitter buffer drops that frame.
+AcceptResultCode CCommHandler::AcceptUdpClient(int* clientSocket)
 {
-    int retCode = 0;
-    unsigned char header[4] = {0};
+    struct sockaddr_in remAddr = { 0 };
+    struct sockaddr_in localAddr = { 0 };
+    socklen_t opt = sizeof(remAddr);
+    unsigned char datagram[64];
+    int reuse = 1;
 
-    retCode = recv(clientSocket, (char*) header, 4, 0);
-    if((retCode == 0) || (retCode == -1))
+    if(recvfrom(serverSockets[CONN_UDP], datagram, sizeof(datagram), MSG_TRUNC, (struct sockaddr*) &remAddr, &opt) < 0)
     {
-        Disconnect();
-        pSmartEngine->OnDisconnected();
-        return -1;
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+            return ACCEPT_RETRY;
+        }
+        CUIHandler::Msg("Could not receive on udp socket: %d(%s)\n", errno, strerror(errno));
+        StopServer(CONN_UDP);
+        return ACCEPT_ERROR;
+    }
+    // queued before the phone's own socket was connected
+    if(IsUdpPeerConnected(&remAddr))
+    {
+        return ACCEPT_RETRY;
     }
 
-    rcvPacketType = (SmartCamPacketType) (header[0]);
-    rcvPacketLen = ((unsigned int)header[1] << 16) | ((unsigned int)header[2] << 8) | ((unsigned int)header[3]);
-    if(rcvPacketMaxLen < rcvPacketLen)
+    *clientSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(*clientSocket == INVALID_SOCKET)
     {
-        delete[] rcvPacket;
-        rcvPacketMaxLen = rcvPacketLen + rcvPacketLen/3;
-        rcvPacket = new unsigned char[rcvPacketMaxLen];
+        CUIHandler::Msg("Could not create udp socket: %d(%s)\n", errno, strerror(errno));
+        return ACCEPT_RETRY;
+    }
+    setsockopt(*clientSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    SetRcvBufSize(*clientSocket, serverRcvBufSize);
+    localAddr.sin_family = AF_INET;
+    localAddr.sin_addr.s_addr = INADDR_ANY;
+    localAddr.sin_port = htons(serverPort);
+    if(bind(*clientSocket, (struct sockaddr*) &localAddr, sizeof(localAddr)) < 0 ||
+       connect(*clientSocket, (struct sockaddr*) &remAddr, sizeof(remAddr)) < 0)
+    {
+        printf("smartcam: could not connect udp socket: %s\n", strerror(errno));
+        close(*clientSocket);
+        *clientSocket = INVALID_SOCKET;
+        return ACCEPT_RETRY;
     }
 
-    int rcvdBytesCount = 0;
-    while(rcvdBytesCount < rcvPacketLen)
+    for(int i = 0; i < SMARTCAM_MAX_SESSIONS; i++)
     {
-        retCode = recv(clientSocket, ((char*) rcvPacket) + rcvdBytesCount, rcvPacketLen - rcvdBytesCount, 0);
-        // Connection closed or socket error
-        if((retCode == 0) || (retCode == -1))
+        if(udpPeerSockets[i] == INVALID_SOCKET || !IsUdpPeerConnected(&udpPeerAddrs[i]))
         {
-            Disconnect();
-            pSmartEngine->OnDisconnected();
-            return -1;
+            udpPeerAddrs[i] = remAddr;
+            udpPeerSockets[i] = *clientSocket;
+            break;
         }
-        // All went well, advance the byte count
-        else
+    }
+    printf("smartcam: accepted udp stream from %s:%d\n", inet_ntoa(remAddr.sin_addr), ntohs(remAddr.sin_port));
+    return ACCEPT_OK;
+}
+
+// Phones send the hello right after connecting; edge triggered, so a client
+// with part of its hello in is not reported again until more arrives
+int CCommHandler::WatchHello(int clientSocket, ConnectionType connType, int timeoutMillis)
+{
+    for(int i = 0; i < SMARTCAM_MAX_HELLOS; i++)
+    {
+        if(helloSockets[i] != INVALID_SOCKET)
+        {
+            continue;
+        }
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        event.data.fd = clientSocket;
+        if(epoll_ctl(epollFd, EPOLL_CTL_ADD, clientSocket, &event) != 0)
         {
-            rcvdBytesCount += retCode;
+            printf("smartcam: could not watch client socket: %d(%s)\n", errno, strerror(errno));
+            return -1;
         }
+        helloSockets[i] = clientSocket;
+        helloTypes[i] = connType;
+        helloDeadlines[i] = CPacketRing::GetMicros() + (unsigned long long)timeoutMillis * 1000;
+        return 0;
     }
+    return -1;
+}
 
-    return 0;
+int CCommHandler::TakeHelloClient(ConnectionType* connType, unsigned int* flags, unsigned int* helloId,
+                                  unsigned long long* secret)
+{
+    unsigned char hello[PACKET_HELLO_LEN + PACKET_HELLO_SECRET_LEN];
+    unsigned long long now = CPacketRing::GetMicros();
+    for(int i = 0; i < SMARTCAM_MAX_HELLOS; i++)
+    {
+        int clientSocket = helloSockets[i];
+        if(clientSocket == INVALID_SOCKET)
+        {
+            continue;
+        }
+        // done on a whole hello, anything else, end of stream or error
+        bool isDone = false;
+        *flags = 0;
+        ssize_t count = recv(clientSocket, hello, sizeof(hello), MSG_PEEK | MSG_DONTWAIT);
+        if(count == 0 || (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            isDone = true;
+        }
+        else if(count > 0 && CPacketParser::PeekHello(hello, count, flags, helloId, secret) >= 0)
+        {
+            isDone = true;
+        }
+        if(!isDone && now < helloDeadlines[i])
+        {
+            continue;
+        }
+        if(!isDone)
+        {
+            *flags = 0;
+        }
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, clientSocket, NULL);
+        helloSockets[i] = INVALID_SOCKET;
+        *connType = helloTypes[i];
+        return clientSocket;
+    }
+    return INVALID_SOCKET;
 }
 
-void CCommHandler::StopServer()
+void CCommHandler::SetPeerTimeout(int socket, int timeoutMillis)
 {
-    if(sdpRecord != NULL && sdpSession != NULL)
+    int on = 1;
+    // probe after a second of silence, once a second
+    int idleSecs = 1;
+    int intervalSecs = 1;
+    int probeCount = (timeoutMillis + 999) / 1000;
+    unsigned int userTimeout = timeoutMillis;
+    if(timeoutMillis <= 0)
     {
-        sdp_record_unregister(sdpSession, sdpRecord);
-        sdpRecord = NULL;
+        return;
     }
-    if(sdpSession != NULL)
+    if(setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) < 0 ||
+       setsockopt(socket, IPPROTO_TCP, TCP_KEEPIDLE, &idleSecs, sizeof(idleSecs)) < 0 ||
+       setsockopt(socket, IPPROTO_TCP, TCP_KEEPINTVL, &intervalSecs, sizeof(intervalSecs)) < 0 ||
+       setsockopt(socket, IPPROTO_TCP, TCP_KEEPCNT, &probeCount, sizeof(probeCount)) < 0)
     {
-        sdp_close(sdpSession);
-        sdpSession = NULL;
+        printf("smartcam: could not enable keepalive: %d(%s)\n", errno, strerror(errno));
     }
+    // also bounds how long sent data (the control messages) may stay unacknowledged
+    if(setsockopt(socket, IPPROTO_TCP, TCP_USER_TIMEOUT, &userTimeout, sizeof(userTimeout)) < 0)
+    {
+        printf("smartcam: could not set tcp user timeout: %d(%s)\n", errno, strerror(errno));
+    }
+}
 
-    // close the sockets (if open)
-    if(clientSocket != INVALID_SOCKET)
+void CCommHandler::Wakeup()
+{
+    uint64_t one = 1;
+    if(write(wakeupFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
     {
-        close(clientSocket);
-        clientSocket = INVALID_SOCKET;
+        CUIHandler::Msg("Could not signal wakeup eventfd: %d(%s)\n", errno, strerror(errno));
     }
-    if(serverSocket != INVALID_SOCKET)
+}
+
+// Sleeps until a phone connects, a watched client sends something or its
+// hello deadline passes, or somebody calls Wakeup()
+CommEventType CCommHandler::WaitEvent(ConnectionType* connType)
+{
+    // wakeup, every listener, the L2CAP one and the watched clients
+    struct epoll_event events[SMARTCAM_CONN_TYPES + 2 + SMARTCAM_MAX_HELLOS];
+    CommEventType result = COMM_EVENT_WAKEUP;
+    uint64_t count = 0;
+    int eventCount = 0;
+    int timeoutMillis = -1;
+
+    // no timers otherwise: wait for the first hello deadline at most
+    unsigned long long now = CPacketRing::GetMicros();
+    for(int i = 0; i < SMARTCAM_MAX_HELLOS; i++)
     {
-        close(serverSocket);
-        serverSocket = INVALID_SOCKET;
+        if(helloSockets[i] == INVALID_SOCKET)
+        {
+            continue;
+        }
+        int millis = (helloDeadlines[i] > now ? (int)((helloDeadlines[i] - now) / 1000) + 1 : 0);
+        if(timeoutMillis < 0 || millis < timeoutMillis)
+        {
+            timeoutMillis = millis;
+        }
     }
+    do
+        eventCount = epoll_wait(epollFd, events, SMARTCAM_CONN_TYPES + 2 + SMARTCAM_MAX_HELLOS, timeoutMillis);
+    while(eventCount < 0 && errno == EINTR);
+    if(eventCount < 0)
+    {
+        CUIHandler::Msg("Could not wait for socket events: %d(%s)\n", errno, strerror(errno));
+        return COMM_EVENT_ERROR;
+    }
+    if(eventCount == 0)
+    {
+        return COMM_EVENT_TIMEOUT;
+    }
+    // the wakeup takes precedence, stop must not wait behind a connecting phone
+    for(int i = 0; i < eventCount; i++)
+    {
+        if(events[i].data.fd == wakeupFd)
+        {
+            while(read(wakeupFd, &count, sizeof(count)) > 0)
+                ;
+            return COMM_EVENT_WAKEUP;
+        }
+        if(result == COMM_EVENT_ACCEPT)
+            continue;
+        for(int j = 0; j < SMARTCAM_MAX_HELLOS; j++)
+        {
+            if(events[i].data.fd == helloSockets[j] && helloSockets[j] != INVALID_SOCKET)
+            {
+                result = COMM_EVENT_DATA;
+            }
+        }
+        if(events[i].data.fd == l2capServerSocket && l2capServerSocket != INVALID_SOCKET)
+        {
+            *connType = CONN_BLUETOOTH;
+            result = COMM_EVENT_ACCEPT;
+            continue;
+        }
+        for(int type = 0; type < SMARTCAM_CONN_TYPES; type++)
+        {
+            if(events[i].data.fd == serverSockets[type] && serverSockets[type] != INVALID_SOCKET)
+            {
+                *connType = (ConnectionType) type;
+                result = COMM_EVENT_ACCEPT;
+            }
+        }
+    }
+    return result;
 }
 
-void CCommHandler::Cleanup()
+// Closing a socket drops it from the epoll set, so the comm thread may keep
+// waiting on the others
+void CCommHandler::StopServer(ConnectionType connType)
 {
-    StopServer();
-    if(rcvPacket != NULL)
+    if(connType == CONN_BLUETOOTH)
     {
-        delete[] rcvPacket;
-        rcvPacket = NULL;
+        if(sdpRecord != NULL && sdpSession != NULL)
+        {
+            sdp_record_unregister(sdpSession, sdpRecord);
+            sdpRecord = NULL;
+        }
+        if(sdpSession != NULL)
+        {
+            sdp_close(sdpSession);
+            sdpSession = NULL;
+        }
+        if(l2capServerSocket != INVALID_SOCKET)
+        {
+            close(l2capServerSocket);
+            l2capServerSocket = INVALID_SOCKET;
+        }
+    }
+    // close the server socket (if open), clients belong to their sessions;
+    // an inherited one is only no longer watched, phones knocking meanwhile
+    // wait in its backlog
+    if(serverSockets[connType] != INVALID_SOCKET)
+    {
+        if(serverSockets[connType] == inheritedSockets[connType])
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, serverSockets[connType], NULL);
+        else
+            close(serverSockets[connType]);
+        serverSockets[connType] = INVALID_SOCKET;
+        printf("smartcam: stopped listening on %s\n",
+               (connType == CONN_BLUETOOTH ? "bluetooth" : (connType == CONN_UDP ? "udp" : "inet")));
     }
-    rcvPacketLen = 0;
-    rcvPacketMaxLen = 0;
 }
 
-bool CCommHandler::IsConnected()
+void CCommHandler::StopServer()
 {
-    return isConnected;
+    for(int i = 0; i < SMARTCAM_CONN_TYPES; i++)
+    {
+        StopServer((ConnectionType) i);
+    }
+    for(int i = 0; i < SMARTCAM_MAX_SESSIONS; i++)
+    {
+        udpPeerSockets[i] = INVALID_SOCKET;
+    }
+    for(int i = 0; i < SMARTCAM_MAX_HELLOS; i++)
+    {
+        if(helloSockets[i] != INVALID_SOCKET)
+        {
+            close(helloSockets[i]);
+            helloSockets[i] = INVALID_SOCKET;
+        }
+    }
 }
 
-unsigned char* CCommHandler::GetRcvPacket()
+bool CCommHandler::IsServerStarted(ConnectionType connType)
 {
-    return rcvPacket;
+    return (serverSockets[connType] != INVALID_SOCKET);
 }
 
-unsigned int CCommHandler::GetRcvPacketLen()
+bool CCommHandler::IsAnyServerStarted()
 {
-    return rcvPacketLen;
+    for(int i = 0; i < SMARTCAM_CONN_TYPES; i++)
+    {
+        if(serverSockets[i] != INVALID_SOCKET)
+            return true;
+    }
+    return false;
 }
 
-SmartCamPacketType CCommHandler::GetRcvPacketType()
+void CCommHandler::Cleanup()
 {
-    return rcvPacketType;
+    StopServer();
+    for(int i = 0; i < SMARTCAM_CONN_TYPES; i++)
+    {
+        if(inheritedSockets[i] != INVALID_SOCKET)
+        {
+            close(inheritedSockets[i]);
+            inheritedSockets[i] = INVALID_SOCKET;
+        }
+    }
+    if(wakeupFd != -1)
+    {
+        close(wakeupFd);
+        wakeupFd = -1;
+    }
+    if(epollFd != -1)
+    {
+        close(epollFd);
+        epollFd = -1;
+    }
 }
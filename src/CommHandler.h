@@ -22,10 +22,20 @@
 #ifndef __COMM_HANDLER_H__
 #define __COMM_HANDLER_H__
 
+#include <netinet/in.h>
 #include <bluetooth/sdp.h>
 #include <bluetooth/sdp_lib.h>
 
+#include "smartcam.h"
+#include "UserSettings.h"
+
 #define INVALID_SOCKET -1
+// L2CAP MTU asked for on the incoming side, the largest L2CAP allows
+#define SMARTCAM_L2CAP_MTU 65535
+// one listener per ConnectionType
+#define SMARTCAM_CONN_TYPES 3
+// accepted clients whose hello may be awaited at the same time
+#define SMARTCAM_MAX_HELLOS 8
 
 class CSmartEngine;
 
@@ -36,13 +46,35 @@ typedef enum AcceptResultCode
     ACCEPT_ERROR = 2
 } AcceptResultCode;
 
+typedef enum CommEventType
+{
+    COMM_EVENT_ACCEPT = 0,
+    COMM_EVENT_DATA = 1,
+    COMM_EVENT_WAKEUP = 2,
+    COMM_EVENT_ERROR = 3,
+    COMM_EVENT_TIMEOUT = 4
+} CommEventType;
+
 typedef enum SmartCamPacketType
 {
     PACKET_JPEG_HEDAER = 0,
-    PACKET_JPEG_DATA = 1
+    PACKET_JPEG_DATA = 1,
+    // v2 only, the answer to a CONTROL_CLOCK_PING (see PacketParser.h)
+    PACKET_CLOCK_REPLY = 2
 } SmartCamPacketType;
 
-#define DEFAULT_PAKET_MAX_LEN 4096
+// Payload format of a protocol v2 packet, v1 packets are always JPEG. The
+// raw codecs carry a whole frame in a PACKET_JPEG_DATA packet, as YUV 4:2:0
+// planes (NV21: Y then interleaved VU, I420: Y, U, V), the _LZ4 ones
+// compressed as one LZ4 block (see PacketParser.h)
+typedef enum SmartCamCodec
+{
+    CODEC_JPEG = 0,
+    CODEC_NV21 = 1,
+    CODEC_I420 = 2,
+    CODEC_NV21_LZ4 = 3,
+    CODEC_I420_LZ4 = 4
+} SmartCamCodec;
 
 class CCommHandler
 {
@@ -51,36 +83,75 @@ public:
     virtual ~CCommHandler();
     int Initialize();
     void Cleanup();
-    int StartInetServer(int port);
-    int StartBtServer();
+    int StartInetServer(int port, int rcvBufSize);
+    int StartBtServer(int rcvBufSize, BtL2capMode l2capMode);
+    int StartUdpServer(int port, int rcvBufSize);
+    // Takes over a listener set up by whoever started us (socket activation):
+    // a listening TCP/IP or a bound UDP socket, used instead of creating one
+    // whenever that listener is started
+    int AdoptServerSocket(int socket);
+    bool IsServerInherited(ConnectionType connType);
+    // Stops one listener, or all of them along with the clients still
+    // waiting for their hello; clients of sessions are not touched
+    void StopServer(ConnectionType connType);
     void StopServer();
-    AcceptResultCode AcceptBtClient();
-    AcceptResultCode AcceptInetClient();
-    int Disconnect();
-    int RcvPacket();
-    bool IsConnected();
-    unsigned char* GetRcvPacket();
-    unsigned int GetRcvPacketLen();
-    SmartCamPacketType GetRcvPacketType();
+    bool IsServerStarted(ConnectionType connType);
+    bool IsAnyServerStarted();
+    AcceptResultCode AcceptBtClient(int* clientSocket);
+    AcceptResultCode AcceptInetClient(int* clientSocket);
+    AcceptResultCode AcceptUdpClient(int* clientSocket);
+    // COMM_EVENT_ACCEPT tells in *connType which listener has a phone waiting
+    CommEventType WaitEvent(ConnectionType* connType);
+    // Watches an accepted client on the epoll set until its hello is in, for
+    // at most timeoutMillis; -1 if too many clients are waiting already
+    int WatchHello(int clientSocket, ConnectionType connType, int timeoutMillis);
+    // A watched client done waiting, its hello left unconsumed: the flags,
+    // multipath stream id and secret of a hello that joins a session, flags
+    // 0 for anything else or if nothing came in time; INVALID_SOCKET if no
+    // client is done yet
+    int TakeHelloClient(ConnectionType* connType, unsigned int* flags, unsigned int* helloId,
+                        unsigned long long* secret);
+    void Wakeup();
+    // TCP keepalive probes and user timeout, so that a peer that vanished
+    // (out of WiFi range, battery pulled) fails the socket within timeoutMillis
+    static void SetPeerTimeout(int socket, int timeoutMillis);
 
 private:
     // Methods:
-    void RegisterBtService(uint8_t rfcommChannel);
+    void RegisterBtService(uint8_t rfcommChannel, uint16_t l2capPsm);
     int DynamicBtBind(int sock, struct sockaddr_rc* sockaddr, uint8_t* port);
+    uint16_t StartL2capServer(const bdaddr_t* bdaddr, int rcvBufSize, BtL2capMode l2capMode);
+    int WatchServerSocket(int socket);
+    void SetRcvBufSize(int socket, int rcvBufSize);
+    bool IsUdpPeerConnected(struct sockaddr_in* peerAddr);
     // Data:
     CSmartEngine* pSmartEngine;
-    bool isConnected;
-    // sockets:
-    int serverSocket;
-    int clientSocket;
+    // listening sockets by ConnectionType, any number of them may be open;
+    // accepted clients are handed over to a CSmartSession
+    int serverSockets[SMARTCAM_CONN_TYPES];
+    // adopted listeners, they live as long as we do and keep their port
+    int inheritedSockets[SMARTCAM_CONN_TYPES];
+    // UDP listener
+    int serverPort;
+    int serverRcvBufSize;
+    // Bluetooth: optional L2CAP listener next to the RFCOMM one
+    int l2capServerSocket;
+    // UDP has no accept: every phone gets its own socket connected to it,
+    // remembered so that its late datagrams on the server socket are ignored
+    struct sockaddr_in udpPeerAddrs[SMARTCAM_MAX_SESSIONS];
+    int udpPeerSockets[SMARTCAM_MAX_SESSIONS];
+    // event loop: epoll set with the server sockets plus an eventfd used to
+    // wake the comm thread up on stop, session end or settings change
+    int epollFd;
+    int wakeupFd;
+    // accepted clients whose hello is awaited, until their deadline in
+    // CLOCK_MONOTONIC micros (comm thread only)
+    int helloSockets[SMARTCAM_MAX_HELLOS];
+    ConnectionType helloTypes[SMARTCAM_MAX_HELLOS];
+    unsigned long long helloDeadlines[SMARTCAM_MAX_HELLOS];
     // BT SDP:
     sdp_record_t* sdpRecord;
     sdp_session_t* sdpSession;
-
-    unsigned char* rcvPacket;
-    unsigned int rcvPacketLen;
-    unsigned int rcvPacketMaxLen;
-    SmartCamPacketType rcvPacketType;
 };
 
 #endif//__COMM_HANDLER_H__
@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// DecodeGovernor.cpp
+
+#include "DecodeGovernor.h"
+
+// frames measured before deciding
+#define GOVERNOR_WINDOW_FRAMES 30
+// share of the frame interval decoding may take before stepping down, and
+// the share below which there is room to step up
+#define GOVERNOR_BUSY_SHARE 0.9f
+#define GOVERNOR_IDLE_SHARE 0.5f
+// windows with room needed before stepping up, and before trying a tier
+// that looks too slow anyway
+#define GOVERNOR_CALM_WINDOWS 3
+#define GOVERNOR_RETRY_WINDOWS 20
+
+static const char* TIER_NAMES[JPEG_TIER_COUNT] =
+{
+    "full quality",
+    "fast IDCT",
+    "no upsampling",
+    "no smoothing",
+    "low resolution"
+};
+
+CDecodeGovernor::CDecodeGovernor():
+    tier(JPEG_TIER_FULL),
+    windowFrames(0),
+    windowDecodedFrames(0),
+    windowDecodeMicros(0),
+    windowFirstMicros(0),
+    lastFrameMicros(0),
+    calmWindows(0),
+    lastDecodeMicros(0),
+    isSteppedDown(false)
+{
+    for(int i = 0; i < JPEG_TIER_COUNT; i++)
+    {
+        costRatios[i] = 0;
+    }
+}
+
+CDecodeGovernor::~CDecodeGovernor()
+{
+}
+
+JpegDecodeTier CDecodeGovernor::GetTier()
+{
+    return tier;
+}
+
+const char* CDecodeGovernor::GetTierName(JpegDecodeTier tier)
+{
+    return TIER_NAMES[tier];
+}
+
+bool CDecodeGovernor::AddFrame(unsigned long long decodeMicros, unsigned long long frameMicros)
+{
+    ++windowDecodedFrames;
+    windowDecodeMicros += decodeMicros;
+    return CountFrame(frameMicros);
+}
+
+bool CDecodeGovernor::SkipFrame(unsigned long long frameMicros)
+{
+    return CountFrame(frameMicros);
+}
+
+bool CDecodeGovernor::CountFrame(unsigned long long frameMicros)
+{
+    // a clock that went back (a resumed phone) starts the window over
+    if(windowFrames == 0 || frameMicros < lastFrameMicros)
+    {
+        windowFrames = 0;
+        windowFirstMicros = frameMicros;
+    }
+    lastFrameMicros = frameMicros;
+    if(++windowFrames < GOVERNOR_WINDOW_FRAMES)
+    {
+        return false;
+    }
+    unsigned long long intervalMicros = (frameMicros - windowFirstMicros) / (windowFrames - 1);
+    unsigned long long decodeMicros = (windowDecodedFrames > 0 ? windowDecodeMicros / windowDecodedFrames : 0);
+    windowFrames = 0;
+    windowDecodedFrames = 0;
+    windowDecodeMicros = 0;
+    if(intervalMicros == 0 || decodeMicros == 0)
+    {
+        return false;
+    }
+    if(isSteppedDown)
+    {
+        costRatios[tier - 1] = (float) lastDecodeMicros / decodeMicros;
+        isSteppedDown = false;
+    }
+    lastDecodeMicros = decodeMicros;
+
+    if(decodeMicros > intervalMicros * GOVERNOR_BUSY_SHARE)
+    {
+        calmWindows = 0;
+        if(tier == JPEG_TIER_COUNT - 1)
+        {
+            return false;
+        }
+        tier = (JpegDecodeTier)(tier + 1);
+        isSteppedDown = true;
+        return true;
+    }
+    if(tier == JPEG_TIER_FULL || decodeMicros > intervalMicros * GOVERNOR_IDLE_SHARE)
+    {
+        calmWindows = 0;
+        return false;
+    }
+    ++calmWindows;
+    bool isUpperFit = (decodeMicros * costRatios[tier - 1] <= intervalMicros * GOVERNOR_BUSY_SHARE);
+    if((calmWindows >= GOVERNOR_CALM_WINDOWS && isUpperFit) || calmWindows >= GOVERNOR_RETRY_WINDOWS)
+    {
+        calmWindows = 0;
+        tier = (JpegDecodeTier)(tier - 1);
+        return true;
+    }
+    return false;
+}
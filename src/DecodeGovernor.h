@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// DecodeGovernor.h
+
+#ifndef __DECODE_GOVERNOR_H__
+#define __DECODE_GOVERNOR_H__
+
+#include "JpegHandler.h"
+
+// Keeps the JPEG decode time of a session within the frame interval, by
+// trading decode quality for speed: measured over a window of frames, a
+// decoder busy for most of the interval steps down to the next cheaper
+// JpegDecodeTier, one with plenty of headroom for a few windows steps up
+// again. How much dearer a tier is than the next one is measured on the
+// way down, in the windows right before and after the step; stepping up to a
+// tier that would bring the host behind again is held off, but still tried
+// now and then.
+class CDecodeGovernor
+{
+public:
+    CDecodeGovernor();
+    virtual ~CDecodeGovernor();
+    // A decoded frame: its decode time, and its capture (or receive) time
+    // on any clock that only goes forward. Returns true if the tier changed.
+    bool AddFrame(unsigned long long decodeMicros, unsigned long long frameMicros);
+    // A frame skipped without decoding, it still counts for the interval
+    bool SkipFrame(unsigned long long frameMicros);
+    JpegDecodeTier GetTier();
+    static const char* GetTierName(JpegDecodeTier tier);
+
+private:
+    // Methods:
+    bool CountFrame(unsigned long long frameMicros);
+    // Data:
+    JpegDecodeTier tier;
+    // the window being measured: frames seen and decoded, decode time
+    int windowFrames;
+    int windowDecodedFrames;
+    unsigned long long windowDecodeMicros;
+    unsigned long long windowFirstMicros;
+    unsigned long long lastFrameMicros;
+    int calmWindows;
+    // average decode time of the last window, and whether the tier was
+    // stepped down to right after it
+    unsigned long long lastDecodeMicros;
+    bool isSteppedDown;
+    // decode time of every tier over that of the next one, 0 while unknown
+    float costRatios[JPEG_TIER_COUNT];
+};
+
+#endif//__DECODE_GOVERNOR_H__
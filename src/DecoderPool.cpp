@@ -0,0 +1,360 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// DecoderPool.cpp
+
+#include <stdio.h>
+#include <string.h>
+
+#include "DecoderPool.h"
+#include "RawHandler.h"
+
+CDecoderPool::CDecoderPool():
+    workers(NULL),
+    workerCount(0),
+    jobs(NULL),
+    jobCount(0),
+    frameWidth(0),
+    frameHeight(0),
+    submitCount(0),
+    takeCount(0),
+    releaseCount(0),
+    currentTables(NULL),
+    decodeTier(JPEG_TIER_FULL),
+    isClosed(FALSE),
+    lock(NULL),
+    jobQueued(NULL),
+    jobDone(NULL),
+    jobFree(NULL),
+    busyCount(0),
+    maxBusyCount(0)
+{
+    lock = g_mutex_new();
+    jobQueued = g_cond_new();
+    jobDone = g_cond_new();
+    jobFree = g_cond_new();
+}
+
+CDecoderPool::~CDecoderPool()
+{
+    Close();
+    if(workers != NULL)
+    {
+        for(int i = 0; i < workerCount; i++)
+        {
+            if(workers[i].thread != NULL)
+            {
+                g_thread_join(workers[i].thread);
+            }
+            delete workers[i].pJpegHandler;
+            delete workers[i].pRawHandler;
+        }
+        delete[] workers;
+        workers = NULL;
+    }
+    if(jobs != NULL)
+    {
+        for(int i = 0; i < jobCount; i++)
+        {
+            if(jobs[i].job.pixbuf != NULL)
+            {
+                g_object_unref(jobs[i].job.pixbuf);
+            }
+            UnrefTables(jobs[i].tables);
+            delete[] jobs[i].buffer;
+        }
+        delete[] jobs;
+        jobs = NULL;
+    }
+    UnrefTables(currentTables);
+    g_cond_free(jobFree);
+    g_cond_free(jobDone);
+    g_cond_free(jobQueued);
+    g_mutex_free(lock);
+}
+
+int CDecoderPool::Initialize(int count, int width, int height)
+{
+    GError* error = NULL;
+
+    workerCount = (count < 1 ? 1 : (count > DECODER_POOL_MAX_WORKERS ? DECODER_POOL_MAX_WORKERS : count));
+    frameWidth = width;
+    frameHeight = height;
+    jobCount = workerCount * DECODER_POOL_JOBS_PER_WORKER;
+    jobs = new PoolJob[jobCount];
+    memset(jobs, 0, jobCount * sizeof(PoolJob));
+    workers = new PoolWorker[workerCount];
+    memset(workers, 0, workerCount * sizeof(PoolWorker));
+    for(int i = 0; i < workerCount; i++)
+    {
+        workers[i].pPool = this;
+        workers[i].pJpegHandler = new CJpegHandler();
+        workers[i].pJpegHandler->setOutputSize(width, height);
+        workers[i].pRawHandler = new CRawHandler(width, height);
+    }
+    for(int i = 0; i < workerCount; i++)
+    {
+        workers[i].thread = g_thread_create(WorkerThreadProc, &workers[i], TRUE, &error);
+        if(workers[i].thread == NULL)
+        {
+            g_printerr("Failed to create decoder thread: %s\n", error->message);
+            g_error_free(error);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Called with the lock held
+void CDecoderPool::UnrefTables(PoolTables* tables)
+{
+    if(tables != NULL && --tables->refCount == 0)
+    {
+        delete[] tables->data;
+        delete tables;
+    }
+}
+
+void CDecoderPool::SetTables(const unsigned char* data, unsigned int length)
+{
+    PoolTables* tables = new PoolTables;
+    tables->data = new unsigned char[length];
+    tables->length = length;
+    tables->refCount = 1;
+    memcpy(tables->data, data, length);
+    g_mutex_lock(lock);
+    UnrefTables(currentTables);
+    currentTables = tables;
+    g_mutex_unlock(lock);
+}
+
+void CDecoderPool::SetDecodeTier(JpegDecodeTier tier)
+{
+    decodeTier = tier;
+}
+
+int CDecoderPool::Submit(const SmartCamPacket* packet, bool isDecodeWanted, bool isRepeat, int queueDepth)
+{
+    g_mutex_lock(lock);
+    while(!isClosed && submitCount - releaseCount == (unsigned int) jobCount)
+    {
+        g_cond_wait(jobFree, lock);
+    }
+    g_mutex_unlock(lock);
+    if(isClosed)
+    {
+        return -1;
+    }
+
+    // a free job is the dispatcher's until it is queued, the copy needs no lock
+    PoolJob* job = &jobs[submitCount % jobCount];
+    if(job->capacity < packet->length)
+    {
+        delete[] job->buffer;
+        job->buffer = new unsigned char[packet->length];
+        job->capacity = packet->length;
+    }
+    memcpy(job->buffer, packet->data, packet->length);
+    job->job.packet = *packet;
+    job->job.packet.data = job->buffer;
+    job->job.isDecodeWanted = isDecodeWanted;
+    job->job.isRepeat = isRepeat;
+    job->job.pixbuf = NULL;
+    job->job.width = 0;
+    job->job.height = 0;
+    job->job.decodeMicros = 0;
+    job->job.queueDepth = queueDepth;
+
+    g_mutex_lock(lock);
+    job->tables = NULL;
+    if(isDecodeWanted && packet->codec == CODEC_JPEG && currentTables != NULL)
+    {
+        job->tables = currentTables;
+        ++currentTables->refCount;
+    }
+    job->state = (isDecodeWanted ? JOB_QUEUED : JOB_DONE);
+    ++submitCount;
+    g_cond_signal(isDecodeWanted ? jobQueued : jobDone);
+    g_mutex_unlock(lock);
+    return 0;
+}
+
+void* CDecoderPool::WorkerThreadProc(void* args)
+{
+    PoolWorker* worker = (PoolWorker*) args;
+    CDecoderPool* pPool = worker->pPool;
+
+    g_mutex_lock(pPool->lock);
+    while(!pPool->isClosed)
+    {
+        // the jobs passed through are done already, the output may even have
+        // released them before a worker got that far
+        if((int)(pPool->releaseCount - pPool->takeCount) > 0)
+        {
+            pPool->takeCount = pPool->releaseCount;
+        }
+        while(pPool->takeCount != pPool->submitCount &&
+              pPool->jobs[pPool->takeCount % pPool->jobCount].state != JOB_QUEUED)
+        {
+            ++pPool->takeCount;
+        }
+        if(pPool->takeCount == pPool->submitCount)
+        {
+            g_cond_wait(pPool->jobQueued, pPool->lock);
+            continue;
+        }
+        PoolJob* job = &pPool->jobs[pPool->takeCount++ % pPool->jobCount];
+        job->state = JOB_DECODING;
+        if(++pPool->busyCount > pPool->maxBusyCount)
+        {
+            pPool->maxBusyCount = pPool->busyCount;
+        }
+        g_mutex_unlock(pPool->lock);
+        pPool->Decode(worker, job);
+        g_mutex_lock(pPool->lock);
+        --pPool->busyCount;
+        job->state = JOB_DONE;
+        g_cond_signal(pPool->jobDone);
+    }
+    g_mutex_unlock(pPool->lock);
+    return NULL;
+}
+
+void CDecoderPool::Decode(PoolWorker* worker, PoolJob* job)
+{
+    unsigned long long startMicros = CPacketRing::GetMicros();
+    DecodeJob* decodeJob = &job->job;
+    worker->pJpegHandler->setDecodeTier(decodeTier);
+    if(job->tables != NULL)
+    {
+        worker->pJpegHandler->decodeHeader(job->tables->data, job->tables->length);
+    }
+    decodeJob->pixbuf = DecodeFrame(worker->pJpegHandler, worker->pRawHandler, &decodeJob->packet, false,
+                                    frameWidth, frameHeight, true, &decodeJob->width, &decodeJob->height);
+    decodeJob->decodeMicros = CPacketRing::GetMicros() - startMicros;
+}
+
+DecodeJob* CDecoderPool::WaitDone()
+{
+    DecodeJob* job = NULL;
+    g_mutex_lock(lock);
+    while(!isClosed && (releaseCount == submitCount || jobs[releaseCount % jobCount].state != JOB_DONE))
+    {
+        g_cond_wait(jobDone, lock);
+    }
+    if(!isClosed)
+    {
+        job = &jobs[releaseCount % jobCount].job;
+    }
+    g_mutex_unlock(lock);
+    return job;
+}
+
+void CDecoderPool::ReleaseJob(DecodeJob* job)
+{
+    PoolJob* poolJob = &jobs[releaseCount % jobCount];
+    if(job != &poolJob->job)
+    {
+        return;
+    }
+    if(job->pixbuf != NULL)
+    {
+        g_object_unref(job->pixbuf);
+        job->pixbuf = NULL;
+    }
+    g_mutex_lock(lock);
+    UnrefTables(poolJob->tables);
+    poolJob->tables = NULL;
+    poolJob->state = JOB_FREE;
+    ++releaseCount;
+    g_cond_signal(jobFree);
+    g_mutex_unlock(lock);
+}
+
+void CDecoderPool::Close()
+{
+    g_mutex_lock(lock);
+    isClosed = TRUE;
+    g_cond_broadcast(jobQueued);
+    g_cond_broadcast(jobDone);
+    g_cond_broadcast(jobFree);
+    g_mutex_unlock(lock);
+}
+
+int CDecoderPool::GetWorkerCount()
+{
+    return workerCount;
+}
+
+int CDecoderPool::GetMaxBusyCount()
+{
+    return maxBusyCount;
+}
+
+GdkPixbuf* CDecoderPool::DecodeFrame(CJpegHandler* pJpegHandler, CRawHandler* pRawHandler,
+                                     const SmartCamPacket* packet, bool isStreamed, int width, int height,
+                                     bool isCopyWanted, int* frameWidth, int* frameHeight)
+{
+    int decodedW = 0, decodedH = 0;
+    unsigned char* rgb24 = NULL;
+    GdkPixbuf* pixbuf = NULL, * scaledPixbuf = NULL;
+    if(packet->codec != CODEC_JPEG)
+    {
+        // raw frames are repacked straight to the device frame
+        rgb24 = pRawHandler->decodeRGB24(packet->data, packet->length, packet->codec, *frameWidth, *frameHeight);
+        decodedW = width;
+        decodedH = height;
+    }
+    else
+    {
+        // scaled down in the IDCT already if the frame is bigger
+        if(isStreamed)
+        {
+            pJpegHandler->decodeStream(packet->data, packet->length, true, rgb24, decodedW, decodedH);
+        }
+        else
+        {
+            rgb24 = pJpegHandler->decodeRGB24(packet->data, packet->length, decodedW, decodedH);
+        }
+        *frameWidth = pJpegHandler->getImageWidth();
+        *frameHeight = pJpegHandler->getImageHeight();
+    }
+    if(rgb24 == NULL)
+    {
+        return NULL;    // error, maybe just disconnected...
+    }
+    // gdk-pixbuf does not need the gdk lock, so sessions scale in parallel
+    pixbuf = gdk_pixbuf_new_from_data(rgb24, GDK_COLORSPACE_RGB, FALSE, 8,
+                                      decodedW, decodedH, decodedW * 3, NULL, NULL);
+    if(decodedW != width || decodedH != height)
+    {
+        scaledPixbuf = gdk_pixbuf_scale_simple(pixbuf, width, height, GDK_INTERP_BILINEAR);
+        g_object_unref(pixbuf);
+    }
+    else if(isCopyWanted)
+    {
+        scaledPixbuf = gdk_pixbuf_copy(pixbuf);
+        g_object_unref(pixbuf);
+    }
+    else // do not scale, use original buffer/pixbuf
+    {
+        scaledPixbuf = pixbuf;
+    }
+    return scaledPixbuf;
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// DecoderPool.h
+
+#ifndef __DECODER_POOL_H__
+#define __DECODER_POOL_H__
+
+#include <gtk/gtk.h>
+
+#include "PacketRing.h"
+#include "JpegHandler.h"
+
+class CRawHandler;
+
+#define DECODER_POOL_MAX_WORKERS 16
+// jobs per worker: the one it decodes and one waiting for it or the output
+#define DECODER_POOL_JOBS_PER_WORKER 2
+
+// A packet handed to the pool, given back in the order it was submitted
+typedef struct DecodeJob
+{
+    // a copy of the packet, data included
+    SmartCamPacket packet;
+    // false for a packet passed through in order: clock reply, dropped frame
+    bool isDecodeWanted;
+    // passed through as well: the frame repeats the last one decoded
+    bool isRepeat;
+    // the frame scaled to the device size, owned by the job; NULL if it did
+    // not decode
+    GdkPixbuf* pixbuf;
+    // frame size as sent
+    int width;
+    int height;
+    // time the worker spent on it
+    unsigned long long decodeMicros;
+    // packets waiting in the ring when it was submitted
+    int queueDepth;
+} DecodeJob;
+
+// Decodes consecutive frames of a session on several worker threads, each
+// with decoders of its own, so a big frame size is not held to one core.
+// The workers take the jobs in submit order and WaitDone() hands them out
+// in submit order, however the decoding finished, so the device gets the
+// frames in sequence. Packets that need no decoding go through the same
+// queue to keep their place.
+// JPEG tables are copied once and shared by the jobs submitted after them;
+// a worker loads them into its decoder before an abbreviated frame (the
+// decoder's table cache makes that cheap).
+class CDecoderPool
+{
+public:
+    CDecoderPool();
+    virtual ~CDecoderPool();
+    int Initialize(int workerCount, int width, int height);
+    // Dispatcher: copies the packet into the next job, waits while every job
+    // is taken; -1 once closed
+    int Submit(const SmartCamPacket* packet, bool isDecodeWanted, bool isRepeat, int queueDepth);
+    // Dispatcher: tables for the frames submitted from now on
+    void SetTables(const unsigned char* data, unsigned int length);
+    // decode quality for the frames the workers start from now on
+    void SetDecodeTier(JpegDecodeTier tier);
+    // Output: waits for the oldest job to be done, NULL once closed
+    DecodeJob* WaitDone();
+    void ReleaseJob(DecodeJob* job);
+    // Wakes up every side for good, the jobs not handed out are dropped
+    void Close();
+    int GetWorkerCount();
+    // most frames decoded at the same time
+    int GetMaxBusyCount();
+    // Decodes a frame and scales it to width x height, if it is not that
+    // size already. With isCopyWanted the pixbuf gets its own pixels, else
+    // it may use the decoder's buffer until the next frame.
+    static GdkPixbuf* DecodeFrame(CJpegHandler* pJpegHandler, CRawHandler* pRawHandler,
+                                  const SmartCamPacket* packet, bool isStreamed, int width, int height,
+                                  bool isCopyWanted, int* frameWidth, int* frameHeight);
+
+private:
+    typedef enum JobState
+    {
+        JOB_FREE = 0,
+        JOB_QUEUED = 1,
+        JOB_DECODING = 2,
+        JOB_DONE = 3
+    } JobState;
+
+    typedef struct PoolTables
+    {
+        unsigned char* data;
+        unsigned int length;
+        int refCount;
+    } PoolTables;
+
+    typedef struct PoolJob
+    {
+        DecodeJob job;
+        JobState state;
+        unsigned char* buffer;
+        unsigned int capacity;
+        PoolTables* tables;
+    } PoolJob;
+
+    typedef struct PoolWorker
+    {
+        CDecoderPool* pPool;
+        GThread* thread;
+        CJpegHandler* pJpegHandler;
+        CRawHandler* pRawHandler;
+    } PoolWorker;
+
+    // Methods:
+    void Decode(PoolWorker* worker, PoolJob* job);
+    void UnrefTables(PoolTables* tables);
+    static void* WorkerThreadProc(void* args);
+    // Data:
+    PoolWorker* workers;
+    int workerCount;
+    PoolJob* jobs;
+    int jobCount;
+    int frameWidth;
+    int frameHeight;
+    // jobs submitted, taken by a worker and released, ever: the job ring
+    // index is the count modulo jobCount
+    unsigned int submitCount;
+    unsigned int takeCount;
+    unsigned int releaseCount;
+    PoolTables* currentTables;
+    volatile JpegDecodeTier decodeTier;
+    gboolean isClosed;
+    GMutex* lock;
+    GCond* jobQueued;
+    GCond* jobDone;
+    GCond* jobFree;
+    // statistics
+    int busyCount;
+    int maxBusyCount;
+};
+
+#endif//__DECODER_POOL_H__
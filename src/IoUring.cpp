@@ -0,0 +1,360 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// IoUring.cpp
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "IoUring.h"
+
+#if defined(SMARTCAM_HAVE_IO_URING) && defined(__NR_io_uring_setup)
+
+#include <linux/io_uring.h>
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params* params)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned int toSubmit, unsigned int minComplete, unsigned int flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, const void* arg, unsigned int count)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+CIoUring::CIoUring():
+    ringFd(-1),
+    sqRing(MAP_FAILED),
+    cqRing(MAP_FAILED),
+    sqRingSize(0),
+    cqRingSize(0),
+    sqes((struct io_uring_sqe*) MAP_FAILED),
+    sqesSize(0),
+    sqHead(NULL),
+    sqTail(NULL),
+    sqMask(NULL),
+    sqArray(NULL),
+    cqHead(NULL),
+    cqTail(NULL),
+    cqMask(NULL),
+    cqes(NULL),
+    pending(0)
+{
+    memset(timerSpec, 0, sizeof(timerSpec));
+}
+
+CIoUring::~CIoUring()
+{
+    Cleanup();
+}
+
+void CIoUring::Cleanup()
+{
+    if(sqes != MAP_FAILED)
+    {
+        munmap(sqes, sqesSize);
+        sqes = (struct io_uring_sqe*) MAP_FAILED;
+    }
+    if(cqRing != MAP_FAILED && cqRing != sqRing)
+    {
+        munmap(cqRing, cqRingSize);
+    }
+    cqRing = MAP_FAILED;
+    if(sqRing != MAP_FAILED)
+    {
+        munmap(sqRing, sqRingSize);
+        sqRing = MAP_FAILED;
+    }
+    if(ringFd != -1)
+    {
+        close(ringFd);
+        ringFd = -1;
+    }
+}
+
+int CIoUring::Initialize(unsigned int entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ringFd = io_uring_setup(entries, &params);
+    if(ringFd < 0)
+    {
+        ringFd = -1;
+        return -1;  // ENOSYS, or disabled by kernel.io_uring_disabled
+    }
+
+    // the probe needs 5.6, the operations used here are older
+    unsigned char probeBuffer[sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op)];
+    struct io_uring_probe* probe = (struct io_uring_probe*) probeBuffer;
+    memset(probeBuffer, 0, sizeof(probeBuffer));
+    if(io_uring_register(ringFd, IORING_REGISTER_PROBE, probe, 256) < 0 ||
+       probe->last_op < IORING_OP_ASYNC_CANCEL ||
+       !(probe->ops[IORING_OP_READV].flags & IO_URING_OP_SUPPORTED) ||
+       !(probe->ops[IORING_OP_POLL_ADD].flags & IO_URING_OP_SUPPORTED) ||
+       !(probe->ops[IORING_OP_ASYNC_CANCEL].flags & IO_URING_OP_SUPPORTED) ||
+       !(probe->ops[IORING_OP_TIMEOUT].flags & IO_URING_OP_SUPPORTED))
+    {
+        Cleanup();
+        return -1;
+    }
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(cqRingSize > sqRingSize)
+        {
+            sqRingSize = cqRingSize;
+        }
+        cqRingSize = sqRingSize;
+    }
+    sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if(sqRing == MAP_FAILED)
+    {
+        Cleanup();
+        return -1;
+    }
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        cqRing = sqRing;
+    }
+    else
+    {
+        cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if(cqRing == MAP_FAILED)
+        {
+            Cleanup();
+            return -1;
+        }
+    }
+    sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe*) mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                       ringFd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED)
+    {
+        Cleanup();
+        return -1;
+    }
+
+    sqHead = (unsigned int*)((char*) sqRing + params.sq_off.head);
+    sqTail = (unsigned int*)((char*) sqRing + params.sq_off.tail);
+    sqMask = (unsigned int*)((char*) sqRing + params.sq_off.ring_mask);
+    sqArray = (unsigned int*)((char*) sqRing + params.sq_off.array);
+    cqHead = (unsigned int*)((char*) cqRing + params.cq_off.head);
+    cqTail = (unsigned int*)((char*) cqRing + params.cq_off.tail);
+    cqMask = (unsigned int*)((char*) cqRing + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)((char*) cqRing + params.cq_off.cqes);
+    return 0;
+}
+
+int CIoUring::RegisterFiles(const int* fds, unsigned int count)
+{
+    return (io_uring_register(ringFd, IORING_REGISTER_FILES, fds, count) < 0 ? -1 : 0);
+}
+
+struct io_uring_sqe* CIoUring::GetSqe()
+{
+    unsigned int head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    unsigned int tail = *sqTail;
+    if(tail - head > *sqMask)
+    {
+        return NULL;
+    }
+    unsigned int index = tail & *sqMask;
+    struct io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray[index] = index;
+    // the kernel only looks at the entry once the tail moved past it
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    ++pending;
+    return sqe;
+}
+
+int CIoUring::PrepareReadv(int fileIndex, const struct iovec* iov, int iovCount, uint64_t userData)
+{
+    struct io_uring_sqe* sqe = GetSqe();
+    if(sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_READV;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = fileIndex;
+    sqe->addr = (uint64_t)(uintptr_t) iov;
+    sqe->len = iovCount;
+    sqe->user_data = userData;
+    return 0;
+}
+
+int CIoUring::PreparePoll(int fileIndex, unsigned int events, uint64_t userData)
+{
+    struct io_uring_sqe* sqe = GetSqe();
+    if(sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = fileIndex;
+    sqe->poll_events = events;
+    sqe->user_data = userData;
+    return 0;
+}
+
+int CIoUring::PrepareCancel(uint64_t targetUserData, uint64_t userData)
+{
+    struct io_uring_sqe* sqe = GetSqe();
+    if(sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = targetUserData;
+    sqe->user_data = userData;
+    return 0;
+}
+
+int CIoUring::PrepareTimeout(unsigned int timeoutMillis, uint64_t userData)
+{
+    struct io_uring_sqe* sqe = GetSqe();
+    if(sqe == NULL)
+    {
+        return -1;
+    }
+    timerSpec[0] = timeoutMillis / 1000;
+    timerSpec[1] = (long long)(timeoutMillis % 1000) * 1000000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t) timerSpec;
+    sqe->len = 1;
+    // no completion count, a pure timer
+    sqe->off = 0;
+    sqe->user_data = userData;
+    return 0;
+}
+
+int CIoUring::SubmitAndWait(unsigned int waitCount)
+{
+    int result = 0;
+    do
+        result = io_uring_enter(ringFd, pending, waitCount, IORING_ENTER_GETEVENTS);
+    while(result < 0 && errno == EINTR);
+    if(result < 0)
+    {
+        return -1;
+    }
+    pending -= result;
+    return 0;
+}
+
+bool CIoUring::GetCompletion(uint64_t* userData, int* result)
+{
+    unsigned int head = *cqHead;
+    if(head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+    {
+        return false;
+    }
+    struct io_uring_cqe* cqe = &cqes[head & *cqMask];
+    *userData = cqe->user_data;
+    *result = cqe->res;
+    __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#else // no io_uring in the kernel headers: Initialize() always fails
+
+CIoUring::CIoUring():
+    ringFd(-1),
+    sqRing(NULL),
+    cqRing(NULL),
+    sqRingSize(0),
+    cqRingSize(0),
+    sqes(NULL),
+    sqesSize(0),
+    sqHead(NULL),
+    sqTail(NULL),
+    sqMask(NULL),
+    sqArray(NULL),
+    cqHead(NULL),
+    cqTail(NULL),
+    cqMask(NULL),
+    cqes(NULL),
+    pending(0)
+{
+    memset(timerSpec, 0, sizeof(timerSpec));
+}
+
+CIoUring::~CIoUring()
+{
+}
+
+void CIoUring::Cleanup()
+{
+}
+
+int CIoUring::Initialize(unsigned int entries)
+{
+    return -1;
+}
+
+int CIoUring::RegisterFiles(const int* fds, unsigned int count)
+{
+    return -1;
+}
+
+int CIoUring::PrepareReadv(int fileIndex, const struct iovec* iov, int iovCount, uint64_t userData)
+{
+    return -1;
+}
+
+int CIoUring::PreparePoll(int fileIndex, unsigned int events, uint64_t userData)
+{
+    return -1;
+}
+
+int CIoUring::PrepareCancel(uint64_t targetUserData, uint64_t userData)
+{
+    return -1;
+}
+
+int CIoUring::PrepareTimeout(unsigned int timeoutMillis, uint64_t userData)
+{
+    return -1;
+}
+
+int CIoUring::SubmitAndWait(unsigned int waitCount)
+{
+    return -1;
+}
+
+bool CIoUring::GetCompletion(uint64_t* userData, int* result)
+{
+    return false;
+}
+
+#endif//SMARTCAM_HAVE_IO_URING
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// IoUring.h
+
+#ifndef __IO_URING_H__
+#define __IO_URING_H__
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Built with io_uring support when the kernel headers know it; whether the
+// running kernel does is only found out by Initialize()
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define SMARTCAM_HAVE_IO_URING 1
+#endif
+#endif
+
+// Minimal io_uring on the raw system calls: one submission queue and one
+// completion queue mapped into the process, and a table of registered
+// files so the queued operations skip the fd lookup.
+// Not thread safe, a ring belongs to the thread that submits to it.
+class CIoUring
+{
+public:
+    CIoUring();
+    virtual ~CIoUring();
+    // -1 if the kernel lacks io_uring or one of the operations used here
+    int Initialize(unsigned int entries);
+    int RegisterFiles(const int* fds, unsigned int count);
+    // Queue an operation on a registered file, -1 if the queue is full
+    int PrepareReadv(int fileIndex, const struct iovec* iov, int iovCount, uint64_t userData);
+    int PreparePoll(int fileIndex, unsigned int events, uint64_t userData);
+    int PrepareCancel(uint64_t targetUserData, uint64_t userData);
+    // A timer completing after timeoutMillis (with -ETIME); only one at a
+    // time, it shares its timespec with the next one
+    int PrepareTimeout(unsigned int timeoutMillis, uint64_t userData);
+    // Submits the queued operations and waits for waitCount completions
+    int SubmitAndWait(unsigned int waitCount);
+    // Takes the next completion, false if there is none
+    bool GetCompletion(uint64_t* userData, int* result);
+
+private:
+    // Methods:
+    struct io_uring_sqe* GetSqe();
+    void Cleanup();
+    // Data:
+    int ringFd;
+    void* sqRing;
+    void* cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    unsigned int* sqHead;
+    unsigned int* sqTail;
+    unsigned int* sqMask;
+    unsigned int* sqArray;
+    unsigned int* cqHead;
+    unsigned int* cqTail;
+    unsigned int* cqMask;
+    struct io_uring_cqe* cqes;
+    // queued but not yet submitted
+    unsigned int pending;
+    // struct __kernel_timespec of the queued timer: seconds, nanoseconds
+    long long timerSpec[2];
+};
+
+#endif//__IO_URING_H__
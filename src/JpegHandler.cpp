@@ -21,23 +21,41 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <cmath>
 
 #include "JpegHandler.h"
 
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+// ends the part of the scan a band gets
+static const JOCTET BAND_EOI[2] = { 0xFF, 0xD9 };
+
 void CJpegHandler::init_source(j_decompress_ptr cinfo)
 {
 }
 
+// Suspends libjpeg until more of the frame is there; the bytes from
+// next_input_byte on are still in the buffer when it resumes
 boolean CJpegHandler::fill_input_buffer(j_decompress_ptr cinfo)
 {
-    ERREXIT(cinfo, JERR_FILE_READ);
-    return TRUE;
+    CJpegHandler* data = (CJpegHandler*) cinfo->client_data;
+    if (data->isStreamComplete)
+        ERREXIT(cinfo, JERR_FILE_READ);
+    return FALSE;
 }
 
+// May skip past the bytes received so far, decodeStream() counts from
+// next_input_byte
 void CJpegHandler::skip_input_data(j_decompress_ptr cinfo, long num_bytes)
 {
-    cinfo->src->bytes_in_buffer -= num_bytes;
+    if (num_bytes <= 0)
+        return;
+    if ((size_t) num_bytes > cinfo->src->bytes_in_buffer)
+        cinfo->src->bytes_in_buffer = 0;
+    else
+        cinfo->src->bytes_in_buffer -= num_bytes;
     cinfo->src->next_input_byte += num_bytes;
 }
 
@@ -45,6 +63,35 @@ void CJpegHandler::term_source(j_decompress_ptr cinfo)
 {
 }
 
+// Header, band, EOI: a band has all of its bytes from the start
+boolean CJpegHandler::band_fill_input_buffer(j_decompress_ptr cinfo)
+{
+    JpegBand* band = (JpegBand*) cinfo->client_data;
+    band->chunk++;
+    if (band->chunk == 1) {
+        cinfo->src->next_input_byte = band->segment;
+        cinfo->src->bytes_in_buffer = band->segmentSize;
+    } else if (band->chunk == 2) {
+        cinfo->src->next_input_byte = BAND_EOI;
+        cinfo->src->bytes_in_buffer = sizeof(BAND_EOI);
+    } else {
+        ERREXIT(cinfo, JERR_FILE_READ);
+    }
+    return TRUE;
+}
+
+void CJpegHandler::band_skip_input_data(j_decompress_ptr cinfo, long num_bytes)
+{
+    if (num_bytes <= 0)
+        return;
+    while ((size_t) num_bytes > cinfo->src->bytes_in_buffer) {
+        num_bytes -= cinfo->src->bytes_in_buffer;
+        band_fill_input_buffer(cinfo);
+    }
+    cinfo->src->bytes_in_buffer -= num_bytes;
+    cinfo->src->next_input_byte += num_bytes;
+}
+
 CJpegHandler::CJpegHandler()
 {
     srcmgr.init_source = init_source;
@@ -64,55 +111,713 @@ CJpegHandler::CJpegHandler()
 
     rgbBuffer = NULL;
     rgbBufferSize = 0;
+
+    tableCacheCount = 0;
+    tableUseClock = 0;
+    currentTablesHash = 0;
+    tableParseCount = 0;
+    tableHitCount = 0;
+
+    outputWidth = 0;
+    outputHeight = 0;
+    scaledImageWidth = 0;
+    scaledImageHeight = 0;
+    scaleNum = JPEG_SCALE_DENOM;
+    decodeTier = JPEG_TIER_FULL;
+    frameScaleNum = JPEG_SCALE_DENOM;
+
+    streamState = STREAM_IDLE;
+    streamBuffer = NULL;
+    isStreamComplete = true;
+
+    bandThreadCount = 1;
+    intervalStarts = NULL;
+    intervalCapacity = 0;
+    bandLock = NULL;
+    bandStart = NULL;
+    bandDone = NULL;
+    bandGeneration = 0;
+    activeBandCount = 0;
+    bandsPending = 0;
+    isBandClosed = false;
+    bandFrameCount = 0;
 }
 
 CJpegHandler::~CJpegHandler()
 {
+    if (bandLock != NULL) {
+        g_mutex_lock(bandLock);
+        isBandClosed = true;
+        g_cond_broadcast(bandStart);
+        g_mutex_unlock(bandLock);
+        for (int i = 0; i < bandThreadCount; i++) {
+            if (bands[i].thread != NULL)
+                g_thread_join(bands[i].thread);
+            jpeg_destroy_decompress(&bands[i].cinfo);
+            free(bands[i].header);
+        }
+        g_cond_free(bandDone);
+        g_cond_free(bandStart);
+        g_mutex_free(bandLock);
+    }
+    free(intervalStarts);
     jpeg_destroy_decompress(&cinfo);
     free(rgbBuffer);
 }
 
+void CJpegHandler::setBandThreads(int count)
+{
+    if (bandLock != NULL || count < 2)
+        return;
+    if (count > JPEG_MAX_BANDS)
+        count = JPEG_MAX_BANDS;
+    bandLock = g_mutex_new();
+    bandStart = g_cond_new();
+    bandDone = g_cond_new();
+    for (int i = 0; i < count; i++) {
+        JpegBand* band = &bands[i];
+        band->pHandler = this;
+        band->index = i;
+        band->thread = NULL;
+        band->header = NULL;
+        band->headerSize = 0;
+        band->headerCapacity = 0;
+        band->srcmgr.init_source = init_source;
+        band->srcmgr.fill_input_buffer = band_fill_input_buffer;
+        band->srcmgr.skip_input_data = band_skip_input_data;
+        band->srcmgr.resync_to_restart = jpeg_resync_to_restart;
+        band->srcmgr.term_source = term_source;
+        band->cinfo.client_data = (void*) band;
+        band->cinfo.err = jpeg_std_error(&band->jerr);
+        band->jerr.error_exit = band_error_exit;
+        band->jerr.output_message = output_message;
+        jpeg_create_decompress(&band->cinfo);
+        band->cinfo.src = &band->srcmgr;
+        bandThreadCount = i + 1;
+        // the first band is decoded by the calling thread
+        if (i == 0)
+            continue;
+        GError* error = NULL;
+        band->thread = g_thread_create(bandThreadProc, band, TRUE, &error);
+        if (band->thread == NULL) {
+            g_printerr("Failed to create band thread: %s\n", error->message);
+            g_error_free(error);
+            jpeg_destroy_decompress(&band->cinfo);
+            bandThreadCount = i;
+            break;
+        }
+    }
+}
+
+unsigned int CJpegHandler::getBandFrameCount()
+{
+    return bandFrameCount;
+}
+
+// FNV-1a, 64 bits: a header is a few hundred bytes
+unsigned long long CJpegHandler::hashBytes(const unsigned char* buffer, int size)
+{
+    unsigned long long hash = FNV_OFFSET_BASIS;
+    for (int i = 0; i < size; i++) {
+        hash = (hash ^ buffer[i]) * FNV_PRIME;
+    }
+    return (hash == 0 ? 1 : hash);
+}
+
+// Eight bytes at a time, every step rotated so the high bits come down too
+unsigned long long CJpegHandler::hashFrame(const unsigned char* buffer, int size)
+{
+    unsigned long long hash = FNV_OFFSET_BASIS ^ (unsigned long long) size;
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        unsigned long long word;
+        memcpy(&word, buffer + i, sizeof(word));
+        hash = (((hash << 27) | (hash >> 37)) ^ word) * FNV_PRIME;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ buffer[i]) * FNV_PRIME;
+    }
+    hash ^= hash >> 29;
+    return (hash == 0 ? 1 : hash);
+}
+
+// Whether a frame brings DQT or DHT tables of its own: walks the marker
+// segments up to the scan, anything odd counts as yes
+bool CJpegHandler::hasTables(const unsigned char* buffer, int size)
+{
+    int pos = 2;
+    while (pos + 4 <= size) {
+        if (buffer[pos] != 0xFF)
+            return true;
+        int marker = buffer[pos + 1];
+        if (marker == 0xFF) {
+            pos++;      // fill byte
+            continue;
+        }
+        if (marker == 0xDA)
+            return false;
+        if (marker == 0xDB || marker == 0xC4)
+            return true;
+        pos += 2 + ((buffer[pos + 2] << 8) | buffer[pos + 3]);
+    }
+    return true;
+}
+
+void CJpegHandler::saveTables(j_decompress_ptr cinfo, JpegTables* tables)
+{
+    for (int i = 0; i < NUM_QUANT_TBLS; i++) {
+        tables->hasQuant[i] = (cinfo->quant_tbl_ptrs[i] != NULL);
+        if (tables->hasQuant[i])
+            tables->quant[i] = *cinfo->quant_tbl_ptrs[i];
+    }
+    for (int i = 0; i < NUM_HUFF_TBLS; i++) {
+        tables->hasDc[i] = (cinfo->dc_huff_tbl_ptrs[i] != NULL);
+        if (tables->hasDc[i])
+            tables->dc[i] = *cinfo->dc_huff_tbl_ptrs[i];
+        tables->hasAc[i] = (cinfo->ac_huff_tbl_ptrs[i] != NULL);
+        if (tables->hasAc[i])
+            tables->ac[i] = *cinfo->ac_huff_tbl_ptrs[i];
+    }
+}
+
+// What parsing the header again would do, without the parsing
+void CJpegHandler::restoreTables(j_decompress_ptr cinfo, const JpegTables* tables)
+{
+    for (int i = 0; i < NUM_QUANT_TBLS; i++) {
+        if (!tables->hasQuant[i])
+            continue;
+        if (cinfo->quant_tbl_ptrs[i] == NULL)
+            cinfo->quant_tbl_ptrs[i] = jpeg_alloc_quant_table((j_common_ptr) cinfo);
+        *cinfo->quant_tbl_ptrs[i] = tables->quant[i];
+    }
+    for (int i = 0; i < NUM_HUFF_TBLS; i++) {
+        if (tables->hasDc[i]) {
+            if (cinfo->dc_huff_tbl_ptrs[i] == NULL)
+                cinfo->dc_huff_tbl_ptrs[i] = jpeg_alloc_huff_table((j_common_ptr) cinfo);
+            *cinfo->dc_huff_tbl_ptrs[i] = tables->dc[i];
+        }
+        if (tables->hasAc[i]) {
+            if (cinfo->ac_huff_tbl_ptrs[i] == NULL)
+                cinfo->ac_huff_tbl_ptrs[i] = jpeg_alloc_huff_table((j_common_ptr) cinfo);
+            *cinfo->ac_huff_tbl_ptrs[i] = tables->ac[i];
+        }
+    }
+}
+
 bool CJpegHandler::decodeHeader(const unsigned char* buffer, int size)
 {
+    abortStream();
+    unsigned long long hash = hashBytes(buffer, size);
+    if (hash == currentTablesHash) {
+        tableHitCount++;
+        return true;
+    }
+    for (int i = 0; i < tableCacheCount; i++) {
+        if (tableCache[i].hash == hash) {
+            restoreTables(&cinfo, &tableCache[i]);
+            tableCache[i].lastUse = ++tableUseClock;
+            currentTablesHash = hash;
+            tableHitCount++;
+            return true;
+        }
+    }
+
     if (setjmp(returnpoint)) {
         printf("Error: %s\n", messagebuffer);
+        // the tables parsed so far stay, whatever they are
+        jpeg_abort_decompress(&cinfo);
+        currentTablesHash = 0;
         return false;
     }
     srcmgr.bytes_in_buffer = size;
     srcmgr.next_input_byte = buffer;
+    isStreamComplete = true;
 
     jpeg_read_header(&cinfo, FALSE);
+    tableParseCount++;
+
+    JpegTables* tables = &tableCache[0];
+    if (tableCacheCount < JPEG_TABLE_CACHE_SIZE) {
+        tables = &tableCache[tableCacheCount++];
+    } else {
+        for (int i = 1; i < JPEG_TABLE_CACHE_SIZE; i++) {
+            if (tableCache[i].lastUse < tables->lastUse)
+                tables = &tableCache[i];
+        }
+    }
+    saveTables(&cinfo, tables);
+    tables->hash = hash;
+    tables->lastUse = ++tableUseClock;
+    currentTablesHash = hash;
     return true;
 }
 
+unsigned int CJpegHandler::getTableParseCount()
+{
+    return tableParseCount;
+}
+
+unsigned int CJpegHandler::getTableHitCount()
+{
+    return tableHitCount;
+}
+
+void CJpegHandler::setOutputSize(int width, int height)
+{
+    outputWidth = width;
+    outputHeight = height;
+    scaledImageWidth = 0;
+    scaledImageHeight = 0;
+}
+
+void CJpegHandler::setDecodeTier(JpegDecodeTier tier)
+{
+    decodeTier = tier;
+}
+
+// Sets what the tier gives up on a decompressor whose header was read
+void CJpegHandler::applyTier(j_decompress_ptr cinfo)
+{
+    if (decodeTier >= JPEG_TIER_FAST_DCT)
+        cinfo->dct_method = JDCT_IFAST;
+    if (decodeTier >= JPEG_TIER_NO_UPSAMPLING)
+        cinfo->do_fancy_upsampling = FALSE;
+    if (decodeTier >= JPEG_TIER_NO_SMOOTHING)
+        cinfo->do_block_smoothing = FALSE;
+    cinfo->scale_num = frameScaleNum;
+    cinfo->scale_denom = JPEG_SCALE_DENOM;
+}
+
+int CJpegHandler::getImageWidth()
+{
+    return cinfo.image_width;
+}
+
+int CJpegHandler::getImageHeight()
+{
+    return cinfo.image_height;
+}
+
+// Smallest scale whose output still covers the output size. libjpeg 6b
+// rounds to 1/8, 1/4 or 1/2, libjpeg-turbo offers every n/8: a scale the
+// linked libjpeg rounded to another one is not taken, so that the bands
+// and the lower tier scale the same way it does.
+void CJpegHandler::chooseScale()
+{
+    if (cinfo.image_width == scaledImageWidth && cinfo.image_height == scaledImageHeight)
+        return;
+    scaledImageWidth = cinfo.image_width;
+    scaledImageHeight = cinfo.image_height;
+    scaleNum = JPEG_SCALE_DENOM;
+    if (outputWidth <= 0 || outputHeight <= 0)
+        return;
+    cinfo.scale_denom = JPEG_SCALE_DENOM;
+    for (unsigned int num = 1; num < JPEG_SCALE_DENOM; num++) {
+        cinfo.scale_num = num;
+        jpeg_calc_output_dimensions(&cinfo);
+        if (cinfo.output_width != (cinfo.image_width * num + JPEG_SCALE_DENOM - 1) / JPEG_SCALE_DENOM ||
+            cinfo.output_height != (cinfo.image_height * num + JPEG_SCALE_DENOM - 1) / JPEG_SCALE_DENOM)
+            continue;
+        if ((int) cinfo.output_width >= outputWidth && (int) cinfo.output_height >= outputHeight) {
+            scaleNum = num;
+            break;
+        }
+    }
+}
+
 unsigned char* CJpegHandler::decodeRGB24(const unsigned char* buffer, int size, int &width, int &height)
 {
-    if (setjmp(returnpoint)) {
-        printf("Error: %s\n", messagebuffer);
+    unsigned char* rgb = NULL;
+    abortStream();
+    if (decodeStream(buffer, size, true, rgb, width, height) != JPEG_STREAM_DONE)
         return NULL;
+    return rgb;
+}
+
+// Starts a frame, or hands libjpeg the bytes added since it suspended
+void CJpegHandler::beginStream(const unsigned char* buffer, int available, bool isComplete)
+{
+    if (streamState == STREAM_IDLE || buffer != streamBuffer) {
+        abortStream();
+        streamBuffer = buffer;
+        srcmgr.next_input_byte = buffer;
+        streamState = STREAM_HEADER;
     }
-    srcmgr.bytes_in_buffer = size;
-    srcmgr.next_input_byte = buffer;
+    isStreamComplete = isComplete;
+    const unsigned char* end = buffer + available;
+    srcmgr.bytes_in_buffer = (srcmgr.next_input_byte < end ? end - srcmgr.next_input_byte : 0);
+}
 
-    jpeg_read_header(&cinfo, TRUE);
-    jpeg_start_decompress(&cinfo);
+JpegStreamResult CJpegHandler::decodeStream(const unsigned char* buffer, int available, bool isComplete,
+                                            unsigned char* &rgb, int &width, int &height)
+{
+    if (setjmp(returnpoint)) {
+        printf("Error: %s\n", messagebuffer);
+        jpeg_abort_decompress(&cinfo);
+        streamState = STREAM_IDLE;
+        return JPEG_STREAM_ERROR;
+    }
+    beginStream(buffer, available, isComplete);
 
+    if (streamState == STREAM_HEADER) {
+        if (jpeg_read_header(&cinfo, TRUE) == JPEG_SUSPENDED)
+            return JPEG_STREAM_MORE;
+        // a full frame leaves its own tables behind
+        if (currentTablesHash != 0 && hasTables(buffer, available))
+            currentTablesHash = 0;
+        chooseScale();
+        // half the scale picked, the rest is left to the resampling
+        frameScaleNum = scaleNum;
+        if (decodeTier >= JPEG_TIER_LOW_SCALE && frameScaleNum > 1)
+            frameScaleNum = (frameScaleNum + 1) / 2;
+        applyTier(&cinfo);
+        streamState = STREAM_START;
+        if (isComplete && bandThreadCount > 1 && decodeBands(buffer, available)) {
+            jpeg_abort_decompress(&cinfo);
+            bandFrameCount++;
+            streamState = STREAM_DONE;
+        }
+    }
+    if (streamState == STREAM_START) {
+        if (!jpeg_start_decompress(&cinfo))
+            return JPEG_STREAM_MORE;
+        int size = 3 * cinfo.output_width * cinfo.output_height;
+        if (rgbBuffer == NULL || rgbBufferSize < size) {
+            rgbBufferSize = size;
+            free(rgbBuffer);
+            rgbBuffer = (unsigned char*) malloc(rgbBufferSize);
+        }
+        streamState = STREAM_SCANLINES;
+    }
+    if (streamState == STREAM_SCANLINES) {
+        while (cinfo.output_scanline < cinfo.output_height)
+        {
+            unsigned char* crtRGBRow = rgbBuffer + 3 * cinfo.output_width * cinfo.output_scanline;
+            if (jpeg_read_scanlines(&cinfo, (JSAMPARRAY) &crtRGBRow, 1) == 0)
+                return JPEG_STREAM_MORE;
+        }
+        streamState = STREAM_FINISH;
+    }
+    if (streamState == STREAM_FINISH) {
+        if (!jpeg_finish_decompress(&cinfo))
+            return JPEG_STREAM_MORE;
+        streamState = STREAM_DONE;
+    }
     width = cinfo.output_width;
     height = cinfo.output_height;
+    rgb = rgbBuffer;
+    return JPEG_STREAM_DONE;
+}
 
-    if (rgbBuffer == NULL || rgbBufferSize < 3 * width * height) {
-        rgbBufferSize = 3 * width * height;
+// Splits a whole frame, whose header was just read, into bands at its
+// restart markers and decodes them at once. False if the frame has no
+// markers where they would help or a band failed: it is decoded whole then.
+bool CJpegHandler::decodeBands(const unsigned char* buffer, int size)
+{
+    int interval = cinfo.restart_interval;
+    if (interval == 0 || cinfo.progressive_mode || cinfo.comps_in_scan != cinfo.num_components)
+        return false;
+    // a scan of one component has one block per MCU
+    int mcuWidth = DCTSIZE;
+    int mcuHeight = DCTSIZE;
+    if (cinfo.comps_in_scan > 1) {
+        mcuWidth *= cinfo.max_h_samp_factor;
+        mcuHeight *= cinfo.max_v_samp_factor;
+    }
+    int mcusPerRow = (cinfo.image_width + mcuWidth - 1) / mcuWidth;
+    int mcuRows = (cinfo.image_height + mcuHeight - 1) / mcuHeight;
+    int intervalCount = (mcusPerRow * mcuRows + interval - 1) / interval;
+    int bandCount = mcuRows / JPEG_BAND_MIN_MCU_ROWS;
+    if (bandCount > bandThreadCount)
+        bandCount = bandThreadCount;
+    if (bandCount < 2)
+        return false;
+
+    // the header ends with SOS, SOF holds the height every band gets its own of
+    int sofPos = -1;
+    int dataPos = -1;
+    int pos = 2;
+    while (dataPos < 0 && pos + 4 <= size) {
+        if (buffer[pos] != 0xFF)
+            return false;
+        int marker = buffer[pos + 1];
+        if (marker == 0xFF) {
+            pos++;      // fill byte
+            continue;
+        }
+        if (marker == 0xC0 || marker == 0xC1)
+            sofPos = pos;
+        pos += 2 + ((buffer[pos + 2] << 8) | buffer[pos + 3]);
+        if (marker == 0xDA)
+            dataPos = pos;
+    }
+    if (sofPos < 0 || dataPos < 0 || dataPos > size)
+        return false;
+
+    // every RSTn starts an interval; they have to be all there and in order
+    if (intervalCapacity < intervalCount) {
+        free(intervalStarts);
+        intervalCapacity = intervalCount;
+        intervalStarts = (int*) malloc(intervalCapacity * sizeof(int));
+    }
+    intervalStarts[0] = dataPos;
+    int found = 1;
+    int scanEnd = size;
+    const unsigned char* p = buffer + dataPos;
+    const unsigned char* end = buffer + size;
+    while (p + 1 < end) {
+        p = (const unsigned char*) memchr(p, 0xFF, end - 1 - p);
+        if (p == NULL)
+            break;
+        int marker = p[1];
+        if (marker == 0xFF) {
+            p++;
+        } else if (marker == 0x00) {
+            p += 2;     // stuffed byte
+        } else if (marker >= 0xD0 && marker <= 0xD7) {
+            if (found == intervalCount || marker != 0xD0 + ((found - 1) & 7))
+                return false;
+            p += 2;
+            intervalStarts[found++] = p - buffer;
+        } else {
+            scanEnd = p - buffer;
+            break;
+        }
+    }
+    if (found != intervalCount)
+        return false;
+
+    // Bands start where an interval starts a row, and with RST0 expected
+    // next, as in a JPEG of their own: every 8th interval
+    int firstIntervals[JPEG_MAX_BANDS + 1];
+    firstIntervals[0] = 0;
+    int count = 1;
+    for (int i = 8; i < intervalCount && count < bandCount; i += 8) {
+        int mcus = i * interval;
+        if (mcus % mcusPerRow == 0 && mcus / mcusPerRow >= count * mcuRows / bandCount)
+            firstIntervals[count++] = i;
+    }
+    if (count < 2)
+        return false;
+    firstIntervals[count] = intervalCount;
+
+    // the rows every band gets as libjpeg scales them, from the height in
+    // its header; they have to add up to the rows of the whole frame
+    unsigned int imageHeight = cinfo.image_height;
+    unsigned int bandRows[JPEG_MAX_BANDS];
+    unsigned int rowSum = 0;
+    for (int i = 0; i < count; i++) {
+        int first = firstIntervals[i];
+        int next = firstIntervals[i + 1];
+        unsigned int top = first * interval / mcusPerRow * mcuHeight;
+        unsigned int bottom = (next == intervalCount ? imageHeight : next * interval / mcusPerRow * mcuHeight);
+        cinfo.image_height = bottom - top;
+        jpeg_calc_output_dimensions(&cinfo);
+        bandRows[i] = cinfo.output_height;
+        rowSum += bandRows[i];
+    }
+    cinfo.image_height = imageHeight;
+    jpeg_calc_output_dimensions(&cinfo);
+    if (rowSum != cinfo.output_height)
+        return false;
+
+    int stride = 3 * cinfo.output_width;
+    int rgbSize = stride * cinfo.output_height;
+    if (rgbBuffer == NULL || rgbBufferSize < rgbSize) {
+        rgbBufferSize = rgbSize;
         free(rgbBuffer);
         rgbBuffer = (unsigned char*) malloc(rgbBufferSize);
     }
+    saveTables(&cinfo, &bandTables);
+    unsigned int outputTop = 0;
+    for (int i = 0; i < count; i++) {
+        JpegBand* band = &bands[i];
+        int first = firstIntervals[i];
+        int next = firstIntervals[i + 1];
+        unsigned int top = first * interval / mcusPerRow * mcuHeight;
+        unsigned int bottom = (next == intervalCount ? cinfo.image_height :
+                               next * interval / mcusPerRow * mcuHeight);
+        if (band->headerCapacity < dataPos) {
+            free(band->header);
+            band->headerCapacity = dataPos;
+            band->header = (unsigned char*) malloc(band->headerCapacity);
+        }
+        memcpy(band->header, buffer, dataPos);
+        band->header[sofPos + 5] = (bottom - top) >> 8;
+        band->header[sofPos + 6] = (bottom - top) & 0xFF;
+        band->headerSize = dataPos;
+        band->segment = buffer + intervalStarts[first];
+        // the band ends before the RSTn of the next one
+        band->segmentSize = (next == intervalCount ? scanEnd : intervalStarts[next] - 2) - intervalStarts[first];
+        band->output = rgbBuffer + stride * outputTop;
+        band->outputRows = bandRows[i];
+        outputTop += bandRows[i];
+    }
+
+    g_mutex_lock(bandLock);
+    activeBandCount = count;
+    bandsPending = count - 1;
+    bandGeneration++;
+    g_cond_broadcast(bandStart);
+    g_mutex_unlock(bandLock);
+    decodeBand(&bands[0]);
+    g_mutex_lock(bandLock);
+    while (bandsPending > 0)
+        g_cond_wait(bandDone, bandLock);
+    g_mutex_unlock(bandLock);
+
+    for (int i = 0; i < count; i++) {
+        if (!bands[i].isOk)
+            return false;
+    }
+    return true;
+}
+
+// Runs on the band's thread, or on the calling one for the first band
+void CJpegHandler::decodeBand(JpegBand* band)
+{
+    CJpegHandler* handler = band->pHandler;
+    band->isOk = false;
+    if (setjmp(band->returnpoint)) {
+        jpeg_abort_decompress(&band->cinfo);
+        return;
+    }
+    band->chunk = 0;
+    band->srcmgr.next_input_byte = band->header;
+    band->srcmgr.bytes_in_buffer = band->headerSize;
+    restoreTables(&band->cinfo, &handler->bandTables);
 
-    while (cinfo.output_scanline < cinfo.output_height)
+    jpeg_read_header(&band->cinfo, TRUE);
+    handler->applyTier(&band->cinfo);
+    jpeg_start_decompress(&band->cinfo);
+    // a libjpeg that rounds the scale differently would not fit the rows
+    if (band->cinfo.output_height != band->outputRows ||
+        band->cinfo.output_width != handler->cinfo.output_width) {
+        jpeg_abort_decompress(&band->cinfo);
+        return;
+    }
+    while (band->cinfo.output_scanline < band->cinfo.output_height)
     {
-        unsigned char* crtRGBRow = rgbBuffer + 3 * cinfo.image_width * cinfo.output_scanline;
-        jpeg_read_scanlines(&cinfo, (JSAMPARRAY) &crtRGBRow, 1);
+        unsigned char* crtRGBRow = band->output + 3 * band->cinfo.output_width * band->cinfo.output_scanline;
+        jpeg_read_scanlines(&band->cinfo, (JSAMPARRAY) &crtRGBRow, 1);
+    }
+    jpeg_finish_decompress(&band->cinfo);
+    band->isOk = true;
+}
+
+void* CJpegHandler::bandThreadProc(void* args)
+{
+    JpegBand* band = (JpegBand*) args;
+    CJpegHandler* handler = band->pHandler;
+    unsigned int generation = 0;
+    g_mutex_lock(handler->bandLock);
+    while (true) {
+        while (!handler->isBandClosed && generation == handler->bandGeneration)
+            g_cond_wait(handler->bandStart, handler->bandLock);
+        if (handler->isBandClosed)
+            break;
+        generation = handler->bandGeneration;
+        if (band->index >= handler->activeBandCount)
+            continue;
+        g_mutex_unlock(handler->bandLock);
+        decodeBand(band);
+        g_mutex_lock(handler->bandLock);
+        if (--handler->bandsPending == 0)
+            g_cond_signal(handler->bandDone);
+    }
+    g_mutex_unlock(handler->bandLock);
+    return NULL;
+}
+
+bool CJpegHandler::decodeDcMap(const unsigned char* buffer, int size, JpegDcMap* map)
+{
+    abortStream();
+    if (setjmp(returnpoint)) {
+        printf("Error: %s\n", messagebuffer);
+        jpeg_abort_decompress(&cinfo);
+        return false;
+    }
+    srcmgr.bytes_in_buffer = size;
+    srcmgr.next_input_byte = buffer;
+    isStreamComplete = true;
+
+    jpeg_read_header(&cinfo, TRUE);
+    if (currentTablesHash != 0 && hasTables(buffer, size))
+        currentTablesHash = 0;
+    jvirt_barray_ptr* coefficients = jpeg_read_coefficients(&cinfo);
+    jpeg_component_info* luma = &cinfo.comp_info[0];
+    int count = luma->width_in_blocks * luma->height_in_blocks;
+    if (map->dc == NULL || map->capacity < count) {
+        free(map->dc);
+        map->capacity = count;
+        map->dc = (short*) malloc(map->capacity * sizeof(short));
+    }
+    map->blocksWide = luma->width_in_blocks;
+    map->blocksHigh = luma->height_in_blocks;
+    // dequantized, so that maps of a different quality still compare
+    int dcQuant = (luma->quant_table != NULL ? luma->quant_table->quantval[0] : 1);
+    for (int row = 0; row < map->blocksHigh; row++) {
+        JBLOCKARRAY blocks = (*cinfo.mem->access_virt_barray)((j_common_ptr) &cinfo, coefficients[0],
+                                                              row, 1, FALSE);
+        short* dc = map->dc + row * map->blocksWide;
+        for (int col = 0; col < map->blocksWide; col++)
+            dc[col] = blocks[0][col][0] * dcQuant;
     }
     jpeg_finish_decompress(&cinfo);
-    return rgbBuffer;
+    return true;
+}
+
+int CJpegHandler::compareDcMaps(const JpegDcMap* map, const JpegDcMap* other, int &maxDiff)
+{
+    maxDiff = 0;
+    if (map->blocksWide != other->blocksWide || map->blocksHigh != other->blocksHigh ||
+        map->blocksWide * map->blocksHigh == 0)
+        return -1;
+    int count = map->blocksWide * map->blocksHigh;
+    long long sum = 0;
+    for (int i = 0; i < count; i++) {
+        int diff = abs(map->dc[i] - other->dc[i]);
+        sum += diff;
+        if (diff > maxDiff)
+            maxDiff = diff;
+    }
+    return (int)(sum / count);
+}
+
+int CJpegHandler::motionScore(const JpegDcMap* map, const JpegDcMap* previous, int blockDiff)
+{
+    if (map->blocksWide != previous->blocksWide || map->blocksHigh != previous->blocksHigh ||
+        map->blocksWide * map->blocksHigh == 0)
+        return -1;
+    int count = map->blocksWide * map->blocksHigh;
+    int moved = 0;
+    for (int i = 0; i < count; i++) {
+        if (abs(map->dc[i] - previous->dc[i]) > blockDiff)
+            moved++;
+    }
+    // rounded up, a single block that moved still shows
+    return (int)(((long long) moved * 100 + count - 1) / count);
+}
+
+void CJpegHandler::copyDcMap(JpegDcMap* map, const JpegDcMap* other)
+{
+    int count = other->blocksWide * other->blocksHigh;
+    if (map->dc == NULL || map->capacity < count) {
+        free(map->dc);
+        map->capacity = count;
+        map->dc = (short*) malloc(map->capacity * sizeof(short));
+    }
+    if (count > 0)
+        memcpy(map->dc, other->dc, count * sizeof(short));
+    map->blocksWide = other->blocksWide;
+    map->blocksHigh = other->blocksHigh;
+}
+
+void CJpegHandler::abortStream()
+{
+    if (streamState != STREAM_IDLE && streamState != STREAM_DONE)
+        jpeg_abort_decompress(&cinfo);
+    streamState = STREAM_IDLE;
 }
 
 void CJpegHandler::error_exit(j_common_ptr cinfo)
@@ -122,6 +827,13 @@ void CJpegHandler::error_exit(j_common_ptr cinfo)
     longjmp(data->returnpoint, 1);
 }
 
+// A band that fails is decoded again with the whole frame, which reports it
+void CJpegHandler::band_error_exit(j_common_ptr cinfo)
+{
+    JpegBand* band = (JpegBand*) cinfo->client_data;
+    longjmp(band->returnpoint, 1);
+}
+
 void CJpegHandler::output_message(j_common_ptr cinfo)
 {
     printf("Outputting message:\n");
@@ -22,12 +22,70 @@
 #ifndef __JPEG_HANDLER_H__
 #define __JPEG_HANDLER_H__
 
+// jpeglib.h wants size_t and FILE declared
+#include <cstdio>
 extern "C" {
 #include "jpeglib.h"
 #include "jerror.h"
 }
 #include <setjmp.h>
+#include <gtk/gtk.h>
 
+// table sets kept for abbreviated streams, the least recently used goes
+#define JPEG_TABLE_CACHE_SIZE 4
+// DCT scaling is tried in steps of 1/8
+#define JPEG_SCALE_DENOM 8
+// a frame with restart markers is decoded in at most this many bands, each
+// of at least JPEG_BAND_MIN_MCU_ROWS rows of MCUs
+#define JPEG_MAX_BANDS 8
+#define JPEG_BAND_MIN_MCU_ROWS 8
+
+// Decoding settings from the best to the cheapest, every tier keeps what
+// the one before it gave up
+typedef enum JpegDecodeTier
+{
+    JPEG_TIER_FULL = 0,             // libjpeg defaults
+    JPEG_TIER_FAST_DCT = 1,         // JDCT_IFAST
+    JPEG_TIER_NO_UPSAMPLING = 2,    // no fancy upsampling
+    JPEG_TIER_NO_SMOOTHING = 3,     // no block smoothing
+    JPEG_TIER_LOW_SCALE = 4,        // IDCT scaled below the output size
+    JPEG_TIER_COUNT = 5
+} JpegDecodeTier;
+
+// Luma DC coefficients of a frame, dequantized, one per 8x8 block row by
+// row: the average brightness of every block, read without any IDCT. The
+// caller owns dc (malloc'ed), zero the struct before the first use.
+typedef struct JpegDcMap
+{
+    short* dc;
+    int capacity;
+    int blocksWide;
+    int blocksHigh;
+} JpegDcMap;
+
+typedef enum JpegStreamResult
+{
+    JPEG_STREAM_MORE = 0,   // suspended, waits for more bytes of the frame
+    JPEG_STREAM_DONE = 1,
+    JPEG_STREAM_ERROR = 2
+} JpegStreamResult;
+
+// Decodes the frames of one phone. A phone may send the DQT/DHT tables once
+// in a tables-only header packet and leave them out of the data packets
+// (abbreviated JPEG): libjpeg keeps the tables of the last header. Every
+// header is hashed, a header seen before is not parsed again but its tables
+// are copied back from the cache.
+// Given an output size, a bigger frame is scaled down in the IDCT to the
+// smallest size libjpeg offers that still covers it, which costs less than
+// decoding it whole; only what is left has to be resampled.
+// A frame can also be decoded while it is still coming in: the source
+// suspends libjpeg where the bytes run out, and the next call with more of
+// them picks up at that point.
+// A whole frame with restart markers can be split where an interval starts
+// a row of MCUs: every band is a JPEG of its own (the frame header with the
+// band's height, then its part of the scan), and the bands are decoded at the
+// same time by band threads, each straight into its rows of the output.
+// A decode tier below JPEG_TIER_FULL trades quality for decode time.
 class CJpegHandler
 {
 public:
@@ -36,9 +94,127 @@ public:
 
     bool decodeHeader(const unsigned char* buffer, int size);
 
+    // width and height of the decoded image, see setOutputSize()
     unsigned char* decodeRGB24(const unsigned char* buffer, int size, int &width, int &height);
 
+    // Streaming: the first available bytes of a frame, which stay where they
+    // are while more of them are added; isComplete once the whole frame is
+    // there. The frame lands in rgb once DONE; calls with the same buffer
+    // return it again until abortStream(), another buffer starts a new one.
+    JpegStreamResult decodeStream(const unsigned char* buffer, int available, bool isComplete,
+                                  unsigned char* &rgb, int &width, int &height);
+    // drops a frame decoded in part, nothing happens if there is none
+    void abortStream();
+
+    // Reads the DC map of a frame, from its entropy coded data only
+    bool decodeDcMap(const unsigned char* buffer, int size, JpegDcMap* map);
+    // Average and largest difference between the blocks of two maps, -1
+    // if they are not the same size
+    static int compareDcMaps(const JpegDcMap* map, const JpegDcMap* other, int &maxDiff);
+    // Motion between two frames: percentage (rounded up) of the blocks whose
+    // brightness changed by more than blockDiff, -1 if the maps differ in size
+    static int motionScore(const JpegDcMap* map, const JpegDcMap* previous, int blockDiff);
+    static void copyDcMap(JpegDcMap* map, const JpegDcMap* other);
+    // Fast hash of a whole payload, to tell frames sent twice
+    static unsigned long long hashFrame(const unsigned char* buffer, int size);
+
+    // size the frames end up at, 0 to decode them whole
+    void setOutputSize(int width, int height);
+    // for the frames started from now on
+    void setDecodeTier(JpegDecodeTier tier);
+    // size of the last frame as sent, before any scaling
+    int getImageWidth();
+    int getImageHeight();
+
+    // statistics: headers parsed, and headers taken from the cache
+    unsigned int getTableParseCount();
+    unsigned int getTableHitCount();
+
+    // Threads decoding the bands of a frame, counting the calling one; 1
+    // (the default) decodes every frame whole. Set once, before decoding.
+    void setBandThreads(int count);
+    // statistics: frames decoded in bands
+    unsigned int getBandFrameCount();
+
 private:
+    typedef struct JpegTables
+    {
+        unsigned long long hash;
+        unsigned int lastUse;
+        bool hasQuant[NUM_QUANT_TBLS];
+        JQUANT_TBL quant[NUM_QUANT_TBLS];
+        bool hasDc[NUM_HUFF_TBLS];
+        JHUFF_TBL dc[NUM_HUFF_TBLS];
+        bool hasAc[NUM_HUFF_TBLS];
+        JHUFF_TBL ac[NUM_HUFF_TBLS];
+    } JpegTables;
+
+    // One band of a frame and the decompressor that decodes it: the source
+    // serves the patched header, the band's part of the scan, then an EOI
+    typedef struct JpegBand
+    {
+        CJpegHandler* pHandler;
+        int index;
+        GThread* thread;
+        struct jpeg_decompress_struct cinfo;
+        struct jpeg_error_mgr jerr;
+        struct jpeg_source_mgr srcmgr;
+        jmp_buf returnpoint;
+        unsigned char* header;
+        int headerSize;
+        int headerCapacity;
+        const unsigned char* segment;
+        int segmentSize;
+        int chunk;
+        unsigned char* output;
+        unsigned int outputRows;
+        bool isOk;
+    } JpegBand;
+
+    static void saveTables(j_decompress_ptr cinfo, JpegTables* tables);
+    static void restoreTables(j_decompress_ptr cinfo, const JpegTables* tables);
+    static unsigned long long hashBytes(const unsigned char* buffer, int size);
+    static bool hasTables(const unsigned char* buffer, int size);
+    void chooseScale();
+    void applyTier(j_decompress_ptr cinfo);
+    void beginStream(const unsigned char* buffer, int available, bool isComplete);
+    bool decodeBands(const unsigned char* buffer, int size);
+    static void decodeBand(JpegBand* band);
+    static void* bandThreadProc(void* args);
+
+    JpegTables tableCache[JPEG_TABLE_CACHE_SIZE];
+    int tableCacheCount;
+    unsigned int tableUseClock;
+    // hash of the tables libjpeg holds now, 0 if a full frame replaced them
+    unsigned long long currentTablesHash;
+    unsigned int tableParseCount;
+    unsigned int tableHitCount;
+
+    int outputWidth;
+    int outputHeight;
+    // scale picked for the last image size, the size rarely changes
+    unsigned int scaledImageWidth;
+    unsigned int scaledImageHeight;
+    unsigned int scaleNum;
+    JpegDecodeTier decodeTier;
+    // scale of the frame being decoded, decodeTier may lower it
+    unsigned int frameScaleNum;
+
+    typedef enum StreamState
+    {
+        STREAM_IDLE = 0,
+        STREAM_HEADER = 1,
+        STREAM_START = 2,
+        STREAM_SCANLINES = 3,
+        STREAM_FINISH = 4,
+        STREAM_DONE = 5     // the frame stays in rgbBuffer until the next one
+    } StreamState;
+
+    StreamState streamState;
+    const unsigned char* streamBuffer;
+    // no more bytes will come, running dry is an error
+    bool isStreamComplete;
+
     struct jpeg_decompress_struct cinfo;
     struct jpeg_error_mgr jerr;
     struct jpeg_source_mgr srcmgr;
@@ -49,6 +225,24 @@ private:
     unsigned char* rgbBuffer;
     int rgbBufferSize;
 
+    JpegBand bands[JPEG_MAX_BANDS];
+    int bandThreadCount;
+    // where every restart interval of the frame starts
+    int* intervalStarts;
+    int intervalCapacity;
+    // tables of the frame, copied into every band decompressor
+    JpegTables bandTables;
+    // band threads wake up when the generation changes, and decode their
+    // band if it is one of activeBandCount
+    GMutex* bandLock;
+    GCond* bandStart;
+    GCond* bandDone;
+    unsigned int bandGeneration;
+    int activeBandCount;
+    int bandsPending;
+    bool isBandClosed;
+    unsigned int bandFrameCount;
+
     static void error_exit(j_common_ptr cinfo);
     static void output_message(j_common_ptr cinfo);
 
@@ -56,6 +250,10 @@ private:
     static boolean fill_input_buffer(j_decompress_ptr cinfo);
     static void skip_input_data(j_decompress_ptr cinof, long num_bytes);
     static void term_source(j_decompress_ptr cinfo);
+
+    static void band_error_exit(j_common_ptr cinfo);
+    static boolean band_fill_input_buffer(j_decompress_ptr cinfo);
+    static void band_skip_input_data(j_decompress_ptr cinfo, long num_bytes);
 };
 
 #endif//__JPEG_HANDLER_H__
@@ -0,0 +1,503 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// MultipathStream.cpp
+
+#include <string.h>
+
+#include "MultipathStream.h"
+
+// capacities are re-estimated once a second
+#define MULTIPATH_SAMPLE_MICROS 1000000
+// delay on top of the path's base delay that means its queue is building up
+#define MULTIPATH_QUEUE_MICROS 40000
+// how fast the base delay forgets, per sample
+#define MULTIPATH_BASE_DRIFT_MICROS 1000
+// every path keeps some frames, or its capacity could never be measured again
+#define MULTIPATH_MIN_SHARE 5
+// smaller share changes are not worth telling the phone
+#define MULTIPATH_SHARE_STEP 5
+
+CMultipathStream::CMultipathStream():
+    frames(NULL),
+    frameCount(0),
+    reorderMicros(0),
+    hasNextSeq(false),
+    nextSeq(0),
+    hasMaxSeq(false),
+    maxSeq(0),
+    pathCount(0),
+    sampleStartMicros(0),
+    reorderedCount(0),
+    skippedCount(0),
+    lateCount(0)
+{
+    memset(&lateHeader, 0, sizeof(lateHeader));
+    memset(paths, 0, sizeof(paths));
+}
+
+CMultipathStream::~CMultipathStream()
+{
+    if(frames != NULL)
+    {
+        for(int i = 0; i < frameCount; i++)
+        {
+            delete[] frames[i].header.buffer;
+            delete[] frames[i].data.buffer;
+        }
+        delete[] frames;
+        frames = NULL;
+    }
+    delete[] lateHeader.buffer;
+    lateHeader.buffer = NULL;
+}
+
+int CMultipathStream::Initialize(int windowFrames, int reorderMillis)
+{
+    frameCount = (windowFrames < 2 ? 2 : windowFrames);
+    reorderMicros = (unsigned long long)(reorderMillis < 0 ? 0 : reorderMillis) * 1000;
+    frames = new MultipathFrame[frameCount];
+    memset(frames, 0, frameCount * sizeof(MultipathFrame));
+    return 0;
+}
+
+int CMultipathStream::AddPath(ConnectionType connType)
+{
+    if(pathCount == MULTIPATH_MAX_PATHS)
+    {
+        return -1;
+    }
+    memset(&paths[pathCount], 0, sizeof(MultipathPath));
+    paths[pathCount].connType = connType;
+    ++pathCount;
+    Reshare(true);
+    return pathCount - 1;
+}
+
+void CMultipathStream::RemovePath(int path)
+{
+    if(path < 0 || path >= pathCount)
+    {
+        return;
+    }
+    memmove(&paths[path], &paths[path + 1], (pathCount - path - 1) * sizeof(MultipathPath));
+    --pathCount;
+    Reshare(true);
+}
+
+int CMultipathStream::GetPathCount()
+{
+    return pathCount;
+}
+
+ConnectionType CMultipathStream::GetPathType(int path)
+{
+    return paths[path].connType;
+}
+
+// The window is a handful of frames, a linear search will do
+CMultipathStream::MultipathFrame* CMultipathStream::FindFrame(unsigned int seq)
+{
+    for(int i = 0; i < frameCount; i++)
+    {
+        if(frames[i].inUse && frames[i].seq == seq)
+        {
+            return &frames[i];
+        }
+    }
+    return NULL;
+}
+
+// The window holds frameCount sequence numbers, so there is always a free entry
+CMultipathStream::MultipathFrame* CMultipathStream::NewFrame(unsigned int seq, unsigned long long nowMicros)
+{
+    for(int i = 0; i < frameCount; i++)
+    {
+        if(!frames[i].inUse)
+        {
+            frames[i].inUse = true;
+            frames[i].seq = seq;
+            frames[i].firstMicros = nowMicros;
+            frames[i].header.isSet = false;
+            frames[i].data.isSet = false;
+            return &frames[i];
+        }
+    }
+    return NULL;
+}
+
+void CMultipathStream::CopyPacket(MultipathEntry* entry, const SmartCamPacket* packet)
+{
+    if(entry->capacity < packet->length)
+    {
+        delete[] entry->buffer;
+        entry->buffer = new unsigned char[packet->length];
+        entry->capacity = packet->length;
+    }
+    memcpy(entry->buffer, packet->data, packet->length);
+    entry->packet = *packet;
+    entry->packet.data = entry->buffer;
+    entry->isSet = true;
+}
+
+// Gives up on the next frame; a header that came with it still applies to
+// the frames after it
+void CMultipathStream::DropNext()
+{
+    MultipathFrame* frame = FindFrame(nextSeq);
+    if(frame != NULL)
+    {
+        if(frame->header.isSet)
+        {
+            CopyPacket(&lateHeader, &frame->header.packet);
+        }
+        frame->inUse = false;
+    }
+    ++skippedCount;
+    ++nextSeq;
+}
+
+// The phone restarted its sequence
+void CMultipathStream::Reset()
+{
+    for(int i = 0; i < frameCount; i++)
+    {
+        if(frames[i].inUse && frames[i].header.isSet)
+        {
+            CopyPacket(&lateHeader, &frames[i].header.packet);
+        }
+        frames[i].inUse = false;
+    }
+    hasMaxSeq = false;
+}
+
+void CMultipathStream::Feed(int path, const SmartCamPacket* packet)
+{
+    if(path < 0 || path >= pathCount || !packet->hasSeq)
+    {
+        return;
+    }
+    if(!hasNextSeq)
+    {
+        nextSeq = packet->seq;
+        hasNextSeq = true;
+    }
+    int distance = (int)(packet->seq - nextSeq);
+    if(distance >= 4 * frameCount || distance <= -4 * frameCount)
+    {
+        Reset();
+        nextSeq = packet->seq;
+        distance = 0;
+    }
+
+    if(packet->type == PACKET_JPEG_DATA)
+    {
+        MultipathPath* p = &paths[path];
+        ++p->frameCount;
+        ++p->sampleFrames;
+        p->sampleBytes += packet->length;
+        if(packet->hasCaptureTime)
+        {
+            p->sampleDelayMicros += (long long)(packet->receiveMicros - packet->captureMicros);
+            ++p->sampleDelayFrames;
+        }
+        // overtaken by a newer frame sent on another path
+        if(hasMaxSeq && (int)(packet->seq - maxSeq) < 0)
+        {
+            ++p->sampleLate;
+            ++reorderedCount;
+        }
+        else
+        {
+            maxSeq = packet->seq;
+            hasMaxSeq = true;
+        }
+    }
+
+    // already delivered or given up on
+    if(distance < 0)
+    {
+        if(packet->type == PACKET_JPEG_HEDAER)
+        {
+            CopyPacket(&lateHeader, packet);
+        }
+        else
+        {
+            ++lateCount;
+        }
+        return;
+    }
+    // make room in the window, the oldest frames lose
+    while(distance >= frameCount)
+    {
+        DropNext();
+        distance = (int)(packet->seq - nextSeq);
+    }
+    MultipathFrame* frame = FindFrame(packet->seq);
+    if(frame == NULL)
+    {
+        frame = NewFrame(packet->seq, packet->receiveMicros);
+    }
+    if(packet->type == PACKET_JPEG_HEDAER)
+    {
+        CopyPacket(&frame->header, packet);
+    }
+    else if(!frame->data.isSet)
+    {
+        CopyPacket(&frame->data, packet);
+    }
+    else
+    {
+        ++lateCount;    // sent twice
+    }
+}
+
+// The next frame may hold up the newer ones for reorderMicros at most,
+// counted from the arrival of the first newer frame
+bool CMultipathStream::GetDeadline(unsigned long long* deadline)
+{
+    bool found = false;
+    for(int i = 0; i < frameCount; i++)
+    {
+        if(!frames[i].inUse || frames[i].seq == nextSeq)
+        {
+            continue;
+        }
+        if(!found || frames[i].firstMicros < *deadline)
+        {
+            *deadline = frames[i].firstMicros;
+            found = true;
+        }
+    }
+    if(found)
+    {
+        *deadline += reorderMicros;
+    }
+    return found;
+}
+
+int CMultipathStream::Deliver(CPacketRing* pRing, unsigned long long nowMicros)
+{
+    unsigned long long deadline = 0;
+    while(true)
+    {
+        if(lateHeader.isSet)
+        {
+            if(pRing->Push(&lateHeader.packet) != 0)
+            {
+                return -1;
+            }
+            lateHeader.isSet = false;
+        }
+        if(!hasNextSeq)
+        {
+            break;
+        }
+        MultipathFrame* frame = FindFrame(nextSeq);
+        if(frame != NULL && frame->data.isSet)
+        {
+            if(frame->header.isSet && pRing->Push(&frame->header.packet) != 0)
+            {
+                return -1;
+            }
+            if(pRing->Push(&frame->data.packet) != 0)
+            {
+                return -1;
+            }
+            frame->inUse = false;
+            ++nextSeq;
+            continue;
+        }
+        if(!GetDeadline(&deadline) || nowMicros < deadline)
+        {
+            break;
+        }
+        DropNext();
+    }
+    return 0;
+}
+
+int CMultipathStream::GetTimeout(unsigned long long nowMicros)
+{
+    unsigned long long deadline = 0;
+    if(!GetDeadline(&deadline))
+    {
+        return -1;
+    }
+    return (deadline <= nowMicros ? 0 : (int)((deadline - nowMicros + 999) / 1000));
+}
+
+// Shares follow the capacities; a path not measured yet counts as an
+// average one. Only changes of MULTIPATH_SHARE_STEP or more are applied,
+// unless forced.
+bool CMultipathStream::Reshare(bool force)
+{
+    int shares[MULTIPATH_MAX_PATHS];
+    unsigned long long known = 0;
+    int knownCount = 0;
+    for(int i = 0; i < pathCount; i++)
+    {
+        if(paths[i].capacity > 0)
+        {
+            known += paths[i].capacity;
+            ++knownCount;
+        }
+    }
+    unsigned long long total = 0;
+    unsigned long long capacities[MULTIPATH_MAX_PATHS];
+    for(int i = 0; i < pathCount; i++)
+    {
+        capacities[i] = paths[i].capacity;
+        if(capacities[i] == 0)
+        {
+            capacities[i] = (knownCount > 0 ? known / knownCount : 1);
+        }
+        total += capacities[i];
+    }
+    int sum = 0;
+    int largest = 0;
+    for(int i = 0; i < pathCount; i++)
+    {
+        shares[i] = (int)(capacities[i] * 100 / total);
+        if(shares[i] < MULTIPATH_MIN_SHARE)
+        {
+            shares[i] = MULTIPATH_MIN_SHARE;
+        }
+        sum += shares[i];
+        if(shares[i] > shares[largest])
+        {
+            largest = i;
+        }
+    }
+    if(pathCount > 0)
+    {
+        shares[largest] += 100 - sum;
+    }
+    bool isChanged = force;
+    for(int i = 0; i < pathCount; i++)
+    {
+        int step = shares[i] - paths[i].share;
+        if(step >= MULTIPATH_SHARE_STEP || step <= -MULTIPATH_SHARE_STEP)
+        {
+            isChanged = true;
+        }
+    }
+    if(isChanged)
+    {
+        for(int i = 0; i < pathCount; i++)
+        {
+            paths[i].share = shares[i];
+        }
+    }
+    return isChanged;
+}
+
+// A path is congested when its delay grows above its base delay or when a
+// good part of its frames get overtaken by the other paths: it is then held
+// to a bit less than what it carried. Otherwise it is probed upwards, by a
+// quarter per second but never above twice what it carried.
+bool CMultipathStream::UpdateShares(unsigned long long nowMicros)
+{
+    if(sampleStartMicros == 0)
+    {
+        sampleStartMicros = nowMicros;
+        return false;
+    }
+    unsigned long long elapsedMicros = nowMicros - sampleStartMicros;
+    if(elapsedMicros < MULTIPATH_SAMPLE_MICROS)
+    {
+        return false;
+    }
+    for(int i = 0; i < pathCount; i++)
+    {
+        MultipathPath* p = &paths[i];
+        if(p->sampleFrames > 0)
+        {
+            unsigned long long bytesPerSecond = p->sampleBytes * 1000000 / elapsedMicros;
+            long long queueMicros = 0;
+            if(p->sampleDelayFrames > 0)
+            {
+                long long delayMicros = p->sampleDelayMicros / (long long)p->sampleDelayFrames;
+                // the base creeps up so that a slower route is learnt again
+                if(!p->hasBaseDelay || delayMicros < p->baseDelayMicros)
+                {
+                    p->baseDelayMicros = delayMicros;
+                    p->hasBaseDelay = true;
+                }
+                else
+                {
+                    p->baseDelayMicros += MULTIPATH_BASE_DRIFT_MICROS;
+                }
+                queueMicros = delayMicros - p->baseDelayMicros;
+            }
+            if(queueMicros > MULTIPATH_QUEUE_MICROS || p->sampleLate * 4 > p->sampleFrames)
+            {
+                p->capacity = (unsigned int)(bytesPerSecond * 7 / 8);
+            }
+            else
+            {
+                unsigned long long capacity = (p->capacity > bytesPerSecond ? p->capacity : bytesPerSecond);
+                capacity = capacity * 5 / 4;
+                if(capacity > 2 * bytesPerSecond)
+                {
+                    capacity = 2 * bytesPerSecond;
+                }
+                p->capacity = (unsigned int) capacity;
+            }
+        }
+        p->sampleBytes = 0;
+        p->sampleFrames = 0;
+        p->sampleDelayFrames = 0;
+        p->sampleDelayMicros = 0;
+        p->sampleLate = 0;
+    }
+    sampleStartMicros = nowMicros;
+    return Reshare(false);
+}
+
+int CMultipathStream::GetShare(int path)
+{
+    return paths[path].share;
+}
+
+unsigned int CMultipathStream::GetCapacity(int path)
+{
+    return paths[path].capacity;
+}
+
+unsigned int CMultipathStream::GetFrameCount(int path)
+{
+    return paths[path].frameCount;
+}
+
+unsigned int CMultipathStream::GetReorderedCount()
+{
+    return reorderedCount;
+}
+
+unsigned int CMultipathStream::GetSkippedCount()
+{
+    return skippedCount;
+}
+
+unsigned int CMultipathStream::GetLateCount()
+{
+    return lateCount;
+}
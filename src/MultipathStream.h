@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// MultipathStream.h
+
+#ifndef __MULTIPATH_STREAM_H__
+#define __MULTIPATH_STREAM_H__
+
+#include "CommHandler.h"
+#include "PacketRing.h"
+
+// connections one phone may stripe a stream over
+#define MULTIPATH_MAX_PATHS 3
+
+// One v2 stream striped by the phone over several connections. The packets
+// of every path go through a reorder window of windowFrames frames and reach
+// the decode ring in sequence order; a missing frame holds up the newer ones
+// for reorderMillis at most, counted from the arrival of the first newer one.
+// Per path it learns the bytes per second the connection carries before it
+// starts queueing and turns that into the share of frames the phone should
+// send on it: a path whose frames come in late or delayed is held to what it
+// carried, the others are probed upwards.
+class CMultipathStream
+{
+public:
+    CMultipathStream();
+    virtual ~CMultipathStream();
+    int Initialize(int windowFrames, int reorderMillis);
+    // Index of the new path, -1 if all are taken
+    int AddPath(ConnectionType connType);
+    // The paths after it move down by one
+    void RemovePath(int path);
+    int GetPathCount();
+    ConnectionType GetPathType(int path);
+    // Copies a packet received on a path into the window
+    void Feed(int path, const SmartCamPacket* packet);
+    // Pushes the packets that are due to the ring, -1 once the ring is closed
+    int Deliver(CPacketRing* pRing, unsigned long long nowMicros);
+    // Milliseconds until a missing frame is given up on, -1 for none
+    int GetTimeout(unsigned long long nowMicros);
+    // Once a second re-estimates the path capacities; true if the shares changed
+    bool UpdateShares(unsigned long long nowMicros);
+    // percentage of the frames the phone should send on the path
+    int GetShare(int path);
+    // bytes per second, 0 while not known
+    unsigned int GetCapacity(int path);
+    unsigned int GetFrameCount(int path);
+    unsigned int GetReorderedCount();
+    unsigned int GetSkippedCount();
+    unsigned int GetLateCount();
+
+private:
+    typedef struct MultipathEntry
+    {
+        bool isSet;
+        SmartCamPacket packet;
+        unsigned char* buffer;
+        unsigned int capacity;
+    } MultipathEntry;
+
+    typedef struct MultipathFrame
+    {
+        bool inUse;
+        unsigned int seq;
+        unsigned long long firstMicros;
+        MultipathEntry header;
+        MultipathEntry data;
+    } MultipathFrame;
+
+    typedef struct MultipathPath
+    {
+        ConnectionType connType;
+        int share;
+        unsigned int capacity;
+        // lowest capture to receive delay seen, the clocks differ so only
+        // the delay on top of it means something
+        bool hasBaseDelay;
+        long long baseDelayMicros;
+        // current sample
+        unsigned long long sampleBytes;
+        unsigned int sampleFrames;
+        unsigned int sampleDelayFrames;
+        long long sampleDelayMicros;
+        unsigned int sampleLate;
+        unsigned int frameCount;
+    } MultipathPath;
+
+    // Methods:
+    MultipathFrame* FindFrame(unsigned int seq);
+    MultipathFrame* NewFrame(unsigned int seq, unsigned long long nowMicros);
+    void CopyPacket(MultipathEntry* entry, const SmartCamPacket* packet);
+    bool GetDeadline(unsigned long long* deadline);
+    void DropNext();
+    void Reset();
+    bool Reshare(bool force);
+    // Data:
+    MultipathFrame* frames;
+    int frameCount;
+    unsigned long long reorderMicros;
+    bool hasNextSeq;
+    unsigned int nextSeq;
+    bool hasMaxSeq;
+    unsigned int maxSeq;
+    // a header whose frame is gone, it goes out first
+    MultipathEntry lateHeader;
+    MultipathPath paths[MULTIPATH_MAX_PATHS];
+    int pathCount;
+    unsigned long long sampleStartMicros;
+    // statistics
+    unsigned int reorderedCount;
+    unsigned int skippedCount;
+    unsigned int lateCount;
+};
+
+#endif//__MULTIPATH_STREAM_H__
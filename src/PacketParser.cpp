@@ -0,0 +1,415 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// PacketParser.cpp
+
+#include <string.h>
+
+#include "PacketParser.h"
+
+// bytes after the EOI marker tolerated at the end of a payload
+#define PACKET_EOI_SLACK 8
+
+static const unsigned char HELLO_MAGIC[4] = { 'S', 'C', 'A', 'M' };
+
+// big endian, as every field of the wire format
+static unsigned long long ReadSecret(const unsigned char* buffer)
+{
+    unsigned long long secret = 0;
+    for(int i = 0; i < PACKET_HELLO_SECRET_LEN; i++)
+    {
+        secret = (secret << 8) | buffer[i];
+    }
+    return secret;
+}
+
+CPacketParser::CPacketParser():
+    state(PARSER_HEADER),
+    version(0),
+    streamId(0),
+    streamSecret(0),
+    resumeToken(0),
+    helloFlags(0),
+    helloLen(PACKET_HELLO_LEN),
+    packetType(PACKET_JPEG_HEDAER),
+    packetLen(0),
+    codec(CODEC_JPEG),
+    packetSeq(0),
+    captureMicros(0),
+    scanPos(0),
+    resyncCount(0),
+    skippedBytes(0)
+{
+}
+
+CPacketParser::~CPacketParser()
+{
+}
+
+void CPacketParser::Reset()
+{
+    state = PARSER_HEADER;
+    packetLen = 0;
+    scanPos = 0;
+}
+
+unsigned int CPacketParser::GetHeaderLen()
+{
+    return (version == SMARTCAM_PROTOCOL_V2 ? PACKET_V2_HEADER_LEN : PACKET_V1_HEADER_LEN);
+}
+
+// header followed by the JPEG SOI marker, or for v2 the raw frame size
+unsigned int CPacketParser::GetStartLen()
+{
+    return (version == SMARTCAM_PROTOCOL_V2 ? PACKET_V2_HEADER_LEN + PACKET_RAW_HEADER_LEN :
+                                              PACKET_V1_HEADER_LEN + 2);
+}
+
+// A raw frame is trusted if its size fits the length: exactly, or within
+// what LZ4 can make of it
+bool CPacketParser::IsRawStart(SmartCamCodec codec, const unsigned char* payload, unsigned int length)
+{
+    unsigned int width = ((unsigned int)payload[0] << 8) | payload[1];
+    unsigned int height = ((unsigned int)payload[2] << 8) | payload[3];
+    if(width == 0 || height == 0 || (width & 1) || (height & 1) ||
+       width > PACKET_RAW_MAX_SIDE || height > PACKET_RAW_MAX_SIDE)
+    {
+        return false;
+    }
+    unsigned int planesLen = width * height * 3 / 2;
+    if(codec == CODEC_NV21 || codec == CODEC_I420)
+    {
+        return (length == PACKET_RAW_HEADER_LEN + planesLen);
+    }
+    return (length <= PACKET_RAW_HEADER_LEN + planesLen + planesLen / 255 + 16);
+}
+
+bool CPacketParser::IsPacketStart(const unsigned char* buffer)
+{
+    if(buffer[0] != PACKET_JPEG_HEDAER && buffer[0] != PACKET_JPEG_DATA &&
+       (buffer[0] != PACKET_CLOCK_REPLY || version != SMARTCAM_PROTOCOL_V2))
+    {
+        return false;
+    }
+    unsigned int length = 0;
+    if(version == SMARTCAM_PROTOCOL_V2)
+    {
+        if(buffer[0] == PACKET_CLOCK_REPLY)
+        {
+            return (buffer[1] == CODEC_JPEG && buffer[16] == 0 && buffer[17] == 0 &&
+                    buffer[18] == 0 && buffer[19] == PACKET_CLOCK_REPLY_LEN);
+        }
+        if(buffer[1] > CODEC_I420_LZ4 || (buffer[1] != CODEC_JPEG && buffer[0] != PACKET_JPEG_DATA))
+        {
+            return false;
+        }
+        length = ((unsigned int)buffer[16] << 24) | ((unsigned int)buffer[17] << 16) |
+                 ((unsigned int)buffer[18] << 8) | ((unsigned int)buffer[19]);
+        if(length < 4 || length > PACKET_V2_MAX_LEN)
+        {
+            return false;
+        }
+        if(buffer[1] != CODEC_JPEG)
+        {
+            return IsRawStart((SmartCamCodec) buffer[1], buffer + PACKET_V2_HEADER_LEN, length);
+        }
+        return (buffer[20] == 0xFF && buffer[21] == 0xD8);
+    }
+    length = ((unsigned int)buffer[1] << 16) | ((unsigned int)buffer[2] << 8) | ((unsigned int)buffer[3]);
+    if(length < 4 || length > PACKET_MAX_LEN)
+    {
+        return false;
+    }
+    return (buffer[4] == 0xFF && buffer[5] == 0xD8);
+}
+
+unsigned int CPacketParser::GetHelloLen(const unsigned char* buffer)
+{
+    if(buffer[4] >= SMARTCAM_PROTOCOL_V2 && (buffer[5] & (HELLO_FLAG_MULTIPATH | HELLO_FLAG_RESUME)))
+    {
+        return PACKET_HELLO_LEN + PACKET_HELLO_SECRET_LEN;
+    }
+    return PACKET_HELLO_LEN;
+}
+
+// Only the very first bytes of the stream may be a hello
+ParseResult CPacketParser::ParseHello(const unsigned char* buffer, unsigned int length, unsigned int* skip)
+{
+    unsigned int magicLen = (length < sizeof(HELLO_MAGIC) ? length : sizeof(HELLO_MAGIC));
+    if(memcmp(buffer, HELLO_MAGIC, magicLen) != 0)
+    {
+        version = SMARTCAM_PROTOCOL_V1;
+        helloFlags = 0;
+        return Parse(buffer, length, skip);
+    }
+    if(length < PACKET_HELLO_LEN)
+    {
+        return PARSE_MORE;
+    }
+    helloLen = GetHelloLen(buffer);
+    if(length < helloLen)
+    {
+        return PARSE_MORE;
+    }
+    version = buffer[4];
+    if(version < SMARTCAM_PROTOCOL_V1)
+    {
+        version = SMARTCAM_PROTOCOL_V1;
+    }
+    else if(version > SMARTCAM_PROTOCOL_V2)
+    {
+        version = SMARTCAM_PROTOCOL_V2;
+    }
+    streamId = 0;
+    streamSecret = 0;
+    resumeToken = 0;
+    helloFlags = (version == SMARTCAM_PROTOCOL_V2 ? buffer[5] : 0);
+    if(version == SMARTCAM_PROTOCOL_V2 && (buffer[5] & HELLO_FLAG_MULTIPATH))
+    {
+        streamId = ((unsigned int)buffer[6] << 8) | buffer[7];
+        streamSecret = ReadSecret(buffer + PACKET_HELLO_LEN);
+    }
+    else if(version == SMARTCAM_PROTOCOL_V2 && (buffer[5] & HELLO_FLAG_RESUME))
+    {
+        resumeToken = ReadSecret(buffer + PACKET_HELLO_LEN);
+    }
+    *skip = helloLen;
+    return PARSE_HELLO;
+}
+
+ParseResult CPacketParser::Parse(const unsigned char* buffer, unsigned int length, unsigned int* skip)
+{
+    *skip = 0;
+    if(version == 0)
+    {
+        if(length == 0)
+        {
+            return PARSE_MORE;
+        }
+        return ParseHello(buffer, length, skip);
+    }
+    if(state == PARSER_RESYNC)
+    {
+        return Resync(buffer, length, skip);
+    }
+    unsigned int headerLen = GetHeaderLen();
+    if(state == PARSER_HEADER)
+    {
+        if(length < GetStartLen())
+        {
+            return PARSE_MORE;
+        }
+        if(!IsPacketStart(buffer))
+        {
+            state = PARSER_RESYNC;
+            scanPos = 1;
+            ++resyncCount;
+            return Resync(buffer, length, skip);
+        }
+        packetType = (SmartCamPacketType) buffer[0];
+        if(version == SMARTCAM_PROTOCOL_V2)
+        {
+            codec = (SmartCamCodec) buffer[1];
+            packetSeq = ((unsigned int)buffer[4] << 24) | ((unsigned int)buffer[5] << 16) |
+                        ((unsigned int)buffer[6] << 8) | ((unsigned int)buffer[7]);
+            captureMicros = 0;
+            for(int i = 8; i < 16; i++)
+            {
+                captureMicros = (captureMicros << 8) | buffer[i];
+            }
+            packetLen = ((unsigned int)buffer[16] << 24) | ((unsigned int)buffer[17] << 16) |
+                        ((unsigned int)buffer[18] << 8) | ((unsigned int)buffer[19]);
+        }
+        else
+        {
+            codec = CODEC_JPEG;
+            packetLen = ((unsigned int)buffer[1] << 16) | ((unsigned int)buffer[2] << 8) | ((unsigned int)buffer[3]);
+        }
+        state = PARSER_PAYLOAD;
+    }
+
+    if(length < headerLen + packetLen)
+    {
+        return PARSE_MORE;
+    }
+    // raw frames and clock replies were checked at the start already
+    if(codec != CODEC_JPEG || packetType == PACKET_CLOCK_REPLY)
+    {
+        state = PARSER_HEADER;
+        return PARSE_PACKET;
+    }
+    // a wrong length lands anywhere but on the EOI marker
+    const unsigned char* end = buffer + headerLen + packetLen;
+    for(unsigned int i = 2; i <= PACKET_EOI_SLACK && i <= packetLen; i++)
+    {
+        if(*(end - i) == 0xFF && *(end - i + 1) == 0xD9)
+        {
+            state = PARSER_HEADER;
+            return PARSE_PACKET;
+        }
+    }
+    state = PARSER_RESYNC;
+    scanPos = 1;
+    ++resyncCount;
+    return Resync(buffer, length, skip);
+}
+
+// Looks for the next header + SOI, scanning every byte only once
+ParseResult CPacketParser::Resync(const unsigned char* buffer, unsigned int length, unsigned int* skip)
+{
+    unsigned int startLen = GetStartLen();
+    for(; scanPos + startLen <= length; scanPos++)
+    {
+        if(IsPacketStart(buffer + scanPos))
+        {
+            state = PARSER_HEADER;
+            break;
+        }
+    }
+    if(scanPos == 0)
+    {
+        // already at the buffer start
+        if(state == PARSER_HEADER)
+        {
+            return Parse(buffer, length, skip);
+        }
+        return PARSE_MORE;
+    }
+    // if not found, the tail is kept: it may hold the start of the next header
+    *skip = scanPos;
+    skippedBytes += scanPos;
+    scanPos = 0;
+    return PARSE_SKIP;
+}
+
+ParserState CPacketParser::GetState()
+{
+    return state;
+}
+
+unsigned int CPacketParser::GetWanted()
+{
+    if(version == 0)
+    {
+        return helloLen;
+    }
+    if(state == PARSER_PAYLOAD)
+    {
+        return GetHeaderLen() + packetLen;
+    }
+    return GetStartLen();
+}
+
+int CPacketParser::GetVersion()
+{
+    return (version == 0 ? SMARTCAM_PROTOCOL_V1 : version);
+}
+
+void CPacketParser::SetVersion(int protocolVersion)
+{
+    version = protocolVersion;
+}
+
+unsigned int CPacketParser::GetStreamId()
+{
+    return streamId;
+}
+
+unsigned long long CPacketParser::GetStreamSecret()
+{
+    return streamSecret;
+}
+
+unsigned long long CPacketParser::GetResumeToken()
+{
+    return resumeToken;
+}
+
+unsigned int CPacketParser::GetHelloFlags()
+{
+    return helloFlags;
+}
+
+int CPacketParser::PeekHello(const unsigned char* buffer, unsigned int length, unsigned int* flags,
+                             unsigned int* helloId, unsigned long long* secret)
+{
+    *flags = 0;
+    *helloId = 0;
+    *secret = 0;
+    unsigned int magicLen = (length < sizeof(HELLO_MAGIC) ? length : sizeof(HELLO_MAGIC));
+    if(memcmp(buffer, HELLO_MAGIC, magicLen) != 0)
+    {
+        return 0;
+    }
+    if(length < PACKET_HELLO_LEN)
+    {
+        return -1;
+    }
+    if(buffer[4] < SMARTCAM_PROTOCOL_V2 || !(buffer[5] & (HELLO_FLAG_MULTIPATH | HELLO_FLAG_RESUME)))
+    {
+        return 0;
+    }
+    unsigned int len = GetHelloLen(buffer);
+    if(length < len)
+    {
+        return -1;
+    }
+    *flags = buffer[5];
+    *helloId = ((unsigned int)buffer[6] << 8) | buffer[7];
+    if(len > PACKET_HELLO_LEN)
+    {
+        *secret = ReadSecret(buffer + PACKET_HELLO_LEN);
+    }
+    return 1;
+}
+
+SmartCamPacketType CPacketParser::GetPacketType()
+{
+    return packetType;
+}
+
+unsigned int CPacketParser::GetPacketLength()
+{
+    return packetLen;
+}
+
+SmartCamCodec CPacketParser::GetCodec()
+{
+    return codec;
+}
+
+unsigned int CPacketParser::GetPacketSeq()
+{
+    return packetSeq;
+}
+
+unsigned long long CPacketParser::GetCaptureMicros()
+{
+    return captureMicros;
+}
+
+unsigned int CPacketParser::GetResyncCount()
+{
+    return resyncCount;
+}
+
+unsigned int CPacketParser::GetSkippedBytes()
+{
+    return skippedBytes;
+}
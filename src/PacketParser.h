@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// PacketParser.h
+
+#ifndef __PACKET_PARSER_H__
+#define __PACKET_PARSER_H__
+
+#include "CommHandler.h"
+
+// Protocol versions, a v2 phone opens the stream with a hello:
+//   0  magic           "SCAM"
+//   4  version         highest version the phone speaks
+//   5  flags           HELLO_FLAG_*, 0 for older phones
+//   6  stream id       16 bits, multipath stream id (see below)
+//   8  secret          64 bits, only with HELLO_FLAG_MULTIPATH (the stream
+//                      secret) or HELLO_FLAG_RESUME (the resume token)
+// and the host answers the same way, with the version it picked and the flags
+// it agreed to.
+// v1 phones send their first packet straight away, whose type byte can never
+// be mistaken for the magic.
+#define SMARTCAM_PROTOCOL_V1 1
+#define SMARTCAM_PROTOCOL_V2 2
+#define PACKET_HELLO_LEN 8
+#define PACKET_HELLO_SECRET_LEN 8
+// Multipath: the phone stripes one v2 stream over several connections (e.g.
+// TCP/IP and Bluetooth). Every connection opens with a hello carrying this
+// flag, the same non-zero stream id and the same random non-zero secret the
+// phone picked for the stream; a connection with another secret joins no
+// stream. The frame seq numbers are shared, and a JPEG header packet carries
+// the seq of the first frame that uses it.
+#define HELLO_FLAG_MULTIPATH 0x01
+// Resumption: the host answers a single connection v2 hello with this flag
+// and a random 64-bit resume token. A phone that lost its connection
+// reconnects with the flag and that token, and carries on in its old session
+// (decoder, frame sequence and statistics) if the host still waits for it.
+#define HELLO_FLAG_RESUME 0x02
+// Raw frames: the phone can send raw YUV frames instead of JPEG ones, the
+// host agrees if it may ask for them (CONTROL_STREAM_PARAMS codec)
+#define HELLO_FLAG_RAW 0x04
+// Clock sync: the phone answers CONTROL_CLOCK_PING with a PACKET_CLOCK_REPLY
+#define HELLO_FLAG_CLOCK 0x08
+
+// Host to phone messages, v2 only and after the hello answer, all 8 bytes:
+//   0  message type    CONTROL_STREAM_PARAMS
+//   1  frame rate      frames per second
+//   2  JPEG quality    1..100
+//   3  codec           CODEC_JPEG, or CODEC_NV21 for raw frames (NV21 or I420,
+//                      LZ4 or not, as the phone likes); always CODEC_JPEG
+//                      unless the hello agreed to HELLO_FLAG_RAW
+//   4  width           16 bits
+//   6  height          16 bits
+// or, multipath only, on every connection of the stream:
+//   0  message type    CONTROL_PATH_SHARE
+//   1  share           percentage of the frames to send on this connection
+//   2  reserved        6 bytes
+// or, if the hello agreed to HELLO_FLAG_CLOCK:
+//   0  message type    CONTROL_CLOCK_PING
+//   1  reserved
+//   2  ping id         16 bits
+//   4  reserved        4 bytes
+#define PACKET_CONTROL_LEN 8
+#define CONTROL_STREAM_PARAMS 1
+#define CONTROL_PATH_SHARE 2
+#define CONTROL_CLOCK_PING 3
+
+// v1 header: 1 type byte and a 24-bit length
+#define PACKET_V1_HEADER_LEN 4
+// v2 header, all fields big endian:
+//   0  packet type     PACKET_JPEG_HEDAER or PACKET_JPEG_DATA
+//   1  codec           SmartCamCodec of the payload
+//   2  flags           16 bits, reserved
+//   4  frame seq       32 bits, +1 for every data packet sent by the phone
+//   8  capture time    64 bits, microseconds on the phone clock
+//  16  length          32 bits
+#define PACKET_V2_HEADER_LEN 20
+// Payload of a raw codec packet: frame size, then the planes (or the LZ4
+// block holding them)
+//   0  width           16 bits, even
+//   2  height          16 bits, even
+#define PACKET_RAW_HEADER_LEN 4
+#define PACKET_RAW_MAX_SIDE 4096
+// Payload of a PACKET_CLOCK_REPLY, sent as soon as the ping came in; its
+// header carries no frame seq and the send time as capture time
+//   0  ping id         16 bits
+//   2  reserved        16 bits
+//   4  receive time    64 bits, when the ping came in, phone clock
+#define PACKET_CLOCK_REPLY_LEN 12
+// Largest payload accepted, anything above is taken for a corrupt header
+#define PACKET_MAX_LEN (4 * 1024 * 1024)
+#define PACKET_V2_MAX_LEN (64 * 1024 * 1024)
+
+typedef enum ParserState
+{
+    PARSER_HEADER = 0,
+    PARSER_PAYLOAD = 1,
+    PARSER_RESYNC = 2
+} ParserState;
+
+typedef enum ParseResult
+{
+    PARSE_MORE = 0,     // need more bytes, see GetWanted()
+    PARSE_PACKET = 1,   // a packet starts at the buffer start, see GetPacket*()
+    PARSE_SKIP = 2,     // drop the first *skip bytes and parse again
+    PARSE_HELLO = 3     // v2 hello: answer it, drop *skip bytes, parse again
+} ParseResult;
+
+// Non-blocking state machine for the SmartCam wire format: a v1 or v2 header
+// (picked by the hello, if any) followed by a JPEG stream (tables or frame)
+// or a raw frame.
+// The caller owns the bytes: it appends whatever it received to a buffer that
+// starts at the current packet and calls Parse() again, so nothing is copied
+// unless the stream is corrupt. A header is only trusted if the payload starts
+// with SOI, a payload only if it ends with EOI (raw frames: if the frame size
+// matches the length); otherwise the parser scans for the next plausible
+// header + payload start and tells the caller to skip up to it.
+class CPacketParser
+{
+public:
+    CPacketParser();
+    virtual ~CPacketParser();
+    void Reset();
+    ParseResult Parse(const unsigned char* buffer, unsigned int length, unsigned int* skip);
+    ParserState GetState();
+    // total bytes the current packet needs at the buffer start
+    unsigned int GetWanted();
+    // SMARTCAM_PROTOCOL_V1 until a hello said otherwise
+    int GetVersion();
+    // For a connection whose hello was read by somebody else
+    void SetVersion(int version);
+    // multipath stream id and secret from the hello, 0 for a single connection
+    unsigned int GetStreamId();
+    unsigned long long GetStreamSecret();
+    // resume token from the hello, 0 for a new session
+    unsigned long long GetResumeToken();
+    // HELLO_FLAG_* of the hello, 0 for a v1 phone
+    unsigned int GetHelloFlags();
+    unsigned int GetHeaderLen();
+    SmartCamPacketType GetPacketType();
+    unsigned int GetPacketLength();
+    // v2 only
+    SmartCamCodec GetCodec();
+    unsigned int GetPacketSeq();
+    unsigned long long GetCaptureMicros();
+    unsigned int GetResyncCount();
+    unsigned int GetSkippedBytes();
+    // Bytes of the hello at the buffer start, which holds at least its
+    // first PACKET_HELLO_LEN
+    static unsigned int GetHelloLen(const unsigned char* buffer);
+    // Whether the bytes start with a hello that joins a session, with its
+    // flags, multipath stream id and secret: 1 if so, 0 if they are no such
+    // hello, -1 if more of them are needed to tell
+    static int PeekHello(const unsigned char* buffer, unsigned int length, unsigned int* flags,
+                         unsigned int* helloId, unsigned long long* secret);
+
+private:
+    // Methods:
+    bool IsPacketStart(const unsigned char* buffer);
+    bool IsRawStart(SmartCamCodec codec, const unsigned char* payload, unsigned int length);
+    unsigned int GetStartLen();
+    ParseResult ParseHello(const unsigned char* buffer, unsigned int length, unsigned int* skip);
+    ParseResult Resync(const unsigned char* buffer, unsigned int length, unsigned int* skip);
+    // Data:
+    ParserState state;
+    // 0 until the first bytes told whether a hello comes
+    int version;
+    unsigned int streamId;
+    unsigned long long streamSecret;
+    unsigned long long resumeToken;
+    unsigned int helloFlags;
+    // bytes of the hello coming in, once its flags are known
+    unsigned int helloLen;
+    SmartCamPacketType packetType;
+    unsigned int packetLen;
+    SmartCamCodec codec;
+    unsigned int packetSeq;
+    unsigned long long captureMicros;
+    // resync: where the scan for the next header stopped
+    unsigned int scanPos;
+    // statistics
+    unsigned int resyncCount;
+    unsigned int skippedBytes;
+};
+
+#endif//__PACKET_PARSER_H__
@@ -0,0 +1,805 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// PacketRing.cpp
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <time.h>
+
+#include "PacketRing.h"
+
+CPacketRing::CPacketRing():
+    slots(NULL),
+    slotCount(0),
+    pageSize(4096),
+    recvSlot(0),
+    decodeSlot(0),
+    carry(NULL),
+    carryLen(0),
+    readFirstLen(0),
+    helloVersion(0),
+    isZeroCopy(false),
+    zeroCopySkipPacket(0),
+    peekState(PEEK_NONE),
+    isPeekBusy(false),
+    isClosed(FALSE),
+    lock(NULL),
+    slotReady(NULL),
+    slotFree(NULL),
+    peekIdle(NULL),
+    readCount(0),
+    packetCount(0),
+    receivedBytes(0),
+    zeroCopyBytes(0)
+{
+    lock = g_mutex_new();
+    slotReady = g_cond_new();
+    slotFree = g_cond_new();
+    peekIdle = g_cond_new();
+}
+
+CPacketRing::~CPacketRing()
+{
+    if(slots != NULL)
+    {
+        for(int i = 0; i < slotCount; i++)
+        {
+            if(slots[i].buffer != NULL)
+            {
+                munmap(slots[i].buffer, slots[i].capacity);
+            }
+        }
+        delete[] slots;
+        slots = NULL;
+    }
+    g_cond_free(peekIdle);
+    g_cond_free(slotFree);
+    g_cond_free(slotReady);
+    g_mutex_free(lock);
+}
+
+int CPacketRing::Initialize(int count, unsigned int slotSize)
+{
+    long sysPageSize = sysconf(_SC_PAGESIZE);
+    if(sysPageSize > 0)
+    {
+        pageSize = sysPageSize;
+    }
+    // the receiver reads into the slot after the one it fills
+    if(count < 2)
+    {
+        count = 2;
+    }
+    slots = new PacketSlot[count];
+    slotCount = count;
+    memset(slots, 0, count * sizeof(PacketSlot));
+    for(int i = 0; i < slotCount; i++)
+    {
+        if(GrowSlot(&slots[i], slotSize) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int CPacketRing::NextSlot(int index)
+{
+    return (index + 1) % slotCount;
+}
+
+// Reallocates a slot with at least size bytes (rounded up to whole pages),
+// keeping what was already received into it. The buffers are mapped rather
+// than allocated, zero copy maps socket pages over parts of them; the copy
+// also turns those back into plain memory.
+int CPacketRing::GrowSlot(PacketSlot* slot, unsigned int size)
+{
+    size = (size + pageSize - 1) & ~(pageSize - 1);
+    void* buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(buffer == MAP_FAILED)
+    {
+        printf("smartcam: could not allocate %u bytes packet slot\n", size);
+        return -1;
+    }
+    if(slot->buffer != NULL)
+    {
+        memcpy(buffer, slot->buffer, slot->fill);
+        munmap(slot->buffer, slot->capacity);
+    }
+    slot->buffer = (unsigned char*) buffer;
+    slot->capacity = size;
+    slot->zeroCopyStart = 0;
+    slot->zeroCopyEnd = 0;
+    return 0;
+}
+
+// Gives the socket pages mapped into a slot back to the kernel, the slot
+// is plain writable memory again afterwards
+void CPacketRing::RestoreSlot(PacketSlot* slot)
+{
+    if(slot->zeroCopyEnd == 0)
+    {
+        return;
+    }
+    if(mmap(slot->buffer + slot->zeroCopyStart, slot->zeroCopyEnd - slot->zeroCopyStart, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+    {
+        printf("smartcam: could not unmap zero copy pages: %d(%s)\n", errno, strerror(errno));
+    }
+    slot->zeroCopyStart = 0;
+    slot->zeroCopyEnd = 0;
+}
+
+// Fills in the packet the parser found at the start of a slot. Called with
+// the lock held.
+void CPacketRing::SetPacket(PacketSlot* slot)
+{
+    bool isV2 = (parser.GetVersion() == SMARTCAM_PROTOCOL_V2);
+    slot->packet.type = parser.GetPacketType();
+    slot->packet.codec = parser.GetCodec();
+    slot->packet.data = slot->buffer + parser.GetHeaderLen();
+    slot->packet.length = parser.GetPacketLength();
+    slot->packet.hasSeq = isV2;
+    slot->packet.seq = parser.GetPacketSeq();
+    slot->packet.hasCaptureTime = isV2;
+    slot->packet.captureMicros = parser.GetCaptureMicros();
+    slot->packet.receiveMicros = GetMicros();
+}
+
+// The bytes of the receive slot are about to move or go, a decoder peeking
+// at them has to give up. Returns once it no longer reads them: decoding
+// the bytes it has takes a moment, and it comes back to wait for more, or
+// to find the frame dropped, without touching the slot. Called with the
+// lock held.
+void CPacketRing::DropPeeked()
+{
+    if(peekState == PEEK_FILLING)
+    {
+        peekState = PEEK_DROPPED;
+        g_cond_broadcast(slotReady);
+    }
+    while(isPeekBusy)
+    {
+        g_cond_wait(peekIdle, lock);
+    }
+}
+
+// Hands every complete packet of the receive slot over to the decoder and
+// moves on to the next slot. Called with the lock held.
+int CPacketRing::Settle()
+{
+    while(carryLen == 0)
+    {
+        PacketSlot* slot = &slots[recvSlot];
+        PacketSlot* next = &slots[NextSlot(recvSlot)];
+        unsigned int skip = 0;
+        // ring full, the next packet waits for the decoder to free its slot
+        if(slot->state == SLOT_READY || slot->state == SLOT_DECODING)
+        {
+            return 0;
+        }
+        ParseResult result = parser.Parse(slot->buffer, slot->fill, &skip);
+        if(result == PARSE_HELLO)
+        {
+            helloVersion = parser.GetVersion();
+        }
+        if(result == PARSE_SKIP || result == PARSE_HELLO)
+        {
+            DropPeeked();
+            // socket pages are read-only, a copy of the slot is not
+            if(slot->zeroCopyEnd != 0 && GrowSlot(slot, slot->capacity) != 0)
+            {
+                return -1;
+            }
+            // hello or corrupt stream: drop those bytes, and pull back whatever was
+            // scattered into the next slot since it follows these bytes
+            slot->fill -= skip;
+            memmove(slot->buffer, slot->buffer + skip, slot->fill);
+            if(next->state == SLOT_FILLING)
+            {
+                if(slot->capacity < slot->fill + next->fill && GrowSlot(slot, slot->fill + next->fill) != 0)
+                {
+                    return -1;
+                }
+                memcpy(slot->buffer + slot->fill, next->buffer, next->fill);
+                slot->fill += next->fill;
+                next->fill = 0;
+                next->state = SLOT_FREE;
+            }
+            continue;
+        }
+        if(result == PARSE_MORE)
+        {
+            // make room for the whole packet as soon as its length is known
+            if(slot->capacity < parser.GetWanted())
+            {
+                DropPeeked();
+                if(GrowSlot(slot, parser.GetWanted()) != 0)
+                {
+                    return -1;
+                }
+            }
+            // more of the frame the decoder peeks at
+            if(peekState == PEEK_FILLING)
+            {
+                g_cond_broadcast(slotReady);
+            }
+            return 0;
+        }
+
+        unsigned int packetLen = parser.GetHeaderLen() + parser.GetPacketLength();
+        SetPacket(slot);
+        if(peekState == PEEK_FILLING)
+        {
+            peekState = PEEK_COMPLETE;
+        }
+
+        // anything past the packet belongs to the next one
+        carry = slot->buffer + packetLen;
+        carryLen = slot->fill - packetLen;
+        slot->fill = packetLen;
+        slot->state = SLOT_READY;
+        ++packetCount;
+        g_cond_signal(slotReady);
+        recvSlot = NextSlot(recvSlot);
+
+        // the slot is not overwritten before the carry is moved, the
+        // receiver has to go round the whole ring to get back to it
+        if(carryLen > 0 && next->state == SLOT_FREE)
+        {
+            if(next->capacity < carryLen && GrowSlot(next, carryLen) != 0)
+            {
+                return -1;
+            }
+            memcpy(next->buffer, carry, carryLen);
+            next->fill = carryLen;
+            next->state = SLOT_FILLING;
+            carry = NULL;
+            carryLen = 0;
+        }
+    }
+    return 0;
+}
+
+// Sets up the next read: the rest of the packet being received and, once
+// its length is known, the next free slot for what follows it. Moves any
+// carried bytes first and waits while every slot is owned by the decoder.
+int CPacketRing::BeginRead(struct iovec* iov)
+{
+    int iovCount = -1;
+    g_mutex_lock(lock);
+    while(!isClosed)
+    {
+        PacketSlot* slot = &slots[recvSlot];
+        // every slot is still owned by the decoder, wait for one
+        if(slot->state == SLOT_READY || slot->state == SLOT_DECODING)
+        {
+            g_cond_wait(slotFree, lock);
+            continue;
+        }
+        if(carryLen > 0)
+        {
+            if(slot->capacity < carryLen && GrowSlot(slot, carryLen) != 0)
+            {
+                break;
+            }
+            memcpy(slot->buffer, carry, carryLen);
+            slot->fill = carryLen;
+            slot->state = SLOT_FILLING;
+            carry = NULL;
+            carryLen = 0;
+            if(Settle() != 0)
+            {
+                break;
+            }
+            continue;
+        }
+
+        PacketSlot* next = &slots[NextSlot(recvSlot)];
+        iovCount = 1;
+        if(parser.GetState() != PARSER_PAYLOAD)
+        {
+            // length not known yet, read as much as the slot can take
+            iov[0].iov_base = slot->buffer + slot->fill;
+            iov[0].iov_len = slot->capacity - slot->fill;
+        }
+        else if(IsZeroCopyWanted(slot))
+        {
+            // up to the next page boundary, zero copy takes over from there
+            iov[0].iov_base = slot->buffer + slot->fill;
+            iov[0].iov_len = pageSize - (slot->fill & (pageSize - 1));
+        }
+        else
+        {
+            // exactly the rest of this packet, the surplus goes to the next slot
+            iov[0].iov_base = slot->buffer + slot->fill;
+            iov[0].iov_len = parser.GetWanted() - slot->fill;
+            if(next->state == SLOT_FREE)
+            {
+                iov[1].iov_base = next->buffer;
+                iov[1].iov_len = next->capacity;
+                iovCount = 2;
+            }
+        }
+        slot->state = SLOT_FILLING;
+        readFirstLen = iov[0].iov_len;
+        break;
+    }
+    g_mutex_unlock(lock);
+    // the decoder only touches ready slots, the read needs no lock
+    return (isClosed ? -1 : iovCount);
+}
+
+// Accounts for count bytes read into the iovecs of the last BeginRead()
+// and hands the packets completed by them to the decoder
+int CPacketRing::EndRead(unsigned int count)
+{
+    int result = 0;
+    g_mutex_lock(lock);
+    PacketSlot* slot = &slots[recvSlot];
+    PacketSlot* next = &slots[NextSlot(recvSlot)];
+    ++readCount;
+    receivedBytes += count;
+    if(count <= readFirstLen)
+    {
+        slot->fill += count;
+    }
+    else
+    {
+        slot->fill += readFirstLen;
+        next->fill = count - readFirstLen;
+        next->state = SLOT_FILLING;
+    }
+    if(isClosed || Settle() != 0)
+    {
+        result = -1;
+    }
+    g_mutex_unlock(lock);
+    return result;
+}
+
+// Whether the rest of the payload being received is worth mapping. Called
+// with the lock held.
+bool CPacketRing::IsZeroCopyWanted(PacketSlot* slot)
+{
+    return (isZeroCopy && parser.GetState() == PARSER_PAYLOAD &&
+            parser.GetPacketLength() >= PACKET_ZEROCOPY_MIN_LEN &&
+            parser.GetWanted() - slot->fill >= pageSize && zeroCopySkipPacket != packetCount + 1);
+}
+
+// Maps the whole pages left of the payload being received into the slot,
+// from a page boundary on. Returns the number of bytes mapped, 0 if none
+// were (nothing queued, a socket that cannot, segments too small to map:
+// the caller copies) and -1 once the ring is closed.
+int CPacketRing::ZeroCopyRead(int socket)
+{
+#ifdef TCP_ZEROCOPY_RECEIVE
+    struct tcp_zerocopy_receive zc;
+    socklen_t zcLen = sizeof(zc);
+    unsigned int length = 0;
+
+    g_mutex_lock(lock);
+    PacketSlot* slot = &slots[recvSlot];
+    if(!isClosed && carryLen == 0 && slot->state == SLOT_FILLING &&
+       IsZeroCopyWanted(slot) && (slot->fill & (pageSize - 1)) == 0)
+    {
+        length = (parser.GetWanted() - slot->fill) & ~(pageSize - 1);
+        readFirstLen = length;
+    }
+    g_mutex_unlock(lock);
+    if(length == 0)
+    {
+        return 0;
+    }
+
+    // the kernel only maps pages into a mapping of the socket itself
+    unsigned char* address = slot->buffer + slot->fill;
+    void* mapping = mmap(address, length, PROT_READ, MAP_SHARED | MAP_FIXED, socket, 0);
+    int result = -1;
+    memset(&zc, 0, sizeof(zc));
+    if(mapping != MAP_FAILED)
+    {
+        zc.address = (uint64_t)(uintptr_t) address;
+        zc.length = length;
+        result = getsockopt(socket, IPPROTO_TCP, TCP_ZEROCOPY_RECEIVE, &zc, &zcLen);
+    }
+    if(result != 0)
+    {
+        printf("smartcam: zero copy receive unavailable, copying: %d(%s)\n", errno, strerror(errno));
+        isZeroCopy = false;
+        zc.length = 0;
+    }
+    unsigned int mapped = zc.length;
+    // whatever was not mapped becomes plain memory again for the copying reads
+    if(mapped < length && mmap(address + mapped, length - mapped, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+    {
+        printf("smartcam: could not remap packet slot: %d(%s)\n", errno, strerror(errno));
+        return -1;
+    }
+    if(mapped == 0)
+    {
+        // queued bytes the kernel cannot map: copy the rest of this packet
+        if(result == 0 && zc.recv_skip_hint > 0)
+        {
+            zeroCopySkipPacket = packetCount + 1;
+        }
+        return 0;
+    }
+    if(slot->zeroCopyEnd == 0)
+    {
+        slot->zeroCopyStart = slot->fill;
+    }
+    slot->zeroCopyEnd = slot->fill + mapped;
+    zeroCopyBytes += mapped;
+    return (EndRead(mapped) != 0 ? -1 : (int) mapped);
+#else
+    isZeroCopy = false;
+    return 0;
+#endif
+}
+
+int CPacketRing::Receive(int socket)
+{
+    struct iovec iov[2];
+    while(true)
+    {
+        if(isZeroCopy)
+        {
+            int mapped = ZeroCopyRead(socket);
+            if(mapped < 0)
+            {
+                return -1;
+            }
+            if(mapped > 0)
+            {
+                continue;
+            }
+        }
+        int iovCount = BeginRead(iov);
+        if(iovCount < 0)
+        {
+            return -1;
+        }
+        ssize_t count = readv(socket, iov, iovCount);
+        if(count == 0)
+        {
+            return -1;      // connection closed
+        }
+        if(count < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return ((errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1);
+        }
+        if(EndRead(count) != 0)
+        {
+            return -1;
+        }
+    }
+}
+
+int CPacketRing::Push(const SmartCamPacket* packet)
+{
+    g_mutex_lock(lock);
+    while(!isClosed && slots[recvSlot].state != SLOT_FREE)
+    {
+        g_cond_wait(slotFree, lock);
+    }
+    if(isClosed)
+    {
+        g_mutex_unlock(lock);
+        return -1;
+    }
+    PacketSlot* slot = &slots[recvSlot];
+    slot->state = SLOT_FILLING;
+    g_mutex_unlock(lock);
+
+    // the decoder does not touch a filling slot
+    slot->fill = 0;
+    if(slot->capacity < packet->length && GrowSlot(slot, packet->length) != 0)
+    {
+        g_mutex_lock(lock);
+        slot->state = SLOT_FREE;
+        g_mutex_unlock(lock);
+        return 0;   // dropped
+    }
+    memcpy(slot->buffer, packet->data, packet->length);
+
+    g_mutex_lock(lock);
+    slot->fill = packet->length;
+    slot->packet = *packet;
+    slot->packet.data = slot->buffer;
+    // a packet moved on from another ring keeps its arrival time
+    if(packet->receiveMicros == 0)
+    {
+        slot->packet.receiveMicros = GetMicros();
+    }
+    slot->state = SLOT_READY;
+    ++packetCount;
+    g_cond_signal(slotReady);
+    recvSlot = NextSlot(recvSlot);
+    g_mutex_unlock(lock);
+    return 0;
+}
+
+int CPacketRing::TakeHello()
+{
+    g_mutex_lock(lock);
+    int version = helloVersion;
+    helloVersion = 0;
+    g_mutex_unlock(lock);
+    return version;
+}
+
+unsigned int CPacketRing::GetStreamId()
+{
+    g_mutex_lock(lock);
+    unsigned int streamId = parser.GetStreamId();
+    g_mutex_unlock(lock);
+    return streamId;
+}
+
+unsigned long long CPacketRing::GetStreamSecret()
+{
+    g_mutex_lock(lock);
+    unsigned long long streamSecret = parser.GetStreamSecret();
+    g_mutex_unlock(lock);
+    return streamSecret;
+}
+
+unsigned long long CPacketRing::GetResumeToken()
+{
+    g_mutex_lock(lock);
+    unsigned long long resumeToken = parser.GetResumeToken();
+    g_mutex_unlock(lock);
+    return resumeToken;
+}
+
+unsigned int CPacketRing::GetHelloFlags()
+{
+    g_mutex_lock(lock);
+    unsigned int helloFlags = parser.GetHelloFlags();
+    g_mutex_unlock(lock);
+    return helloFlags;
+}
+
+void CPacketRing::Restart()
+{
+    g_mutex_lock(lock);
+    PacketSlot* slot = &slots[recvSlot];
+    PacketSlot* next = &slots[NextSlot(recvSlot)];
+    // only the receive slot and the one after it can hold a partial packet
+    DropPeeked();
+    if(slot->state == SLOT_FILLING)
+    {
+        RestoreSlot(slot);
+        slot->fill = 0;
+        slot->state = SLOT_FREE;
+    }
+    if(next->state == SLOT_FILLING)
+    {
+        next->fill = 0;
+        next->state = SLOT_FREE;
+    }
+    carry = NULL;
+    carryLen = 0;
+    helloVersion = 0;
+    parser.Reset();
+    parser.SetVersion(0);
+    g_mutex_unlock(lock);
+}
+
+void CPacketRing::SetVersion(int version)
+{
+    g_mutex_lock(lock);
+    parser.SetVersion(version);
+    g_mutex_unlock(lock);
+}
+
+int CPacketRing::GetPendingCount()
+{
+    int count = 0;
+    g_mutex_lock(lock);
+    for(int i = 0; i < slotCount; i++)
+    {
+        if(slots[i].state == SLOT_READY)
+        {
+            ++count;
+        }
+    }
+    g_mutex_unlock(lock);
+    return count;
+}
+
+bool CPacketRing::HasNewerFrame()
+{
+    bool found = false;
+    g_mutex_lock(lock);
+    for(int i = NextSlot(decodeSlot); i != decodeSlot && slots[i].state == SLOT_READY; i = NextSlot(i))
+    {
+        if(slots[i].packet.type == PACKET_JPEG_DATA)
+        {
+            found = true;
+            break;
+        }
+    }
+    g_mutex_unlock(lock);
+    return found;
+}
+
+SmartCamPacket* CPacketRing::WaitPacket()
+{
+    SmartCamPacket* packet = NULL;
+    g_mutex_lock(lock);
+    while(!isClosed && slots[decodeSlot].state != SLOT_READY)
+    {
+        g_cond_wait(slotReady, lock);
+    }
+    if(!isClosed)
+    {
+        slots[decodeSlot].state = SLOT_DECODING;
+        packet = &slots[decodeSlot].packet;
+    }
+    g_mutex_unlock(lock);
+    return packet;
+}
+
+SmartCamPacket* CPacketRing::TakePacket()
+{
+    SmartCamPacket* packet = NULL;
+    g_mutex_lock(lock);
+    if(!isClosed && slots[decodeSlot].state == SLOT_READY)
+    {
+        slots[decodeSlot].state = SLOT_DECODING;
+        packet = &slots[decodeSlot].packet;
+    }
+    g_mutex_unlock(lock);
+    return packet;
+}
+
+SmartCamPacket* CPacketRing::PeekPacket(unsigned int* available)
+{
+    SmartCamPacket* packet = NULL;
+    g_mutex_lock(lock);
+    PacketSlot* slot = &slots[decodeSlot];
+    // a slot being filled at the decode position is the receive slot
+    if(!isClosed && slot->state == SLOT_FILLING && decodeSlot == recvSlot &&
+       parser.GetState() == PARSER_PAYLOAD && parser.GetPacketType() == PACKET_JPEG_DATA &&
+       parser.GetCodec() == CODEC_JPEG)
+    {
+        SetPacket(slot);
+        packet = &slot->packet;
+        *available = slot->fill - parser.GetHeaderLen();
+        peekState = PEEK_FILLING;
+        isPeekBusy = true;
+    }
+    g_mutex_unlock(lock);
+    return packet;
+}
+
+int CPacketRing::WaitPeeked(unsigned int* available)
+{
+    int result = -1;
+    g_mutex_lock(lock);
+    PacketSlot* slot = &slots[decodeSlot];
+    unsigned int headerLen = slot->packet.data - slot->buffer;
+    // done with the bytes it had, the receiver may move them now
+    isPeekBusy = false;
+    g_cond_broadcast(peekIdle);
+    while(!isClosed && peekState == PEEK_FILLING && slot->fill - headerLen <= *available)
+    {
+        g_cond_wait(slotReady, lock);
+    }
+    if(!isClosed && peekState == PEEK_FILLING)
+    {
+        *available = slot->fill - headerLen;
+        isPeekBusy = true;
+        result = 1;
+    }
+    else if(!isClosed && peekState == PEEK_COMPLETE)
+    {
+        result = 0;
+    }
+    if(result != 1)
+    {
+        peekState = PEEK_NONE;
+    }
+    g_mutex_unlock(lock);
+    return result;
+}
+
+void CPacketRing::ReleasePacket(SmartCamPacket* packet)
+{
+    // still the decoder's, the receiver does not touch it
+    if(packet == &slots[decodeSlot].packet)
+    {
+        RestoreSlot(&slots[decodeSlot]);
+    }
+    g_mutex_lock(lock);
+    if(packet == &slots[decodeSlot].packet)
+    {
+        slots[decodeSlot].fill = 0;
+        slots[decodeSlot].state = SLOT_FREE;
+        decodeSlot = NextSlot(decodeSlot);
+        g_cond_signal(slotFree);
+    }
+    g_mutex_unlock(lock);
+}
+
+void CPacketRing::Close()
+{
+    g_mutex_lock(lock);
+    isClosed = TRUE;
+    g_cond_broadcast(slotReady);
+    g_cond_broadcast(slotFree);
+    g_mutex_unlock(lock);
+}
+
+void CPacketRing::EnableZeroCopy()
+{
+    isZeroCopy = true;
+}
+
+unsigned long long CPacketRing::GetZeroCopyBytes()
+{
+    return zeroCopyBytes;
+}
+
+unsigned long long CPacketRing::GetCopiedBytes()
+{
+    return receivedBytes - zeroCopyBytes;
+}
+
+unsigned int CPacketRing::GetReadCount()
+{
+    return readCount;
+}
+
+unsigned int CPacketRing::GetPacketCount()
+{
+    return packetCount;
+}
+
+unsigned int CPacketRing::GetResyncCount()
+{
+    return parser.GetResyncCount();
+}
+
+unsigned int CPacketRing::GetSkippedBytes()
+{
+    return parser.GetSkippedBytes();
+}
+
+unsigned long long CPacketRing::GetMicros()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// PacketRing.h
+
+#ifndef __PACKET_RING_H__
+#define __PACKET_RING_H__
+
+#include <gtk/gtk.h>
+#include <sys/uio.h>
+
+#include "CommHandler.h"
+#include "PacketParser.h"
+
+#define PACKET_RING_SLOT_COUNT 4
+#define PACKET_RING_SLOT_SIZE (256 * 1024)
+// Zero copy receive only pays off for big payloads, below this the page
+// mapping costs more than the copy
+#define PACKET_ZEROCOPY_MIN_LEN (64 * 1024)
+
+// A complete packet, it stays in its ring slot until the decoder releases it
+typedef struct SmartCamPacket
+{
+    SmartCamPacketType type;
+    SmartCamCodec codec;
+    const unsigned char* data;
+    unsigned int length;
+    // frame sequence number (v2 and UDP) and phone capture time (v2)
+    bool hasSeq;
+    unsigned int seq;
+    bool hasCaptureTime;
+    unsigned long long captureMicros;
+    // host monotonic time at which the packet was complete
+    unsigned long long receiveMicros;
+} SmartCamPacket;
+
+// Fixed ring of page-aligned packet slots shared by the receive thread
+// (producer) and the decode thread (consumer) of a session.
+// Each read scatters into the rest of the packet being received and into
+// the next free slot, so one syscall usually brings in the end of a frame
+// together with the header and start of the following one. Only the bytes
+// of a third packet caught by the same read are moved to their own slot.
+// Framing is left to a CPacketParser working in place on the slot memory.
+// With zero copy enabled, Receive() has the kernel map whole pages of a big
+// TCP payload into the slot (TCP_ZEROCOPY_RECEIVE) instead of copying them;
+// the bytes up to the next page boundary, and whatever the kernel cannot
+// map, are still copied.
+// With nothing else to do, the decoder may peek at a JPEG frame still being
+// received and decode it as its bytes come in; the slot stays put, and the
+// bytes below its fill are never written again until it is released.
+class CPacketRing
+{
+public:
+    CPacketRing();
+    virtual ~CPacketRing();
+    int Initialize(int slotCount, unsigned int slotSize);
+    // Producer: reads from the non-blocking socket until it is drained.
+    // Waits while every slot is owned by the decoder. Returns 0 when the
+    // socket would block and -1 when the peer is gone or the ring was closed.
+    int Receive(int socket);
+    // Producer: lets Receive() try TCP_ZEROCOPY_RECEIVE, it turns itself
+    // off again on a socket that does not support it
+    void EnableZeroCopy();
+    // The same in two steps, for callers that do the read themselves:
+    // BeginRead() fills up to 2 iovecs and returns their count (-1 once
+    // closed), EndRead() takes the number of bytes that were read into them
+    int BeginRead(struct iovec* iov);
+    int EndRead(unsigned int count);
+    // Producer for transports that assemble whole packets themselves (UDP):
+    // copies the packet into the next slot, -1 once the ring was closed
+    int Push(const SmartCamPacket* packet);
+    // Protocol version to acknowledge if a hello came in since the last
+    // call, 0 otherwise
+    int TakeHello();
+    // multipath stream id and resume token of that hello, 0 if none
+    unsigned int GetStreamId();
+    unsigned long long GetStreamSecret();
+    unsigned long long GetResumeToken();
+    unsigned int GetHelloFlags();
+    // Skips the hello on a connection whose version is already known
+    void SetVersion(int version);
+    // Producer: drops the bytes of a packet cut off by a lost connection, the
+    // next read starts a new stream (hello included). The packets already
+    // received stay for the decoder.
+    void Restart();
+    // Packets received and not yet taken by the decoder
+    int GetPendingCount();
+    // Whether a frame newer than the one being decoded has been received
+    bool HasNewerFrame();
+    // Consumer: waits for the next packet in arrival order, NULL once closed
+    SmartCamPacket* WaitPacket();
+    // The same without waiting, NULL if none is ready
+    SmartCamPacket* TakePacket();
+    // Consumer, streaming: the JPEG frame being received while no packet is
+    // ready, once its header is in, and the payload bytes received so far.
+    // NULL if there is none. The receiver leaves those bytes alone until the
+    // decoder calls WaitPeeked() again.
+    SmartCamPacket* PeekPacket(unsigned int* available);
+    // Waits for more than *available bytes of the peeked frame: 1 with the
+    // new count, 0 once it is complete (WaitPacket() returns it next), -1 if
+    // it was dropped (corrupt stream, lost connection) or the ring closed
+    int WaitPeeked(unsigned int* available);
+    void ReleasePacket(SmartCamPacket* packet);
+    // Wakes up both sides for good
+    void Close();
+    unsigned int GetReadCount();
+    unsigned int GetPacketCount();
+    // bytes received by mapping pages and by copying
+    unsigned long long GetZeroCopyBytes();
+    unsigned long long GetCopiedBytes();
+    unsigned int GetResyncCount();
+    unsigned int GetSkippedBytes();
+    static unsigned long long GetMicros();
+
+private:
+    typedef enum SlotState
+    {
+        SLOT_FREE = 0,
+        SLOT_FILLING = 1,
+        SLOT_READY = 2,
+        SLOT_DECODING = 3
+    } SlotState;
+
+    typedef enum PeekState
+    {
+        PEEK_NONE = 0,
+        PEEK_FILLING = 1,
+        PEEK_COMPLETE = 2,
+        PEEK_DROPPED = 3
+    } PeekState;
+
+    typedef struct PacketSlot
+    {
+        unsigned char* buffer;      // packet header + payload, page-aligned
+        unsigned int capacity;
+        unsigned int fill;
+        SlotState state;
+        SmartCamPacket packet;
+        // range of read-only socket pages mapped into the buffer, if any
+        unsigned int zeroCopyStart;
+        unsigned int zeroCopyEnd;
+    } PacketSlot;
+
+    // Methods:
+    int GrowSlot(PacketSlot* slot, unsigned int size);
+    void SetPacket(PacketSlot* slot);
+    void DropPeeked();
+    bool IsZeroCopyWanted(PacketSlot* slot);
+    int ZeroCopyRead(int socket);
+    void RestoreSlot(PacketSlot* slot);
+    int Settle();
+    int NextSlot(int index);
+    // Data:
+    PacketSlot* slots;
+    int slotCount;
+    unsigned long pageSize;
+    int recvSlot;
+    int decodeSlot;
+    CPacketParser parser;
+    // bytes past a complete packet that still wait for a free slot
+    const unsigned char* carry;
+    unsigned int carryLen;
+    // room in the first iovec of the read in progress
+    size_t readFirstLen;
+    int helloVersion;
+    // zero copy: on, and the packet it gave up on (counted by packetCount)
+    bool isZeroCopy;
+    unsigned int zeroCopySkipPacket;
+    // the frame the decoder peeks at is always the receive slot's; the
+    // decoder reads its bytes outside the lock until it waits for more
+    PeekState peekState;
+    bool isPeekBusy;
+    gboolean isClosed;
+    GMutex* lock;
+    GCond* slotReady;
+    GCond* slotFree;
+    GCond* peekIdle;
+    // statistics
+    unsigned int readCount;
+    unsigned int packetCount;
+    unsigned long long receivedBytes;
+    unsigned long long zeroCopyBytes;
+};
+
+#endif//__PACKET_RING_H__
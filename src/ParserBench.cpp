@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// ParserBench.cpp
+
+// Throughput microbenchmark of CPacketParser, not installed. Parses an
+// in-memory v2 stream the way CPacketRing feeds it, in chunks of a given
+// size with the buffer starting at the current packet, once clean and once
+// with a share of the frames corrupt so that the parser has to resync.
+// A clean packet costs a header and an EOI check whatever its size, so the
+// MB/s of the clean stream mostly tell how cheap that is; the packets/s and
+// the corrupt stream, scanned byte by byte, are the figures to compare.
+//
+// usage: parserbench [packets [frame bytes [chunk bytes [corrupt percent]]]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "PacketParser.h"
+
+// each stream is parsed again until this much time has gone by
+#define BENCH_MIN_MICROS 500000
+
+typedef struct BenchResult
+{
+    unsigned int packets;
+    unsigned int resyncs;
+    unsigned int skippedBytes;
+    unsigned int passes;
+    unsigned long long micros;
+} BenchResult;
+
+static unsigned long long GetMicros()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void PutBigEndian(unsigned char* buffer, unsigned int value, int length)
+{
+    for(int i = length - 1; i >= 0; i--)
+    {
+        buffer[i] = (unsigned char)(value & 0xFF);
+        value >>= 8;
+    }
+}
+
+static unsigned char* PutPacket(unsigned char* buffer, SmartCamPacketType type, unsigned int seq,
+                                unsigned int payloadLen)
+{
+    memset(buffer, 0, PACKET_V2_HEADER_LEN);
+    buffer[0] = type;
+    buffer[1] = CODEC_JPEG;
+    PutBigEndian(buffer + 4, seq, 4);
+    PutBigEndian(buffer + 12, seq * 33333, 4);
+    PutBigEndian(buffer + 16, payloadLen, 4);
+    unsigned char* payload = buffer + PACKET_V2_HEADER_LEN;
+    // no 0xFF inside, so a resync only finds the real packet starts
+    for(unsigned int i = 2; i < payloadLen - 2; i++)
+    {
+        payload[i] = (unsigned char)(rand() % 255);
+    }
+    payload[0] = 0xFF;
+    payload[1] = 0xD8;
+    payload[payloadLen - 2] = 0xFF;
+    payload[payloadLen - 1] = 0xD9;
+    return payload + payloadLen;
+}
+
+// Hello, JPEG tables and packetCount frames of 3/4 to 5/4 frameBytes; the
+// SOI marker of about corruptPercent of the frames is wiped out
+static unsigned char* MakeStream(unsigned int packetCount, unsigned int frameBytes, int corruptPercent,
+                                 unsigned int* length, unsigned int* corruptCount)
+{
+    unsigned int capacity = PACKET_HELLO_LEN + (packetCount + 1) * (PACKET_V2_HEADER_LEN + frameBytes * 5 / 4 + 1);
+    unsigned char* stream = (unsigned char*) malloc(capacity);
+    if(stream == NULL)
+    {
+        return NULL;
+    }
+    unsigned char* end = stream;
+    memcpy(end, "SCAM", 4);
+    end[4] = SMARTCAM_PROTOCOL_V2;
+    end[5] = 0;
+    end[6] = 0;
+    end[7] = 0;
+    end += PACKET_HELLO_LEN;
+    end = PutPacket(end, PACKET_JPEG_HEDAER, 0, 600);
+    *corruptCount = 0;
+    for(unsigned int i = 0; i < packetCount; i++)
+    {
+        unsigned char* packet = end;
+        end = PutPacket(end, PACKET_JPEG_DATA, i, frameBytes * 3 / 4 + rand() % (frameBytes / 2 + 1));
+        if(rand() % 100 < corruptPercent)
+        {
+            packet[PACKET_V2_HEADER_LEN] = 0;
+            ++(*corruptCount);
+        }
+    }
+    *length = end - stream;
+    return stream;
+}
+
+// One pass: the receiver gets chunkBytes more whenever the parser wants more
+static void ParseStream(const unsigned char* stream, unsigned int length, unsigned int chunkBytes,
+                        BenchResult* result)
+{
+    CPacketParser parser;
+    unsigned int start = 0;
+    unsigned int received = 0;
+    unsigned int skip = 0;
+    while(true)
+    {
+        ParseResult parsed = parser.Parse(stream + start, received - start, &skip);
+        if(parsed == PARSE_PACKET)
+        {
+            start += parser.GetHeaderLen() + parser.GetPacketLength();
+            ++result->packets;
+        }
+        else if(parsed == PARSE_SKIP || parsed == PARSE_HELLO)
+        {
+            start += skip;
+        }
+        else if(received < length)
+        {
+            received = (length - received > chunkBytes ? received + chunkBytes : length);
+        }
+        else
+        {
+            break;
+        }
+    }
+    result->resyncs += parser.GetResyncCount();
+    result->skippedBytes += parser.GetSkippedBytes();
+}
+
+static void RunBench(const unsigned char* stream, unsigned int length, unsigned int chunkBytes,
+                     BenchResult* result)
+{
+    memset(result, 0, sizeof(BenchResult));
+    unsigned long long startMicros = GetMicros();
+    do
+    {
+        ParseStream(stream, length, chunkBytes, result);
+        ++result->passes;
+        result->micros = GetMicros() - startMicros;
+    }
+    while(result->micros < BENCH_MIN_MICROS);
+}
+
+static bool PrintResult(const char* name, unsigned int length, unsigned int expected, const BenchResult* result)
+{
+    double seconds = (result->micros > 0 ? result->micros / 1000000.0 : 1e-6);
+    unsigned int packets = result->packets / result->passes;
+    printf("parserbench: %-8s %6u/%u packets, %4u resyncs, %8u bytes skipped, %8.1f MB/s, %9.0f packets/s\n",
+           name, packets, expected, result->resyncs / result->passes, result->skippedBytes / result->passes,
+           (double)length * result->passes / seconds / (1024 * 1024), result->packets / seconds);
+    return (packets == expected);
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned int packetCount = (argc > 1 ? atoi(argv[1]) : 2000);
+    unsigned int frameBytes = (argc > 2 ? atoi(argv[2]) : 30000);
+    unsigned int chunkBytes = (argc > 3 ? atoi(argv[3]) : 65536);
+    int corruptPercent = (argc > 4 ? atoi(argv[4]) : 5);
+    if(packetCount == 0 || frameBytes < 8 || chunkBytes == 0)
+    {
+        printf("usage: parserbench [packets [frame bytes [chunk bytes [corrupt percent]]]]\n");
+        return 2;
+    }
+    printf("parserbench: %u frames of ~%u bytes, read in %u byte chunks\n", packetCount, frameBytes, chunkBytes);
+
+    int failed = 0;
+    const char* names[2] = { "clean", "corrupt" };
+    int percents[2] = { 0, corruptPercent };
+    for(int i = 0; i < 2; i++)
+    {
+        unsigned int length = 0;
+        unsigned int corruptCount = 0;
+        BenchResult result;
+        srand(1);
+        unsigned char* stream = MakeStream(packetCount, frameBytes, percents[i], &length, &corruptCount);
+        if(stream == NULL)
+        {
+            printf("parserbench: could not allocate the stream\n");
+            return 1;
+        }
+        RunBench(stream, length, chunkBytes, &result);
+        // every frame but the corrupt ones, and the tables
+        if(!PrintResult(names[i], length, packetCount - corruptCount + 1, &result))
+        {
+            failed = 1;
+        }
+        free(stream);
+    }
+    return failed;
+}
@@ -0,0 +1,354 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// PoolBench.cpp
+
+// Frame rate benchmark of CDecoderPool, not installed. Encodes a few frames
+// the way a phone sends them (the JPEG tables once, then abbreviated frames),
+// decodes a stream of them on pools of one up to the given number of workers
+// and prints the frames per second of each. The output side checks that the
+// frames come out in the order they were submitted, and the same as decoded
+// by a single decoder.
+//
+// usage: poolbench [frames [width height [max workers]]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "DecoderPool.h"
+#include "RawHandler.h"
+
+// different frames in the stream, one after the other
+#define BENCH_FRAME_KINDS 4
+// what the pool scales the frames to, the device frame size
+#define BENCH_OUTPUT_WIDTH 320
+#define BENCH_OUTPUT_HEIGHT 240
+#define BENCH_JPEG_QUALITY 85
+
+typedef struct EncodedFrame
+{
+    unsigned char* data;
+    unsigned long length;
+} EncodedFrame;
+
+// libjpeg destination filling a malloc'd buffer that grows as needed
+typedef struct BufferDest
+{
+    struct jpeg_destination_mgr pub;
+    unsigned char* data;
+    unsigned long capacity;
+} BufferDest;
+
+typedef struct BenchOutput
+{
+    CDecoderPool* pPool;
+    int frameCount;
+    unsigned char* references[BENCH_FRAME_KINDS];
+    int outOfOrder;
+    int wrong;
+    int maxBusyCount;
+    unsigned long long doneMicros;
+} BenchOutput;
+
+static void InitDest(j_compress_ptr cinfo)
+{
+    BufferDest* dest = (BufferDest*) cinfo->dest;
+    dest->capacity = 65536;
+    dest->data = (unsigned char*) malloc(dest->capacity);
+    dest->pub.next_output_byte = dest->data;
+    dest->pub.free_in_buffer = dest->capacity;
+}
+
+static boolean EmptyDest(j_compress_ptr cinfo)
+{
+    BufferDest* dest = (BufferDest*) cinfo->dest;
+    unsigned long used = dest->capacity;
+    dest->capacity *= 2;
+    dest->data = (unsigned char*) realloc(dest->data, dest->capacity);
+    dest->pub.next_output_byte = dest->data + used;
+    dest->pub.free_in_buffer = dest->capacity - used;
+    return TRUE;
+}
+
+static void TermDest(j_compress_ptr cinfo)
+{
+}
+
+static void TakeDest(BufferDest* dest, EncodedFrame* frame)
+{
+    frame->data = dest->data;
+    frame->length = dest->capacity - dest->pub.free_in_buffer;
+    dest->data = NULL;
+}
+
+// Smooth gradients with some noise on top, somewhat like a camera picture
+static void FillPicture(unsigned char* rgb, int width, int height, int kind)
+{
+    for(int y = 0; y < height; y++)
+    {
+        for(int x = 0; x < width; x++)
+        {
+            unsigned char* pixel = rgb + (y * width + x) * 3;
+            int noise = rand() % 24;
+            pixel[0] = (unsigned char)((x * 200 / width + kind * 50 + noise) & 0xFF);
+            pixel[1] = (unsigned char)((y * 200 / height + noise) & 0xFF);
+            pixel[2] = (unsigned char)(((x + y) * 100 / (width + height) + ((x / 64 + y / 64 + kind) & 1) * 80) & 0xFF);
+        }
+    }
+}
+
+// The tables, then one abbreviated frame per kind
+static bool EncodeFrames(int width, int height, EncodedFrame* tables, EncodedFrame* frames)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    BufferDest dest;
+    unsigned char* rgb = (unsigned char*) malloc(width * height * 3);
+    if(rgb == NULL)
+    {
+        return false;
+    }
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    memset(&dest, 0, sizeof(dest));
+    dest.pub.init_destination = InitDest;
+    dest.pub.empty_output_buffer = EmptyDest;
+    dest.pub.term_destination = TermDest;
+    cinfo.dest = &dest.pub;
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, BENCH_JPEG_QUALITY, TRUE);
+    jpeg_write_tables(&cinfo);
+    TakeDest(&dest, tables);
+    for(int kind = 0; kind < BENCH_FRAME_KINDS; kind++)
+    {
+        FillPicture(rgb, width, height, kind);
+        jpeg_suppress_tables(&cinfo, TRUE);
+        jpeg_start_compress(&cinfo, FALSE);
+        while(cinfo.next_scanline < cinfo.image_height)
+        {
+            JSAMPROW row = rgb + cinfo.next_scanline * width * 3;
+            jpeg_write_scanlines(&cinfo, &row, 1);
+        }
+        jpeg_finish_compress(&cinfo);
+        TakeDest(&dest, &frames[kind]);
+    }
+    jpeg_destroy_compress(&cinfo);
+    free(rgb);
+    return true;
+}
+
+static void MakePacket(const EncodedFrame* frame, unsigned int seq, SmartCamPacket* packet)
+{
+    memset(packet, 0, sizeof(SmartCamPacket));
+    packet->type = PACKET_JPEG_DATA;
+    packet->codec = CODEC_JPEG;
+    packet->data = frame->data;
+    packet->length = frame->length;
+    packet->hasSeq = true;
+    packet->seq = seq;
+}
+
+static bool IsSamePicture(GdkPixbuf* pixbuf, const unsigned char* reference)
+{
+    if(pixbuf == NULL || gdk_pixbuf_get_width(pixbuf) != BENCH_OUTPUT_WIDTH ||
+       gdk_pixbuf_get_height(pixbuf) != BENCH_OUTPUT_HEIGHT)
+    {
+        return false;
+    }
+    const unsigned char* pixels = gdk_pixbuf_get_pixels(pixbuf);
+    int rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+    for(int y = 0; y < BENCH_OUTPUT_HEIGHT; y++)
+    {
+        if(memcmp(pixels + y * rowstride, reference + y * BENCH_OUTPUT_WIDTH * 3, BENCH_OUTPUT_WIDTH * 3) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// What one decoder makes of every kind of frame
+static bool DecodeReferences(const EncodedFrame* tables, const EncodedFrame* frames,
+                             unsigned char* references[BENCH_FRAME_KINDS])
+{
+    CJpegHandler jpegHandler;
+    CRawHandler rawHandler(BENCH_OUTPUT_WIDTH, BENCH_OUTPUT_HEIGHT);
+    jpegHandler.setOutputSize(BENCH_OUTPUT_WIDTH, BENCH_OUTPUT_HEIGHT);
+    jpegHandler.decodeHeader(tables->data, tables->length);
+    for(int kind = 0; kind < BENCH_FRAME_KINDS; kind++)
+    {
+        SmartCamPacket packet;
+        int width = 0;
+        int height = 0;
+        MakePacket(&frames[kind], kind, &packet);
+        GdkPixbuf* pixbuf = CDecoderPool::DecodeFrame(&jpegHandler, &rawHandler, &packet, false, BENCH_OUTPUT_WIDTH,
+                                                      BENCH_OUTPUT_HEIGHT, true, &width, &height);
+        if(pixbuf == NULL)
+        {
+            return false;
+        }
+        references[kind] = (unsigned char*) malloc(BENCH_OUTPUT_WIDTH * BENCH_OUTPUT_HEIGHT * 3);
+        const unsigned char* pixels = gdk_pixbuf_get_pixels(pixbuf);
+        for(int y = 0; y < BENCH_OUTPUT_HEIGHT; y++)
+        {
+            memcpy(references[kind] + y * BENCH_OUTPUT_WIDTH * 3, pixels + y * gdk_pixbuf_get_rowstride(pixbuf),
+                   BENCH_OUTPUT_WIDTH * 3);
+        }
+        g_object_unref(pixbuf);
+    }
+    return true;
+}
+
+// The device side: takes the frames in turn, as the session does
+static void* OutputThreadProc(void* args)
+{
+    BenchOutput* output = (BenchOutput*) args;
+    for(int i = 0; i < output->frameCount; i++)
+    {
+        DecodeJob* job = output->pPool->WaitDone();
+        if(job == NULL)
+        {
+            break;
+        }
+        if(job->packet.seq != (unsigned int) i)
+        {
+            ++output->outOfOrder;
+        }
+        if(!IsSamePicture(job->pixbuf, output->references[job->packet.seq % BENCH_FRAME_KINDS]))
+        {
+            ++output->wrong;
+        }
+        output->pPool->ReleaseJob(job);
+    }
+    output->doneMicros = CPacketRing::GetMicros();
+    return NULL;
+}
+
+// Frames per second through a pool of workerCount decoders, 0 on failure
+static double RunPool(int workerCount, int frameCount, const EncodedFrame* tables, const EncodedFrame* frames,
+                      BenchOutput* output)
+{
+    CDecoderPool pool;
+    GError* error = NULL;
+    if(pool.Initialize(workerCount, BENCH_OUTPUT_WIDTH, BENCH_OUTPUT_HEIGHT) != 0)
+    {
+        return 0;
+    }
+    output->pPool = &pool;
+    output->frameCount = frameCount;
+    output->outOfOrder = 0;
+    output->wrong = 0;
+    GThread* outputThread = g_thread_create(OutputThreadProc, output, TRUE, &error);
+    if(outputThread == NULL)
+    {
+        g_printerr("Failed to create output thread: %s\n", error->message);
+        g_error_free(error);
+        return 0;
+    }
+    unsigned long long startMicros = CPacketRing::GetMicros();
+    pool.SetTables(tables->data, tables->length);
+    for(int i = 0; i < frameCount; i++)
+    {
+        SmartCamPacket packet;
+        MakePacket(&frames[i % BENCH_FRAME_KINDS], i, &packet);
+        if(pool.Submit(&packet, true, false, 0) != 0)
+        {
+            break;
+        }
+    }
+    g_thread_join(outputThread);
+    output->maxBusyCount = pool.GetMaxBusyCount();
+    unsigned long long micros = output->doneMicros - startMicros;
+    return (micros > 0 ? frameCount * 1000000.0 / micros : 0);
+}
+
+int main(int argc, char* argv[])
+{
+    int frameCount = (argc > 1 ? atoi(argv[1]) : 240);
+    int width = (argc > 3 ? atoi(argv[2]) : 1920);
+    int height = (argc > 3 ? atoi(argv[3]) : 1080);
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int maxWorkers = (argc > 4 ? atoi(argv[4]) : (int) cores);
+    if(maxWorkers > DECODER_POOL_MAX_WORKERS)
+    {
+        maxWorkers = DECODER_POOL_MAX_WORKERS;
+    }
+    if(frameCount <= 0 || width <= 0 || height <= 0 || maxWorkers <= 0)
+    {
+        printf("usage: poolbench [frames [width height [max workers]]]\n");
+        return 2;
+    }
+    g_thread_init(NULL);
+
+    EncodedFrame tables;
+    EncodedFrame frames[BENCH_FRAME_KINDS];
+    BenchOutput output;
+    memset(&output, 0, sizeof(output));
+    srand(1);
+    if(!EncodeFrames(width, height, &tables, frames) || !DecodeReferences(&tables, frames, output.references))
+    {
+        printf("poolbench: could not make the frames\n");
+        return 1;
+    }
+    printf("poolbench: %d frames of %dx%d (%lu bytes for the first), %ld cores\n",
+           frameCount, width, height, frames[0].length, cores);
+
+    // one worker, then twice as many each time up to maxWorkers
+    int failed = 0;
+    double oneWorkerFps = 0;
+    int workerCount = 1;
+    while(workerCount > 0)
+    {
+        double fps = RunPool(workerCount, frameCount, &tables, frames, &output);
+        if(workerCount == 1)
+        {
+            oneWorkerFps = fps;
+        }
+        printf("poolbench: %2d workers: %7.1f fps, %5.2fx one worker, %2d decoding at most, "
+               "%d out of order, %d wrong\n", workerCount, fps, (oneWorkerFps > 0 ? fps / oneWorkerFps : 0),
+               output.maxBusyCount, output.outOfOrder, output.wrong);
+        if(fps <= 0 || output.outOfOrder != 0 || output.wrong != 0)
+        {
+            failed = 1;
+        }
+        if(workerCount == maxWorkers)
+        {
+            workerCount = 0;
+        }
+        else
+        {
+            workerCount = (workerCount * 2 < maxWorkers ? workerCount * 2 : maxWorkers);
+        }
+    }
+
+    free(tables.data);
+    for(int kind = 0; kind < BENCH_FRAME_KINDS; kind++)
+    {
+        free(frames[kind].data);
+        free(output.references[kind]);
+    }
+    return failed;
+}
@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// RateController.cpp
+
+#include "RateController.h"
+
+#define RATE_MIN_FPS 5
+#define RATE_FPS_STEP 2
+#define RATE_MIN_QUALITY 30
+#define RATE_MAX_QUALITY 85
+#define RATE_START_QUALITY 75
+#define RATE_QUALITY_STEP 5
+#define RATE_QUALITY_DROP 10
+// share of the time the decoder may be busy before the host counts as slow
+#define RATE_MAX_BUSY 0.85f
+// share of the time spent decoding JPEG that makes raw frames worth the
+// bandwidth, and the share of the link capacity they may take
+#define RATE_RAW_BUSY 0.5f
+#define RATE_RAW_LINK_SHARE 0.8f
+// healthy samples needed before probing upwards, and after an undone step
+#define RATE_HEALTHY_SAMPLES 3
+#define RATE_HOLD_SAMPLES 10
+
+static const int RESOLUTIONS[][2] =
+{
+    { 160, 120 },
+    { 240, 180 },
+    { 320, 240 },
+    { 480, 360 },
+    { 640, 480 }
+};
+#define RESOLUTION_COUNT ((int)(sizeof(RESOLUTIONS) / sizeof(RESOLUTIONS[0])))
+
+CRateController::CRateController():
+    maxFps(0),
+    resolutionIndex(0),
+    maxResolutionIndex(0),
+    isRawAllowed(false),
+    lastStep(STEP_NONE),
+    healthySamples(0),
+    holdSamples(0),
+    linkBytesPerSecond(0)
+{
+    params.fps = 0;
+    params.quality = RATE_START_QUALITY;
+    params.width = RESOLUTIONS[0][0];
+    params.height = RESOLUTIONS[0][1];
+    params.isRaw = false;
+}
+
+CRateController::~CRateController()
+{
+}
+
+// Starts from the best the host can use: full frame rate, and the largest
+// resolution that does not exceed the device frame
+void CRateController::Initialize(int fps, int maxWidth, int maxHeight)
+{
+    maxFps = (fps < RATE_MIN_FPS ? RATE_MIN_FPS : fps);
+    maxResolutionIndex = 0;
+    for(int i = 0; i < RESOLUTION_COUNT; i++)
+    {
+        if(RESOLUTIONS[i][0] <= maxWidth && RESOLUTIONS[i][1] <= maxHeight)
+        {
+            maxResolutionIndex = i;
+        }
+    }
+    params.fps = maxFps;
+    params.quality = RATE_START_QUALITY;
+    params.isRaw = false;
+    SetResolution(maxResolutionIndex);
+    isRawAllowed = false;
+    lastStep = STEP_NONE;
+    healthySamples = 0;
+    holdSamples = 0;
+    linkBytesPerSecond = 0;
+}
+
+void CRateController::SetRawAllowed(bool isAllowed)
+{
+    isRawAllowed = isAllowed;
+    if(!isAllowed)
+    {
+        params.isRaw = false;
+    }
+}
+
+// YUV 4:2:0, uncompressed: LZ4 only makes it better
+bool CRateController::CanCarryRaw(int fps, int resolution)
+{
+    unsigned int rawBytesPerSecond = RESOLUTIONS[resolution][0] * RESOLUTIONS[resolution][1] * 3 / 2 * fps;
+    return isRawAllowed &&
+           (linkBytesPerSecond == 0 || rawBytesPerSecond <= linkBytesPerSecond * RATE_RAW_LINK_SHARE);
+}
+
+const StreamParams* CRateController::GetParams()
+{
+    return &params;
+}
+
+void CRateController::SetResolution(int index)
+{
+    resolutionIndex = index;
+    params.width = RESOLUTIONS[index][0];
+    params.height = RESOLUTIONS[index][1];
+}
+
+// Smaller frames: JPEG instead of raw, lower quality, then lower resolution
+bool CRateController::StepDownSize()
+{
+    if(params.isRaw)
+    {
+        params.isRaw = false;
+        return true;
+    }
+    if(params.quality > RATE_MIN_QUALITY)
+    {
+        params.quality -= RATE_QUALITY_DROP;
+        if(params.quality < RATE_MIN_QUALITY)
+        {
+            params.quality = RATE_MIN_QUALITY;
+        }
+        return true;
+    }
+    if(resolutionIndex > 0)
+    {
+        SetResolution(resolutionIndex - 1);
+        return true;
+    }
+    return false;
+}
+
+bool CRateController::StepUp(const RateSample* sample)
+{
+    float busy = sample->fps * sample->decodeMillis / 1000;
+    if(!params.isRaw && busy > RATE_RAW_BUSY && CanCarryRaw(params.fps, resolutionIndex))
+    {
+        params.isRaw = true;
+        lastStep = STEP_RAW;
+        return true;
+    }
+    if(params.fps < maxFps)
+    {
+        int fps = params.fps + RATE_FPS_STEP;
+        if(fps > maxFps)
+        {
+            fps = maxFps;
+        }
+        // the same frames, only more of them: skip if the link cannot carry it
+        if(linkBytesPerSecond == 0 || sample->fps < 1 ||
+           sample->bytesPerSecond / sample->fps * fps <= linkBytesPerSecond)
+        {
+            params.fps = fps;
+            lastStep = STEP_FPS;
+            return true;
+        }
+    }
+    if(linkBytesPerSecond != 0 && sample->bytesPerSecond > linkBytesPerSecond * 0.9f)
+    {
+        return false;
+    }
+    if(params.quality < RATE_MAX_QUALITY && !params.isRaw)
+    {
+        params.quality += RATE_QUALITY_STEP;
+        if(params.quality > RATE_MAX_QUALITY)
+        {
+            params.quality = RATE_MAX_QUALITY;
+        }
+        lastStep = STEP_QUALITY;
+        return true;
+    }
+    if(resolutionIndex < maxResolutionIndex &&
+       (!params.isRaw || CanCarryRaw(params.fps, resolutionIndex + 1)))
+    {
+        SetResolution(resolutionIndex + 1);
+        lastStep = STEP_RESOLUTION;
+        return true;
+    }
+    return false;
+}
+
+bool CRateController::Update(const RateSample* sample)
+{
+    RateStep step = lastStep;
+    float busy = sample->fps * sample->decodeMillis / 1000;
+    lastStep = STEP_NONE;
+
+    // the host falls behind: fewer frames, and smaller ones once the
+    // frame rate is down to the minimum
+    if(sample->queueDepth >= 2 || busy > RATE_MAX_BUSY)
+    {
+        healthySamples = 0;
+        // unless raw frames spare the decoder
+        if(!params.isRaw && CanCarryRaw(params.fps, resolutionIndex))
+        {
+            params.isRaw = true;
+            lastStep = STEP_RAW;
+            return true;
+        }
+        int fps = (int)(sample->fps * 0.8f);
+        if(fps < RATE_MIN_FPS)
+        {
+            fps = RATE_MIN_FPS;
+        }
+        if(fps < params.fps)
+        {
+            params.fps = fps;
+            return true;
+        }
+        return StepDownSize();
+    }
+    // frames lost on the link: make them smaller
+    if(sample->gaps > 0)
+    {
+        healthySamples = 0;
+        linkBytesPerSecond = sample->bytesPerSecond;
+        return StepDownSize();
+    }
+    // the phone does not reach the frame rate asked for
+    if(sample->fps < params.fps * 0.8f)
+    {
+        healthySamples = 0;
+        if(step != STEP_NONE)
+        {
+            holdSamples = RATE_HOLD_SAMPLES;
+        }
+        if(step == STEP_QUALITY)
+        {
+            params.quality -= RATE_QUALITY_STEP;
+            linkBytesPerSecond = sample->bytesPerSecond;
+            return true;
+        }
+        if(step == STEP_RESOLUTION)
+        {
+            SetResolution(resolutionIndex - 1);
+            linkBytesPerSecond = sample->bytesPerSecond;
+            return true;
+        }
+        if(step == STEP_RAW)
+        {
+            params.isRaw = false;
+            linkBytesPerSecond = sample->bytesPerSecond;
+            return true;
+        }
+        int fps = (int)(sample->fps + 0.5f);
+        params.fps = (fps < RATE_MIN_FPS ? RATE_MIN_FPS : fps);
+        if(step == STEP_NONE)
+        {
+            // nothing changed on our side, the link got slower: trade
+            // frame size for frame rate
+            linkBytesPerSecond = sample->bytesPerSecond;
+            StepDownSize();
+        }
+        return true;
+    }
+    if(holdSamples > 0)
+    {
+        --holdSamples;
+        return false;
+    }
+    if(++healthySamples < RATE_HEALTHY_SAMPLES)
+    {
+        return false;
+    }
+    healthySamples = 0;
+    return StepUp(sample);
+}
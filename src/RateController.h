@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// RateController.h
+
+#ifndef __RATE_CONTROLLER_H__
+#define __RATE_CONTROLLER_H__
+
+// What the host asks the phone to send
+typedef struct StreamParams
+{
+    int fps;
+    int quality;
+    int width;
+    int height;
+    // raw YUV frames instead of JPEG ones
+    bool isRaw;
+} StreamParams;
+
+// What the host measured over one FPS sample (about a second)
+typedef struct RateSample
+{
+    float fps;                      // frame rate of the phone
+    float decodeMillis;             // average decode + device write time
+    int queueDepth;                 // most packets seen waiting for the decoder
+    unsigned int gaps;              // frames lost during the sample
+    unsigned int bytesPerSecond;    // payload throughput of the link
+} RateSample;
+
+// Host side of the control channel: adapts the frame rate, JPEG quality and
+// resolution asked from the phone to what the link and the host keep up
+// with. A busy host cuts the frame rate, a lossy link the frame size. When
+// the phone falls short of the frame rate, the last step up is undone, or
+// if there was none the link got slower and the frames are made smaller.
+// Losses and shortfalls record the throughput as the link capacity. After a few
+// healthy samples it probes upwards again, within that capacity: frame
+// rate, quality, resolution.
+// Where the phone may send raw frames, a host busy decoding JPEG trades
+// bandwidth for CPU: it asks for raw frames as long as the link capacity
+// (while unknown: the link, tried out) carries them. Smaller frames start
+// with going back to JPEG.
+class CRateController
+{
+public:
+    CRateController();
+    virtual ~CRateController();
+    void Initialize(int maxFps, int maxWidth, int maxHeight);
+    // whether the phone and the link may carry raw frames, JPEG by default
+    void SetRawAllowed(bool isAllowed);
+    const StreamParams* GetParams();
+    // Returns true if the params changed and have to be sent to the phone
+    bool Update(const RateSample* sample);
+
+private:
+    typedef enum RateStep
+    {
+        STEP_NONE = 0,
+        STEP_FPS = 1,
+        STEP_QUALITY = 2,
+        STEP_RESOLUTION = 3,
+        STEP_RAW = 4
+    } RateStep;
+
+    // Methods:
+    bool StepDownSize();
+    bool StepUp(const RateSample* sample);
+    bool CanCarryRaw(int fps, int resolution);
+    void SetResolution(int index);
+    // Data:
+    StreamParams params;
+    int maxFps;
+    int resolutionIndex;
+    int maxResolutionIndex;
+    bool isRawAllowed;
+    // the increase made by the last sample, undone if the phone falls short
+    RateStep lastStep;
+    int healthySamples;
+    int holdSamples;
+    // throughput at which the link gave up, 0 while unknown
+    unsigned int linkBytesPerSecond;
+};
+
+#endif//__RATE_CONTROLLER_H__
@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// RawHandler.cpp
+
+#include <stdio.h>
+#include <string.h>
+
+#include "RawHandler.h"
+#include "PacketParser.h"
+
+// BT.601 full range, as JPEG: 16.16 fixed point factors
+#define YUV_RV 91881
+#define YUV_GU 22554
+#define YUV_GV 46802
+#define YUV_BU 116130
+
+static inline unsigned char clamp(int value)
+{
+    return (value < 0 ? 0 : (value > 255 ? 255 : value));
+}
+
+CRawHandler::CRawHandler(int width, int height):
+    outWidth(width),
+    outHeight(height),
+    rgbBuffer(NULL),
+    planeBuffer(NULL),
+    planeBufferSize(0),
+    columnMap(NULL),
+    columnMapWidth(0)
+{
+    rgbBuffer = new unsigned char[outWidth * outHeight * 3];
+    columnMap = new int[outWidth];
+}
+
+CRawHandler::~CRawHandler()
+{
+    delete[] rgbBuffer;
+    delete[] planeBuffer;
+    delete[] columnMap;
+}
+
+int CRawHandler::decompressLz4(const unsigned char* src, int srcLen, unsigned char* dst, int dstLen)
+{
+    const unsigned char* ip = src;
+    const unsigned char* ipEnd = src + srcLen;
+    unsigned char* op = dst;
+    unsigned char* opEnd = dst + dstLen;
+    while(ip < ipEnd)
+    {
+        unsigned int token = *ip++;
+        unsigned int length = token >> 4;
+        unsigned int extra = 255;
+        if(length == 15)
+        {
+            while(extra == 255 && length <= (unsigned int) dstLen)
+            {
+                if(ip == ipEnd)
+                {
+                    return -1;
+                }
+                extra = *ip++;
+                length += extra;
+            }
+        }
+        if(length > (unsigned int)(ipEnd - ip) || length > (unsigned int)(opEnd - op))
+        {
+            return -1;
+        }
+        memcpy(op, ip, length);
+        op += length;
+        ip += length;
+        // the last sequence has literals only
+        if(ip == ipEnd)
+        {
+            break;
+        }
+
+        if(ipEnd - ip < 2)
+        {
+            return -1;
+        }
+        unsigned int offset = ip[0] | ((unsigned int)ip[1] << 8);
+        ip += 2;
+        if(offset == 0 || offset > (unsigned int)(op - dst))
+        {
+            return -1;
+        }
+        length = token & 0x0F;
+        extra = 255;
+        if(length == 15)
+        {
+            while(extra == 255 && length <= (unsigned int) dstLen)
+            {
+                if(ip == ipEnd)
+                {
+                    return -1;
+                }
+                extra = *ip++;
+                length += extra;
+            }
+        }
+        length += 4;
+        if(length > (unsigned int)(opEnd - op))
+        {
+            return -1;
+        }
+        // the match may overlap what it produces
+        const unsigned char* match = op - offset;
+        for(unsigned int i = 0; i < length; i++)
+        {
+            op[i] = match[i];
+        }
+        op += length;
+    }
+    return (int)(op - dst);
+}
+
+// Nearest neighbour, like the device frame was always stretched
+void CRawHandler::repack(const unsigned char* y, const unsigned char* u, const unsigned char* v,
+                         int chromaStep, int width, int height)
+{
+    if(columnMapWidth != width)
+    {
+        for(int x = 0; x < outWidth; x++)
+        {
+            columnMap[x] = x * width / outWidth;
+        }
+        columnMapWidth = width;
+    }
+    int chromaStride = width / 2 * chromaStep;
+    unsigned char* out = rgbBuffer;
+    for(int row = 0; row < outHeight; row++)
+    {
+        int srcRow = row * height / outHeight;
+        const unsigned char* yRow = y + srcRow * width;
+        const unsigned char* uRow = u + (srcRow / 2) * chromaStride;
+        const unsigned char* vRow = v + (srcRow / 2) * chromaStride;
+        for(int x = 0; x < outWidth; x++)
+        {
+            int srcX = columnMap[x];
+            int luma = yRow[srcX];
+            int cb = uRow[(srcX / 2) * chromaStep] - 128;
+            int cr = vRow[(srcX / 2) * chromaStep] - 128;
+            out[0] = clamp(luma + ((YUV_RV * cr) >> 16));
+            out[1] = clamp(luma - ((YUV_GU * cb + YUV_GV * cr) >> 16));
+            out[2] = clamp(luma + ((YUV_BU * cb) >> 16));
+            out += 3;
+        }
+    }
+}
+
+unsigned char* CRawHandler::decodeRGB24(const unsigned char* buffer, int size, SmartCamCodec codec, int &width, int &height)
+{
+    if(size < PACKET_RAW_HEADER_LEN)
+    {
+        return NULL;
+    }
+    width = ((int)buffer[0] << 8) | buffer[1];
+    height = ((int)buffer[2] << 8) | buffer[3];
+    int planesLen = width * height * 3 / 2;
+    const unsigned char* planes = buffer + PACKET_RAW_HEADER_LEN;
+    if(codec == CODEC_NV21_LZ4 || codec == CODEC_I420_LZ4)
+    {
+        if(planeBufferSize < planesLen)
+        {
+            delete[] planeBuffer;
+            planeBuffer = new unsigned char[planesLen];
+            planeBufferSize = planesLen;
+        }
+        if(decompressLz4(planes, size - PACKET_RAW_HEADER_LEN, planeBuffer, planesLen) != planesLen)
+        {
+            printf("smartcam: corrupt LZ4 frame\n");
+            return NULL;
+        }
+        planes = planeBuffer;
+        codec = (codec == CODEC_NV21_LZ4 ? CODEC_NV21 : CODEC_I420);
+    }
+    else if(size - PACKET_RAW_HEADER_LEN != planesLen)
+    {
+        return NULL;
+    }
+
+    const unsigned char* chroma = planes + width * height;
+    if(codec == CODEC_NV21)
+    {
+        repack(planes, chroma + 1, chroma, 2, width, height);
+    }
+    else
+    {
+        repack(planes, chroma, chroma + width * height / 4, 1, width, height);
+    }
+    return rgbBuffer;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// RawHandler.h
+
+#ifndef __RAW_HANDLER_H__
+#define __RAW_HANDLER_H__
+
+#include "CommHandler.h"
+
+// Turns a raw codec payload (see PacketParser.h) into the device frame in one
+// pass: the YUV 4:2:0 planes are sampled straight to the output size and
+// converted to RGB24, no JPEG decoder and no pixbuf scaling involved
+class CRawHandler
+{
+public:
+    CRawHandler(int outWidth, int outHeight);
+    ~CRawHandler();
+
+    // RGB24 frame of the output size, NULL for a corrupt payload; width and
+    // height tell the frame size the phone sent
+    unsigned char* decodeRGB24(const unsigned char* buffer, int size, SmartCamCodec codec, int &width, int &height);
+
+    // LZ4 block format; the decompressed length, -1 if the block is corrupt
+    // or does not fit in dstLen
+    static int decompressLz4(const unsigned char* src, int srcLen, unsigned char* dst, int dstLen);
+
+private:
+    void repack(const unsigned char* y, const unsigned char* u, const unsigned char* v,
+                int chromaStep, int width, int height);
+
+    int outWidth;
+    int outHeight;
+    unsigned char* rgbBuffer;
+    // decompressed planes of an LZ4 frame
+    unsigned char* planeBuffer;
+    int planeBufferSize;
+    // source column of every output column, for the last frame width
+    int* columnMap;
+    int columnMapWidth;
+};
+
+#endif//__RAW_HANDLER_H__
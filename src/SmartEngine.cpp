@@ -21,6 +21,7 @@
 
 #include <unistd.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -31,12 +32,25 @@
 #include <gdk/gdkx.h>
 
 #include "SmartEngine.h"
+#include "SmartSession.h"
 #include "CommHandler.h"
+#include "PacketRing.h"
 #include "UIHandler.h"
-#include "JpegHandler.h"
+#include "DecodeGovernor.h"
 #include "smartcam.h"
 
 #define SMARTCAM_DRIVER_NAME "smartcam"
+// private driver ioctl, see driver_src/smartcam.c: CLOCK_MONOTONIC micros
+// to stamp the next frame written with, instead of the write time
+#define VIDIOC_SMARTCAM_S_TIMESTAMP _IOW('V', BASE_VIDIOC_PRIVATE + 0, __u64)
+// hands the last frame written out again as the next one
+#define VIDIOC_SMARTCAM_REPEAT_FRAME _IO('V', BASE_VIDIOC_PRIVATE + 1)
+// how long a client may take with its hello while a session could be joined
+#define HELLO_WAIT_MILLIS 500
+// a TCP/IP peer with this many failed joins, the last one less than
+// JOIN_BLOCK_MILLIS ago, may not join any session
+#define JOIN_MAX_FAILURES 5
+#define JOIN_BLOCK_MILLIS 60000
 
 static void term_handler(int signo)
 {
@@ -46,17 +60,47 @@ static void term_handler(int signo)
 CSmartEngine::CSmartEngine():
         commThread(NULL),
         dbusConnection(NULL),
-        crtWidth(-1),
-        crtHeight(-1),
-        lastSampleTimeMillis(0),
-        crtSampleFrames(0),
-        deviceFd(-1),
+        deviceCount(0),
         isAlive(0),
         pCommHandler(NULL),
-        pJpegHandler(NULL),
         pUIHandler(NULL),
-        crtSettings()
+        crtSettings(),
+        settingsLock(NULL),
+        isSettingsChanged(FALSE),
+        serverSettings(),
+        sessionsLock(NULL),
+        connectedCount(0),
+        previewSession(NULL),
+        previewWidth(-1),
+        previewHeight(-1),
+        listenSocketCount(0),
+        startMicros(0),
+        isFirstFrameShown(FALSE)
 {
+    memset(joinFailures, 0, sizeof(joinFailures));
+    for(int i = 0; i < SMARTCAM_MAX_SESSIONS; i++)
+    {
+        deviceFds[i] = -1;
+        sessions[i] = NULL;
+    }
+    sessionsLock = g_mutex_new();
+    settingsLock = g_mutex_new();
+}
+
+void CSmartEngine::AddListenSocket(int socket)
+{
+    if(listenSocketCount == SMARTCAM_CONN_TYPES)
+    {
+        printf("smartcam: too many inherited sockets, closing fd %d\n", socket);
+        close(socket);
+        return;
+    }
+    listenSockets[listenSocketCount++] = socket;
+}
+
+void CSmartEngine::SetStartMicros(unsigned long long micros)
+{
+    startMicros = micros;
 }
 
 CSmartEngine::~CSmartEngine()
@@ -66,16 +110,21 @@ CSmartEngine::~CSmartEngine()
         delete pCommHandler;
         pCommHandler = NULL;
     }
-    if(pJpegHandler != NULL)
-    {
-        delete pJpegHandler;
-        pJpegHandler = NULL;
-    }
     if(pUIHandler != NULL)
     {
         delete pUIHandler;
         pUIHandler = NULL;
     }
+    if(sessionsLock != NULL)
+    {
+        g_mutex_free(sessionsLock);
+        sessionsLock = NULL;
+    }
+    if(settingsLock != NULL)
+    {
+        g_mutex_free(settingsLock);
+        settingsLock = NULL;
+    }
 }
 
 DBusHandlerResult CSmartEngine::dbus_msg_handler(
@@ -173,10 +222,14 @@ int CSmartEngine::Initialize()
     result = pCommHandler->Initialize();
     if (result != 0)
         return result;
+    for(int i = 0; i < listenSocketCount; i++)
+    {
+        if(pCommHandler->AdoptServerSocket(listenSockets[i]) != 0)
+            close(listenSockets[i]);
+    }
+    listenSocketCount = 0;
 
-    pJpegHandler = new CJpegHandler();
-
-    if(OpenSmartCamDevice() != 0)
+    if(OpenSmartCamDevices() != 0)
     {
         pUIHandler->ShowDeviceErrorDlg();
     }
@@ -184,7 +237,7 @@ int CSmartEngine::Initialize()
     crtSettings = CUserSettings::LoadSettings();
 
     // put logo image in the driver
-    WriteDeviceFrame((const char*) gdk_pixbuf_get_pixels(pUIHandler->GetLogoIcon()), SMARTCAM_FRAME_SIZE);
+    WriteLogoFrames();
 
     return 0;
 }
@@ -199,14 +252,15 @@ void CSmartEngine::Cleanup(gboolean fromSignal)
         dbusConnection = NULL;
     }
     // put logo image in the driver
-    if(pUIHandler != NULL && pUIHandler->GetLogoIcon() != NULL)
+    WriteLogoFrames();
+
+    // close smartcam device files
+    for(int i = 0; i < deviceCount; i++)
     {
-        WriteDeviceFrame((const char*) gdk_pixbuf_get_pixels(pUIHandler->GetLogoIcon()), SMARTCAM_FRAME_SIZE);
+        close(deviceFds[i]);
+        deviceFds[i] = -1;
     }
-
-    // close smartcam device file
-    if(deviceFd != -1)
-        close(deviceFd);
+    deviceCount = 0;
 
     if(pCommHandler != NULL)
         pCommHandler->Cleanup();
@@ -219,59 +273,43 @@ int CSmartEngine::StartUI()
     return pUIHandler->CreateMainWnd();
 }
 
+// Without any listener the thread still waits for a settings change
 void* CSmartEngine::CommThreadProc(void *args)
 {
-    int errCode = 0;
-    int frameSize = 0;
-    int crtBytesRcvd = 0;
-    int totalBytesRcvd = 0;
-
-    GError* error = NULL;
-
+    ConnectionType connType = CONN_BLUETOOTH;
     g_pEngine->StartServer();
 
-ACCEPT_CLIENT:
-    while(1)
+    while(g_pEngine->isAlive)
     {
-        errCode = g_pEngine->AcceptClient();
-        if(errCode == ACCEPT_OK)
-        {
-            break;
-        }
-        else if(errCode == ACCEPT_ERROR)
+        switch(g_pEngine->pCommHandler->WaitEvent(&connType))
         {
-            return NULL;
-        }
-        else if(errCode == ACCEPT_RETRY)
-        {
-            if(g_pEngine->isAlive)
+        case COMM_EVENT_ACCEPT:
+            // a failed listener was closed, the other ones keep serving
+            if(g_pEngine->AcceptClient(connType) == ACCEPT_ERROR &&
+               !g_pEngine->pCommHandler->IsAnyServerStarted())
             {
-                usleep(300000);
+                printf("smartcam: no listener left, waiting for a settings change\n");
             }
-            else
+            break;
+        case COMM_EVENT_ERROR:
+            return NULL;
+        case COMM_EVENT_DATA:
+        case COMM_EVENT_TIMEOUT:
+            // a watched client sent its hello or ran out of time
+            break;
+        default:
+            // woken up: stop (isAlive is checked above), a finished
+            // session waiting to be reaped or new transport settings
+            g_pEngine->ReapSessions(FALSE);
+            if(g_pEngine->TakeSettingsChanged())
             {
-                return NULL;
+                g_pEngine->StartServer();
             }
+            break;
         }
-    }
-
-    while(g_pEngine->isAlive)
-    {
-        errCode = g_pEngine->RcvPacket();
-        if (errCode == 0) // SUCCESS
-        {
-            g_pEngine->ProcessPacket();
-        }
-        else             // ERROR
+        if(g_pEngine->isAlive)
         {
-            if(g_pEngine->isAlive)
-            {
-                goto ACCEPT_CLIENT;
-            }
-            else
-            {
-                return NULL;
-            }
+            g_pEngine->ServeHelloClients();
         }
     }
 
@@ -297,10 +335,13 @@ int CSmartEngine::StartCommThread()
 void CSmartEngine::StopCommThread(gboolean fromSignal)
 {
     isAlive = FALSE;
+    pCommHandler->Wakeup();
     if(!fromSignal)
         gdk_threads_leave();
     if(commThread)
         g_thread_join(commThread);
+    // session threads take the gdk lock too, so stop them before re-entering
+    ReapSessions(TRUE);
     if(!fromSignal)
         gdk_threads_enter();
 
@@ -311,12 +352,19 @@ void CSmartEngine::StopCommThread(gboolean fromSignal)
 
 int CSmartEngine::Disconnect()
 {
-    return pCommHandler->Disconnect();
+    g_mutex_lock(sessionsLock);
+    for(int i = 0; i < SMARTCAM_MAX_SESSIONS; i++)
+    {
+        if(sessions[i] != NULL)
+            sessions[i]->RequestDisconnect();
+    }
+    g_mutex_unlock(sessionsLock);
+    return 0;
 }
 
 gboolean CSmartEngine::IsConnected()
 {
-    return pCommHandler->IsConnected();
+    return connectedCount > 0;
 }
 
 int CSmartEngine::xioctl(int fd, int request, void *arg)
@@ -329,12 +377,15 @@ int CSmartEngine::xioctl(int fd, int request, void *arg)
     return r;
 }
 
-int CSmartEngine::OpenSmartCamDevice()
+// Collects every smartcam video device, one per phone that can be served
+int CSmartEngine::OpenSmartCamDevices()
 {
     int crt_video_dev = 0;
-    char dev_name[12];
+    int deviceFd = -1;
+    char dev_name[16];
 
-    for(crt_video_dev = 0; crt_video_dev < 10; crt_video_dev++)
+    deviceCount = 0;
+    for(crt_video_dev = 0; crt_video_dev < 64 && deviceCount < SMARTCAM_MAX_SESSIONS; crt_video_dev++)
     {
         struct stat st;
         struct v4l2_capability v4l2cap;
@@ -344,7 +395,8 @@ int CSmartEngine::OpenSmartCamDevice()
         sprintf(dev_name, "%s%d", "/dev/video", crt_video_dev);
         if(-1 == stat(dev_name, &st))
         {
-            printf("Cannot identify '%s': %d, %s\n", dev_name, errno, strerror(errno));
+            if(errno != ENOENT)
+                printf("Cannot identify '%s': %d, %s\n", dev_name, errno, strerror(errno));
             continue;
         }
 
@@ -376,102 +428,311 @@ int CSmartEngine::OpenSmartCamDevice()
             close(deviceFd);
             continue;
         }
-        // found the smartcam device
+        // found a smartcam device
         else
         {
             printf("Found smartcam device file: %s\n", dev_name);
-            return 0;
+            deviceFds[deviceCount++] = deviceFd;
         }
     }
-    return -1;
+    return (deviceCount > 0 ? 0 : -1);
+}
+
+void CSmartEngine::WriteLogoFrames()
+{
+    const char* logoFrame = GetLogoFrame();
+    for(int i = 0; i < deviceCount; i++)
+    {
+        WriteDeviceFrame(deviceFds[i], logoFrame, SMARTCAM_FRAME_SIZE);
+    }
 }
 
+// Brings the listeners in line with the settings: starts the wanted ones
+// that are not listening yet, stops or restarts the others. Only the comm
+// thread calls it, accepted sessions are never touched.
 int CSmartEngine::StartServer()
 {
-    int result = 0;
-    if (crtSettings.connectionType == CONN_INET)
-        result = pCommHandler->StartInetServer(crtSettings.inetPort);
-    else if (crtSettings.connectionType == CONN_BLUETOOTH)
-        result = pCommHandler->StartBtServer();
+    CUserSettings settings = GetSettings();
+    for(int i = 0; i < SMARTCAM_CONN_TYPES; i++)
+    {
+        ConnectionType connType = (ConnectionType) i;
+        // an inherited listener is what we were started for
+        gboolean isWanted = (settings.listenAll || settings.connectionType == connType ||
+                             pCommHandler->IsServerInherited(connType));
+        gboolean isChanged = (settings.rcvBufSize != serverSettings.rcvBufSize);
+        if(connType == CONN_BLUETOOTH)
+            isChanged = isChanged || (settings.l2capMode != serverSettings.l2capMode);
+        else
+            isChanged = isChanged || (settings.inetPort != serverSettings.inetPort);
+
+        if(pCommHandler->IsServerStarted(connType) && (!isWanted || isChanged))
+            pCommHandler->StopServer(connType);
+        if(!isWanted || pCommHandler->IsServerStarted(connType))
+            continue;
+        if(connType == CONN_INET)
+            pCommHandler->StartInetServer(settings.inetPort, settings.rcvBufSize);
+        else if(connType == CONN_BLUETOOTH)
+            pCommHandler->StartBtServer(settings.rcvBufSize, settings.l2capMode);
+        else if(connType == CONN_UDP)
+            pCommHandler->StartUdpServer(settings.inetPort, settings.rcvBufSize);
+    }
+    serverSettings = settings;
+    if(!pCommHandler->IsAnyServerStarted())
+    {
+        printf("smartcam: not listening on any connection\n");
+        return -1;
+    }
+    return 0;
+}
+
+gboolean CSmartEngine::TakeSettingsChanged()
+{
+    g_mutex_lock(settingsLock);
+    gboolean result = isSettingsChanged;
+    isSettingsChanged = FALSE;
+    g_mutex_unlock(settingsLock);
     return result;
 }
 
-AcceptResultCode CSmartEngine::AcceptClient()
+AcceptResultCode CSmartEngine::AcceptClient(ConnectionType connType)
 {
     AcceptResultCode result = ACCEPT_OK;
-    if(crtSettings.connectionType == CONN_INET)
+    int clientSocket = INVALID_SOCKET;
+    if(connType == CONN_INET)
     {
-        result = pCommHandler->AcceptInetClient();
+        result = pCommHandler->AcceptInetClient(&clientSocket);
     }
-    else if(crtSettings.connectionType == CONN_BLUETOOTH)
+    else if(connType == CONN_BLUETOOTH)
     {
-        result = pCommHandler->AcceptBtClient();
+        result = pCommHandler->AcceptBtClient(&clientSocket);
     }
-    return result;
+    else if(connType == CONN_UDP)
+    {
+        result = pCommHandler->AcceptUdpClient(&clientSocket);
+    }
+    if(result != ACCEPT_OK)
+    {
+        return result;
+    }
+    // another connection of a multipath stream or a phone coming back joins
+    // its session, it needs no device of its own; its hello is waited for on
+    // the comm thread's epoll set, other phones are not held up meanwhile
+    if(connType != CONN_UDP && IsJoinPossible() &&
+       pCommHandler->WatchHello(clientSocket, connType, HELLO_WAIT_MILLIS) == 0)
+    {
+        return ACCEPT_OK;
+    }
+    return StartSession(clientSocket, connType);
 }
 
-int CSmartEngine::RcvPacket()
+// Gives a client a session of its own
+AcceptResultCode CSmartEngine::StartSession(int clientSocket, ConnectionType connType)
 {
-    return pCommHandler->RcvPacket();
+    // session i feeds device i; without any device still serve one phone
+    // so that the preview works
+    int maxSessions = (deviceCount > 0 ? deviceCount : 1);
+    int sessionId = -1;
+    g_mutex_lock(sessionsLock);
+    for(int i = 0; i < maxSessions; i++)
+    {
+        if(sessions[i] == NULL)
+        {
+            sessionId = i;
+            break;
+        }
+    }
+    g_mutex_unlock(sessionsLock);
+    if(sessionId == -1)
+    {
+        printf("smartcam: all %d smartcam devices are busy, rejecting client\n", maxSessions);
+        close(clientSocket);
+        return ACCEPT_RETRY;
+    }
+
+    CSmartSession* pSession = new CSmartSession(this, sessionId, deviceFds[sessionId]);
+    g_mutex_lock(sessionsLock);
+    sessions[sessionId] = pSession;
+    g_mutex_unlock(sessionsLock);
+    if(pSession->Start(clientSocket, connType) != 0)
+    {
+        g_mutex_lock(sessionsLock);
+        sessions[sessionId] = NULL;
+        g_mutex_unlock(sessionsLock);
+        delete pSession;    // closes the client socket
+        return ACCEPT_RETRY;
+    }
+    return ACCEPT_OK;
 }
 
-void CSmartEngine::ProcessPacket()
+// Whether a multipath stream is live or a session holds a resume token;
+// only then are new clients' hellos waited for
+gboolean CSmartEngine::IsJoinPossible()
 {
-    if(pCommHandler->GetRcvPacketType() == PACKET_JPEG_HEDAER)
+    gboolean isJoinable = FALSE;
+    g_mutex_lock(sessionsLock);
+    for(int i = 0; i < SMARTCAM_MAX_SESSIONS; i++)
     {
-        pJpegHandler->decodeHeader(pCommHandler->GetRcvPacket(), pCommHandler->GetRcvPacketLen());
+        if(sessions[i] != NULL && (sessions[i]->GetMultipathId() != 0 || sessions[i]->GetResumeToken() != 0))
+        {
+            isJoinable = TRUE;
+        }
     }
-    else if(pCommHandler->GetRcvPacketType() == PACKET_JPEG_DATA)
+    g_mutex_unlock(sessionsLock);
+    return isJoinable;
+}
+
+// The watched clients that are done waiting join their session, or get one
+// of their own
+void CSmartEngine::ServeHelloClients()
+{
+    ConnectionType connType = CONN_BLUETOOTH;
+    unsigned int flags = 0;
+    unsigned int helloId = 0;
+    unsigned long long secret = 0;
+    int clientSocket = INVALID_SOCKET;
+    while((clientSocket = pCommHandler->TakeHelloClient(&connType, &flags, &helloId, &secret)) != INVALID_SOCKET)
     {
-        int w = 0, h = 0;
-        GdkPixbuf* pixbuf = NULL, * scaledPixbuf = NULL;
-        unsigned char* driverBufferRgb24 = NULL;
-        unsigned char* rgb24 = pJpegHandler->decodeRGB24(pCommHandler->GetRcvPacket(), pCommHandler->GetRcvPacketLen(), w, h);
-        if(rgb24 == NULL)
+        if(!JoinSession(clientSocket, connType, flags, helloId, secret))
         {
-            return; // error, maybe just disconnected...
+            StartSession(clientSocket, connType);
         }
-        gdk_threads_enter();
-        pixbuf = gdk_pixbuf_new_from_data(rgb24, GDK_COLORSPACE_RGB, FALSE, 8, w, h, w * 3, NULL, NULL);
-        if(w != SMARTCAM_FRAME_WIDTH || h != SMARTCAM_FRAME_HEIGHT)
+    }
+}
+
+// Tries a client whose hello (flags 0 if it has none that joins) came in.
+// TRUE once the connection is taken care of: joined to its session, or
+// closed because its peer failed too often or its phone's old connection
+// is still up.
+gboolean CSmartEngine::JoinSession(int clientSocket, ConnectionType connType, unsigned int flags,
+                                   unsigned int helloId, unsigned long long secret)
+{
+    if(!(flags & (HELLO_FLAG_MULTIPATH | HELLO_FLAG_RESUME)))
+    {
+        return FALSE;
+    }
+    JoinFailure* failure = FindJoinFailure(clientSocket, false);
+    if(failure != NULL && failure->count >= JOIN_MAX_FAILURES)
+    {
+        failure->lastMillis = (unsigned long)(CPacketRing::GetMicros() / 1000);
+        printf("smartcam: too many failed joins from this peer, closing its connection\n");
+        close(clientSocket);
+        return TRUE;
+    }
+    gboolean isJoined = FALSE;
+    gboolean isResumed = FALSE;
+    g_mutex_lock(sessionsLock);
+    for(int i = 0; i < SMARTCAM_MAX_SESSIONS; i++)
+    {
+        if(sessions[i] == NULL || sessions[i]->IsFinished())
         {
-            scaledPixbuf = gdk_pixbuf_scale_simple(
-                                pixbuf, SMARTCAM_FRAME_WIDTH, SMARTCAM_FRAME_HEIGHT, GDK_INTERP_BILINEAR);
-            g_object_unref(pixbuf);
-            pixbuf = NULL;
-            driverBufferRgb24 = gdk_pixbuf_get_pixels(scaledPixbuf);
+            continue;
         }
-        else // do not scale, use original buffer/pixbuf
+        if((flags & HELLO_FLAG_MULTIPATH) && sessions[i]->GetMultipathId() == helloId && secret != 0 &&
+           sessions[i]->GetMultipathSecret() == secret)
         {
-            scaledPixbuf = pixbuf;
-            driverBufferRgb24 = rgb24;
+            isJoined = (sessions[i]->AddPath(clientSocket, connType) == 0);
+            break;
         }
-        gdk_threads_leave();
-        // write the frame in the driverb
-        WriteDeviceFrame((const char*)driverBufferRgb24, SMARTCAM_FRAME_SIZE);
-        // draw the frame
-        gdk_threads_enter();
-        pUIHandler->DrawFrame(scaledPixbuf);
-        gdk_threads_leave();
-        g_object_unref(scaledPixbuf);
-        scaledPixbuf = NULL;
-        SampleFPS();
+        if((flags & HELLO_FLAG_RESUME) && secret != 0 && sessions[i]->GetResumeToken() == secret)
+        {
+            // the old connection is not found dead yet: the phone tries again
+            if(sessions[i]->Resume(clientSocket, connType) != 0)
+            {
+                close(clientSocket);
+            }
+            isResumed = TRUE;
+            break;
+        }
+    }
+    g_mutex_unlock(sessionsLock);
+    if(isResumed)
+    {
+        return TRUE;
+    }
+    if(!isJoined)
+    {
+        failure = FindJoinFailure(clientSocket, true);
+        if(failure != NULL)
+        {
+            failure->count++;
+            failure->lastMillis = (unsigned long)(CPacketRing::GetMicros() / 1000);
+        }
+    }
+    return isJoined;
+}
 
-        // Update resolution status bar message
-        if(crtWidth != w || crtHeight != h)
+// The failed joins of a TCP/IP client's peer, or with isAdded a fresh
+// record (the oldest one is reused); NULL for other clients. Records older
+// than JOIN_BLOCK_MILLIS are forgotten.
+JoinFailure* CSmartEngine::FindJoinFailure(int clientSocket, bool isAdded)
+{
+    struct sockaddr_in peerAddr;
+    socklen_t len = sizeof(peerAddr);
+    if(getpeername(clientSocket, (struct sockaddr*) &peerAddr, &len) != 0 || peerAddr.sin_family != AF_INET)
+    {
+        return NULL;
+    }
+    unsigned long nowMillis = (unsigned long)(CPacketRing::GetMicros() / 1000);
+    JoinFailure* reused = NULL;
+    for(int i = 0; i < JOIN_FAILURE_SLOTS; i++)
+    {
+        if(joinFailures[i].count > 0 && nowMillis - joinFailures[i].lastMillis >= JOIN_BLOCK_MILLIS)
         {
-            crtWidth = w;
-            crtHeight = h;
-            gdk_threads_enter();
-            pUIHandler->UpdateStatusbarResolution(crtWidth, crtHeight);
-            gdk_threads_leave();
+            joinFailures[i].count = 0;
+        }
+        if(joinFailures[i].count > 0 && joinFailures[i].peerAddr == peerAddr.sin_addr.s_addr)
+        {
+            return &joinFailures[i];
+        }
+        // a free record, or else the one that failed longest ago
+        if(reused == NULL || (reused->count != 0 &&
+           (joinFailures[i].count == 0 || joinFailures[i].lastMillis < reused->lastMillis)))
+        {
+            reused = &joinFailures[i];
         }
     }
+    if(!isAdded)
+    {
+        return NULL;
+    }
+    reused->peerAddr = peerAddr.sin_addr.s_addr;
+    reused->count = 0;
+    return reused;
 }
 
-void CSmartEngine::WriteDeviceFrame(const char* frameData, int frameLength)
+// Stops and deletes the finished sessions, or all of them on shutdown.
+// Called from the comm thread (or after it was joined), never from a session.
+void CSmartEngine::ReapSessions(gboolean all)
 {
-    if(deviceFd == -1)
+    CSmartSession* reaped[SMARTCAM_MAX_SESSIONS];
+    int reapedCount = 0;
+
+    g_mutex_lock(sessionsLock);
+    for(int i = 0; i < SMARTCAM_MAX_SESSIONS; i++)
+    {
+        if(sessions[i] != NULL && (all || sessions[i]->IsFinished()))
+        {
+            if(previewSession == sessions[i])
+                previewSession = NULL;
+            reaped[reapedCount++] = sessions[i];
+            sessions[i] = NULL;
+        }
+    }
+    if(all)
+        connectedCount = 0;
+    g_mutex_unlock(sessionsLock);
+
+    // join outside the lock, the session threads call back into the engine
+    for(int i = 0; i < reapedCount; i++)
+    {
+        reaped[i]->Stop();
+        delete reaped[i];
+    }
+}
+
+void CSmartEngine::WriteDeviceFrame(int deviceFd, const char* frameData, int frameLength)
+{
+    if(deviceFd == -1 || frameData == NULL)
     {
         return;
     }
@@ -485,60 +746,262 @@ void CSmartEngine::WriteDeviceFrame(const char* frameData, int frameLength)
             printf("smartcam: error writing device frame: %s\n", strerror(errno));
             return;
         }
-        else
+        else if(result > 0)
         {
             size -= result;
         }
     }
 }
 
-void CSmartEngine::SampleFPS()
+int CSmartEngine::SetDeviceTimestamp(int deviceFd, unsigned long long monotonicMicros)
 {
-    struct timeval now = {0};
-    if(gettimeofday(&now, NULL))
+    __u64 micros = monotonicMicros;
+    if(deviceFd == -1)
     {
-        return;
+        return -1;
+    }
+    return xioctl(deviceFd, VIDIOC_SMARTCAM_S_TIMESTAMP, &micros);
+}
+
+int CSmartEngine::RepeatDeviceFrame(int deviceFd)
+{
+    if(deviceFd == -1)
+    {
+        return 0;
+    }
+    return xioctl(deviceFd, VIDIOC_SMARTCAM_REPEAT_FRAME, NULL);
+}
+
+const char* CSmartEngine::GetLogoFrame()
+{
+    if(pUIHandler == NULL || pUIHandler->GetLogoIcon() == NULL)
+    {
+        return NULL;
+    }
+    return (const char*) gdk_pixbuf_get_pixels(pUIHandler->GetLogoIcon());
+}
+
+// Formats into text after its first length chars, cut off to fit size;
+// returns the new length
+int CSmartEngine::AppendText(char* text, int size, int length, const char* format, ...)
+{
+    if(length >= size - 1)
+    {
+        return size - 1;
+    }
+    va_list args;
+    va_start(args, format);
+    int count = vsnprintf(text + length, size - length, format, args);
+    va_end(args);
+    if(count < 0)
+    {
+        return length;
+    }
+    return (length + count < size - 1 ? length + count : size - 1);
+}
+
+// Refreshes the connection and FPS labels from the live sessions,
+// e.g. "Connected (2)" and "FPS: 29.9 | 15.0", or for a single session
+// "FPS: 29.97 (42 ms, 3 lost, 5 skipped, full quality)" with the decode
+// tier, the cheapest one of them for several sessions; "Reconnecting"
+// while a phone is gone but its session waits for it. Call with the gdk
+// lock held.
+void CSmartEngine::UpdateStatusbarSessions()
+{
+    char conn_str[30];
+    char fps_str[48 + SMARTCAM_MAX_SESSIONS * 8];
+    int fpsLen = 0;
+    int liveCount = 0;
+    int suspendedCount = 0;
+    float lastFps = 0;
+    float lastLatency = 0;
+    unsigned int lastGaps = 0;
+    unsigned int lastDropped = 0;
+    int decodeTier = JPEG_TIER_FULL;
+    int lastMotion = -1;
+    gboolean isLastStill = FALSE;
+
+    memset(fps_str, 0, sizeof(fps_str));
+    fpsLen = AppendText(fps_str, sizeof(fps_str), 0, "FPS:");
+    g_mutex_lock(sessionsLock);
+    for(int i = 0; i < SMARTCAM_MAX_SESSIONS; i++)
+    {
+        if(sessions[i] == NULL || sessions[i]->IsFinished())
+            continue;
+        lastFps = sessions[i]->GetFps();
+        lastLatency = sessions[i]->GetLatencyMillis();
+        lastGaps = sessions[i]->GetGapCount();
+        lastDropped = sessions[i]->GetDroppedCount();
+        lastMotion = sessions[i]->GetMotionScore();
+        isLastStill = sessions[i]->IsStill();
+        if(sessions[i]->GetDecodeTier() > decodeTier)
+        {
+            decodeTier = sessions[i]->GetDecodeTier();
+        }
+        if(sessions[i]->IsSuspended())
+        {
+            ++suspendedCount;
+        }
+        fpsLen = AppendText(fps_str, sizeof(fps_str), fpsLen, (liveCount == 0 ? " %.1f" : " | %.1f"), lastFps);
+        ++liveCount;
+    }
+    if(liveCount == 1)
+    {
+        fpsLen = AppendText(fps_str, sizeof(fps_str), 0, "FPS: %.2f (%.0f ms, %u lost, %u skipped, %s", lastFps,
+                            lastLatency, lastGaps, lastDropped,
+                            CDecodeGovernor::GetTierName((JpegDecodeTier) decodeTier));
+        if(lastMotion >= 0)
+        {
+            fpsLen = AppendText(fps_str, sizeof(fps_str), fpsLen, (isLastStill ? ", still" : ", motion %d%%"),
+                                lastMotion);
+        }
+        AppendText(fps_str, sizeof(fps_str), fpsLen, ")");
+    }
+    else
+    {
+        AppendText(fps_str, sizeof(fps_str), fpsLen, " (%s)", CDecodeGovernor::GetTierName((JpegDecodeTier) decodeTier));
     }
-    unsigned long nowMillis = now.tv_sec * 1000 + now.tv_usec/1000;
-    if(lastSampleTimeMillis == 0)
+    if(suspendedCount > 0)
+    {
+        snprintf(conn_str, sizeof(conn_str), "Reconnecting");
+    }
+    else
+    {
+        snprintf(conn_str, sizeof(conn_str), (connectedCount > 1 ? "Connected (%d)" : "Connected"), connectedCount);
+    }
+    g_mutex_unlock(sessionsLock);
+
+    if(liveCount == 0)
     {
-        lastSampleTimeMillis = nowMillis;
         return;
     }
-    unsigned long elapsedMillis = nowMillis - lastSampleTimeMillis;
-    if(elapsedMillis >= 1000)
+    pUIHandler->UpdateStatusbarConnLabel(conn_str);
+    pUIHandler->UpdateStatusbarFps(fps_str);
+}
+
+void CSmartEngine::OnConnected(CSmartSession* pSession)
+{
+    int count = 0;
+    g_mutex_lock(sessionsLock);
+    count = ++connectedCount;
+    if(previewSession == NULL)
+    {
+        previewSession = pSession;
+        previewWidth = -1;
+        previewHeight = -1;
+    }
+    g_mutex_unlock(sessionsLock);
+
+    printf("smartcam: session %d connected\n", pSession->GetId());
+    if(count == 1)
+    {
+        pUIHandler->UpdateOnConnected();
+    }
+    gdk_threads_enter();
+    // the icon shows the transport the previewed phone came in on
+    if(previewSession == pSession)
     {
-        float fps = ((float)crtSampleFrames * 1000)/elapsedMillis;
-        char fps_str[30];
-        memset(fps_str, 0, 30);
-        sprintf(fps_str, "FPS: %.2f", fps);
+        pUIHandler->UpdateStatusbarConnIcon(pSession->GetConnectionType());
+    }
+    UpdateStatusbarSessions();
+    gdk_threads_leave();
+}
+
+void CSmartEngine::OnDisconnected(CSmartSession* pSession)
+{
+    int count = 0;
+    g_mutex_lock(sessionsLock);
+    count = --connectedCount;
+    // hand the preview over to another live session
+    if(previewSession == pSession)
+    {
+        previewSession = NULL;
+        previewWidth = -1;
+        previewHeight = -1;
+        for(int i = 0; i < SMARTCAM_MAX_SESSIONS; i++)
+        {
+            if(sessions[i] != NULL && !sessions[i]->IsFinished())
+            {
+                previewSession = sessions[i];
+                break;
+            }
+        }
+    }
+    g_mutex_unlock(sessionsLock);
+
+    printf("smartcam: session %d disconnected\n", pSession->GetId());
+    if(count == 0)
+    {
+        pUIHandler->UpdateOnDisconnected();
         gdk_threads_enter();
-        pUIHandler->UpdateStatusbarFps(fps_str);
+        pUIHandler->UpdateStatusbarConnIcon(GetSettings().connectionType);
         gdk_threads_leave();
-        lastSampleTimeMillis = nowMillis;
-        crtSampleFrames = 0;
+        return;
     }
-    else
+    gdk_threads_enter();
+    UpdateStatusbarSessions();
+    gdk_threads_leave();
+}
+
+void CSmartEngine::OnSessionFinished(CSmartSession* pSession)
+{
+    // let the comm thread reap it
+    pCommHandler->Wakeup();
+}
+
+void CSmartEngine::OnFrame(CSmartSession* pSession, GdkPixbuf* frame)
+{
+    gboolean isPreview = FALSE;
+    gboolean isResized = FALSE;
+    gboolean isFirstFrame = FALSE;
+    g_mutex_lock(sessionsLock);
+    isFirstFrame = !isFirstFrameShown;
+    isFirstFrameShown = TRUE;
+    isPreview = (previewSession == pSession);
+    if(isPreview && (previewWidth != pSession->GetWidth() || previewHeight != pSession->GetHeight()))
+    {
+        previewWidth = pSession->GetWidth();
+        previewHeight = pSession->GetHeight();
+        isResized = TRUE;
+    }
+    g_mutex_unlock(sessionsLock);
+    if(isFirstFrame && startMicros != 0)
+    {
+        printf("smartcam: cold start to first frame: %llu ms\n",
+               (CPacketRing::GetMicros() - startMicros) / 1000);
+    }
+    if(!isPreview)
+    {
+        return;
+    }
+
+    gdk_threads_enter();
+    pUIHandler->DrawFrame(frame);
+    // Update resolution status bar message
+    if(isResized)
     {
-        ++crtSampleFrames;
+        pUIHandler->UpdateStatusbarResolution(pSession->GetWidth(), pSession->GetHeight());
     }
+    gdk_threads_leave();
 }
 
-void CSmartEngine::OnConnected()
+void CSmartEngine::OnFpsSampled(CSmartSession* pSession)
 {
-    crtSampleFrames = 0;
-    lastSampleTimeMillis = 0;
-    pUIHandler->UpdateOnConnected();
+    gdk_threads_enter();
+    UpdateStatusbarSessions();
+    gdk_threads_leave();
 }
 
-void CSmartEngine::OnDisconnected()
+void CSmartEngine::OnReconnecting(CSmartSession* pSession)
 {
-    crtWidth = -1;
-    crtHeight = -1;
-    crtSampleFrames = 0;
-    lastSampleTimeMillis = 0;
-    WriteDeviceFrame((const char*) gdk_pixbuf_get_pixels(pUIHandler->GetLogoIcon()), SMARTCAM_FRAME_SIZE);
-    pUIHandler->UpdateOnDisconnected();
+    gdk_threads_enter();
+    // a phone may come back on another transport
+    if(previewSession == pSession && !pSession->IsSuspended())
+    {
+        pUIHandler->UpdateStatusbarConnIcon(pSession->GetConnectionType());
+    }
+    UpdateStatusbarSessions();
+    gdk_threads_leave();
 }
 
 GtkWidget* CSmartEngine::GetMainWindow()
@@ -600,23 +1063,31 @@ void CSmartEngine::ShowSettingsDlg(void)
 
 CUserSettings CSmartEngine::GetSettings()
 {
-    return crtSettings;
+    g_mutex_lock(settingsLock);
+    CUserSettings settings = crtSettings;
+    g_mutex_unlock(settingsLock);
+    return settings;
 }
 
+// Transport changes are applied by the comm thread the next time it wakes
+// up: only the affected listeners restart, connected phones keep streaming
 void CSmartEngine::SaveSettings(CUserSettings settings)
 {
-    if((crtSettings.connectionType != settings.connectionType) ||
-       (crtSettings.inetPort != settings.inetPort))
+    CUserSettings oldSettings = GetSettings();
+    if((oldSettings.connectionType == settings.connectionType) &&
+       (oldSettings.inetPort == settings.inetPort) &&
+       (oldSettings.listenAll == settings.listenAll))
     {
-        CUserSettings::SaveSettings(settings);
-        CUserSettings oldSettings = crtSettings;
-        crtSettings = settings;
-        if((oldSettings.connectionType != settings.connectionType) ||
-           (oldSettings.inetPort != settings.inetPort))
-        {
-            pUIHandler->UpdateStatusbarConnIcon(settings.connectionType);
-            StopCommThread(FALSE);
-            StartCommThread();
-        }
+        return;
+    }
+    CUserSettings::SaveSettings(settings);
+    g_mutex_lock(settingsLock);
+    crtSettings = settings;
+    isSettingsChanged = TRUE;
+    g_mutex_unlock(settingsLock);
+    if(connectedCount == 0)
+    {
+        pUIHandler->UpdateStatusbarConnIcon(settings.connectionType);
     }
+    pCommHandler->Wakeup();
 }
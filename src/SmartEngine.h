@@ -27,6 +27,7 @@
 
 #include "CommHandler.h"
 #include "UserSettings.h"
+#include "smartcam.h"
 
 // SmartCam DBus service
 #define SMARTCAM_DBUS_SERVICE                               "org.gnome.smartcam"
@@ -37,22 +38,44 @@
 // SmartCam DBus bring to front method
 #define SMARTCAM_DBUS_BRING_TO_FRONT_METHOD_NAME            "bring_to_front"
 
+// TCP/IP peers whose failed joins are remembered
+#define JOIN_FAILURE_SLOTS 16
+
 class CUIHandler;
-class CJpegHandler;
+class CSmartSession;
+
+// Join hellos (resume or multipath) of one TCP/IP peer that no session took
+typedef struct JoinFailure
+{
+    in_addr_t peerAddr;
+    int count;
+    unsigned long lastMillis;
+} JoinFailure;
 
 class CSmartEngine
 {
 public:
     CSmartEngine();
     virtual ~CSmartEngine();
+    // Before Initialize(): a listener handed over by whoever started us, and
+    // when the process started, to measure the cold start to the first frame
+    void AddListenSocket(int socket);
+    void SetStartMicros(unsigned long long micros);
     int Initialize();
     void Cleanup(gboolean fromSignal);
     int StartUI();
     int StartCommThread();
     void StopCommThread(gboolean fromSignal);
     int Disconnect();
-    void OnConnected();
-    void OnDisconnected();
+    // Session callbacks (called from the session threads):
+    void OnConnected(CSmartSession* pSession);
+    void OnDisconnected(CSmartSession* pSession);
+    void OnSessionFinished(CSmartSession* pSession);
+    void OnFrame(CSmartSession* pSession, GdkPixbuf* frame);
+    void OnFpsSampled(CSmartSession* pSession);
+    // the phone of a live session is gone and may come back, or came back
+    void OnReconnecting(CSmartSession* pSession);
+    const char* GetLogoFrame();
     GtkWidget* GetMainWindow();
     void ShowMainWindow();
     void HideMainWindow();
@@ -67,19 +90,37 @@ public:
     CUserSettings GetSettings();
     void SaveSettings(CUserSettings settings);
     void ExitApp(gboolean fromSignal);
+    static void WriteDeviceFrame(int deviceFd, const char* frameData, int frameLength);
+    // Capture time of the next frame written, -1 if the driver does not
+    // take it (older driver): the frame is stamped when written then
+    static int SetDeviceTimestamp(int deviceFd, unsigned long long monotonicMicros);
+    // Shows the last frame written once more, as a new frame; -1 if the
+    // driver cannot (older driver): the frame has to be written again then
+    static int RepeatDeviceFrame(int deviceFd);
+
+    static const int SMARTCAM_FRAME_WIDTH = 320;
+    static const int SMARTCAM_FRAME_HEIGHT = 240;
+    static const int SMARTCAM_FRAME_SIZE = SMARTCAM_FRAME_WIDTH * SMARTCAM_FRAME_HEIGHT * 3;
 
 private:
     // Methods:
-    int OpenSmartCamDevice();
+    int OpenSmartCamDevices();
+    void WriteLogoFrames();
     int StartServer();
-    AcceptResultCode AcceptClient();
-    int RcvPacket();
-    void ProcessPacket();
-    void WriteDeviceFrame(const char* frame_data, int frame_length);
-    void SampleFPS();
+    gboolean TakeSettingsChanged();
+    AcceptResultCode AcceptClient(ConnectionType connType);
+    AcceptResultCode StartSession(int clientSocket, ConnectionType connType);
+    gboolean IsJoinPossible();
+    void ServeHelloClients();
+    gboolean JoinSession(int clientSocket, ConnectionType connType, unsigned int flags, unsigned int helloId,
+                         unsigned long long secret);
+    JoinFailure* FindJoinFailure(int clientSocket, bool isAdded);
+    void ReapSessions(gboolean all);
+    void UpdateStatusbarSessions();
     void BringToFrontDBusCB(DBusMessage *message, DBusConnection *connection);
     // Static methods:
     static int xioctl(int fd, int request, void *arg);
+    static int AppendText(char* text, int size, int length, const char* format, ...);
     static DBusHandlerResult dbus_msg_handler(DBusConnection *connection, DBusMessage *message, void *user_data);
     // Comm thread procedure:
     static void* CommThreadProc(void* args);
@@ -87,20 +128,38 @@ private:
     // Data:
     GThread* commThread;
     DBusConnection* dbusConnection;
-    int crtWidth;
-    int crtHeight;
-    unsigned long lastSampleTimeMillis;
-    int crtSampleFrames;
-    int deviceFd;
+    // smartcam video devices, device i is fed by session i
+    int deviceFds[SMARTCAM_MAX_SESSIONS];
+    int deviceCount;
     // Comm thread
     gboolean isAlive;
     CCommHandler* pCommHandler;
-    CJpegHandler* pJpegHandler;
     CUIHandler* pUIHandler;
+    // crtSettings is read by every thread, settingsLock guards it and the
+    // flag telling the comm thread to restart its listeners
     CUserSettings crtSettings;
-
-    static const int SMARTCAM_FRAME_WIDTH = 320;
-    static const int SMARTCAM_FRAME_HEIGHT = 240;
-    static const int SMARTCAM_FRAME_SIZE = SMARTCAM_FRAME_WIDTH * SMARTCAM_FRAME_HEIGHT * 3;
+    GMutex* settingsLock;
+    gboolean isSettingsChanged;
+    // what the listeners were started with (comm thread only)
+    CUserSettings serverSettings;
+    // Sessions, one per connected phone; sessionsLock guards the array and
+    // the preview/connection state below
+    GMutex* sessionsLock;
+    CSmartSession* sessions[SMARTCAM_MAX_SESSIONS];
+    int connectedCount;
+    // the session shown in the main window
+    CSmartSession* previewSession;
+    int previewWidth;
+    int previewHeight;
+    // inherited listeners, until the comm handler adopts them
+    int listenSockets[SMARTCAM_CONN_TYPES];
+    int listenSocketCount;
+    // cold start: CLOCK_MONOTONIC micros at process start, and whether any
+    // frame was shown since (guarded by sessionsLock)
+    unsigned long long startMicros;
+    gboolean isFirstFrameShown;
+    // a peer that keeps trying tokens is not let in for a while (comm thread
+    // only); Bluetooth peers are paired and not counted
+    JoinFailure joinFailures[JOIN_FAILURE_SLOTS];
 };
 #endif//__SMART_ENGINE_H__
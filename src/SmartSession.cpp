@@ -0,0 +1,2192 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// SmartSession.cpp
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/random.h>
+#include <poll.h>
+#include <time.h>
+
+#include "SmartSession.h"
+#include "SmartEngine.h"
+#include "UIHandler.h"
+#include "JpegHandler.h"
+#include "RawHandler.h"
+#include "ClockSync.h"
+#include "PacketRing.h"
+#include "UdpAssembler.h"
+#include "RateController.h"
+#include "IoUring.h"
+#include "MultipathStream.h"
+#include "DecoderPool.h"
+#include "DecodeGovernor.h"
+
+// a frame is as good as the last one shown while its blocks are, on
+// average and at most, within this much brightness (dequantized DC, 8 per
+// grey level) of that frame's
+#define SIMILAR_MEAN_DC 4
+#define SIMILAR_MAX_DC 48
+// motion detection: a block moved if its brightness changed by more than
+// MOTION_BLOCK_DC, a frame with MOTION_MIN_SCORE percent of moved blocks
+// shows motion, the scene is still after MOTION_STILL_FRAMES frames in a
+// row without any
+#define MOTION_BLOCK_DC 32
+#define MOTION_MIN_SCORE 1
+#define MOTION_STILL_FRAMES 30
+
+// datagrams read by one recvmmsg() call
+#define UDP_BATCH_LEN 16
+// a UDP phone that sent nothing for this long is gone
+#define UDP_IDLE_TIMEOUT_MILLIS 3000
+// io_uring: operations in flight and their user data
+#define URING_ENTRIES 8
+#define URING_READ 1
+#define URING_WAKEUP 2
+#define URING_CANCEL 3
+#define URING_TIMER 4
+// multipath reorder window, in frames
+#define MULTIPATH_WINDOW_FRAMES 8
+
+CSmartSession::CSmartSession(CSmartEngine* pEngine, int id, int fd):
+    pSmartEngine(pEngine),
+    sessionId(id),
+    connectionType(CONN_BLUETOOTH),
+    sessionThread(NULL),
+    decodeThread(NULL),
+    outputThread(NULL),
+    isAlive(FALSE),
+    isFinished(FALSE),
+    isDisconnectRequested(false),
+    clientSocket(INVALID_SOCKET),
+    epollFd(-1),
+    wakeupFd(-1),
+    pIoUring(NULL),
+    uringIov(NULL),
+    isUringReadPending(false),
+    isUringPollPending(false),
+    isUringTimerPending(false),
+    hasUringReadResult(false),
+    uringReadResult(0),
+    pPacketRing(NULL),
+    pUdpAssembler(NULL),
+    udpDatagrams(NULL),
+    lastDatagramMillis(0),
+    isMultipathEnabled(false),
+    multipathReorderMillis(0),
+    pMultipath(NULL),
+    multipathId(0),
+    multipathSecret(0),
+    pathLock(NULL),
+    pendingPathSocket(INVALID_SOCKET),
+    pendingPathType(CONN_BLUETOOTH),
+    peerTimeoutMillis(0),
+    lastDataMillis(0),
+    resumeMillis(0),
+    resumeToken(0),
+    isSuspended(FALSE),
+    suspendMillis(0),
+    pendingResumeSocket(INVALID_SOCKET),
+    pendingResumeType(CONN_BLUETOOTH),
+    reconnectMicros(0),
+    resumeCount(0),
+    resumeFrameMicros(0),
+    protocolVersion(SMARTCAM_PROTOCOL_V1),
+    pRateController(NULL),
+    isRawEnabled(false),
+    pClockSync(NULL),
+    isClockAgreed(false),
+    nextPingMicros(0),
+    isDeviceTimestampOk(true),
+    pJpegHandler(NULL),
+    pRawHandler(NULL),
+    isStreamDecodeEnabled(false),
+    streamedPacket(NULL),
+    pDecoderPool(NULL),
+    pDecodeGovernor(NULL),
+    decodeTier(JPEG_TIER_FULL),
+    isSkipIdenticalEnabled(false),
+    isSkipSimilarEnabled(false),
+    isDeviceRepeatOk(true),
+    shownFrameHash(0),
+    pShownDcMap(NULL),
+    frameHash(0),
+    pFrameDcMap(NULL),
+    isFrameDcMapped(false),
+    avgDecodeMicros(0),
+    isMotionEnabled(false),
+    stillFps(0),
+    pLastDcMap(NULL),
+    motionScore(-1),
+    stillFrames(0),
+    stillDecodeMicros(0),
+    deviceFd(fd),
+    dropPolicy(DROP_NONE),
+    dropMaxAgeMicros(0),
+    crtWidth(-1),
+    crtHeight(-1),
+    lastSampleTimeMillis(0),
+    crtSampleFrames(0),
+    crtFps(0),
+    sampleLatencyMicros(0),
+    crtLatencyMillis(0),
+    sampleDecodeMicros(0),
+    sampleQueueDepth(0),
+    sampleBytes(0),
+    sampleGapBase(0),
+    sampleCaptureFrames(0),
+    sampleFirstCaptureMicros(0),
+    sampleLastCaptureMicros(0),
+    hasLastSeq(false),
+    lastSeq(0),
+    gapCount(0),
+    droppedCount(0),
+    streamedCount(0),
+    repeatedCount(0),
+    similarCount(0),
+    savedDecodeMicros(0),
+    motionCount(0),
+    stillCount(0)
+{
+    for(int i = 0; i < MULTIPATH_MAX_PATHS; i++)
+    {
+        pathSockets[i] = INVALID_SOCKET;
+        pathRings[i] = NULL;
+        isPathReady[i] = false;
+    }
+    pathLock = g_mutex_new();
+}
+
+CSmartSession::~CSmartSession()
+{
+    if(clientSocket != INVALID_SOCKET)
+    {
+        close(clientSocket);
+        clientSocket = INVALID_SOCKET;
+    }
+    // path 0 is the client socket
+    for(int i = 1; i < MULTIPATH_MAX_PATHS; i++)
+    {
+        if(pathSockets[i] != INVALID_SOCKET)
+        {
+            close(pathSockets[i]);
+            pathSockets[i] = INVALID_SOCKET;
+        }
+    }
+    for(int i = 0; i < MULTIPATH_MAX_PATHS; i++)
+    {
+        if(pathRings[i] != NULL)
+        {
+            delete pathRings[i];
+            pathRings[i] = NULL;
+        }
+    }
+    if(pendingPathSocket != INVALID_SOCKET)
+    {
+        close(pendingPathSocket);
+        pendingPathSocket = INVALID_SOCKET;
+    }
+    if(pendingResumeSocket != INVALID_SOCKET)
+    {
+        close(pendingResumeSocket);
+        pendingResumeSocket = INVALID_SOCKET;
+    }
+    if(pMultipath != NULL)
+    {
+        delete pMultipath;
+        pMultipath = NULL;
+    }
+    if(wakeupFd != -1)
+    {
+        close(wakeupFd);
+        wakeupFd = -1;
+    }
+    if(epollFd != -1)
+    {
+        close(epollFd);
+        epollFd = -1;
+    }
+    if(pDecoderPool != NULL)
+    {
+        delete pDecoderPool;
+        pDecoderPool = NULL;
+    }
+    if(pDecodeGovernor != NULL)
+    {
+        delete pDecodeGovernor;
+        pDecodeGovernor = NULL;
+    }
+    if(pShownDcMap != NULL)
+    {
+        free(pShownDcMap->dc);
+        delete pShownDcMap;
+        pShownDcMap = NULL;
+    }
+    if(pFrameDcMap != NULL)
+    {
+        free(pFrameDcMap->dc);
+        delete pFrameDcMap;
+        pFrameDcMap = NULL;
+    }
+    if(pLastDcMap != NULL)
+    {
+        free(pLastDcMap->dc);
+        delete pLastDcMap;
+        pLastDcMap = NULL;
+    }
+    if(pJpegHandler != NULL)
+    {
+        delete pJpegHandler;
+        pJpegHandler = NULL;
+    }
+    if(pRawHandler != NULL)
+    {
+        delete pRawHandler;
+        pRawHandler = NULL;
+    }
+    if(pClockSync != NULL)
+    {
+        delete pClockSync;
+        pClockSync = NULL;
+    }
+    if(pPacketRing != NULL)
+    {
+        delete pPacketRing;
+        pPacketRing = NULL;
+    }
+    if(pUdpAssembler != NULL)
+    {
+        delete pUdpAssembler;
+        pUdpAssembler = NULL;
+    }
+    if(udpDatagrams != NULL)
+    {
+        delete[] udpDatagrams;
+        udpDatagrams = NULL;
+    }
+    if(pRateController != NULL)
+    {
+        delete pRateController;
+        pRateController = NULL;
+    }
+    if(pIoUring != NULL)
+    {
+        delete pIoUring;
+        pIoUring = NULL;
+    }
+    if(uringIov != NULL)
+    {
+        delete[] uringIov;
+        uringIov = NULL;
+    }
+    g_mutex_free(pathLock);
+}
+
+// Takes ownership of the accepted client socket and starts the session thread
+int CSmartSession::Start(int socket, ConnectionType type)
+{
+    struct epoll_event event;
+    GError* error = NULL;
+
+    clientSocket = socket;
+    connectionType = type;
+
+    pPacketRing = new CPacketRing();
+    if(pPacketRing->Initialize(PACKET_RING_SLOT_COUNT, PACKET_RING_SLOT_SIZE) != 0)
+        return -1;
+    pJpegHandler = new CJpegHandler();
+    pJpegHandler->setOutputSize(CSmartEngine::SMARTCAM_FRAME_WIDTH, CSmartEngine::SMARTCAM_FRAME_HEIGHT);
+    pRawHandler = new CRawHandler(CSmartEngine::SMARTCAM_FRAME_WIDTH, CSmartEngine::SMARTCAM_FRAME_HEIGHT);
+    pClockSync = new CClockSync();
+    CUserSettings settings = pSmartEngine->GetSettings();
+    isRawEnabled = settings.rawFrames;
+    isStreamDecodeEnabled = settings.streamDecode;
+    dropPolicy = settings.dropPolicy;
+    dropMaxAgeMicros = (unsigned long long)settings.dropMaxAgeMillis * 1000;
+    isMultipathEnabled = settings.multipath;
+    multipathReorderMillis = settings.multipathReorderMillis;
+    peerTimeoutMillis = settings.peerTimeoutMillis;
+    resumeMillis = settings.resumeMillis;
+    lastDataMillis = GetMillis();
+    if(connectionType == CONN_INET)
+    {
+        CCommHandler::SetPeerTimeout(clientSocket, peerTimeoutMillis);
+    }
+    if(settings.rateControl)
+    {
+        pRateController = new CRateController();
+        pRateController->Initialize(settings.maxFps,
+                                    CSmartEngine::SMARTCAM_FRAME_WIDTH, CSmartEngine::SMARTCAM_FRAME_HEIGHT);
+    }
+    if(connectionType == CONN_UDP)
+    {
+        pUdpAssembler = new CUdpAssembler();
+        pUdpAssembler->Initialize(settings.udpJitterFrames, settings.udpJitterMillis);
+        udpDatagrams = new unsigned char[UDP_BATCH_LEN * UDP_MAX_DATAGRAM_LEN];
+        lastDatagramMillis = GetMillis();
+    }
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if(epollFd < 0)
+    {
+        CUIHandler::Msg("Could not create epoll instance: %d(%s)\n", errno, strerror(errno));
+        return -1;
+    }
+    wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(wakeupFd < 0)
+    {
+        CUIHandler::Msg("Could not create wakeup eventfd: %d(%s)\n", errno, strerror(errno));
+        return -1;
+    }
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = wakeupFd;
+    if(epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeupFd, &event) < 0)
+    {
+        CUIHandler::Msg("Could not watch wakeup eventfd: %d(%s)\n", errno, strerror(errno));
+        return -1;
+    }
+
+    // zero copy maps the pages from the epoll path, io_uring would copy them
+    if(connectionType == CONN_INET && settings.tcpZeroCopy)
+    {
+        pPacketRing->EnableZeroCopy();
+        printf("smartcam: session %d receives with tcp zero copy\n", sessionId);
+    }
+    else if(connectionType != CONN_UDP && settings.ioUring && StartUring() == 0)
+    {
+        printf("smartcam: session %d receives through io_uring\n", sessionId);
+    }
+    // io_uring waits for the data itself, epoll + readv need a non-blocking socket
+    int flags = fcntl(clientSocket, F_GETFL, NULL);
+    if(flags >= 0)
+    {
+        fcntl(clientSocket, F_SETFL, (pIoUring != NULL ? flags & ~O_NONBLOCK : flags | O_NONBLOCK));
+    }
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.fd = clientSocket;
+    if(epoll_ctl(epollFd, EPOLL_CTL_ADD, clientSocket, &event) < 0)
+    {
+        CUIHandler::Msg("Could not watch client socket: %d(%s)\n", errno, strerror(errno));
+        return -1;
+    }
+
+    if(settings.decodeThreads > 1)
+    {
+        pDecoderPool = new CDecoderPool();
+        if(pDecoderPool->Initialize(settings.decodeThreads,
+                                    CSmartEngine::SMARTCAM_FRAME_WIDTH, CSmartEngine::SMARTCAM_FRAME_HEIGHT) != 0)
+        {
+            return -1;
+        }
+        printf("smartcam: session %d decodes on %d threads\n", sessionId, pDecoderPool->GetWorkerCount());
+    }
+    else
+    {
+        // the pool keeps the cores busy with whole frames already
+        pJpegHandler->setBandThreads(settings.decodeBands);
+    }
+    if(settings.decodeGovernor)
+    {
+        pDecodeGovernor = new CDecodeGovernor();
+    }
+    isSkipIdenticalEnabled = settings.skipIdentical;
+    // the pool's workers have the tables, the session decoder has not
+    isSkipSimilarEnabled = (settings.skipSimilar && pDecoderPool == NULL);
+    pShownDcMap = new JpegDcMap();
+    pFrameDcMap = new JpegDcMap();
+    // motion is scored on whole frames, so they are not decoded as they come in
+    isMotionEnabled = ((settings.motionDetect || settings.stillFps > 0) && pDecoderPool == NULL);
+    if(isMotionEnabled)
+    {
+        isStreamDecodeEnabled = false;
+        stillFps = settings.stillFps;
+        motionScore = 0;
+    }
+    pLastDcMap = new JpegDcMap();
+
+    isAlive = TRUE;
+    decodeThread = g_thread_create(DecodeThreadProc, this, TRUE, &error);
+    if(decodeThread == NULL)
+    {
+        g_printerr("Failed to create decode thread: %s\n", error->message);
+        g_error_free(error);
+        isAlive = FALSE;
+        return -1;
+    }
+    if(pDecoderPool != NULL)
+    {
+        outputThread = g_thread_create(OutputThreadProc, this, TRUE, &error);
+        if(outputThread == NULL)
+        {
+            g_printerr("Failed to create output thread: %s\n", error->message);
+            g_error_free(error);
+            StopDecodeThread();
+            isAlive = FALSE;
+            return -1;
+        }
+    }
+    sessionThread = g_thread_create(SessionThreadProc, this, TRUE, &error);
+    if(sessionThread == NULL)
+    {
+        g_printerr("Failed to create session thread: %s\n", error->message);
+        g_error_free(error);
+        StopDecodeThread();
+        isAlive = FALSE;
+        return -1;
+    }
+    printf("smartcam: started session %d\n", sessionId);
+    return 0;
+}
+
+// Stops the session thread without touching the device or the UI,
+// used when the engine shuts down or reaps a finished session
+void CSmartSession::Stop()
+{
+    isAlive = FALSE;
+    if(pPacketRing != NULL)
+    {
+        pPacketRing->Close();
+    }
+    if(wakeupFd != -1)
+    {
+        Wakeup();
+    }
+    if(sessionThread != NULL)
+    {
+        g_thread_join(sessionThread);
+        sessionThread = NULL;
+        printf("smartcam: stopped session %d\n", sessionId);
+    }
+}
+
+// Called from the UI thread; the session thread does the actual disconnect
+// when it wakes up, so the client socket is never closed under its feet
+void CSmartSession::RequestDisconnect()
+{
+    isDisconnectRequested = true;
+    // the session thread may be waiting for the decoder to free a slot
+    if(pPacketRing != NULL)
+    {
+        pPacketRing->Close();
+    }
+    if(wakeupFd != -1)
+    {
+        Wakeup();
+    }
+}
+
+// Wakes up the session thread, from any thread; the eventfd only fails
+// to take more once its counter is full, and then a wakeup is pending anyway
+void CSmartSession::Wakeup()
+{
+    uint64_t one = 1;
+    while(write(wakeupFd, &one, sizeof(one)) < 0)
+    {
+        if(errno != EINTR)
+        {
+            if(errno != EAGAIN)
+            {
+                printf("smartcam: session %d could not signal wakeup eventfd: %d(%s)\n", sessionId, errno, strerror(errno));
+            }
+            break;
+        }
+    }
+}
+
+gboolean CSmartSession::IsFinished()
+{
+    return isFinished;
+}
+
+int CSmartSession::GetId()
+{
+    return sessionId;
+}
+
+float CSmartSession::GetFps()
+{
+    return crtFps;
+}
+
+float CSmartSession::GetLatencyMillis()
+{
+    return crtLatencyMillis;
+}
+
+unsigned int CSmartSession::GetGapCount()
+{
+    return gapCount;
+}
+
+unsigned int CSmartSession::GetDroppedCount()
+{
+    return droppedCount;
+}
+
+int CSmartSession::GetDecodeTier()
+{
+    return decodeTier;
+}
+
+int CSmartSession::GetMotionScore()
+{
+    return motionScore;
+}
+
+gboolean CSmartSession::IsStill()
+{
+    return (stillFrames >= MOTION_STILL_FRAMES);
+}
+
+int CSmartSession::GetWidth()
+{
+    return crtWidth;
+}
+
+int CSmartSession::GetHeight()
+{
+    return crtHeight;
+}
+
+ConnectionType CSmartSession::GetConnectionType()
+{
+    return connectionType;
+}
+
+unsigned int CSmartSession::GetMultipathId()
+{
+    return multipathId;
+}
+
+unsigned long long CSmartSession::GetMultipathSecret()
+{
+    return multipathSecret;
+}
+
+int CSmartSession::AddPath(int socket, ConnectionType type)
+{
+    int result = -1;
+    g_mutex_lock(pathLock);
+    if(isAlive && pendingPathSocket == INVALID_SOCKET)
+    {
+        pendingPathSocket = socket;
+        pendingPathType = type;
+        result = 0;
+    }
+    g_mutex_unlock(pathLock);
+    if(result == 0)
+    {
+        Wakeup();
+    }
+    return result;
+}
+
+unsigned long long CSmartSession::GetResumeToken()
+{
+    return resumeToken;
+}
+
+int CSmartSession::Resume(int socket, ConnectionType type)
+{
+    int result = -1;
+    g_mutex_lock(pathLock);
+    // a live connection is never taken over, only a lost one replaced
+    if(isAlive && isSuspended && pendingResumeSocket == INVALID_SOCKET)
+    {
+        pendingResumeSocket = socket;
+        pendingResumeType = type;
+        result = 0;
+    }
+    g_mutex_unlock(pathLock);
+    if(result == 0)
+    {
+        Wakeup();
+    }
+    return result;
+}
+
+gboolean CSmartSession::IsSuspended()
+{
+    return isSuspended;
+}
+
+const char* CSmartSession::GetPathName(ConnectionType type)
+{
+    return (type == CONN_BLUETOOTH ? "bluetooth" : (type == CONN_UDP ? "udp" : "inet"));
+}
+
+void* CSmartSession::SessionThreadProc(void* args)
+{
+    CSmartSession* pSession = (CSmartSession*) args;
+
+    pSession->pSmartEngine->OnConnected(pSession);
+    while(pSession->isAlive)
+    {
+        switch(pSession->WaitEvent(pSession->GetWaitTimeout()))
+        {
+        case COMM_EVENT_DATA:
+            pSession->RcvPackets();
+            break;
+        case COMM_EVENT_TIMEOUT:
+            pSession->HandleTimeout();
+            break;
+        case COMM_EVENT_ERROR:
+            pSession->Disconnect();
+            break;
+        default:
+            // woken up: stop (isAlive is checked above) or a disconnect
+            // request, which has already been served
+            break;
+        }
+    }
+    pSession->CancelUring();
+    pSession->StopDecodeThread();
+    return NULL;
+}
+
+void* CSmartSession::DecodeThreadProc(void* args)
+{
+    CSmartSession* pSession = (CSmartSession*) args;
+    SmartCamPacket* packet = NULL;
+
+    if(pSession->pDecoderPool != NULL)
+    {
+        while((packet = pSession->pPacketRing->WaitPacket()) != NULL)
+        {
+            pSession->DispatchPacket(packet);
+            pSession->pPacketRing->ReleasePacket(packet);
+        }
+        return NULL;
+    }
+    while(true)
+    {
+        packet = pSession->pPacketRing->TakePacket();
+        if(packet == NULL && pSession->isStreamDecodeEnabled)
+        {
+            // idle: get a head start on the frame being received
+            pSession->StreamPacket();
+        }
+        if(packet == NULL && (packet = pSession->pPacketRing->WaitPacket()) == NULL)
+        {
+            break;
+        }
+        pSession->ProcessPacket(packet);
+        pSession->pPacketRing->ReleasePacket(packet);
+    }
+    return NULL;
+}
+
+// Writes the frames of the decoder pool to the device, in sequence
+void* CSmartSession::OutputThreadProc(void* args)
+{
+    CSmartSession* pSession = (CSmartSession*) args;
+    DecodeJob* job = NULL;
+
+    while((job = pSession->pDecoderPool->WaitDone()) != NULL)
+    {
+        pSession->OutputJob(job);
+        pSession->pDecoderPool->ReleaseJob(job);
+    }
+    return NULL;
+}
+
+// Decodes the JPEG frame being received as far as its bytes go, and on as
+// more of them arrive, until it is complete: the entropy decoding of the
+// top rows overlaps the transfer of the bottom ones. ProcessPacket() then
+// finishes it, the decoder holds its state until then.
+void CSmartSession::StreamPacket()
+{
+    unsigned int available = 0;
+    SmartCamPacket* packet = pPacketRing->PeekPacket(&available);
+    if(packet == NULL)
+    {
+        return;
+    }
+    bool isDecoding = true;
+    int result = 1;
+    while(result > 0)
+    {
+        unsigned char* rgb24 = NULL;
+        int w = 0, h = 0;
+        // done early or corrupt: wait for the packet all the same
+        if(isDecoding &&
+           pJpegHandler->decodeStream(packet->data, available, false, rgb24, w, h) != JPEG_STREAM_MORE)
+        {
+            isDecoding = false;
+        }
+        result = pPacketRing->WaitPeeked(&available);
+    }
+    if(result == 0)
+    {
+        streamedPacket = packet;
+        ++streamedCount;
+    }
+    else
+    {
+        pJpegHandler->abortStream();
+    }
+}
+
+// Closes the packet ring and waits for the packet being decoded, so that
+// nothing is written to the device afterwards
+void CSmartSession::StopDecodeThread()
+{
+    pPacketRing->Close();
+    if(pDecoderPool != NULL)
+    {
+        pDecoderPool->Close();
+    }
+    if(decodeThread != NULL)
+    {
+        g_thread_join(decodeThread);
+        decodeThread = NULL;
+    }
+    if(outputThread != NULL)
+    {
+        g_thread_join(outputThread);
+        outputThread = NULL;
+    }
+}
+
+// Closes the client socket, puts the logo back in the device and tells the
+// engine that this session can be reaped
+void CSmartSession::Disconnect()
+{
+    isAlive = FALSE;
+    CancelUring();
+    StopDecodeThread();
+    multipathId = 0;
+    multipathSecret = 0;
+    resumeToken = 0;
+    isSuspended = FALSE;
+    g_mutex_lock(pathLock);
+    if(clientSocket != INVALID_SOCKET)
+    {
+        close(clientSocket);
+        clientSocket = INVALID_SOCKET;
+    }
+    for(int i = 0; i < MULTIPATH_MAX_PATHS; i++)
+    {
+        if(i > 0 && pathSockets[i] != INVALID_SOCKET)
+        {
+            close(pathSockets[i]);
+        }
+        pathSockets[i] = INVALID_SOCKET;
+    }
+    if(pendingPathSocket != INVALID_SOCKET)
+    {
+        close(pendingPathSocket);
+        pendingPathSocket = INVALID_SOCKET;
+    }
+    if(pendingResumeSocket != INVALID_SOCKET)
+    {
+        close(pendingResumeSocket);
+        pendingResumeSocket = INVALID_SOCKET;
+    }
+    g_mutex_unlock(pathLock);
+    if(pClockSync != NULL && pClockSync->IsSynced())
+    {
+        unsigned long long now = CPacketRing::GetMicros();
+        printf("smartcam: session %d phone clock %+lld ms off, drift %.1f ppm, round trip %u us\n", sessionId,
+               pClockSync->GetOffsetMicros(now) / 1000, pClockSync->GetDriftPpm(), pClockSync->GetRoundTripMicros());
+    }
+    if(resumeCount > 0)
+    {
+        printf("smartcam: session %d resumed %u times, first frame %llu ms after the reconnect on average\n",
+               sessionId, resumeCount, resumeFrameMicros / resumeCount / 1000);
+    }
+    if(pMultipath != NULL)
+    {
+        printf("smartcam: session %d multipath: %u frames reordered, %u given up, %u late\n",
+               sessionId, pMultipath->GetReorderedCount(), pMultipath->GetSkippedCount(),
+               pMultipath->GetLateCount());
+    }
+    if(hasLastSeq)
+    {
+        printf("smartcam: session %d lost %u frames\n", sessionId, gapCount);
+    }
+    if(droppedCount > 0)
+    {
+        printf("smartcam: session %d skipped %u stale frames\n", sessionId, droppedCount);
+    }
+    if(pDecoderPool != NULL)
+    {
+        printf("smartcam: session %d decoded up to %d frames at once on %d threads\n", sessionId,
+               pDecoderPool->GetMaxBusyCount(), pDecoderPool->GetWorkerCount());
+    }
+    if(streamedCount > 0)
+    {
+        printf("smartcam: session %d decoded %u frames while they were received\n", sessionId, streamedCount);
+    }
+    if(repeatedCount > 0 || similarCount > 0)
+    {
+        printf("smartcam: session %d repeated %u identical and %u similar frames, about %llu ms of decoding saved\n",
+               sessionId, repeatedCount, similarCount, savedDecodeMicros / 1000);
+    }
+    if(isMotionEnabled)
+    {
+        printf("smartcam: session %d saw motion in %u frames, skipped %u frames while still\n",
+               sessionId, motionCount, stillCount);
+    }
+    if(pJpegHandler->getBandFrameCount() > 0)
+    {
+        printf("smartcam: session %d decoded %u frames in bands\n", sessionId, pJpegHandler->getBandFrameCount());
+    }
+    if(pJpegHandler->getTableHitCount() > 0)
+    {
+        printf("smartcam: session %d JPEG tables: %u parsed, %u from cache\n", sessionId,
+               pJpegHandler->getTableParseCount(), pJpegHandler->getTableHitCount());
+    }
+    if(pUdpAssembler != NULL)
+    {
+        printf("smartcam: session %d received %u udp frames, %u dropped, %u fragments recovered\n",
+               sessionId, pUdpAssembler->GetFrameCount(), pUdpAssembler->GetDroppedCount(),
+               pUdpAssembler->GetRecoveredCount());
+    }
+    else
+    {
+        printf("smartcam: session %d received %u packets in %u reads, %u resyncs (%u bytes skipped)\n",
+               sessionId, pPacketRing->GetPacketCount(), pPacketRing->GetReadCount(),
+               pPacketRing->GetResyncCount(), pPacketRing->GetSkippedBytes());
+        if(pPacketRing->GetZeroCopyBytes() > 0)
+        {
+            printf("smartcam: session %d mapped %llu kB and copied %llu kB\n", sessionId,
+                   pPacketRing->GetZeroCopyBytes() / 1024, pPacketRing->GetCopiedBytes() / 1024);
+        }
+    }
+    crtWidth = -1;
+    crtHeight = -1;
+    crtSampleFrames = 0;
+    lastSampleTimeMillis = 0;
+    crtFps = 0;
+    sampleLatencyMicros = 0;
+    crtLatencyMillis = 0;
+    sampleCaptureFrames = 0;
+    CSmartEngine::WriteDeviceFrame(deviceFd, pSmartEngine->GetLogoFrame(), CSmartEngine::SMARTCAM_FRAME_SIZE);
+    isFinished = TRUE;
+    pSmartEngine->OnDisconnected(this);
+    pSmartEngine->OnSessionFinished(this);
+}
+
+// The phone is gone: a v2 phone that holds a resume token gets resumeMillis
+// to come back, anything else is disconnected right away
+void CSmartSession::LosePeer()
+{
+    if(resumeToken != 0 && pMultipath == NULL)
+    {
+        Suspend();
+    }
+    else
+    {
+        Disconnect();
+    }
+}
+
+// Keeps the decoder, the statistics and the last frame in the device while
+// the session waits for its phone; the packets already received are still
+// decoded
+void CSmartSession::Suspend()
+{
+    DropClient();
+    suspendMillis = GetMillis();
+    isSuspended = TRUE;
+    printf("smartcam: session %d lost its phone, waiting %d ms for it to come back\n", sessionId, resumeMillis);
+    pSmartEngine->OnReconnecting(this);
+}
+
+// Closes the client socket and drops the packet it was cut off in; the
+// session goes on with epoll, io_uring is bound to the old socket
+void CSmartSession::DropClient()
+{
+    StopUring();
+    // the phone has to say hello again before the decode thread may send
+    protocolVersion = SMARTCAM_PROTOCOL_V1;
+    g_mutex_lock(pathLock);
+    if(clientSocket != INVALID_SOCKET)
+    {
+        close(clientSocket);
+        clientSocket = INVALID_SOCKET;
+    }
+    g_mutex_unlock(pathLock);
+    pPacketRing->Restart();
+}
+
+// Swaps in the connection the phone came back on while the session waits
+// for it; its hello is answered with the same token
+void CSmartSession::TakeOverClient(int socket, ConnectionType type)
+{
+    struct epoll_event event;
+
+    if(!isAlive || isDisconnectRequested || !isSuspended || resumeToken == 0 || pMultipath != NULL)
+    {
+        close(socket);
+        return;
+    }
+    unsigned long outageMillis = GetMillis() - suspendMillis;
+    if(type == CONN_INET)
+    {
+        CCommHandler::SetPeerTimeout(socket, peerTimeoutMillis);
+    }
+    int flags = fcntl(socket, F_GETFL, NULL);
+    if(flags >= 0)
+    {
+        fcntl(socket, F_SETFL, flags | O_NONBLOCK);
+    }
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.fd = socket;
+    if(epoll_ctl(epollFd, EPOLL_CTL_ADD, socket, &event) < 0)
+    {
+        printf("smartcam: session %d could not watch its new socket: %d(%s)\n", sessionId, errno, strerror(errno));
+        close(socket);
+        return;
+    }
+    g_mutex_lock(pathLock);
+    clientSocket = socket;
+    g_mutex_unlock(pathLock);
+    connectionType = type;
+    lastDataMillis = GetMillis();
+    reconnectMicros = CPacketRing::GetMicros();
+    ++resumeCount;
+    isSuspended = FALSE;
+    printf("smartcam: session %d resumed over %s after %lu ms\n", sessionId, GetPathName(type), outageMillis);
+    pSmartEngine->OnReconnecting(this);
+}
+
+// Drains the wakeup eventfd and serves a pending disconnect request;
+// returns true if the client was disconnected
+bool CSmartSession::HandleWakeup()
+{
+    uint64_t count = 0;
+    while(read(wakeupFd, &count, sizeof(count)) > 0)
+        ;
+    g_mutex_lock(pathLock);
+    int pathSocket = pendingPathSocket;
+    pendingPathSocket = INVALID_SOCKET;
+    g_mutex_unlock(pathLock);
+    if(pathSocket != INVALID_SOCKET)
+    {
+        OpenPath(pathSocket, pendingPathType);
+    }
+    g_mutex_lock(pathLock);
+    int resumeSocket = pendingResumeSocket;
+    pendingResumeSocket = INVALID_SOCKET;
+    g_mutex_unlock(pathLock);
+    if(resumeSocket != INVALID_SOCKET)
+    {
+        TakeOverClient(resumeSocket, pendingResumeType);
+    }
+    if(!isDisconnectRequested || !isAlive)
+        return false;
+    isDisconnectRequested = false;
+    Disconnect();
+    return true;
+}
+
+unsigned long CSmartSession::GetMillis()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// A token nobody can guess from the ones before, never 0
+unsigned long long CSmartSession::NewResumeToken()
+{
+    unsigned long long token = 0;
+    while(token == 0)
+    {
+        if(getrandom(&token, sizeof(token), 0) != (ssize_t) sizeof(token))
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            printf("smartcam: could not get random bytes: %d(%s)\n", errno, strerror(errno));
+            return 0;
+        }
+    }
+    return token;
+}
+
+// Stream sessions wake up to notice a phone that went silent or, once it
+// is gone, to give up waiting for it; UDP ones also for the jitter buffer
+// deadlines
+int CSmartSession::GetWaitTimeout()
+{
+    unsigned long now = GetMillis();
+    if(isSuspended)
+    {
+        int resumeTimeout = (int)(suspendMillis + resumeMillis - now);
+        return (resumeTimeout < 0 ? 0 : resumeTimeout);
+    }
+    if(pMultipath != NULL)
+    {
+        return pMultipath->GetTimeout(CPacketRing::GetMicros());
+    }
+    if(pUdpAssembler == NULL)
+    {
+        if(peerTimeoutMillis <= 0)
+        {
+            return -1;
+        }
+        int peerTimeout = (int)(lastDataMillis + peerTimeoutMillis - now);
+        return (peerTimeout < 0 ? 0 : peerTimeout);
+    }
+    int timeout = pUdpAssembler->GetTimeout(now);
+    int idleTimeout = (int)(lastDatagramMillis + UDP_IDLE_TIMEOUT_MILLIS - now);
+    if(idleTimeout < 0)
+    {
+        idleTimeout = 0;
+    }
+    if(timeout < 0 || timeout > idleTimeout)
+    {
+        timeout = idleTimeout;
+    }
+    return timeout;
+}
+
+void CSmartSession::HandleTimeout()
+{
+    if(isSuspended)
+    {
+        if(GetMillis() - suspendMillis >= (unsigned long) resumeMillis)
+        {
+            printf("smartcam: session %d gave up waiting for its phone\n", sessionId);
+            Disconnect();
+        }
+        return;
+    }
+    if(pMultipath != NULL)
+    {
+        if(pMultipath->Deliver(pPacketRing, CPacketRing::GetMicros()) != 0 && isAlive && !isDisconnectRequested)
+        {
+            Disconnect();
+        }
+        return;
+    }
+    if(pUdpAssembler == NULL)
+    {
+        // a half dead link (WiFi out of range) leaves the socket silent
+        // rather than failing it
+        if(peerTimeoutMillis > 0 && GetMillis() - lastDataMillis >= (unsigned long) peerTimeoutMillis &&
+           isAlive && !isDisconnectRequested)
+        {
+            printf("smartcam: session %d heard nothing for %d ms\n", sessionId, peerTimeoutMillis);
+            LosePeer();
+        }
+        return;
+    }
+    unsigned long now = GetMillis();
+    if(now - lastDatagramMillis >= UDP_IDLE_TIMEOUT_MILLIS)
+    {
+        printf("smartcam: session %d timed out\n", sessionId);
+        Disconnect();
+        return;
+    }
+    if(pUdpAssembler->Deliver(pPacketRing, now) != 0 && isAlive && !isDisconnectRequested)
+    {
+        Disconnect();
+    }
+}
+
+// Picks io_uring for the receive path if the kernel has it, 0 on success
+int CSmartSession::StartUring()
+{
+    int fds[2] = { clientSocket, wakeupFd };
+    pIoUring = new CIoUring();
+    if(pIoUring->Initialize(URING_ENTRIES) != 0 || pIoUring->RegisterFiles(fds, 2) != 0)
+    {
+        delete pIoUring;
+        pIoUring = NULL;
+        return -1;
+    }
+    uringIov = new struct iovec[2];
+    return 0;
+}
+
+// Takes back the operations still in flight, they point into the packet
+// ring and at the client socket
+void CSmartSession::CancelUring()
+{
+    if(pIoUring == NULL)
+    {
+        return;
+    }
+    if(isUringReadPending)
+    {
+        pIoUring->PrepareCancel(URING_READ, URING_CANCEL);
+    }
+    if(isUringPollPending)
+    {
+        pIoUring->PrepareCancel(URING_WAKEUP, URING_CANCEL);
+    }
+    if(isUringTimerPending)
+    {
+        pIoUring->PrepareCancel(URING_TIMER, URING_CANCEL);
+    }
+    while(isUringReadPending || isUringPollPending || isUringTimerPending)
+    {
+        uint64_t userData = 0;
+        int result = 0;
+        if(pIoUring->SubmitAndWait(1) != 0)
+        {
+            break;
+        }
+        while(pIoUring->GetCompletion(&userData, &result))
+        {
+            if(userData == URING_READ)
+            {
+                isUringReadPending = false;
+            }
+            else if(userData == URING_WAKEUP)
+            {
+                isUringPollPending = false;
+            }
+            else if(userData == URING_TIMER)
+            {
+                isUringTimerPending = false;
+            }
+        }
+    }
+    hasUringReadResult = false;
+}
+
+// io_uring flavour of WaitEvent(): keeps a readv into the packet ring and a
+// poll on the wakeup eventfd queued and waits for either to complete, or for
+// a timer. A timer left over from an earlier wait may fire early, which only
+// costs a HandleTimeout() that finds nothing due.
+CommEventType CSmartSession::WaitUringEvent(int timeoutMillis)
+{
+    uint64_t userData = 0;
+    int result = 0;
+    bool isWakeup = false;
+    bool isTimeout = false;
+
+    // a closed ring (stop or disconnect request) only waits for the wakeup
+    if(!isUringReadPending && !hasUringReadResult)
+    {
+        int iovCount = pPacketRing->BeginRead(uringIov);
+        if(iovCount > 0 && pIoUring->PrepareReadv(0, uringIov, iovCount, URING_READ) == 0)
+        {
+            isUringReadPending = true;
+        }
+    }
+    if(!isUringPollPending && pIoUring->PreparePoll(1, POLLIN, URING_WAKEUP) == 0)
+    {
+        isUringPollPending = true;
+    }
+    if(timeoutMillis >= 0 && !isUringTimerPending && pIoUring->PrepareTimeout(timeoutMillis, URING_TIMER) == 0)
+    {
+        isUringTimerPending = true;
+    }
+    if(!hasUringReadResult && pIoUring->SubmitAndWait(1) != 0)
+    {
+        CUIHandler::Msg("Could not wait for io_uring completions: %d(%s)\n", errno, strerror(errno));
+        return COMM_EVENT_ERROR;
+    }
+    while(pIoUring->GetCompletion(&userData, &result))
+    {
+        if(userData == URING_READ)
+        {
+            isUringReadPending = false;
+            hasUringReadResult = true;
+            uringReadResult = result;
+        }
+        else if(userData == URING_WAKEUP)
+        {
+            isUringPollPending = false;
+            isWakeup = true;
+        }
+        else if(userData == URING_TIMER)
+        {
+            isUringTimerPending = false;
+            isTimeout = true;
+        }
+    }
+    // the wakeup takes precedence, the read result is kept for later
+    if(isWakeup)
+    {
+        HandleWakeup();
+        return COMM_EVENT_WAKEUP;
+    }
+    if(hasUringReadResult)
+    {
+        return COMM_EVENT_DATA;
+    }
+    return (isTimeout ? COMM_EVENT_TIMEOUT : COMM_EVENT_WAKEUP);
+}
+
+// Sleeps until the client socket is readable, the timeout expires or
+// somebody wakes us up
+CommEventType CSmartSession::WaitEvent(int timeoutMillis)
+{
+    struct epoll_event events[2];
+    int count = 0;
+
+    if(pIoUring != NULL)
+    {
+        return WaitUringEvent(timeoutMillis);
+    }
+
+    do
+        count = epoll_wait(epollFd, events, 2, timeoutMillis);
+    while(count < 0 && errno == EINTR);
+    if(count < 0)
+    {
+        CUIHandler::Msg("Could not wait for socket events: %d(%s)\n", errno, strerror(errno));
+        return COMM_EVENT_ERROR;
+    }
+    if(count == 0)
+    {
+        return COMM_EVENT_TIMEOUT;
+    }
+    // the wakeup takes precedence, stop must not wait behind a busy client
+    for(int i = 0; i < count; i++)
+    {
+        if(events[i].data.fd == wakeupFd)
+        {
+            HandleWakeup();
+            return COMM_EVENT_WAKEUP;
+        }
+    }
+    return COMM_EVENT_DATA;
+}
+
+// Drains the client socket into the packet ring, the decode thread picks
+// the complete packets up from there
+int CSmartSession::RcvPackets()
+{
+    if(pUdpAssembler != NULL)
+    {
+        return RcvDatagrams();
+    }
+    if(pMultipath != NULL)
+    {
+        return RcvPaths();
+    }
+    int result = 0;
+    lastDataMillis = GetMillis();
+    if(pIoUring != NULL)
+    {
+        // the read completed in WaitUringEvent(), only the bookkeeping is left
+        int count = uringReadResult;
+        hasUringReadResult = false;
+        if(count == -EINTR || count == -EAGAIN)
+        {
+            return 0;
+        }
+        result = (count > 0 ? pPacketRing->EndRead(count) : -1);
+    }
+    else
+    {
+        result = pPacketRing->Receive(clientSocket);
+    }
+    int version = pPacketRing->TakeHello();
+    if(version != 0)
+    {
+        unsigned int streamId = pPacketRing->GetStreamId();
+        if(streamId != 0 && (!isMultipathEnabled || StartMultipath(streamId, pPacketRing->GetStreamSecret()) != 0))
+        {
+            streamId = 0;
+        }
+        // raw frames are for fast links only; neither they nor clock pings
+        // are for a multipath stream
+        unsigned int helloFlags = pPacketRing->GetHelloFlags();
+        unsigned int agreedFlags = 0;
+        if((helloFlags & HELLO_FLAG_RAW) && isRawEnabled &&
+           connectionType == CONN_INET && streamId == 0 && pRateController != NULL)
+        {
+            agreedFlags |= HELLO_FLAG_RAW;
+        }
+        if((helloFlags & HELLO_FLAG_CLOCK) && streamId == 0)
+        {
+            agreedFlags |= HELLO_FLAG_CLOCK;
+        }
+        if(pRateController != NULL)
+        {
+            pRateController->SetRawAllowed((agreedFlags & HELLO_FLAG_RAW) != 0);
+        }
+        isClockAgreed = ((agreedFlags & HELLO_FLAG_CLOCK) != 0);
+        if(streamId != 0)
+        {
+            SendHello(clientSocket, version, HELLO_FLAG_MULTIPATH, streamId, multipathSecret);
+        }
+        else
+        {
+            // a phone that came back keeps its token
+            if(version >= SMARTCAM_PROTOCOL_V2 && resumeMillis > 0 && resumeToken == 0)
+            {
+                resumeToken = NewResumeToken();
+            }
+            if(version >= SMARTCAM_PROTOCOL_V2 && resumeToken != 0)
+            {
+                SendHello(clientSocket, version, HELLO_FLAG_RESUME | agreedFlags, 0, resumeToken);
+            }
+            else
+            {
+                SendHello(clientSocket, version, agreedFlags, 0, 0);
+            }
+        }
+        if(pMultipath != NULL)
+        {
+            SendPathShares();
+        }
+        if(version >= SMARTCAM_PROTOCOL_V2 && pRateController != NULL)
+        {
+            SendStreamParams(pRateController->GetParams());
+        }
+        // from now on the decode thread may send too
+        protocolVersion = version;
+    }
+    if(result == 0)
+    {
+        return 0;
+    }
+    // peer gone, socket error or ring closed by a stop/disconnect request
+    if(isAlive && !isDisconnectRequested)
+    {
+        LosePeer();
+    }
+    return -1;
+}
+
+// Reads the queued datagrams in batches, reassembles them and pushes the
+// frames that are complete (or given up on) to the decode thread
+int CSmartSession::RcvDatagrams()
+{
+    struct mmsghdr msgs[UDP_BATCH_LEN];
+    struct iovec iovs[UDP_BATCH_LEN];
+    int count = 0;
+
+    memset(msgs, 0, sizeof(msgs));
+    for(int i = 0; i < UDP_BATCH_LEN; i++)
+    {
+        iovs[i].iov_base = udpDatagrams + i * UDP_MAX_DATAGRAM_LEN;
+        iovs[i].iov_len = UDP_MAX_DATAGRAM_LEN;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    do
+    {
+        count = recvmmsg(clientSocket, msgs, UDP_BATCH_LEN, MSG_DONTWAIT, NULL);
+        if(count < 0)
+        {
+            // an ICMP error from an earlier datagram is no reason to give up
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNREFUSED)
+            {
+                break;
+            }
+            if(isAlive && !isDisconnectRequested)
+            {
+                Disconnect();
+            }
+            return -1;
+        }
+        unsigned long now = GetMillis();
+        lastDatagramMillis = now;
+        for(int i = 0; i < count; i++)
+        {
+            pUdpAssembler->Feed((const unsigned char*) iovs[i].iov_base, msgs[i].msg_len, now);
+        }
+        if(pUdpAssembler->Deliver(pPacketRing, now) != 0)
+        {
+            return -1;  // ring closed by a stop/disconnect request
+        }
+    }
+    while(count == UDP_BATCH_LEN);
+    return 0;
+}
+
+// Turns the session into a multipath one when its hello asks for it: the
+// client socket becomes path 0 with a ring of its own and pPacketRing only
+// gets the packets put back in order. The phone waits for the hello answer,
+// so nothing past the hello has been received yet.
+int CSmartSession::StartMultipath(unsigned int streamId, unsigned long long secret)
+{
+    // without a secret anybody could join the stream
+    if(secret == 0)
+    {
+        return -1;
+    }
+    CPacketRing* pRing = new CPacketRing();
+    if(pRing->Initialize(PACKET_RING_SLOT_COUNT, PACKET_RING_SLOT_SIZE) != 0)
+    {
+        delete pRing;
+        return -1;
+    }
+    pRing->SetVersion(SMARTCAM_PROTOCOL_V2);
+    StopUring();
+    pMultipath = new CMultipathStream();
+    pMultipath->Initialize(MULTIPATH_WINDOW_FRAMES, multipathReorderMillis);
+    pMultipath->AddPath(connectionType);
+    pathSockets[0] = clientSocket;
+    pathRings[0] = pRing;
+    isPathReady[0] = true;
+    // the engine matches the id first
+    multipathSecret = secret;
+    multipathId = streamId;
+    printf("smartcam: session %d is multipath stream %u\n", sessionId, streamId);
+    return 0;
+}
+
+// The paths are read with epoll, io_uring only serves a single socket
+void CSmartSession::StopUring()
+{
+    if(pIoUring == NULL)
+    {
+        return;
+    }
+    CancelUring();
+    delete pIoUring;
+    pIoUring = NULL;
+    delete[] uringIov;
+    uringIov = NULL;
+    int flags = fcntl(clientSocket, F_GETFL, NULL);
+    if(flags >= 0)
+    {
+        fcntl(clientSocket, F_SETFL, flags | O_NONBLOCK);
+    }
+}
+
+// Takes over a connection handed over by AddPath(); its hello is answered
+// once it has been read
+void CSmartSession::OpenPath(int socket, ConnectionType type)
+{
+    struct epoll_event event;
+    int path = -1;
+
+    if(isAlive && !isDisconnectRequested && pMultipath != NULL)
+    {
+        path = pMultipath->AddPath(type);
+    }
+    if(path < 0)
+    {
+        printf("smartcam: session %d has no room for another path\n", sessionId);
+        close(socket);
+        return;
+    }
+    CPacketRing* pRing = new CPacketRing();
+    if(type == CONN_INET)
+    {
+        CCommHandler::SetPeerTimeout(socket, peerTimeoutMillis);
+    }
+    int flags = fcntl(socket, F_GETFL, NULL);
+    if(flags >= 0)
+    {
+        fcntl(socket, F_SETFL, flags | O_NONBLOCK);
+    }
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.fd = socket;
+    if(pRing->Initialize(PACKET_RING_SLOT_COUNT, PACKET_RING_SLOT_SIZE) != 0 ||
+       epoll_ctl(epollFd, EPOLL_CTL_ADD, socket, &event) < 0)
+    {
+        printf("smartcam: session %d could not add a path: %d(%s)\n", sessionId, errno, strerror(errno));
+        delete pRing;
+        close(socket);
+        pMultipath->RemovePath(path);
+        return;
+    }
+    g_mutex_lock(pathLock);
+    pathSockets[path] = socket;
+    pathRings[path] = pRing;
+    isPathReady[path] = false;
+    g_mutex_unlock(pathLock);
+    printf("smartcam: session %d added a %s path\n", sessionId, GetPathName(type));
+}
+
+// Drops a path that failed; the control messages move on to the next one.
+// Returns false once no path is left.
+bool CSmartSession::ClosePath(int path)
+{
+    int count = pMultipath->GetPathCount();
+    printf("smartcam: session %d lost its %s path after %u frames\n", sessionId,
+           GetPathName(pMultipath->GetPathType(path)), pMultipath->GetFrameCount(path));
+    g_mutex_lock(pathLock);
+    close(pathSockets[path]);
+    delete pathRings[path];
+    for(int i = path; i < count - 1; i++)
+    {
+        pathSockets[i] = pathSockets[i + 1];
+        pathRings[i] = pathRings[i + 1];
+        isPathReady[i] = isPathReady[i + 1];
+    }
+    pathSockets[count - 1] = INVALID_SOCKET;
+    pathRings[count - 1] = NULL;
+    isPathReady[count - 1] = false;
+    clientSocket = pathSockets[0];
+    g_mutex_unlock(pathLock);
+    pMultipath->RemovePath(path);
+    if(count == 1)
+    {
+        return false;
+    }
+    connectionType = pMultipath->GetPathType(0);
+    SendPathShares();
+    return true;
+}
+
+// Multipath flavour of RcvPackets(): drains every path and delivers the
+// frames that are due. A failing path is dropped, the session only ends
+// with the last one.
+int CSmartSession::RcvPaths()
+{
+    for(int i = 0; i < pMultipath->GetPathCount(); )
+    {
+        if(RcvPath(i) == 0)
+        {
+            ++i;
+            continue;
+        }
+        if(!ClosePath(i))
+        {
+            if(isAlive && !isDisconnectRequested)
+            {
+                Disconnect();
+            }
+            return -1;
+        }
+    }
+    unsigned long long now = CPacketRing::GetMicros();
+    if(pMultipath->Deliver(pPacketRing, now) != 0)
+    {
+        return -1;  // ring closed by a stop/disconnect request
+    }
+    if(pMultipath->UpdateShares(now))
+    {
+        SendPathShares();
+    }
+    return 0;
+}
+
+// Reads one path until it would block, moving every complete packet on to
+// the reorder window right away so that the path ring never fills up
+int CSmartSession::RcvPath(int path)
+{
+    struct iovec iov[2];
+    CPacketRing* pRing = pathRings[path];
+    SmartCamPacket* packet = NULL;
+
+    while(true)
+    {
+        while((packet = pRing->TakePacket()) != NULL)
+        {
+            // only v2 packets can be put back in order
+            bool hasSeq = packet->hasSeq;
+            if(hasSeq)
+            {
+                pMultipath->Feed(path, packet);
+            }
+            pRing->ReleasePacket(packet);
+            if(!hasSeq)
+            {
+                return -1;
+            }
+        }
+        int version = pRing->TakeHello();
+        if(version != 0)
+        {
+            if(pRing->GetStreamId() != multipathId || pRing->GetStreamSecret() != multipathSecret)
+            {
+                return -1;
+            }
+            SendHello(pathSockets[path], version, HELLO_FLAG_MULTIPATH, multipathId, multipathSecret);
+            isPathReady[path] = true;
+            SendPathShares();
+        }
+        int iovCount = pRing->BeginRead(iov);
+        if(iovCount < 0)
+        {
+            return -1;
+        }
+        ssize_t count = readv(pathSockets[path], iov, iovCount);
+        if(count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(count < 0)
+        {
+            return ((errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1);
+        }
+        if(count == 0 || pRing->EndRead(count) != 0)
+        {
+            return -1;
+        }
+    }
+}
+
+// Sends a control message whole or drops the connection: the phone would
+// read the rest of the stream out of step after a short send. The socket is
+// only shut down, the receive thread finds the peer gone and cleans up, so
+// any thread may call this
+bool CSmartSession::SendControl(int socket, const unsigned char* message, ssize_t len, const char* what)
+{
+    if(send(socket, message, len, MSG_NOSIGNAL | MSG_DONTWAIT) == len)
+    {
+        return true;
+    }
+    printf("smartcam: session %d could not send %s, dropping the connection: %d(%s)\n",
+           sessionId, what, errno, strerror(errno));
+    shutdown(socket, SHUT_RDWR);
+    return false;
+}
+
+// Answers a v2 phone's hello with the protocol version both sides speak and
+// the multipath stream id or resume token the flags announce
+void CSmartSession::SendHello(int socket, int version, unsigned int flags, unsigned int helloId, unsigned long long secret)
+{
+    unsigned char hello[PACKET_HELLO_LEN + PACKET_HELLO_SECRET_LEN] = {
+        'S', 'C', 'A', 'M', (unsigned char) version, (unsigned char) flags,
+        (unsigned char)(helloId >> 8), (unsigned char) helloId };
+    for(int i = 0; i < PACKET_HELLO_SECRET_LEN; i++)
+    {
+        hello[PACKET_HELLO_LEN + i] = (unsigned char)(secret >> (8 * (PACKET_HELLO_SECRET_LEN - 1 - i)));
+    }
+    ssize_t helloLen = CPacketParser::GetHelloLen(hello);
+    printf("smartcam: session %d speaks protocol v%d\n", sessionId, version);
+    // the phone waits for the answer, so the socket buffer is empty
+    SendControl(socket, hello, helloLen, "the hello answer");
+}
+
+// Tells a v2 phone what to send
+void CSmartSession::SendStreamParams(const StreamParams* params)
+{
+    unsigned char message[PACKET_CONTROL_LEN];
+    message[0] = CONTROL_STREAM_PARAMS;
+    message[1] = (unsigned char) params->fps;
+    message[2] = (unsigned char) params->quality;
+    message[3] = (unsigned char)(params->isRaw ? CODEC_NV21 : CODEC_JPEG);
+    message[4] = (unsigned char)(params->width >> 8);
+    message[5] = (unsigned char) params->width;
+    message[6] = (unsigned char)(params->height >> 8);
+    message[7] = (unsigned char) params->height;
+    printf("smartcam: session %d asks for %d fps, %s %d, %dx%d\n", sessionId, params->fps,
+           (params->isRaw ? "raw frames, quality" : "quality"), params->quality, params->width, params->height);
+    g_mutex_lock(pathLock);
+    // nobody to tell while the phone is gone, it gets them with the hello answer
+    if(clientSocket != INVALID_SOCKET)
+    {
+        SendControl(clientSocket, message, sizeof(message), "stream params");
+    }
+    g_mutex_unlock(pathLock);
+}
+
+// Sends the next clock ping when it is due; the decode thread sends all
+// pings and takes all replies, so the clock sync needs no lock
+void CSmartSession::PingClock()
+{
+    unsigned long long now = CPacketRing::GetMicros();
+    if(!isClockAgreed || now < nextPingMicros)
+    {
+        return;
+    }
+    nextPingMicros = now + pClockSync->GetPingIntervalMicros();
+    unsigned char message[PACKET_CONTROL_LEN];
+    memset(message, 0, sizeof(message));
+    message[0] = CONTROL_CLOCK_PING;
+    g_mutex_lock(pathLock);
+    if(clientSocket != INVALID_SOCKET)
+    {
+        // only a ping that went out may be answered
+        unsigned int pingId = pClockSync->GetNextPingId();
+        message[2] = (unsigned char)(pingId >> 8);
+        message[3] = (unsigned char) pingId;
+        unsigned long long sendMicros = CPacketRing::GetMicros();
+        if(SendControl(clientSocket, message, sizeof(message), "a clock ping"))
+        {
+            pClockSync->StartPing(sendMicros);
+        }
+    }
+    g_mutex_unlock(pathLock);
+}
+
+// The phone stamped the reply header with its send time
+void CSmartSession::ProcessClockReply(SmartCamPacket* packet)
+{
+    unsigned int pingId = ((unsigned int)packet->data[0] << 8) | packet->data[1];
+    unsigned long long phoneRecvMicros = 0;
+    for(int i = 4; i < PACKET_CLOCK_REPLY_LEN; i++)
+    {
+        phoneRecvMicros = (phoneRecvMicros << 8) | packet->data[i];
+    }
+    bool wasSynced = pClockSync->IsSynced();
+    pClockSync->AddReply(pingId, phoneRecvMicros, packet->captureMicros, packet->receiveMicros);
+    if(!wasSynced && pClockSync->IsSynced())
+    {
+        printf("smartcam: session %d clock synced, phone clock %+lld ms off, round trip %u us\n", sessionId,
+               pClockSync->GetOffsetMicros(packet->receiveMicros) / 1000, pClockSync->GetRoundTripMicros());
+    }
+}
+
+// Tells the phone which share of its frames to send on each connection,
+// whenever the paths or their capacities change
+void CSmartSession::SendPathShares()
+{
+    unsigned char message[PACKET_CONTROL_LEN];
+    for(int i = 0; i < pMultipath->GetPathCount(); i++)
+    {
+        // a path whose hello is not answered yet gets its share afterwards
+        if(!isPathReady[i])
+        {
+            continue;
+        }
+        memset(message, 0, sizeof(message));
+        message[0] = CONTROL_PATH_SHARE;
+        message[1] = (unsigned char) pMultipath->GetShare(i);
+        printf("smartcam: session %d asks for %d%% of the frames over %s (%u kB/s)\n", sessionId,
+               pMultipath->GetShare(i), GetPathName(pMultipath->GetPathType(i)), pMultipath->GetCapacity(i) / 1024);
+        SendControl(pathSockets[i], message, sizeof(message), "a path share");
+    }
+}
+
+// Frames missing between two sequence numbers were lost on the phone, on the
+// way or in the jitter buffer; a sequence going back means the phone restarted
+void CSmartSession::CountGaps(SmartCamPacket* packet)
+{
+    if(!packet->hasSeq)
+    {
+        return;
+    }
+    if(hasLastSeq)
+    {
+        int distance = (int)(packet->seq - lastSeq);
+        if(distance > 1)
+        {
+            gapCount += distance - 1;
+        }
+    }
+    lastSeq = packet->seq;
+    hasLastSeq = true;
+}
+
+// Whether the drop policy lets the decoder skip this frame
+bool CSmartSession::IsStale(SmartCamPacket* packet)
+{
+    switch(dropPolicy)
+    {
+    case DROP_LATEST_WINS:
+        return pPacketRing->HasNewerFrame();
+    case DROP_OLDER_THAN:
+        return CPacketRing::GetMicros() - packet->receiveMicros > dropMaxAgeMicros;
+    default:
+        return false;
+    }
+}
+
+// Runs on the decode thread, the packet data is read in place from the ring
+void CSmartSession::ProcessPacket(SmartCamPacket* packet)
+{
+    // decoded in part already, by StreamPacket()
+    bool isStreamed = (packet == streamedPacket);
+    streamedPacket = NULL;
+    PingClock();
+    if(packet->type == PACKET_JPEG_HEDAER)
+    {
+        // the same frame bytes may make another picture with other tables
+        shownFrameHash = 0;
+        pJpegHandler->decodeHeader(packet->data, packet->length);
+    }
+    else if(packet->type == PACKET_CLOCK_REPLY)
+    {
+        ProcessClockReply(packet);
+    }
+    else if(packet->type == PACKET_JPEG_DATA)
+    {
+        // tables are always decoded, frames only while they are current
+        if(IsStale(packet))
+        {
+            pJpegHandler->abortStream();
+            GovernFrame(packet, false, 0);
+            CountGaps(packet);
+            ++droppedCount;
+            return;
+        }
+        if(IsRepeat(packet, isStreamed) && RepeatFrame(packet))
+        {
+            pJpegHandler->abortStream();
+            return;
+        }
+        if(IsStillSkip(packet))
+        {
+            // the device keeps showing the last frame, or gets it again
+            pJpegHandler->abortStream();
+            if(!isDeviceRepeatOk || !RepeatFrame(packet))
+            {
+                GovernFrame(packet, false, 0);
+                CountGaps(packet);
+            }
+            return;
+        }
+        unsigned long long startMicros = CPacketRing::GetMicros();
+        int queueDepth = pPacketRing->GetPendingCount();
+        int w = 0, h = 0;
+        GdkPixbuf* scaledPixbuf = CDecoderPool::DecodeFrame(pJpegHandler, pRawHandler, packet, isStreamed,
+                                CSmartEngine::SMARTCAM_FRAME_WIDTH, CSmartEngine::SMARTCAM_FRAME_HEIGHT,
+                                false, &w, &h);
+        if(scaledPixbuf == NULL)
+        {
+            shownFrameHash = 0;
+            return;
+        }
+        stillDecodeMicros = packet->receiveMicros;
+        shownFrameHash = frameHash;
+        if(isFrameDcMapped)
+        {
+            JpegDcMap* map = pShownDcMap;
+            pShownDcMap = pFrameDcMap;
+            pFrameDcMap = map;
+        }
+        else
+        {
+            pShownDcMap->blocksWide = 0;
+        }
+        OutputFrame(packet, scaledPixbuf, w, h, CPacketRing::GetMicros() - startMicros, queueDepth);
+        g_object_unref(scaledPixbuf);
+        scaledPixbuf = NULL;
+    }
+}
+
+// Runs on the decode thread with a decoder pool: the pool takes a copy of
+// the packet, tables are shared by the frames after them, and whatever is
+// not decoded goes through the pool anyway to be accounted for in order
+void CSmartSession::DispatchPacket(SmartCamPacket* packet)
+{
+    if(packet->type == PACKET_JPEG_HEDAER)
+    {
+        shownFrameHash = 0;
+        pDecoderPool->SetTables(packet->data, packet->length);
+        return;
+    }
+    bool isDecodeWanted = (packet->type == PACKET_JPEG_DATA && !IsStale(packet));
+    bool isRepeat = false;
+    if(isDecodeWanted)
+    {
+        // taken for shown once submitted, the output finds out otherwise
+        isRepeat = IsRepeat(packet, false);
+        isDecodeWanted = !isRepeat;
+        shownFrameHash = frameHash;
+    }
+    pDecoderPool->Submit(packet, isDecodeWanted, isRepeat, (isDecodeWanted ? pPacketRing->GetPendingCount() : 0));
+}
+
+// Runs on the output thread, for the pool's packets in the order they came in
+void CSmartSession::OutputJob(DecodeJob* job)
+{
+    SmartCamPacket* packet = &job->packet;
+    PingClock();
+    if(packet->type == PACKET_CLOCK_REPLY)
+    {
+        ProcessClockReply(packet);
+    }
+    else if(packet->type == PACKET_JPEG_DATA && !job->isDecodeWanted)
+    {
+        // a repeat the driver turns down is lost, it was not decoded
+        if(!job->isRepeat || !RepeatFrame(packet))
+        {
+            GovernFrame(packet, false, 0);
+            CountGaps(packet);
+            ++droppedCount;
+        }
+    }
+    else if(packet->type == PACKET_JPEG_DATA && job->pixbuf != NULL)
+    {
+        // the workers share the load, the rate controller sees one core's worth
+        OutputFrame(packet, job->pixbuf, job->width, job->height,
+                    job->decodeMicros / pDecoderPool->GetWorkerCount(), job->queueDepth);
+    }
+}
+
+// Writes a decoded frame to the device and the preview, and accounts for it
+void CSmartSession::OutputFrame(SmartCamPacket* packet, GdkPixbuf* pixbuf, int width, int height,
+                                unsigned long long decodeMicros, int queueDepth)
+{
+    unsigned long long startMicros = CPacketRing::GetMicros();
+    unsigned char* driverBufferRgb24 = gdk_pixbuf_get_pixels(pixbuf);
+    unsigned long long captureHostMicros = StampDeviceFrame(packet);
+    // write the frame in the driver
+    CSmartEngine::WriteDeviceFrame(deviceFd, (const char*)driverBufferRgb24, CSmartEngine::SMARTCAM_FRAME_SIZE);
+    unsigned long long writtenMicros = CPacketRing::GetMicros();
+    sampleDecodeMicros += decodeMicros + (writtenMicros - startMicros);
+    avgDecodeMicros = (avgDecodeMicros * 7 + decodeMicros) / 8;
+    sampleBytes += packet->length;
+    if(queueDepth > sampleQueueDepth)
+    {
+        sampleQueueDepth = queueDepth;
+    }
+    crtWidth = width;
+    crtHeight = height;
+    GovernFrame(packet, true, decodeMicros);
+    // draw the frame (only the preview session does)
+    pSmartEngine->OnFrame(this, pixbuf);
+    FinishFrame(packet, captureHostMicros, writtenMicros);
+}
+
+// Whether the frame shows what the last one shown did: sent again byte for
+// byte, or (setting, JPEG only) with every block about as bright. Leaves
+// the frame's hash and DC map behind for when it is shown, and scores its
+// motion on the way (setting).
+bool CSmartSession::IsRepeat(SmartCamPacket* packet, bool isStreamed)
+{
+    frameHash = 0;
+    isFrameDcMapped = false;
+    if(!isDeviceRepeatOk && !isMotionEnabled)
+    {
+        return false;
+    }
+    if(isSkipIdenticalEnabled || isMotionEnabled)
+    {
+        frameHash = CJpegHandler::hashFrame(packet->data, packet->length);
+        if(frameHash == shownFrameHash)
+        {
+            TrackMotion(0);
+            if(isSkipIdenticalEnabled && isDeviceRepeatOk)
+            {
+                ++repeatedCount;
+                return true;
+            }
+            return false;
+        }
+    }
+    // a frame decoded in part already is cheaper to finish
+    if((!isSkipSimilarEnabled && !isMotionEnabled) || isStreamed || packet->codec != CODEC_JPEG)
+    {
+        return false;
+    }
+    isFrameDcMapped = pJpegHandler->decodeDcMap(packet->data, packet->length, pFrameDcMap);
+    if(isFrameDcMapped && isMotionEnabled)
+    {
+        TrackMotion(CJpegHandler::motionScore(pFrameDcMap, pLastDcMap, MOTION_BLOCK_DC));
+        CJpegHandler::copyDcMap(pLastDcMap, pFrameDcMap);
+    }
+    if(!isSkipSimilarEnabled || !isDeviceRepeatOk)
+    {
+        return false;
+    }
+    int maxDiff = 0;
+    int meanDiff = (isFrameDcMapped ? CJpegHandler::compareDcMaps(pFrameDcMap, pShownDcMap, maxDiff) : -1);
+    if(meanDiff < 0 || meanDiff > SIMILAR_MEAN_DC || maxDiff > SIMILAR_MAX_DC)
+    {
+        return false;
+    }
+    ++similarCount;
+    return true;
+}
+
+// Scores the motion of the frame against the one before it, -1 if it cannot
+// be told (another size): the scene is still once it stopped moving for a
+// while, and the first frame that moves again ends that
+void CSmartSession::TrackMotion(int score)
+{
+    if(score < 0)
+    {
+        return;
+    }
+    motionScore = score;
+    if(score >= MOTION_MIN_SCORE)
+    {
+        if(stillFrames >= MOTION_STILL_FRAMES)
+        {
+            printf("smartcam: session %d: motion (%d%% of the picture)\n", sessionId, score);
+        }
+        stillFrames = 0;
+        ++motionCount;
+        return;
+    }
+    if(++stillFrames == MOTION_STILL_FRAMES)
+    {
+        printf("smartcam: session %d: still\n", sessionId);
+    }
+}
+
+// Whether the frame can be left out because the scene is still and a frame
+// was decoded less than a still frame interval (setting) ago
+bool CSmartSession::IsStillSkip(SmartCamPacket* packet)
+{
+    if(stillFps <= 0 || stillFrames < MOTION_STILL_FRAMES)
+    {
+        return false;
+    }
+    if(packet->receiveMicros - stillDecodeMicros >= 1000000ULL / stillFps)
+    {
+        return false;
+    }
+    ++stillCount;
+    return true;
+}
+
+// Shows the last frame again for a packet that repeats it: the driver hands
+// it out as a new frame, nothing is decoded, written or drawn. False if the
+// driver cannot, the frame has to be decoded then.
+bool CSmartSession::RepeatFrame(SmartCamPacket* packet)
+{
+    unsigned long long captureHostMicros = StampDeviceFrame(packet);
+    if(CSmartEngine::RepeatDeviceFrame(deviceFd) != 0)
+    {
+        printf("smartcam: session %d: the driver does not repeat frames, they are decoded again\n", sessionId);
+        isDeviceRepeatOk = false;
+        return false;
+    }
+    savedDecodeMicros += avgDecodeMicros;
+    sampleBytes += packet->length;
+    GovernFrame(packet, false, 0);
+    FinishFrame(packet, captureHostMicros, CPacketRing::GetMicros());
+    return true;
+}
+
+// The capture time on the host clock, once the clocks are synced, for the
+// frame timestamp and the latency; 0 if unknown
+unsigned long long CSmartSession::StampDeviceFrame(SmartCamPacket* packet)
+{
+    unsigned long long captureHostMicros = 0;
+    if(packet->hasCaptureTime && pClockSync->IsSynced())
+    {
+        captureHostMicros = pClockSync->ToHostMicros(packet->captureMicros);
+        if(captureHostMicros > packet->receiveMicros)
+        {
+            captureHostMicros = packet->receiveMicros;
+        }
+        if(deviceFd != -1 && isDeviceTimestampOk &&
+           CSmartEngine::SetDeviceTimestamp(deviceFd, captureHostMicros) != 0)
+        {
+            printf("smartcam: session %d: the driver does not take capture times\n", sessionId);
+            isDeviceTimestampOk = false;
+        }
+    }
+    return captureHostMicros;
+}
+
+// Accounts for a frame that reached the device, written or repeated
+void CSmartSession::FinishFrame(SmartCamPacket* packet, unsigned long long captureHostMicros,
+                                unsigned long long writtenMicros)
+{
+    unsigned long long latencyMicros = writtenMicros -
+                                       (captureHostMicros != 0 ? captureHostMicros : packet->receiveMicros);
+    // frames received before the reconnect do not count
+    if(reconnectMicros != 0 && packet->receiveMicros >= reconnectMicros)
+    {
+        unsigned long long firstFrameMicros = writtenMicros - reconnectMicros;
+        reconnectMicros = 0;
+        resumeFrameMicros += firstFrameMicros;
+        printf("smartcam: session %d shows frames again %llu ms after the reconnect\n",
+               sessionId, firstFrameMicros / 1000);
+    }
+    CountGaps(packet);
+    SampleFPS(packet, latencyMicros);
+}
+
+// Feeds a JPEG frame, decoded or skipped, to the decode governor and hands
+// a new tier to whoever decodes the next frames
+void CSmartSession::GovernFrame(SmartCamPacket* packet, bool isDecoded, unsigned long long decodeMicros)
+{
+    if(pDecodeGovernor == NULL || packet->codec != CODEC_JPEG)
+    {
+        return;
+    }
+    unsigned long long frameMicros = (packet->hasCaptureTime ? packet->captureMicros : packet->receiveMicros);
+    bool isChanged = (isDecoded ? pDecodeGovernor->AddFrame(decodeMicros, frameMicros) :
+                                  pDecodeGovernor->SkipFrame(frameMicros));
+    if(!isChanged)
+    {
+        return;
+    }
+    JpegDecodeTier tier = pDecodeGovernor->GetTier();
+    if(pDecoderPool != NULL)
+    {
+        pDecoderPool->SetDecodeTier(tier);
+    }
+    else
+    {
+        pJpegHandler->setDecodeTier(tier);
+    }
+    printf("smartcam: session %d decodes at %s (was %s)\n", sessionId, CDecodeGovernor::GetTierName(tier),
+           CDecodeGovernor::GetTierName((JpegDecodeTier) decodeTier));
+    decodeTier = tier;
+}
+
+// Called for every frame written; once a second it publishes the frame rate
+// (from the capture times when the phone sends them, so the arrival jitter
+// does not show) and the average receive to write latency
+void CSmartSession::SampleFPS(SmartCamPacket* packet, unsigned long long latencyMicros)
+{
+    unsigned long nowMillis = GetMillis();
+    if(packet->hasCaptureTime)
+    {
+        if(sampleCaptureFrames == 0)
+        {
+            sampleFirstCaptureMicros = packet->captureMicros;
+        }
+        sampleLastCaptureMicros = packet->captureMicros;
+        ++sampleCaptureFrames;
+    }
+    if(lastSampleTimeMillis == 0)
+    {
+        lastSampleTimeMillis = nowMillis;
+        return;
+    }
+    ++crtSampleFrames;
+    sampleLatencyMicros += latencyMicros;
+    unsigned long elapsedMillis = nowMillis - lastSampleTimeMillis;
+    if(elapsedMillis < 1000)
+    {
+        return;
+    }
+    if(sampleCaptureFrames > 1 && sampleLastCaptureMicros > sampleFirstCaptureMicros)
+    {
+        crtFps = ((float)(sampleCaptureFrames - 1) * 1000000)/(sampleLastCaptureMicros - sampleFirstCaptureMicros);
+    }
+    else
+    {
+        crtFps = ((float)crtSampleFrames * 1000)/elapsedMillis;
+    }
+    crtLatencyMillis = ((float)sampleLatencyMicros / crtSampleFrames)/1000;
+    pSmartEngine->OnFpsSampled(this);
+    if(pRateController != NULL && protocolVersion >= SMARTCAM_PROTOCOL_V2)
+    {
+        RateSample sample;
+        sample.fps = crtFps;
+        sample.decodeMillis = ((float)sampleDecodeMicros / crtSampleFrames)/1000;
+        sample.queueDepth = sampleQueueDepth;
+        sample.gaps = gapCount - sampleGapBase;
+        sample.bytesPerSecond = (unsigned int)(sampleBytes * 1000 / elapsedMillis);
+        if(pRateController->Update(&sample))
+        {
+            SendStreamParams(pRateController->GetParams());
+        }
+    }
+    sampleDecodeMicros = 0;
+    sampleQueueDepth = 0;
+    sampleBytes = 0;
+    sampleGapBase = gapCount;
+    lastSampleTimeMillis = nowMillis;
+    crtSampleFrames = 0;
+    sampleLatencyMicros = 0;
+    // the last frame opens the next sample
+    sampleFirstCaptureMicros = sampleLastCaptureMicros;
+    sampleCaptureFrames = (sampleCaptureFrames > 0 ? 1 : 0);
+}
@@ -0,0 +1,291 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// SmartSession.h
+
+#ifndef __SMART_SESSION_H__
+#define __SMART_SESSION_H__
+
+#include <gtk/gtk.h>
+
+#include "CommHandler.h"
+#include "UserSettings.h"
+#include "MultipathStream.h"
+
+class CSmartEngine;
+class CJpegHandler;
+class CRawHandler;
+class CClockSync;
+class CPacketRing;
+class CUdpAssembler;
+class CRateController;
+class CIoUring;
+class CDecoderPool;
+class CDecodeGovernor;
+struct SmartCamPacket;
+struct JpegDcMap;
+struct DecodeJob;
+struct StreamParams;
+
+// One connected phone: owns the client socket and runs its own receive,
+// decode and device write pipeline, bound to one smartcam video device.
+// The session thread drains the socket into a packet ring while the
+// decode thread decodes the previous packet straight out of the ring.
+// UDP sessions reassemble the fragments first and push whole packets, and
+// so do multipath sessions once their paths' packets are back in order.
+// With a decoder pool, the decode thread hands the packets to the pool's
+// workers instead, and an output thread writes the frames in sequence.
+class CSmartSession
+{
+public:
+    CSmartSession(CSmartEngine* pEngine, int sessionId, int deviceFd);
+    virtual ~CSmartSession();
+    int Start(int clientSocket, ConnectionType connectionType);
+    void Stop();
+    void RequestDisconnect();
+    gboolean IsFinished();
+    int GetId();
+    float GetFps();
+    // average receive to device write time over the last FPS sample
+    float GetLatencyMillis();
+    // frames the phone sent that never made it to the device
+    unsigned int GetGapCount();
+    // frames skipped by the drop policy
+    unsigned int GetDroppedCount();
+    // JpegDecodeTier the frames are decoded at
+    int GetDecodeTier();
+    // share of the picture that moved since the last frame, percent; -1
+    // unless motion is detected (setting)
+    int GetMotionScore();
+    // whether the picture stopped moving for a while
+    gboolean IsStill();
+    int GetWidth();
+    int GetHeight();
+    ConnectionType GetConnectionType();
+    // multipath stream id, 0 unless the phone stripes its stream
+    unsigned int GetMultipathId();
+    // the secret every connection of the multipath stream has to bring along
+    unsigned long long GetMultipathSecret();
+    // Hands another connection of the stream over to the session thread
+    // (called from the comm thread), -1 if it cannot take one now
+    int AddPath(int socket, ConnectionType connectionType);
+    // resume token the phone got with its hello answer, 0 if none
+    unsigned long long GetResumeToken();
+    // Hands the connection a phone came back on over to the session thread
+    // (called from the comm thread), -1 unless the session waits for it
+    int Resume(int socket, ConnectionType connectionType);
+    // whether the phone is gone and the session waits for it to come back
+    gboolean IsSuspended();
+
+private:
+    // Methods:
+    void Wakeup();
+    CommEventType WaitEvent(int timeoutMillis);
+    CommEventType WaitUringEvent(int timeoutMillis);
+    int StartUring();
+    void CancelUring();
+    bool HandleWakeup();
+    int GetWaitTimeout();
+    void HandleTimeout();
+    int RcvPackets();
+    int RcvDatagrams();
+    int StartMultipath(unsigned int streamId, unsigned long long secret);
+    void StopUring();
+    void OpenPath(int socket, ConnectionType connectionType);
+    bool ClosePath(int path);
+    int RcvPaths();
+    int RcvPath(int path);
+    void SendPathShares();
+    bool SendControl(int socket, const unsigned char* message, ssize_t len, const char* what);
+    void SendHello(int socket, int version, unsigned int flags, unsigned int helloId, unsigned long long secret);
+    void SendStreamParams(const StreamParams* params);
+    void PingClock();
+    void ProcessClockReply(SmartCamPacket* packet);
+    void LosePeer();
+    void Suspend();
+    void DropClient();
+    void TakeOverClient(int socket, ConnectionType connectionType);
+    void StreamPacket();
+    void ProcessPacket(SmartCamPacket* packet);
+    void DispatchPacket(SmartCamPacket* packet);
+    void OutputJob(DecodeJob* job);
+    void OutputFrame(SmartCamPacket* packet, GdkPixbuf* pixbuf, int width, int height,
+                     unsigned long long decodeMicros, int queueDepth);
+    bool IsRepeat(SmartCamPacket* packet, bool isStreamed);
+    bool RepeatFrame(SmartCamPacket* packet);
+    void TrackMotion(int score);
+    bool IsStillSkip(SmartCamPacket* packet);
+    unsigned long long StampDeviceFrame(SmartCamPacket* packet);
+    void FinishFrame(SmartCamPacket* packet, unsigned long long captureHostMicros, unsigned long long writtenMicros);
+    void CountGaps(SmartCamPacket* packet);
+    void GovernFrame(SmartCamPacket* packet, bool isDecoded, unsigned long long decodeMicros);
+    bool IsStale(SmartCamPacket* packet);
+    void Disconnect();
+    void StopDecodeThread();
+    void SampleFPS(SmartCamPacket* packet, unsigned long long latencyMicros);
+    static unsigned long GetMillis();
+    static unsigned long long NewResumeToken();
+    static const char* GetPathName(ConnectionType connectionType);
+    // Session and decode thread procedures:
+    static void* SessionThreadProc(void* args);
+    static void* DecodeThreadProc(void* args);
+    static void* OutputThreadProc(void* args);
+
+    // Data:
+    CSmartEngine* pSmartEngine;
+    int sessionId;
+    ConnectionType connectionType;
+    GThread* sessionThread;
+    GThread* decodeThread;
+    GThread* outputThread;
+    volatile gboolean isAlive;
+    volatile gboolean isFinished;
+    volatile bool isDisconnectRequested;
+    // client socket and its event loop (client socket + wakeup eventfd)
+    int clientSocket;
+    int epollFd;
+    int wakeupFd;
+    // io_uring receive path, replaces epoll + readv for stream sessions:
+    // one readv into the packet ring and a poll on the wakeup eventfd are
+    // kept queued, a single io_uring_enter() submits and waits for both
+    CIoUring* pIoUring;
+    struct iovec* uringIov;
+    bool isUringReadPending;
+    bool isUringPollPending;
+    bool isUringTimerPending;
+    bool hasUringReadResult;
+    int uringReadResult;
+    // received packets waiting for (or being processed by) the decoder
+    CPacketRing* pPacketRing;
+    // UDP: fragment reassembly and the batch of datagrams read at once
+    CUdpAssembler* pUdpAssembler;
+    unsigned char* udpDatagrams;
+    unsigned long lastDatagramMillis;
+    // multipath: every connection of the stream is read into a ring of its
+    // own, pMultipath puts the packets back in order into pPacketRing. Path 0
+    // is clientSocket, which carries the control messages.
+    bool isMultipathEnabled;
+    int multipathReorderMillis;
+    CMultipathStream* pMultipath;
+    volatile unsigned int multipathId;
+    volatile unsigned long long multipathSecret;
+    int pathSockets[MULTIPATH_MAX_PATHS];
+    CPacketRing* pathRings[MULTIPATH_MAX_PATHS];
+    // whether the path's hello has been answered
+    bool isPathReady[MULTIPATH_MAX_PATHS];
+    // a connection handed over by the comm thread; pathLock also keeps the
+    // decode thread off clientSocket while the paths change
+    GMutex* pathLock;
+    int pendingPathSocket;
+    ConnectionType pendingPathType;
+    // dead peer detection: a stream that stays silent for peerTimeoutMillis
+    // is taken for lost, and so is a TCP peer that stops acknowledging
+    int peerTimeoutMillis;
+    unsigned long lastDataMillis;
+    // resumption: a v2 phone that lost its connection comes back with its
+    // token within resumeMillis; meanwhile the device keeps the last frame
+    int resumeMillis;
+    volatile unsigned long long resumeToken;
+    volatile gboolean isSuspended;
+    unsigned long suspendMillis;
+    int pendingResumeSocket;
+    ConnectionType pendingResumeType;
+    // time from taking the connection back to the first frame written
+    volatile unsigned long long reconnectMicros;
+    unsigned int resumeCount;
+    unsigned long long resumeFrameMicros;
+    // protocol version picked by the hello, and the back-channel it enables
+    volatile int protocolVersion;
+    CRateController* pRateController;
+    // raw frames may be asked for (setting), if the hello offers them
+    bool isRawEnabled;
+    // phone clock to host clock, if the hello agreed to clock pings
+    CClockSync* pClockSync;
+    volatile bool isClockAgreed;
+    unsigned long long nextPingMicros;
+    // cleared once the driver turned down a capture time
+    bool isDeviceTimestampOk;
+    // decode and output
+    CJpegHandler* pJpegHandler;
+    CRawHandler* pRawHandler;
+    // frames are decoded as they come in (setting); the one StreamPacket()
+    // left for ProcessPacket() to finish, if any
+    bool isStreamDecodeEnabled;
+    SmartCamPacket* streamedPacket;
+    // decoder threads, NULL to decode on the decode thread
+    CDecoderPool* pDecoderPool;
+    // decode quality against the frame interval (setting), NULL if off
+    CDecodeGovernor* pDecodeGovernor;
+    volatile int decodeTier;
+    // repeated frames (settings): the hash of the last frame shown, or with
+    // a decoder pool the last one submitted, and the DC map it was shown
+    // with; the hash and map of the frame being looked at
+    bool isSkipIdenticalEnabled;
+    bool isSkipSimilarEnabled;
+    // cleared once the driver turned down a repeat
+    volatile bool isDeviceRepeatOk;
+    unsigned long long shownFrameHash;
+    JpegDcMap* pShownDcMap;
+    unsigned long long frameHash;
+    JpegDcMap* pFrameDcMap;
+    bool isFrameDcMapped;
+    // recent decode time of a frame, what a repeat saves
+    unsigned long long avgDecodeMicros;
+    // motion detection (settings): the DC map of the frame before, frames in
+    // a row without motion, and when the last frame was decoded, which sets
+    // the pace while the scene is still
+    bool isMotionEnabled;
+    int stillFps;
+    JpegDcMap* pLastDcMap;
+    volatile int motionScore;
+    volatile int stillFrames;
+    unsigned long long stillDecodeMicros;
+    int deviceFd;
+    DropPolicy dropPolicy;
+    unsigned long long dropMaxAgeMicros;
+    int crtWidth;
+    int crtHeight;
+    // statistics
+    unsigned long lastSampleTimeMillis;
+    int crtSampleFrames;
+    float crtFps;
+    unsigned long long sampleLatencyMicros;
+    float crtLatencyMillis;
+    // rate control input: decoder load, backlog and throughput of the sample
+    unsigned long long sampleDecodeMicros;
+    int sampleQueueDepth;
+    unsigned long long sampleBytes;
+    unsigned int sampleGapBase;
+    // capture times of the first and last frame of the sample (v2)
+    int sampleCaptureFrames;
+    unsigned long long sampleFirstCaptureMicros;
+    unsigned long long sampleLastCaptureMicros;
+    bool hasLastSeq;
+    unsigned int lastSeq;
+    unsigned int gapCount;
+    unsigned int droppedCount;
+    unsigned int streamedCount;
+    unsigned int repeatedCount;
+    unsigned int similarCount;
+    unsigned long long savedDecodeMicros;
+    unsigned int motionCount;
+    unsigned int stillCount;
+};
+
+#endif//__SMART_SESSION_H__
@@ -396,9 +396,13 @@ int CUIHandler::CreateMainWnd()
     return 0;
 }
 
+// The port is used by TCP/IP and UDP, so also with Bluetooth picked as long
+// as all connections are listened on
 void CUIHandler::OnRadiobuttonBluetooth(GtkToggleButton* btn, GtkWidget* portWidget)
 {
-    if(gtk_toggle_button_get_active(btn))
+    GtkToggleButton* radiobuttonBt = GTK_TOGGLE_BUTTON(g_object_get_data(G_OBJECT(portWidget), "radiobutton-bt"));
+    GtkToggleButton* checkbuttonAll = GTK_TOGGLE_BUTTON(g_object_get_data(G_OBJECT(portWidget), "checkbutton-all"));
+    if(gtk_toggle_button_get_active(radiobuttonBt) && !gtk_toggle_button_get_active(checkbuttonAll))
     {
         g_object_set(G_OBJECT(portWidget), "sensitive", FALSE, NULL);
     }
@@ -418,6 +422,8 @@ void CUIHandler::ShowSettingsDlg(void)
     GtkWidget* radiobuttonBt;
     GtkWidget* hbox2;
     GtkWidget* radiobuttonInet;
+    GtkWidget* radiobuttonUdp;
+    GtkWidget* checkbuttonAll;
     GtkWidget* label5;
     GtkWidget* inetPort;
     GtkWidget* label4;
@@ -464,6 +470,13 @@ void CUIHandler::ShowSettingsDlg(void)
     inetPort = gtk_spin_button_new_with_range(1025, 65536, 1);
     gtk_box_pack_start(GTK_BOX(hbox2), inetPort, TRUE, TRUE, 0);
 
+    // UDP shares the port with TCP/IP
+    radiobuttonUdp = gtk_radio_button_new_with_mnemonic_from_widget(GTK_RADIO_BUTTON(radiobuttonBt), "UDP (WiFi, low latency)");
+    gtk_box_pack_start(GTK_BOX (vbox2), radiobuttonUdp, FALSE, FALSE, 0);
+
+    checkbuttonAll = gtk_check_button_new_with_mnemonic("Accept phones on all connections");
+    gtk_box_pack_start(GTK_BOX (vbox2), checkbuttonAll, FALSE, FALSE, 0);
+
     label4 = gtk_label_new("Connection");
     gtk_frame_set_label_widget(GTK_FRAME(frame4), label4);
     gtk_label_set_use_markup(GTK_LABEL(label4), TRUE);
@@ -471,13 +484,22 @@ void CUIHandler::ShowSettingsDlg(void)
     dialog_action_area1 = GTK_DIALOG(settingsDlg)->action_area;
     gtk_button_box_set_layout(GTK_BUTTON_BOX(dialog_action_area1), GTK_BUTTONBOX_END);
 
+    g_object_set_data(G_OBJECT(inetPort), "radiobutton-bt", radiobuttonBt);
+    g_object_set_data(G_OBJECT(inetPort), "checkbutton-all", checkbuttonAll);
     g_signal_connect(G_OBJECT(radiobuttonBt), "toggled", G_CALLBACK(OnRadiobuttonBluetooth), inetPort);
+    g_signal_connect(G_OBJECT(checkbuttonAll), "toggled", G_CALLBACK(OnRadiobuttonBluetooth), inetPort);
     
     if(crtSettings.connectionType == CONN_BLUETOOTH)
     {
         gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(radiobuttonBt), TRUE);
         gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(radiobuttonInet), FALSE);
-        g_object_set(G_OBJECT(inetPort), "sensitive", FALSE, NULL);
+        g_object_set(G_OBJECT(inetPort), "sensitive", crtSettings.listenAll, NULL);
+    }
+    else if(crtSettings.connectionType == CONN_UDP)
+    {
+        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(radiobuttonBt), FALSE);
+        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(radiobuttonUdp), TRUE);
+        g_object_set(G_OBJECT(inetPort), "sensitive", TRUE, NULL);
     }
     else
     {
@@ -485,15 +507,26 @@ void CUIHandler::ShowSettingsDlg(void)
         gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(radiobuttonInet), TRUE);
         g_object_set(G_OBJECT(inetPort), "sensitive", TRUE, NULL);
     }
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(checkbuttonAll), crtSettings.listenAll);
     gtk_spin_button_set_value(GTK_SPIN_BUTTON(inetPort), crtSettings.inetPort);
     gtk_widget_show_all(settingsDlg);
 
     if(gtk_dialog_run(GTK_DIALOG(settingsDlg)) == GTK_RESPONSE_OK)
     {
         CUserSettings newSettings = crtSettings;
+        newSettings.listenAll = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(checkbuttonAll));
         if(gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(radiobuttonBt)))
         {
             newSettings.connectionType = CONN_BLUETOOTH;
+            if(newSettings.listenAll)
+            {
+                newSettings.inetPort = gtk_spin_button_get_value(GTK_SPIN_BUTTON(inetPort));
+            }
+        }
+        else if(gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(radiobuttonUdp)))
+        {
+            newSettings.connectionType = CONN_UDP;
+            newSettings.inetPort = gtk_spin_button_get_value(GTK_SPIN_BUTTON(inetPort));
         }
         else
         {
@@ -546,8 +579,7 @@ void CUIHandler::UpdateOnConnected()
     gdk_threads_enter();
     gtk_status_icon_set_from_pixbuf(trayIcon, connectedTrayIcon);
     gtk_status_icon_set_tooltip(trayIcon, TRAY_TOOLTIP_CONNECTED);
-    g_object_set(G_OBJECT(tbSettings), "sensitive", FALSE, NULL);    // disable settings
-    g_object_set(G_OBJECT(miSettings), "sensitive", FALSE, NULL);
+    // settings stay enabled: the comm thread applies them without dropping the phones
     g_object_set(G_OBJECT(tbDisconnect), "sensitive", TRUE, NULL);   // enable disconnect
     gtk_label_set_text(GTK_LABEL(statusbarLabelConnection), STATUS_MSG_CONNECTED);
     gdk_threads_leave();
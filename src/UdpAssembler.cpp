@@ -0,0 +1,370 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// UdpAssembler.cpp
+
+#include <string.h>
+
+#include "UdpAssembler.h"
+#include "PacketRing.h"
+
+#define UDP_MAX_FRAGMENTS ((PACKET_MAX_LEN + UDP_FRAGMENT_PAYLOAD_LEN - 1) / UDP_FRAGMENT_PAYLOAD_LEN)
+
+CUdpAssembler::CUdpAssembler():
+    frames(NULL),
+    frameCount(0),
+    jitterMillis(0),
+    hasNextSeq(false),
+    nextSeq(0),
+    seqWraps(0),
+    deliveredCount(0),
+    droppedCount(0),
+    recoveredCount(0)
+{
+}
+
+CUdpAssembler::~CUdpAssembler()
+{
+    if(frames != NULL)
+    {
+        for(int i = 0; i < frameCount; i++)
+        {
+            delete[] frames[i].data;
+            delete[] frames[i].fragReceived;
+            delete[] frames[i].parity;
+            delete[] frames[i].parityReceived;
+        }
+        delete[] frames;
+        frames = NULL;
+    }
+}
+
+int CUdpAssembler::Initialize(int jitterFrames, int jitter)
+{
+    frameCount = (jitterFrames < 1 ? 1 : jitterFrames);
+    jitterMillis = (jitter < 0 ? 0 : jitter);
+    frames = new UdpFrame[frameCount];
+    memset(frames, 0, frameCount * sizeof(UdpFrame));
+    return 0;
+}
+
+// The window is a handful of frames, a linear search is cheaper than
+// keeping an index that has to survive the sequence wrap
+CUdpAssembler::UdpFrame* CUdpAssembler::FindFrame(uint16_t seq)
+{
+    for(int i = 0; i < frameCount; i++)
+    {
+        if(frames[i].inUse && frames[i].seq == seq)
+        {
+            return &frames[i];
+        }
+    }
+    return NULL;
+}
+
+unsigned int CUdpAssembler::GetFragmentLen(UdpFrame* frame, unsigned int index)
+{
+    if(index == frame->fragCount - 1)
+    {
+        return frame->length - index * UDP_FRAGMENT_PAYLOAD_LEN;
+    }
+    return UDP_FRAGMENT_PAYLOAD_LEN;
+}
+
+void CUdpAssembler::PrepareFrame(UdpFrame* frame, uint16_t seq, SmartCamPacketType type,
+                                unsigned int length, unsigned int fragCount, unsigned int fecGroup, unsigned long nowMillis)
+{
+    if(frame->fragCapacity < fragCount)
+    {
+        delete[] frame->data;
+        delete[] frame->fragReceived;
+        delete[] frame->parity;
+        delete[] frame->parityReceived;
+        frame->data = new unsigned char[fragCount * UDP_FRAGMENT_PAYLOAD_LEN];
+        frame->fragReceived = new unsigned char[fragCount];
+        frame->parity = new unsigned char[fragCount * UDP_FRAGMENT_PAYLOAD_LEN];
+        frame->parityReceived = new unsigned char[fragCount];
+        frame->fragCapacity = fragCount;
+    }
+    memset(frame->fragReceived, 0, fragCount);
+    memset(frame->parityReceived, 0, fragCount);
+    frame->inUse = true;
+    frame->seq = seq;
+    frame->type = type;
+    frame->length = length;
+    frame->fragCount = fragCount;
+    frame->received = 0;
+    frame->fecGroup = fecGroup;
+    frame->firstMillis = nowMillis;
+}
+
+// Rebuilds the only missing data fragment of a FEC group from its parity
+void CUdpAssembler::Recover(UdpFrame* frame, unsigned int group)
+{
+    unsigned int first = group * frame->fecGroup;
+    unsigned int last = first + frame->fecGroup;
+    unsigned int missing = frame->fragCount;
+    if(!frame->parityReceived[group])
+    {
+        return;
+    }
+    if(last > frame->fragCount)
+    {
+        last = frame->fragCount;
+    }
+    for(unsigned int i = first; i < last; i++)
+    {
+        if(!frame->fragReceived[i])
+        {
+            if(missing != frame->fragCount)
+            {
+                return;     // more than one lost, nothing to do
+            }
+            missing = i;
+        }
+    }
+    if(missing == frame->fragCount)
+    {
+        return;
+    }
+
+    unsigned char* out = frame->data + missing * UDP_FRAGMENT_PAYLOAD_LEN;
+    memcpy(out, frame->parity + group * UDP_FRAGMENT_PAYLOAD_LEN, UDP_FRAGMENT_PAYLOAD_LEN);
+    for(unsigned int i = first; i < last; i++)
+    {
+        if(i == missing)
+        {
+            continue;
+        }
+        const unsigned char* in = frame->data + i * UDP_FRAGMENT_PAYLOAD_LEN;
+        unsigned int len = GetFragmentLen(frame, i);
+        for(unsigned int j = 0; j < len; j++)
+        {
+            out[j] ^= in[j];
+        }
+    }
+    frame->fragReceived[missing] = 1;
+    ++frame->received;
+    ++recoveredCount;
+}
+
+void CUdpAssembler::DropNext()
+{
+    UdpFrame* frame = FindFrame(nextSeq);
+    if(frame != NULL)
+    {
+        frame->inUse = false;
+    }
+    ++droppedCount;
+    AdvanceSeq();
+}
+
+void CUdpAssembler::AdvanceSeq()
+{
+    if(++nextSeq == 0)
+    {
+        ++seqWraps;
+    }
+}
+
+void CUdpAssembler::Feed(const unsigned char* datagram, unsigned int length, unsigned long nowMillis)
+{
+    if(length < UDP_FRAGMENT_HEADER_LEN)
+    {
+        return;
+    }
+    unsigned int flags = datagram[0];
+    SmartCamPacketType type = (SmartCamPacketType) datagram[1];
+    uint16_t seq = ((uint16_t)datagram[2] << 8) | datagram[3];
+    unsigned int index = ((unsigned int)datagram[4] << 8) | datagram[5];
+    unsigned int fragCount = ((unsigned int)datagram[6] << 8) | datagram[7];
+    unsigned int frameLen = ((unsigned int)datagram[8] << 24) | ((unsigned int)datagram[9] << 16) |
+                            ((unsigned int)datagram[10] << 8) | ((unsigned int)datagram[11]);
+    unsigned int fecGroup = datagram[12];
+    const unsigned char* payload = datagram + UDP_FRAGMENT_HEADER_LEN;
+    unsigned int payloadLen = length - UDP_FRAGMENT_HEADER_LEN;
+
+    if(type != PACKET_JPEG_HEDAER && type != PACKET_JPEG_DATA)
+    {
+        return;
+    }
+    if(fragCount == 0 || fragCount > UDP_MAX_FRAGMENTS ||
+       frameLen > fragCount * UDP_FRAGMENT_PAYLOAD_LEN || frameLen <= (fragCount - 1) * UDP_FRAGMENT_PAYLOAD_LEN)
+    {
+        return;
+    }
+
+    if(!hasNextSeq)
+    {
+        nextSeq = seq;
+        hasNextSeq = true;
+    }
+    int distance = (int16_t)(uint16_t)(seq - nextSeq);
+    // the phone restarted its sequence, start over
+    if(distance >= 4 * frameCount || distance <= -4 * frameCount)
+    {
+        for(int i = 0; i < frameCount; i++)
+        {
+            if(frames[i].inUse)
+            {
+                frames[i].inUse = false;
+                ++droppedCount;
+            }
+        }
+        nextSeq = seq;
+        distance = 0;
+    }
+    // late fragment of a frame already delivered or dropped
+    if(distance < 0)
+    {
+        return;
+    }
+    // make room in the window, the oldest frames lose
+    while(distance >= frameCount)
+    {
+        DropNext();
+        distance = (int16_t)(uint16_t)(seq - nextSeq);
+    }
+
+    // the window holds frameCount sequence numbers, so a new frame always
+    // finds a free entry
+    UdpFrame* frame = FindFrame(seq);
+    if(frame == NULL)
+    {
+        for(int i = 0; i < frameCount && frame == NULL; i++)
+        {
+            if(!frames[i].inUse)
+            {
+                frame = &frames[i];
+            }
+        }
+        PrepareFrame(frame, seq, type, frameLen, fragCount, fecGroup, nowMillis);
+    }
+    else if(frame->length != frameLen || frame->fragCount != fragCount)
+    {
+        return;
+    }
+
+    if(flags & UDP_FLAG_PARITY)
+    {
+        if(frame->fecGroup == 0 || index * frame->fecGroup >= fragCount ||
+           payloadLen != UDP_FRAGMENT_PAYLOAD_LEN || frame->parityReceived[index])
+        {
+            return;
+        }
+        memcpy(frame->parity + index * UDP_FRAGMENT_PAYLOAD_LEN, payload, UDP_FRAGMENT_PAYLOAD_LEN);
+        frame->parityReceived[index] = 1;
+        Recover(frame, index);
+        return;
+    }
+    if(index >= fragCount || frame->fragReceived[index] || payloadLen != GetFragmentLen(frame, index))
+    {
+        return;
+    }
+    memcpy(frame->data + index * UDP_FRAGMENT_PAYLOAD_LEN, payload, payloadLen);
+    frame->fragReceived[index] = 1;
+    ++frame->received;
+    if(frame->fecGroup > 0)
+    {
+        Recover(frame, index / frame->fecGroup);
+    }
+}
+
+// The next frame may hold up the newer ones for jitterMillis at most,
+// counted from the arrival of the first newer fragment
+bool CUdpAssembler::GetDeadline(unsigned long* deadline)
+{
+    bool found = false;
+    for(int i = 0; i < frameCount; i++)
+    {
+        if(!frames[i].inUse || frames[i].seq == nextSeq)
+        {
+            continue;
+        }
+        if(!found || frames[i].firstMillis < *deadline)
+        {
+            *deadline = frames[i].firstMillis;
+            found = true;
+        }
+    }
+    if(found)
+    {
+        *deadline += jitterMillis;
+    }
+    return found;
+}
+
+int CUdpAssembler::Deliver(CPacketRing* pRing, unsigned long nowMillis)
+{
+    unsigned long deadline = 0;
+    while(hasNextSeq)
+    {
+        UdpFrame* frame = FindFrame(nextSeq);
+        if(frame != NULL && frame->received == frame->fragCount)
+        {
+            SmartCamPacket packet;
+            memset(&packet, 0, sizeof(packet));
+            packet.type = frame->type;
+            packet.codec = CODEC_JPEG;
+            packet.data = frame->data;
+            packet.length = frame->length;
+            packet.hasSeq = true;
+            packet.seq = (seqWraps << 16) | nextSeq;
+            if(pRing->Push(&packet) != 0)
+            {
+                return -1;
+            }
+            frame->inUse = false;
+            ++deliveredCount;
+            AdvanceSeq();
+            continue;
+        }
+        if(!GetDeadline(&deadline) || nowMillis < deadline)
+        {
+            break;
+        }
+        DropNext();
+    }
+    return 0;
+}
+
+int CUdpAssembler::GetTimeout(unsigned long nowMillis)
+{
+    unsigned long deadline = 0;
+    if(!GetDeadline(&deadline))
+    {
+        return -1;
+    }
+    return (deadline <= nowMillis ? 0 : (int)(deadline - nowMillis));
+}
+
+unsigned int CUdpAssembler::GetFrameCount()
+{
+    return deliveredCount;
+}
+
+unsigned int CUdpAssembler::GetDroppedCount()
+{
+    return droppedCount;
+}
+
+unsigned int CUdpAssembler::GetRecoveredCount()
+{
+    return recoveredCount;
+}
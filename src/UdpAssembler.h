@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// UdpAssembler.h
+
+#ifndef __UDP_ASSEMBLER_H__
+#define __UDP_ASSEMBLER_H__
+
+#include <stdint.h>
+
+#include "CommHandler.h"
+
+class CPacketRing;
+
+// SmartCam UDP fragment, all fields big endian:
+//   0  flags           UDP_FLAG_PARITY for an XOR parity fragment
+//   1  packet type     PACKET_JPEG_HEDAER or PACKET_JPEG_DATA
+//   2  frame seq       16 bits, wraps; +1 for every frame, like the v2 frame seq
+//   4  fragment index  data fragment index, or group index for parity
+//   6  fragment count  number of data fragments in the frame
+//   8  frame length    32 bits
+//  12  FEC group       data fragments covered by one parity fragment, 0 = no FEC
+//  13  reserved        3 bytes
+//  16  payload         UDP_FRAGMENT_PAYLOAD_LEN bytes, only the last data
+//                      fragment is shorter; parity covers the zero padded group
+#define UDP_FRAGMENT_HEADER_LEN 16
+#define UDP_FRAGMENT_PAYLOAD_LEN 1200
+#define UDP_MAX_DATAGRAM_LEN (UDP_FRAGMENT_HEADER_LEN + UDP_FRAGMENT_PAYLOAD_LEN)
+#define UDP_FLAG_PARITY 0x01
+
+// Reassembles UDP fragments into packets: a reorder window of jitterFrames
+// frames, delivered in sequence order. A frame missing fragments is dropped
+// once it (or the first newer frame) has waited jitterMillis, rather than
+// holding up the frames behind it. One lost fragment per FEC group is
+// rebuilt from the parity fragment.
+class CUdpAssembler
+{
+public:
+    CUdpAssembler();
+    virtual ~CUdpAssembler();
+    int Initialize(int jitterFrames, int jitterMillis);
+    void Feed(const unsigned char* datagram, unsigned int length, unsigned long nowMillis);
+    // Pushes the frames that are due to the ring, -1 once the ring is closed
+    int Deliver(CPacketRing* pRing, unsigned long nowMillis);
+    // Milliseconds until the next frame is due to be dropped, -1 for none
+    int GetTimeout(unsigned long nowMillis);
+    unsigned int GetFrameCount();
+    unsigned int GetDroppedCount();
+    unsigned int GetRecoveredCount();
+
+private:
+    typedef struct UdpFrame
+    {
+        bool inUse;
+        uint16_t seq;
+        SmartCamPacketType type;
+        unsigned int length;
+        unsigned int fragCount;
+        unsigned int received;
+        unsigned int fecGroup;
+        unsigned long firstMillis;
+        unsigned char* data;
+        unsigned int dataCapacity;
+        // one flag per data fragment, then the parity payloads and flags
+        unsigned char* fragReceived;
+        unsigned char* parity;
+        unsigned char* parityReceived;
+        unsigned int fragCapacity;
+    } UdpFrame;
+
+    // Methods:
+    void PrepareFrame(UdpFrame* frame, uint16_t seq, SmartCamPacketType type,
+                      unsigned int length, unsigned int fragCount, unsigned int fecGroup, unsigned long nowMillis);
+    void Recover(UdpFrame* frame, unsigned int group);
+    unsigned int GetFragmentLen(UdpFrame* frame, unsigned int index);
+    UdpFrame* FindFrame(uint16_t seq);
+    bool GetDeadline(unsigned long* deadline);
+    void DropNext();
+    void AdvanceSeq();
+    // Data:
+    UdpFrame* frames;
+    int frameCount;
+    int jitterMillis;
+    bool hasNextSeq;
+    uint16_t nextSeq;
+    // wraps of nextSeq, the delivered packets carry a 32-bit sequence number
+    unsigned int seqWraps;
+    // statistics
+    unsigned int deliveredCount;
+    unsigned int droppedCount;
+    unsigned int recoveredCount;
+};
+
+#endif//__UDP_ASSEMBLER_H__
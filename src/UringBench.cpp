@@ -0,0 +1,432 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// UringBench.cpp
+
+// Receive path benchmark, not installed. Pushes the same v2 packet stream
+// over a socketpair into a CPacketRing through BeginRead()/EndRead(), once
+// with each read queued on a CIoUring and once with epoll_wait() and
+// readv() on the non-blocking socket, the two ways a session can receive.
+// Prints the packets per second and the receive side syscalls per packet
+// of each, and fails if the two deliver different packets.
+// The writer and the consumer standing in for the decode thread are threads
+// of their own; on few cores they take turns with the reader, so the
+// packets/s are only comparable on the same machine.
+//
+// usage: uringbench [packets [frame bytes [repeats]]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "IoUring.h"
+#include "PacketRing.h"
+
+// the writer hands the stream to the socket in pieces of this size
+#define BENCH_WRITE_LEN (64 * 1024)
+#define BENCH_URING_ENTRIES 4
+#define BENCH_URING_READ 1
+
+typedef struct BenchStream
+{
+    unsigned char* data;
+    // hello and JPEG tables, then the frames the writer sends repeats times
+    unsigned int headLen;
+    unsigned int length;
+    unsigned int repeats;
+    int socket;
+} BenchStream;
+
+typedef struct BenchResult
+{
+    // a hash of every packet delivered, in order
+    unsigned int* hashes;
+    unsigned int capacity;
+    unsigned int packets;
+    unsigned int syscalls;
+    unsigned long long micros;
+    CPacketRing* pRing;
+} BenchResult;
+
+static void PutBigEndian(unsigned char* buffer, unsigned int value, int length)
+{
+    for(int i = length - 1; i >= 0; i--)
+    {
+        buffer[i] = (unsigned char)(value & 0xFF);
+        value >>= 8;
+    }
+}
+
+static unsigned char* PutPacket(unsigned char* buffer, SmartCamPacketType type, unsigned int seq,
+                                unsigned int payloadLen)
+{
+    memset(buffer, 0, PACKET_V2_HEADER_LEN);
+    buffer[0] = type;
+    buffer[1] = CODEC_JPEG;
+    PutBigEndian(buffer + 4, seq, 4);
+    PutBigEndian(buffer + 12, seq * 33333, 4);
+    PutBigEndian(buffer + 16, payloadLen, 4);
+    unsigned char* payload = buffer + PACKET_V2_HEADER_LEN;
+    for(unsigned int i = 2; i < payloadLen - 2; i++)
+    {
+        payload[i] = (unsigned char)(rand() % 255);
+    }
+    payload[0] = 0xFF;
+    payload[1] = 0xD8;
+    payload[payloadLen - 2] = 0xFF;
+    payload[payloadLen - 1] = 0xD9;
+    return payload + payloadLen;
+}
+
+// Hello, JPEG tables and packetCount frames of 3/4 to 5/4 frameBytes
+static bool MakeStream(unsigned int packetCount, unsigned int frameBytes, BenchStream* stream)
+{
+    unsigned int capacity = PACKET_HELLO_LEN + (packetCount + 1) * (PACKET_V2_HEADER_LEN + frameBytes * 5 / 4 + 1);
+    stream->data = (unsigned char*) malloc(capacity);
+    if(stream->data == NULL)
+    {
+        return false;
+    }
+    unsigned char* end = stream->data;
+    memcpy(end, "SCAM", 4);
+    end[4] = SMARTCAM_PROTOCOL_V2;
+    end[5] = 0;
+    end[6] = 0;
+    end[7] = 0;
+    end += PACKET_HELLO_LEN;
+    end = PutPacket(end, PACKET_JPEG_HEDAER, 0, 600);
+    stream->headLen = end - stream->data;
+    for(unsigned int i = 0; i < packetCount; i++)
+    {
+        end = PutPacket(end, PACKET_JPEG_DATA, i, frameBytes * 3 / 4 + rand() % (frameBytes / 2 + 1));
+    }
+    stream->length = end - stream->data;
+    return true;
+}
+
+static bool WriteAll(int socket, const unsigned char* data, unsigned int length)
+{
+    while(length > 0)
+    {
+        ssize_t count = write(socket, data, (length > BENCH_WRITE_LEN ? BENCH_WRITE_LEN : length));
+        if(count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(count <= 0)
+        {
+            return false;
+        }
+        data += count;
+        length -= count;
+    }
+    return true;
+}
+
+// The phone: the head once, the frames again and again, then end of stream
+static gpointer WriterThreadProc(gpointer data)
+{
+    BenchStream* stream = (BenchStream*) data;
+    bool isOk = WriteAll(stream->socket, stream->data, stream->headLen);
+    for(unsigned int i = 0; isOk && i < stream->repeats; i++)
+    {
+        isOk = WriteAll(stream->socket, stream->data + stream->headLen, stream->length - stream->headLen);
+    }
+    shutdown(stream->socket, SHUT_WR);
+    return NULL;
+}
+
+// FNV-1a over 64 bit words of what the decoder gets to see, cheap enough
+// not to hold up the ring
+static unsigned int HashPacket(const SmartCamPacket* packet)
+{
+    unsigned long long hash = 14695981039346656037ull;
+    unsigned long long word = ((unsigned long long) packet->type << 56) ^
+                              ((unsigned long long) packet->seq << 24) ^ packet->length;
+    hash = (hash ^ word) * 1099511628211ull;
+    unsigned int i = 0;
+    for(; i + sizeof(word) <= packet->length; i += sizeof(word))
+    {
+        memcpy(&word, packet->data + i, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    for(; i < packet->length; i++)
+    {
+        hash = (hash ^ packet->data[i]) * 1099511628211ull;
+    }
+    return (unsigned int)(hash ^ (hash >> 32));
+}
+
+// The decode thread: takes the packets in order until the ring is closed
+static gpointer ConsumerThreadProc(gpointer data)
+{
+    BenchResult* result = (BenchResult*) data;
+    SmartCamPacket* packet = NULL;
+    while((packet = result->pRing->WaitPacket()) != NULL)
+    {
+        if(result->packets < result->capacity)
+        {
+            result->hashes[result->packets] = HashPacket(packet);
+        }
+        ++result->packets;
+        result->pRing->ReleasePacket(packet);
+    }
+    return NULL;
+}
+
+// Each read queued on the ring and waited for with one io_uring_enter(); the
+// socket blocks, so the kernel parks the read until data comes in.
+// -1 if the kernel has no io_uring.
+static int ReceiveUring(int socket, CPacketRing* pRing, BenchResult* result)
+{
+    CIoUring uring;
+    struct iovec iov[2];
+    if(uring.Initialize(BENCH_URING_ENTRIES) != 0 || uring.RegisterFiles(&socket, 1) != 0)
+    {
+        return -1;
+    }
+    while(true)
+    {
+        int iovCount = pRing->BeginRead(iov);
+        if(iovCount < 0 || uring.PrepareReadv(0, iov, iovCount, BENCH_URING_READ) != 0)
+        {
+            return 0;
+        }
+        ++result->syscalls;
+        if(uring.SubmitAndWait(1) != 0)
+        {
+            return 0;
+        }
+        uint64_t userData = 0;
+        int count = 0;
+        if(!uring.GetCompletion(&userData, &count))
+        {
+            return 0;
+        }
+        if(count == -EINTR || count == -EAGAIN)
+        {
+            continue;
+        }
+        if(count <= 0 || pRing->EndRead(count) != 0)
+        {
+            return 0;
+        }
+    }
+}
+
+// Waits for the non-blocking socket with epoll_wait() and reads it with
+// readv() until it would block, the way a session does without io_uring
+static int ReceiveEpoll(int socket, CPacketRing* pRing, BenchResult* result)
+{
+    struct epoll_event event;
+    struct iovec iov[2];
+    int epollFd = epoll_create1(0);
+    if(epollFd < 0)
+    {
+        return -1;
+    }
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.fd = socket;
+    if(epoll_ctl(epollFd, EPOLL_CTL_ADD, socket, &event) < 0)
+    {
+        close(epollFd);
+        return -1;
+    }
+    bool isDone = false;
+    while(!isDone)
+    {
+        ++result->syscalls;
+        int count = epoll_wait(epollFd, &event, 1, -1);
+        if(count < 0 && errno != EINTR)
+        {
+            break;
+        }
+        while(count > 0)
+        {
+            int iovCount = pRing->BeginRead(iov);
+            if(iovCount < 0)
+            {
+                isDone = true;
+                break;
+            }
+            ++result->syscalls;
+            ssize_t readCount = readv(socket, iov, iovCount);
+            if(readCount < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if(readCount < 0)
+            {
+                isDone = (errno != EAGAIN && errno != EWOULDBLOCK);
+                break;
+            }
+            if(readCount == 0 || pRing->EndRead(readCount) != 0)
+            {
+                isDone = true;
+                break;
+            }
+        }
+    }
+    close(epollFd);
+    return 0;
+}
+
+static GThread* StartThread(GThreadFunc threadProc, gpointer data)
+{
+    GError* error = NULL;
+    GThread* thread = g_thread_create(threadProc, data, TRUE, &error);
+    if(thread == NULL)
+    {
+        g_printerr("Failed to create thread: %s\n", error->message);
+        g_error_free(error);
+    }
+    return thread;
+}
+
+// One run over a fresh socketpair and ring; -1 if the path is not available
+static int RunBench(BenchStream* stream, bool isUring, BenchResult* result)
+{
+    int sockets[2];
+    result->packets = 0;
+    result->syscalls = 0;
+    result->micros = 0;
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+    {
+        return -1;
+    }
+    int flags = fcntl(sockets[0], F_GETFL, NULL);
+    if(flags >= 0)
+    {
+        fcntl(sockets[0], F_SETFL, (isUring ? flags & ~O_NONBLOCK : flags | O_NONBLOCK));
+    }
+    CPacketRing ring;
+    if(ring.Initialize(PACKET_RING_SLOT_COUNT, PACKET_RING_SLOT_SIZE) != 0)
+    {
+        close(sockets[0]);
+        close(sockets[1]);
+        return -1;
+    }
+    stream->socket = sockets[1];
+    result->pRing = &ring;
+    unsigned long long startMicros = CPacketRing::GetMicros();
+    GThread* consumerThread = StartThread(ConsumerThreadProc, result);
+    GThread* writerThread = (consumerThread != NULL ? StartThread(WriterThreadProc, stream) : NULL);
+    int status = -1;
+    if(writerThread != NULL)
+    {
+        status = (isUring ? ReceiveUring(sockets[0], &ring, result) : ReceiveEpoll(sockets[0], &ring, result));
+        // a reader that gave up early must not leave the writer blocked
+        close(sockets[0]);
+        g_thread_join(writerThread);
+    }
+    else
+    {
+        close(sockets[0]);
+    }
+    // every packet complete by the end of the stream is ready in the ring,
+    // the consumer takes them before it is closed
+    while(consumerThread != NULL && ring.GetPendingCount() > 0)
+    {
+        usleep(1000);
+    }
+    ring.Close();
+    if(consumerThread != NULL)
+    {
+        g_thread_join(consumerThread);
+    }
+    result->micros = CPacketRing::GetMicros() - startMicros;
+    close(sockets[1]);
+    return status;
+}
+
+static void PrintResult(const char* name, unsigned int expected, const BenchResult* result)
+{
+    double seconds = (result->micros > 0 ? result->micros / 1000000.0 : 1e-6);
+    printf("uringbench: %-8s %7u/%u packets, %9.0f packets/s, %6.3f syscalls/packet\n", name, result->packets,
+           expected, result->packets / seconds, (result->packets > 0 ? (double) result->syscalls / result->packets : 0));
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned int packetCount = (argc > 1 ? atoi(argv[1]) : 2000);
+    unsigned int frameBytes = (argc > 2 ? atoi(argv[2]) : 30000);
+    unsigned int repeats = (argc > 3 ? atoi(argv[3]) : 5);
+    if(packetCount == 0 || frameBytes < 8 || repeats == 0)
+    {
+        printf("usage: uringbench [packets [frame bytes [repeats]]]\n");
+        return 2;
+    }
+    g_thread_init(NULL);
+
+    BenchStream stream;
+    srand(1);
+    if(!MakeStream(packetCount, frameBytes, &stream))
+    {
+        printf("uringbench: could not allocate the stream\n");
+        return 1;
+    }
+    stream.repeats = repeats;
+    // the JPEG tables and every frame each time
+    unsigned int expected = packetCount * repeats + 1;
+    printf("uringbench: %u frames of ~%u bytes, sent %u times\n", packetCount, frameBytes, repeats);
+
+    BenchResult results[2];
+    const char* names[2] = { "epoll", "io_uring" };
+    int failed = 0;
+    for(int i = 0; i < 2; i++)
+    {
+        results[i].capacity = expected;
+        results[i].hashes = (unsigned int*) malloc(expected * sizeof(unsigned int));
+        if(results[i].hashes == NULL)
+        {
+            printf("uringbench: could not allocate the packet hashes\n");
+            return 1;
+        }
+        if(RunBench(&stream, (i == 1), &results[i]) != 0)
+        {
+            printf("uringbench: %-8s not available here\n", names[i]);
+            results[i].packets = 0;
+            continue;
+        }
+        PrintResult(names[i], expected, &results[i]);
+        if(results[i].packets != expected)
+        {
+            failed = 1;
+        }
+    }
+    // whatever path a kernel lacks, the ones that ran must agree packet by packet
+    if(results[0].packets == expected && results[1].packets == expected &&
+       memcmp(results[0].hashes, results[1].hashes, expected * sizeof(unsigned int)) != 0)
+    {
+        printf("uringbench: io_uring and epoll delivered different packets\n");
+        failed = 1;
+    }
+    free(results[0].hashes);
+    free(results[1].hashes);
+    free(stream.data);
+    return failed;
+}
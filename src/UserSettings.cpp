@@ -27,13 +27,61 @@
 // Constructor, loads with default user settings
 CUserSettings::CUserSettings():
     connectionType(SMARTCAM_DEFAULT_CONNECTION_TYPE),
-    inetPort(SMARTCAM_DEFAULT_INET_PORT)
+    inetPort(SMARTCAM_DEFAULT_INET_PORT),
+    rcvBufSize(SMARTCAM_DEFAULT_RCV_BUF_SIZE),
+    udpJitterFrames(SMARTCAM_DEFAULT_UDP_JITTER_FRAMES),
+    udpJitterMillis(SMARTCAM_DEFAULT_UDP_JITTER_MILLIS),
+    rateControl(SMARTCAM_DEFAULT_RATE_CONTROL),
+    maxFps(SMARTCAM_DEFAULT_MAX_FPS),
+    dropPolicy(SMARTCAM_DEFAULT_DROP_POLICY),
+    dropMaxAgeMillis(SMARTCAM_DEFAULT_DROP_MAX_AGE_MILLIS),
+    ioUring(SMARTCAM_DEFAULT_IO_URING),
+    l2capMode(SMARTCAM_DEFAULT_L2CAP_MODE),
+    listenAll(SMARTCAM_DEFAULT_LISTEN_ALL),
+    multipath(SMARTCAM_DEFAULT_MULTIPATH),
+    multipathReorderMillis(SMARTCAM_DEFAULT_MULTIPATH_REORDER_MILLIS),
+    peerTimeoutMillis(SMARTCAM_DEFAULT_PEER_TIMEOUT_MILLIS),
+    resumeMillis(SMARTCAM_DEFAULT_RESUME_MILLIS),
+    tcpZeroCopy(SMARTCAM_DEFAULT_TCP_ZEROCOPY),
+    rawFrames(SMARTCAM_DEFAULT_RAW_FRAMES),
+    streamDecode(SMARTCAM_DEFAULT_STREAM_DECODE),
+    decodeThreads(SMARTCAM_DEFAULT_DECODE_THREADS),
+    decodeBands(SMARTCAM_DEFAULT_DECODE_BANDS),
+    decodeGovernor(SMARTCAM_DEFAULT_DECODE_GOVERNOR),
+    skipIdentical(SMARTCAM_DEFAULT_SKIP_IDENTICAL),
+    skipSimilar(SMARTCAM_DEFAULT_SKIP_SIMILAR),
+    motionDetect(SMARTCAM_DEFAULT_MOTION_DETECT),
+    stillFps(SMARTCAM_DEFAULT_STILL_FPS)
 {
 }
 
 CUserSettings::CUserSettings(const CUserSettings& settings):
     connectionType(settings.connectionType),
-    inetPort(settings.inetPort)
+    inetPort(settings.inetPort),
+    rcvBufSize(settings.rcvBufSize),
+    udpJitterFrames(settings.udpJitterFrames),
+    udpJitterMillis(settings.udpJitterMillis),
+    rateControl(settings.rateControl),
+    maxFps(settings.maxFps),
+    dropPolicy(settings.dropPolicy),
+    dropMaxAgeMillis(settings.dropMaxAgeMillis),
+    ioUring(settings.ioUring),
+    l2capMode(settings.l2capMode),
+    listenAll(settings.listenAll),
+    multipath(settings.multipath),
+    multipathReorderMillis(settings.multipathReorderMillis),
+    peerTimeoutMillis(settings.peerTimeoutMillis),
+    resumeMillis(settings.resumeMillis),
+    tcpZeroCopy(settings.tcpZeroCopy),
+    rawFrames(settings.rawFrames),
+    streamDecode(settings.streamDecode),
+    decodeThreads(settings.decodeThreads),
+    decodeBands(settings.decodeBands),
+    decodeGovernor(settings.decodeGovernor),
+    skipIdentical(settings.skipIdentical),
+    skipSimilar(settings.skipSimilar),
+    motionDetect(settings.motionDetect),
+    stillFps(settings.stillFps)
 {
 }
 
@@ -43,6 +91,30 @@ CUserSettings& CUserSettings::operator=(const CUserSettings& settings)
     {
         connectionType = settings.connectionType;
         inetPort = settings.inetPort;
+        rcvBufSize = settings.rcvBufSize;
+        udpJitterFrames = settings.udpJitterFrames;
+        udpJitterMillis = settings.udpJitterMillis;
+        rateControl = settings.rateControl;
+        maxFps = settings.maxFps;
+        dropPolicy = settings.dropPolicy;
+        dropMaxAgeMillis = settings.dropMaxAgeMillis;
+        ioUring = settings.ioUring;
+        l2capMode = settings.l2capMode;
+        listenAll = settings.listenAll;
+        multipath = settings.multipath;
+        multipathReorderMillis = settings.multipathReorderMillis;
+        peerTimeoutMillis = settings.peerTimeoutMillis;
+        resumeMillis = settings.resumeMillis;
+        tcpZeroCopy = settings.tcpZeroCopy;
+        rawFrames = settings.rawFrames;
+        streamDecode = settings.streamDecode;
+        decodeThreads = settings.decodeThreads;
+        decodeBands = settings.decodeBands;
+        decodeGovernor = settings.decodeGovernor;
+        skipIdentical = settings.skipIdentical;
+        skipSimilar = settings.skipSimilar;
+        motionDetect = settings.motionDetect;
+        stillFps = settings.stillFps;
     }
     return *this;
 }
@@ -75,6 +147,246 @@ CUserSettings CUserSettings::LoadSettings()
         }
         gconf_value_free(val);
     }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "rcv_buf_size", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is an integer
+        if(val->type == GCONF_VALUE_INT)
+        {
+            regSettings.rcvBufSize = gconf_value_get_int(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "udp_jitter_frames", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is an integer
+        if(val->type == GCONF_VALUE_INT)
+        {
+            regSettings.udpJitterFrames = gconf_value_get_int(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "udp_jitter_ms", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is an integer
+        if(val->type == GCONF_VALUE_INT)
+        {
+            regSettings.udpJitterMillis = gconf_value_get_int(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "rate_control", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is a boolean
+        if(val->type == GCONF_VALUE_BOOL)
+        {
+            regSettings.rateControl = gconf_value_get_bool(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "max_fps", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is an integer
+        if(val->type == GCONF_VALUE_INT)
+        {
+            regSettings.maxFps = gconf_value_get_int(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "drop_policy", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is an integer
+        if(val->type == GCONF_VALUE_INT)
+        {
+            regSettings.dropPolicy = (DropPolicy)gconf_value_get_int(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "drop_max_age_ms", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is an integer
+        if(val->type == GCONF_VALUE_INT)
+        {
+            regSettings.dropMaxAgeMillis = gconf_value_get_int(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "io_uring", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is a boolean
+        if(val->type == GCONF_VALUE_BOOL)
+        {
+            regSettings.ioUring = gconf_value_get_bool(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "l2cap_mode", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is an integer
+        if(val->type == GCONF_VALUE_INT)
+        {
+            regSettings.l2capMode = (BtL2capMode)gconf_value_get_int(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "listen_all", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is a boolean
+        if(val->type == GCONF_VALUE_BOOL)
+        {
+            regSettings.listenAll = gconf_value_get_bool(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "multipath", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is a boolean
+        if(val->type == GCONF_VALUE_BOOL)
+        {
+            regSettings.multipath = gconf_value_get_bool(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "multipath_reorder_ms", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is an integer
+        if(val->type == GCONF_VALUE_INT)
+        {
+            regSettings.multipathReorderMillis = gconf_value_get_int(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "peer_timeout_ms", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is an integer
+        if(val->type == GCONF_VALUE_INT)
+        {
+            regSettings.peerTimeoutMillis = gconf_value_get_int(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "resume_ms", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is an integer
+        if(val->type == GCONF_VALUE_INT)
+        {
+            regSettings.resumeMillis = gconf_value_get_int(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "tcp_zerocopy", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is a boolean
+        if(val->type == GCONF_VALUE_BOOL)
+        {
+            regSettings.tcpZeroCopy = gconf_value_get_bool(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "raw_frames", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is a boolean
+        if(val->type == GCONF_VALUE_BOOL)
+        {
+            regSettings.rawFrames = gconf_value_get_bool(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "stream_decode", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is a boolean
+        if(val->type == GCONF_VALUE_BOOL)
+        {
+            regSettings.streamDecode = gconf_value_get_bool(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "decode_threads", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is an integer
+        if(val->type == GCONF_VALUE_INT)
+        {
+            regSettings.decodeThreads = gconf_value_get_int(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "decode_bands", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is an integer
+        if(val->type == GCONF_VALUE_INT)
+        {
+            regSettings.decodeBands = gconf_value_get_int(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "decode_governor", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is a boolean
+        if(val->type == GCONF_VALUE_BOOL)
+        {
+            regSettings.decodeGovernor = gconf_value_get_bool(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "skip_identical", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is a boolean
+        if(val->type == GCONF_VALUE_BOOL)
+        {
+            regSettings.skipIdentical = gconf_value_get_bool(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "skip_similar", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is a boolean
+        if(val->type == GCONF_VALUE_BOOL)
+        {
+            regSettings.skipSimilar = gconf_value_get_bool(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "motion_detect", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is a boolean
+        if(val->type == GCONF_VALUE_BOOL)
+        {
+            regSettings.motionDetect = gconf_value_get_bool(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "still_fps", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is an integer
+        if(val->type == GCONF_VALUE_INT)
+        {
+            regSettings.stillFps = gconf_value_get_int(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
 
     g_object_unref(gcClient);
     return regSettings;
@@ -91,5 +403,101 @@ void CUserSettings::SaveSettings(CUserSettings settings)
     {
         printf("smartcam: failed to set %s/inet_port to %d\n", SMARTCAM_GCONF_ROOT, settings.inetPort);
     }
+    if(!gconf_client_set_int(gcClient , SMARTCAM_GCONF_ROOT "rcv_buf_size", settings.rcvBufSize, NULL))
+    {
+        printf("smartcam: failed to set %s/rcv_buf_size to %d\n", SMARTCAM_GCONF_ROOT, settings.rcvBufSize);
+    }
+    if(!gconf_client_set_int(gcClient , SMARTCAM_GCONF_ROOT "udp_jitter_frames", settings.udpJitterFrames, NULL))
+    {
+        printf("smartcam: failed to set %s/udp_jitter_frames to %d\n", SMARTCAM_GCONF_ROOT, settings.udpJitterFrames);
+    }
+    if(!gconf_client_set_int(gcClient , SMARTCAM_GCONF_ROOT "udp_jitter_ms", settings.udpJitterMillis, NULL))
+    {
+        printf("smartcam: failed to set %s/udp_jitter_ms to %d\n", SMARTCAM_GCONF_ROOT, settings.udpJitterMillis);
+    }
+    if(!gconf_client_set_bool(gcClient , SMARTCAM_GCONF_ROOT "rate_control", settings.rateControl, NULL))
+    {
+        printf("smartcam: failed to set %s/rate_control to %d\n", SMARTCAM_GCONF_ROOT, settings.rateControl);
+    }
+    if(!gconf_client_set_int(gcClient , SMARTCAM_GCONF_ROOT "max_fps", settings.maxFps, NULL))
+    {
+        printf("smartcam: failed to set %s/max_fps to %d\n", SMARTCAM_GCONF_ROOT, settings.maxFps);
+    }
+    if(!gconf_client_set_int(gcClient , SMARTCAM_GCONF_ROOT "drop_policy", settings.dropPolicy, NULL))
+    {
+        printf("smartcam: failed to set %s/drop_policy to %d\n", SMARTCAM_GCONF_ROOT, settings.dropPolicy);
+    }
+    if(!gconf_client_set_int(gcClient , SMARTCAM_GCONF_ROOT "drop_max_age_ms", settings.dropMaxAgeMillis, NULL))
+    {
+        printf("smartcam: failed to set %s/drop_max_age_ms to %d\n", SMARTCAM_GCONF_ROOT, settings.dropMaxAgeMillis);
+    }
+    if(!gconf_client_set_bool(gcClient , SMARTCAM_GCONF_ROOT "io_uring", settings.ioUring, NULL))
+    {
+        printf("smartcam: failed to set %s/io_uring to %d\n", SMARTCAM_GCONF_ROOT, settings.ioUring);
+    }
+    if(!gconf_client_set_int(gcClient , SMARTCAM_GCONF_ROOT "l2cap_mode", settings.l2capMode, NULL))
+    {
+        printf("smartcam: failed to set %s/l2cap_mode to %d\n", SMARTCAM_GCONF_ROOT, settings.l2capMode);
+    }
+    if(!gconf_client_set_bool(gcClient , SMARTCAM_GCONF_ROOT "listen_all", settings.listenAll, NULL))
+    {
+        printf("smartcam: failed to set %s/listen_all to %d\n", SMARTCAM_GCONF_ROOT, settings.listenAll);
+    }
+    if(!gconf_client_set_bool(gcClient , SMARTCAM_GCONF_ROOT "multipath", settings.multipath, NULL))
+    {
+        printf("smartcam: failed to set %s/multipath to %d\n", SMARTCAM_GCONF_ROOT, settings.multipath);
+    }
+    if(!gconf_client_set_int(gcClient , SMARTCAM_GCONF_ROOT "multipath_reorder_ms", settings.multipathReorderMillis, NULL))
+    {
+        printf("smartcam: failed to set %s/multipath_reorder_ms to %d\n", SMARTCAM_GCONF_ROOT, settings.multipathReorderMillis);
+    }
+    if(!gconf_client_set_int(gcClient , SMARTCAM_GCONF_ROOT "peer_timeout_ms", settings.peerTimeoutMillis, NULL))
+    {
+        printf("smartcam: failed to set %s/peer_timeout_ms to %d\n", SMARTCAM_GCONF_ROOT, settings.peerTimeoutMillis);
+    }
+    if(!gconf_client_set_int(gcClient , SMARTCAM_GCONF_ROOT "resume_ms", settings.resumeMillis, NULL))
+    {
+        printf("smartcam: failed to set %s/resume_ms to %d\n", SMARTCAM_GCONF_ROOT, settings.resumeMillis);
+    }
+    if(!gconf_client_set_bool(gcClient , SMARTCAM_GCONF_ROOT "tcp_zerocopy", settings.tcpZeroCopy, NULL))
+    {
+        printf("smartcam: failed to set %s/tcp_zerocopy to %d\n", SMARTCAM_GCONF_ROOT, settings.tcpZeroCopy);
+    }
+    if(!gconf_client_set_bool(gcClient , SMARTCAM_GCONF_ROOT "raw_frames", settings.rawFrames, NULL))
+    {
+        printf("smartcam: failed to set %s/raw_frames to %d\n", SMARTCAM_GCONF_ROOT, settings.rawFrames);
+    }
+    if(!gconf_client_set_bool(gcClient , SMARTCAM_GCONF_ROOT "stream_decode", settings.streamDecode, NULL))
+    {
+        printf("smartcam: failed to set %s/stream_decode to %d\n", SMARTCAM_GCONF_ROOT, settings.streamDecode);
+    }
+    if(!gconf_client_set_int(gcClient , SMARTCAM_GCONF_ROOT "decode_threads", settings.decodeThreads, NULL))
+    {
+        printf("smartcam: failed to set %s/decode_threads to %d\n", SMARTCAM_GCONF_ROOT, settings.decodeThreads);
+    }
+    if(!gconf_client_set_int(gcClient , SMARTCAM_GCONF_ROOT "decode_bands", settings.decodeBands, NULL))
+    {
+        printf("smartcam: failed to set %s/decode_bands to %d\n", SMARTCAM_GCONF_ROOT, settings.decodeBands);
+    }
+    if(!gconf_client_set_bool(gcClient , SMARTCAM_GCONF_ROOT "decode_governor", settings.decodeGovernor, NULL))
+    {
+        printf("smartcam: failed to set %s/decode_governor to %d\n", SMARTCAM_GCONF_ROOT, settings.decodeGovernor);
+    }
+    if(!gconf_client_set_bool(gcClient , SMARTCAM_GCONF_ROOT "skip_identical", settings.skipIdentical, NULL))
+    {
+        printf("smartcam: failed to set %s/skip_identical to %d\n", SMARTCAM_GCONF_ROOT, settings.skipIdentical);
+    }
+    if(!gconf_client_set_bool(gcClient , SMARTCAM_GCONF_ROOT "skip_similar", settings.skipSimilar, NULL))
+    {
+        printf("smartcam: failed to set %s/skip_similar to %d\n", SMARTCAM_GCONF_ROOT, settings.skipSimilar);
+    }
+    if(!gconf_client_set_bool(gcClient , SMARTCAM_GCONF_ROOT "motion_detect", settings.motionDetect, NULL))
+    {
+        printf("smartcam: failed to set %s/motion_detect to %d\n", SMARTCAM_GCONF_ROOT, settings.motionDetect);
+    }
+    if(!gconf_client_set_int(gcClient , SMARTCAM_GCONF_ROOT "still_fps", settings.stillFps, NULL))
+    {
+        printf("smartcam: failed to set %s/still_fps to %d\n", SMARTCAM_GCONF_ROOT, settings.stillFps);
+    }
     g_object_unref(gcClient);
 }
@@ -26,9 +26,24 @@
 
 typedef enum ConnectionType {
     CONN_BLUETOOTH = 0,
-    CONN_INET = 1
+    CONN_INET = 1,
+    CONN_UDP = 2
 } ConnectionType;
 
+// Bluetooth: L2CAP channel offered next to RFCOMM
+typedef enum BtL2capMode {
+    BT_L2CAP_OFF = 0,
+    BT_L2CAP_ERTM = 1,      // enhanced retransmission, reliable
+    BT_L2CAP_STREAMING = 2  // no retransmissions, lost frames are resynced
+} BtL2capMode;
+
+// Which received frames the decoder may skip to stay current
+typedef enum DropPolicy {
+    DROP_NONE = 0,          // decode every frame
+    DROP_LATEST_WINS = 1,   // skip a frame if a newer one is already waiting
+    DROP_OLDER_THAN = 2     // skip frames received more than dropMaxAgeMillis ago
+} DropPolicy;
+
 class CUserSettings
 {
     friend class CSmartEngine;
@@ -39,6 +54,55 @@ public:
     virtual ~CUserSettings();
     ConnectionType connectionType;
     int inetPort;
+    // SO_RCVBUF of the client sockets in bytes, 0 keeps the kernel default
+    int rcvBufSize;
+    // UDP jitter buffer: frames kept for reordering and how long an
+    // incomplete frame may wait before it is dropped
+    int udpJitterFrames;
+    int udpJitterMillis;
+    // let v2 phones adapt frame rate, quality and resolution to the host and link
+    bool rateControl;
+    // highest frame rate asked from the phones
+    int maxFps;
+    // frames the decoder skips to stay current
+    DropPolicy dropPolicy;
+    // DROP_OLDER_THAN: oldest frame still decoded
+    int dropMaxAgeMillis;
+    // receive Bluetooth and TCP/IP streams through io_uring when the kernel has it
+    bool ioUring;
+    // Bluetooth: L2CAP channel with a large MTU offered next to RFCOMM
+    BtL2capMode l2capMode;
+    // listen on Bluetooth, TCP/IP and UDP at once, the first phone to connect
+    // is served; connectionType only picks the status bar icon then
+    bool listenAll;
+    // let a v2 phone stripe one stream over several connections (TCP/IP and Bluetooth)
+    bool multipath;
+    // multipath: how long a missing frame may hold up the newer ones
+    int multipathReorderMillis;
+    // a phone that sent nothing for this long is taken for dead, 0 = never
+    int peerTimeoutMillis;
+    // how long a session whose phone is gone waits for it to come back
+    int resumeMillis;
+    // map big TCP/IP payloads into the packet ring instead of copying them
+    bool tcpZeroCopy;
+    // let a phone on TCP/IP send raw YUV frames when JPEG decoding costs too much
+    bool rawFrames;
+    // decode JPEG frames while they are still being received
+    bool streamDecode;
+    // decoder threads per session for big frames, 1 decodes on the session decode thread
+    int decodeThreads;
+    // threads decoding one big frame with restart markers in bands, 1 decodes it whole
+    int decodeBands;
+    // trades JPEG decode quality for speed when the host falls behind the frame rate
+    bool decodeGovernor;
+    // a frame sent twice byte for byte is shown again without decoding it
+    bool skipIdentical;
+    // so is a JPEG frame whose blocks are all about as bright as in the last one shown
+    bool skipSimilar;
+    // scores the motion of every JPEG frame from its DC coefficients
+    bool motionDetect;
+    // frames per second decoded while the scene is still, 0 decodes them all
+    int stillFps;
 
 private:
     static CUserSettings LoadSettings();
@@ -46,5 +110,29 @@ private:
     // Default settings:
     static const ConnectionType SMARTCAM_DEFAULT_CONNECTION_TYPE = CONN_BLUETOOTH;
     static const int SMARTCAM_DEFAULT_INET_PORT = 9361;
+    static const int SMARTCAM_DEFAULT_RCV_BUF_SIZE = 0;
+    static const int SMARTCAM_DEFAULT_UDP_JITTER_FRAMES = 4;
+    static const int SMARTCAM_DEFAULT_UDP_JITTER_MILLIS = 40;
+    static const bool SMARTCAM_DEFAULT_RATE_CONTROL = true;
+    static const int SMARTCAM_DEFAULT_MAX_FPS = 30;
+    static const DropPolicy SMARTCAM_DEFAULT_DROP_POLICY = DROP_LATEST_WINS;
+    static const int SMARTCAM_DEFAULT_DROP_MAX_AGE_MILLIS = 100;
+    static const bool SMARTCAM_DEFAULT_IO_URING = true;
+    static const BtL2capMode SMARTCAM_DEFAULT_L2CAP_MODE = BT_L2CAP_ERTM;
+    static const bool SMARTCAM_DEFAULT_LISTEN_ALL = true;
+    static const bool SMARTCAM_DEFAULT_MULTIPATH = true;
+    static const int SMARTCAM_DEFAULT_MULTIPATH_REORDER_MILLIS = 80;
+    static const int SMARTCAM_DEFAULT_PEER_TIMEOUT_MILLIS = 3000;
+    static const int SMARTCAM_DEFAULT_RESUME_MILLIS = 10000;
+    static const bool SMARTCAM_DEFAULT_TCP_ZEROCOPY = false;
+    static const bool SMARTCAM_DEFAULT_RAW_FRAMES = true;
+    static const bool SMARTCAM_DEFAULT_STREAM_DECODE = true;
+    static const int SMARTCAM_DEFAULT_DECODE_THREADS = 1;
+    static const int SMARTCAM_DEFAULT_DECODE_BANDS = 1;
+    static const bool SMARTCAM_DEFAULT_DECODE_GOVERNOR = true;
+    static const bool SMARTCAM_DEFAULT_SKIP_IDENTICAL = true;
+    static const bool SMARTCAM_DEFAULT_SKIP_SIMILAR = false;
+    static const bool SMARTCAM_DEFAULT_MOTION_DETECT = false;
+    static const int SMARTCAM_DEFAULT_STILL_FPS = 0;
 };
 #endif//__USER_SETTINGS_H__
@@ -17,13 +17,59 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
 #include "SmartEngine.h"
+#include "PacketRing.h"
+
+// socket activation (sd_listen_fds protocol): the inherited fds start here
+#define LISTEN_FDS_START 3
 
 CSmartEngine* g_pEngine = NULL;
 
+// Listeners handed over by a service manager (LISTEN_PID/LISTEN_FDS) or on
+// the command line (--listen-fd=N), so that it owns the port and phones can
+// connect while we are (re)starting
+static void AddListenSockets(int argc, char *argv[])
+{
+    const char* listenPid = getenv("LISTEN_PID");
+    const char* listenFds = getenv("LISTEN_FDS");
+    if(listenPid != NULL && listenFds != NULL && atoi(listenPid) == getpid())
+    {
+        int count = atoi(listenFds);
+        for(int i = 0; i < count; i++)
+        {
+            g_pEngine->AddListenSocket(LISTEN_FDS_START + i);
+        }
+    }
+    // not meant for our children
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+
+    for(int i = 1; i < argc; i++)
+    {
+        if(strncmp(argv[i], "--listen-fd=", 12) == 0)
+        {
+            int fd = atoi(argv[i] + 12);
+            if(fd >= 0)
+            {
+                g_pEngine->AddListenSocket(fd);
+            }
+        }
+        else
+        {
+            printf("smartcam: unknown option %s\n", argv[i]);
+        }
+    }
+}
+
 int main(int argc, char *argv[])
 {
     int result = 0;
+    unsigned long long startMicros = CPacketRing::GetMicros();
 
     GError* error = NULL;
 
@@ -36,6 +82,8 @@ int main(int argc, char *argv[])
 
     // Create the engine object
     g_pEngine = new CSmartEngine();
+    g_pEngine->SetStartMicros(startMicros);
+    AddListenSockets(argc, argv);
 
     result = g_pEngine->Initialize();
     if(result != 0)
@@ -26,6 +26,10 @@ class CSmartEngine;
 
 extern CSmartEngine* g_pEngine;
 
-#define SMARTCAM_VERSION "1.4.0"
+#define SMARTCAM_VERSION "1.4.0"
+
+// Maximum number of phones served at once, each one is bound to its own
+// smartcam video device (see the "devices" parameter of the driver)
+#define SMARTCAM_MAX_SESSIONS 16
 
 #endif//__SMART_CAM_H__